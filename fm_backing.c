@@ -0,0 +1,313 @@
+/*************************************************************************
+ *
+ * Fusion Memory Confidential
+ * __________________
+ *
+ *  Fusion Memory Incorporated
+ *  All Rights Reserved.
+ *
+ * NOTICE:  All information contained herein is, and remains
+ * the property of Fusion Memory and its suppliers, if any.
+ * The intellectual and technical concepts contained herein are
+ * proprietary to Fusion Memory and its suppliers and may be covered by
+ * U.S. and Foreign Patents, patents in process, and are protected by
+ * trade secret or copyright law. Dissemination of this information or
+ * reproduction of this material is strictly forbidden unless prior
+ * written permission is obtained from Fusion Memory.
+ */
+
+
+/*
+ * fm_backing - Regions in kernel memory or a file
+ *
+ * Without E820 PMEM ranges (development boxes, CI VMs) the regions of
+ * the devices can be kernel memory instead: vmalloc, or vmalloc mapped
+ * with huge pages where the kernel supports it.  With backing=3 fmdsk's
+ * region is also loaded from a file at load and saved back to it, so
+ * its contents persist like flash.  The file isn't accessed from the I/O
+ * path, whose copies may not sleep: writes mark their pages dirty, and
+ * REQ_PREFLUSH writes the dirty pages to the file and syncs it.
+ */
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/version.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/fs.h>
+#include <linux/bitops.h>
+#include <linux/string.h>
+#include "fm_dsk.h"
+#include "fm_backing.h"
+#include "fm_sysfs.h"
+
+/*-------------------------------------------------------------*/
+/*-------------------   Kernel Memory   -----------------------*/
+/*-------------------------------------------------------------*/
+
+/* Allocate a zeroed region of nr_pages of kernel memory */
+void __iomem *fmd_backing_alloc(struct fmd_device_t *fmd, int type,
+				unsigned int nr_pages)
+{
+	unsigned long size = (unsigned long) nr_pages << PAGE_SHIFT;
+	void *virt;
+
+	printk(KERN_INFO "%s: %s: type %d size 0x%lx\n", fmd->dev_name, __func__, type, size);
+
+	if (type == FMD_BACKING_HUGEPAGE) {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,18,0)
+		virt = vmalloc_huge(size, GFP_KERNEL | __GFP_ZERO);
+#else
+		printk(KERN_INFO "%s: %s: no huge vmalloc mappings before 5.18, using pages\n", fmd->dev_name, __func__);
+		virt = vzalloc(size);
+#endif
+	} else {
+		virt = vzalloc(size);
+	}
+
+	if (!virt)
+		printk(KERN_INFO "%s: %s: ERROR: Unable to allocate 0x%lx bytes\n", fmd->dev_name, __func__, size);
+	return (void __iomem __force *) virt;
+}
+
+void fmd_backing_free(void __iomem *virt)
+{
+	vfree((void __force *) virt);
+}
+
+/*-------------------------------------------------------------*/
+/*---------------------   File Backing   ----------------------*/
+/*-------------------------------------------------------------*/
+
+static ssize_t fmd_backing_read(struct file *file, void *buf, size_t n, loff_t pos)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,14,0)
+	return kernel_read(file, buf, n, &pos);
+#else
+	return kernel_read(file, pos, buf, n);
+#endif
+}
+
+/* Write all n bytes, returns 0 or an error */
+static int fmd_backing_write(struct file *file, const void *buf, size_t n, loff_t pos)
+{
+	ssize_t ret;
+
+	while (n) {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,14,0)
+		ret = kernel_write(file, buf, n, &pos);
+#else
+		ret = kernel_write(file, buf, n, pos);
+		if (ret > 0)
+			pos += ret;
+#endif
+		if (ret <= 0)
+			return ret ? ret : -EIO;
+		buf += ret;
+		n -= ret;
+	}
+	return 0;
+}
+
+/* Fill the region from the file.  Pages past its end stay zero */
+static int fmd_backing_load(struct fmd_device_t *fmd, struct fmd_backing_t *b)
+{
+	loff_t size = min_t(loff_t, i_size_read(file_inode(b->file)),
+			    (loff_t) fmd->nr_pages << PAGE_SHIFT);
+	loff_t pos = 0;
+	ssize_t ret;
+
+	while (pos < size) {
+		ret = fmd_backing_read(b->file, (void __force *) fmd->virt + pos,
+				       min_t(loff_t, size - pos,
+					     FMD_BACKING_IO_PAGES << PAGE_SHIFT), pos);
+		if (ret < 0)
+			return ret;
+		if (!ret)
+			break;
+		pos += ret;
+		cond_resched();
+	}
+
+	b->nr_loaded_pages = DIV_ROUND_UP(pos, PAGE_SIZE);
+	printk(KERN_INFO "%s: %s: %llu pages from %s\n", fmd->dev_name, __func__,
+	       b->nr_loaded_pages, b->path);
+	return 0;
+}
+
+/* Record that the pages of n bytes at sector differ from the file */
+void fmd_backing_dirty(struct fmd_device_t *fmd, sector_t sector, size_t n)
+{
+	struct fmd_backing_t *b = (struct fmd_backing_t *) fmd->backing;
+	unsigned long page = sector >> PAGE_SECTORS_SHIFT;
+	unsigned long last = (((u64) sector << SECTOR_SHIFT) + n - 1) >> PAGE_SHIFT;
+
+	for (; page <= last; page++)
+		if (!test_bit(page, b->dirty))
+			set_bit(page, b->dirty);
+}
+
+/*
+ * Write the dirty pages to the file and sync it.  Runs of dirty pages
+ * are written together.  A page's bit is cleared before it is copied,
+ * so a write racing with the copy leaves it dirty for the next save.
+ * No page is dirty only once a save in progress has synced the ones it
+ * took, so that is checked under the mutex.
+ * Returns -EAGAIN if nowait is set and there is something to save, or a
+ * save in progress.
+ */
+int fmd_backing_save(struct fmd_device_t *fmd, bool nowait)
+{
+	struct fmd_backing_t *b = (struct fmd_backing_t *) fmd->backing;
+	unsigned long nr = fmd->nr_pages;
+	unsigned long first, end, i;
+	int err = 0;
+
+	if (!b)
+		return 0;
+	if (!nowait)
+		mutex_lock(&b->mutex);
+	else if (!mutex_trylock(&b->mutex))
+		return -EAGAIN;
+	if (find_first_bit(b->dirty, nr) >= nr) {
+		mutex_unlock(&b->mutex);
+		return 0;
+	}
+	if (nowait) {
+		mutex_unlock(&b->mutex);
+		return -EAGAIN;
+	}
+
+	for (first = find_first_bit(b->dirty, nr); first < nr;
+	     first = find_next_bit(b->dirty, nr, end)) {
+		for (end = first; end < nr && end - first < FMD_BACKING_IO_PAGES; end++)
+			if (!test_and_clear_bit(end, b->dirty))
+				break;
+
+		err = fmd_backing_write(b->file,
+					(void __force *) fmd->virt + (first << PAGE_SHIFT),
+					(end - first) << PAGE_SHIFT,
+					(loff_t) first << PAGE_SHIFT);
+		if (err) {
+			for (i = first; i < end; i++)
+				set_bit(i, b->dirty);
+			break;
+		}
+		b->nr_saved_pages += end - first;
+		cond_resched();
+	}
+	if (!err)
+		err = vfs_fsync(b->file, 0);
+	b->nr_saves++;
+	mutex_unlock(&b->mutex);
+
+	if (err)
+		printk(KERN_INFO "%s: %s: ERROR: %d saving to %s\n", fmd->dev_name, __func__, err, b->path);
+	return err;
+}
+
+/* Open or create the file behind fmdsk's region, which is already
+ * allocated, and load the region from it */
+int fmd_backing_file_init(struct fmd_device_t *fmd, const char *path)
+{
+	struct fmd_backing_t *b;
+	int err;
+
+	printk(KERN_INFO "%s: %s: %s\n", fmd->dev_name, __func__, path ? path : "(none)");
+
+	if (!path || !*path)
+		return -EINVAL;
+
+	b = kzalloc(sizeof(struct fmd_backing_t), GFP_KERNEL);
+	if (!b)
+		return -ENOMEM;
+	mutex_init(&b->mutex);
+	b->path = kstrdup(path, GFP_KERNEL);
+	b->dirty = vzalloc(BITS_TO_LONGS(fmd->nr_pages) * sizeof(unsigned long));
+	if (!b->path || !b->dirty) {
+		err = -ENOMEM;
+		goto err_free;
+	}
+
+	b->file = filp_open(path, O_RDWR | O_CREAT | O_LARGEFILE, 0600);
+	if (IS_ERR(b->file)) {
+		err = PTR_ERR(b->file);
+		b->file = NULL;
+		printk(KERN_INFO "%s: %s: ERROR: %d opening %s\n", fmd->dev_name, __func__, err, path);
+		goto err_free;
+	}
+
+	err = fmd_backing_load(fmd, b);
+	if (err) {
+		printk(KERN_INFO "%s: %s: ERROR: %d reading %s\n", fmd->dev_name, __func__, err, path);
+		goto err_free;
+	}
+
+	fmd->backing = b;
+	return 0;
+
+err_free:
+	if (b->file)
+		filp_close(b->file, NULL);
+	vfree(b->dirty);
+	kfree(b->path);
+	kfree(b);
+	return err;
+}
+
+/* Save what was written since the last flush and close the file */
+void fmd_backing_file_cleanup(struct fmd_device_t *fmd)
+{
+	struct fmd_backing_t *b = (struct fmd_backing_t *) fmd->backing;
+
+	printk(KERN_INFO "%s: %s\n", fmd->dev_name, __func__);
+
+	if (!b)
+		return;
+
+	fmd_backing_save(fmd, false);
+	fmd->backing = NULL;
+	filp_close(b->file, NULL);
+	vfree(b->dirty);
+	kfree(b->path);
+	kfree(b);
+}
+
+/*-------------------------------------------------------------*/
+/*--------------------   Sysfs Functions   --------------------*/
+/*-------------------------------------------------------------*/
+
+static ssize_t file_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct fmd_backing_t *b = (struct fmd_backing_t *) fmd_from_dev(dev)->backing;
+
+	if (!b)
+		return -ENODEV;
+	return sprintf(buf, "%s\n", b->path);
+}
+static DEVICE_ATTR_RO(file);
+
+/* "<saves> <pages saved> <pages loaded>" */
+static ssize_t saved_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct fmd_backing_t *b = (struct fmd_backing_t *) fmd_from_dev(dev)->backing;
+
+	if (!b)
+		return -ENODEV;
+	return sprintf(buf, "%llu %llu %llu\n", READ_ONCE(b->nr_saves),
+		       READ_ONCE(b->nr_saved_pages), b->nr_loaded_pages);
+}
+static DEVICE_ATTR_RO(saved);
+
+static struct attribute *fmd_backing_attrs[] = {
+	&dev_attr_file.attr,
+	&dev_attr_saved.attr,
+	NULL,
+};
+
+const struct attribute_group fmd_backing_attr_group = {
+	.name = "backing",
+	.attrs = fmd_backing_attrs,
+};
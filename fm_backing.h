@@ -0,0 +1,66 @@
+/*************************************************************************
+ *
+ * Fusion Memory Confidential
+ * __________________
+ *
+ *  Fusion Memory Incorporated
+ *  All Rights Reserved.
+ *
+ * NOTICE:  All information contained herein is, and remains
+ * the property of Fusion Memory and its suppliers, if any.
+ * The intellectual and technical concepts contained herein are
+ * proprietary to Fusion Memory and its suppliers and may be covered by
+ * U.S. and Foreign Patents, patents in process, and are protected by
+ * trade secret or copyright law. Dissemination of this information or
+ * reproduction of this material is strictly forbidden unless prior
+ * written permission is obtained from Fusion Memory.
+ */
+
+
+#ifndef FM_BACKING_H
+#define FM_BACKING_H
+
+#include <linux/types.h>
+#include <linux/fs.h>
+#include <linux/mutex.h>
+#include <linux/sysfs.h>
+#include "fm_dsk.h"
+
+/* What holds the regions of the devices, chosen with backing= */
+#define FMD_BACKING_E820	0	/* E820 PMEM ranges, ioremapped */
+#define FMD_BACKING_VMALLOC	1	/* kernel memory */
+#define FMD_BACKING_HUGEPAGE	2	/* kernel memory in huge pages */
+#define FMD_BACKING_FILE	3	/* fmdsk kernel memory saved to a file */
+#define FMD_BACKING_NR		4
+
+#define FMD_BACKING_IO_PAGES	256	/* file read or written at once */
+
+/*
+ * The file behind a file backed dsk.  The region is kernel memory loaded
+ * from the file at load, so copies in the I/O path never sleep.  Pages
+ * written since the last save are marked in dirty, and written to the
+ * file on REQ_PREFLUSH and at unload.
+ */
+struct fmd_backing_t {
+	struct file *file;
+	char *path;
+	unsigned long *dirty;		/* per page */
+	struct mutex mutex;		/* serializes saves */
+
+	/* Statistics */
+	u64 nr_saves;
+	u64 nr_saved_pages;
+	u64 nr_loaded_pages;
+};
+
+void __iomem *fmd_backing_alloc(struct fmd_device_t *fmd, int type,
+				unsigned int nr_pages);
+void fmd_backing_free(void __iomem *virt);
+int fmd_backing_file_init(struct fmd_device_t *fmd, const char *path);
+void fmd_backing_file_cleanup(struct fmd_device_t *fmd);
+int fmd_backing_save(struct fmd_device_t *fmd, bool nowait);
+void fmd_backing_dirty(struct fmd_device_t *fmd, sector_t sector, size_t n);
+
+extern const struct attribute_group fmd_backing_attr_group;
+
+#endif /* FM_BACKING_H */
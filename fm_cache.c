@@ -27,26 +27,151 @@
 #include <linux/radix-tree.h>
 #include <linux/fs.h>
 #include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/workqueue.h>
+#include <linux/math64.h>
+#include <linux/sort.h>
+#include <linux/crc32c.h>
+#include <linux/version.h>
 
 #include "fm_mem.h"
 #include "fm_dsk.h"
 #include "fm_cache.h"
+#include "fm_sysfs.h"
+#include "fm_copy.h"
+#include "fm_stripe.h"
+#include "fm_ioctl.h"
+#include "fm_zcache.h"
 
-static void fmd_radix_tree_flush_dirty_page(struct fmd_device_t *fmd, struct fmd_page_t *page);
-static inline void fmd_evict_list_add(struct fmd_device_t *fmd, struct fmd_page_t *page);
-static inline void fmd_evict_list_delete(struct fmd_device_t *fmd, struct fmd_page_t *page);
+/*
+ * Locking: fmd->lock protects the radix tree and its tags, the eviction,
+ * pin and free lists, the free frame count and each frame's state.  Frames
+ * handed to the I/O path by fmd_radix_tree_insert_page(s) and
+ * fmd_radix_tree_get_page(s) hold a reference, which keeps the frame from
+ * being reclaimed until fmd_radix_tree_put_page(s).
+ */
+
+static void fmd_radix_tree_flush_dirty_page(struct fmd_device_t *fmd, u32 frame);
+static inline void fmd_evict_list_add(struct fmd_device_t *fmd, u32 frame);
+static inline void fmd_evict_list_delete(struct fmd_device_t *fmd, u32 frame);
+static unsigned int fmd_reclaim_pages(struct fmd_device_t *fmd, unsigned int nr,
+		bool keep);
+static void fmd_dedup_drop_aliases(struct fmd_device_t *fmd, u32 frame);
+static void fmd_dedup_unhash(struct fmd_cache_t *cache, u32 frame);
+static int fmd_dedup_cow(struct fmd_device_t *fmd, pgoff_t index, u32 *frame);
+
+/*-------------------------------------------------------------*/
+/*-------------------   Frame List Functions   ----------------*/
+/*-------------------------------------------------------------*/
+
+/*
+ * The frame lists are circular and linked by frame number, so a link
+ * costs 8 bytes instead of a list_head's 16.  The head of list l is the
+ * pseudo frame nr_pages_cache + l.
+ */
+static inline u32 fmd_frame_list_head(struct fmd_cache_t *cache, int list)
+{
+	return cache->nr_pages_cache + list;
+}
+
+static inline void
+fmd_frame_list_init(struct fmd_cache_t *cache, int list)
+{
+	u32 head = fmd_frame_list_head(cache, list);
+
+	cache->link[head].prev = head;
+	cache->link[head].next = head;
+}
+
+static inline bool
+fmd_frame_list_empty(struct fmd_cache_t *cache, int list)
+{
+	u32 head = fmd_frame_list_head(cache, list);
+
+	return cache->link[head].next == head;
+}
+
+static inline u32
+fmd_frame_list_first(struct fmd_cache_t *cache, int list)
+{
+	return cache->link[fmd_frame_list_head(cache, list)].next;
+}
+
+static inline void
+__fmd_frame_list_add(struct fmd_cache_t *cache, u32 frame, u32 prev, u32 next)
+{
+	cache->link[next].prev = frame;
+	cache->link[frame].next = next;
+	cache->link[frame].prev = prev;
+	cache->link[prev].next = frame;
+}
+
+static inline void
+fmd_frame_list_add(struct fmd_cache_t *cache, u32 frame, int list)
+{
+	u32 head = fmd_frame_list_head(cache, list);
+
+	__fmd_frame_list_add(cache, frame, head, cache->link[head].next);
+}
+
+static inline void
+fmd_frame_list_add_tail(struct fmd_cache_t *cache, u32 frame, int list)
+{
+	u32 head = fmd_frame_list_head(cache, list);
+
+	__fmd_frame_list_add(cache, frame, cache->link[head].prev, head);
+}
+
+/* Unlink a frame, leaving it linked to itself */
+static inline void
+fmd_frame_list_del(struct fmd_cache_t *cache, u32 frame)
+{
+	struct fmd_frame_link_t *l = &cache->link[frame];
+
+	cache->link[l->prev].next = l->next;
+	cache->link[l->next].prev = l->prev;
+	l->prev = frame;
+	l->next = frame;
+}
+
+static inline void
+fmd_frame_list_move_tail(struct fmd_cache_t *cache, u32 frame, int list)
+{
+	fmd_frame_list_del(cache, frame);
+	fmd_frame_list_add_tail(cache, frame, list);
+}
+
+/* Radix tree items point at the index entry of a private frame, or of
+ * an alias of a shared frame */
+static inline void *fmd_frame_item(struct fmd_cache_t *cache, u32 frame)
+{
+	return &cache->index[frame];
+}
+
+static inline u32 fmd_item_frame(struct fmd_cache_t *cache, void *item)
+{
+	u32 *p = item;
+
+	if (p >= cache->index && p < cache->index + cache->nr_pages_cache)
+		return p - cache->index;
+	return container_of(p, struct fmd_dedup_alias_t, index)->frame;
+}
+
+static inline unsigned int fmd_frame_ref(struct fmd_cache_t *cache, u32 frame)
+{
+	return cache->state[frame] & FMD_FRAME_REF_MASK;
+}
 
 /*-------------------------------------------------------------*/
 /*-------------------   Cache Functions   ---------------------*/
 /*-------------------------------------------------------------*/
 
-/* Allocate pagepool and map each page entry to corresponding page in
- * virtual memory
+/* Allocate the frame metadata arrays on the cache's node.  All frames
+ * start out on the free list.
  */
 int fmd_pagepool_init(struct fmd_device_t *fmd)
 {
     struct fmd_cache_t *cache;
-    struct fmd_page_t *page;
     unsigned long i;
 
     BUG_ON(!fmd || !fmd->cache);
@@ -54,47 +179,94 @@ int fmd_pagepool_init(struct fmd_device_t *fmd)
 
     printk(KERN_INFO "%s: %s\n", fmd->dev_name, __func__);
 
-    /* Use the memory at the end of the cache memory area to store the
-     * page structs */
+    /* Keep the metadata in cacheable memory, the whole window holds
+     * frames */
     BUG_ON (!cache->nr_pages_total || !cache->virt);
-    cache->nr_pages_pagepool =
-	    PAGE_ALIGN(cache->nr_pages_total * sizeof(struct fmd_page_t)) /
-	    PAGE_SIZE;
-    if (!cache->nr_pages_pagepool ||
-	 cache->nr_pages_pagepool >= cache->nr_pages_total) {
+    cache->nr_pages_cache = cache->nr_pages_total;
+    cache->fmd = fmd;
+
+    cache->index = vzalloc_node(cache->nr_pages_cache * sizeof(u32), cache->node);
+    cache->state = vzalloc_node(cache->nr_pages_cache * sizeof(u32), cache->node);
+    cache->link = vmalloc_node((cache->nr_pages_cache + FMD_NR_LISTS) *
+			       sizeof(struct fmd_frame_link_t), cache->node);
+    cache->epoch = vmalloc_node(cache->nr_pages_cache * sizeof(u32), cache->node);
+    if (!cache->index || !cache->state || !cache->link || !cache->epoch) {
+	fmd_pagepool_cleanup(fmd);
 	return -ENOMEM;
     }
 
-    cache->nr_pages_cache = cache->nr_pages_total - cache->nr_pages_pagepool;
-    cache->pagepool = cache->virt + (cache->nr_pages_cache * PAGE_SIZE);
+    for (i = 0; i < FMD_NR_LISTS; i++)
+	fmd_frame_list_init(cache, i);
+    cache->nr_free = 0;
 
-    /* Map page structs to corresponding PAGE_SIZE'd memory chunks in cache */
     for (i=0; i < cache->nr_pages_cache; i++) {
-
-	page = &cache->pagepool[i];
-	page->index = i;
-	page->virt = cache->virt + (i * PAGE_SIZE);
+	fmd_frame_list_add_tail(cache, i, FMD_LIST_FREE);
+	cache->nr_free++;
     }
 
+    printk(KERN_INFO "%s: %s: %u frames, %zu bytes of metadata each\n", fmd->dev_name, __func__, cache->nr_pages_cache, 3 * sizeof(u32) + sizeof(struct fmd_frame_link_t));
     return 0;
 }
 
-/* Rretieve corresponding page to the given index */
-static struct fmd_page_t *fmd_alloc_page(struct fmd_device_t *fmd, pgoff_t index)
+void fmd_pagepool_cleanup(struct fmd_device_t *fmd)
+{
+    struct fmd_cache_t *cache = (struct fmd_cache_t *) fmd->cache;
+
+    vfree(cache->epoch);
+    vfree(cache->link);
+    vfree(cache->state);
+    vfree(cache->index);
+    cache->epoch = NULL;
+    cache->link = NULL;
+    cache->state = NULL;
+    cache->index = NULL;
+}
+
+/*
+ * Take a frame off the free list.  Caller holds fmd->lock.
+ *
+ * Free frames are normally kept above the low watermark by the reclaim
+ * worker.  Only when they fall to the min watermark does the allocating
+ * I/O reclaim frames itself.
+ */
+static u32 fmd_alloc_page(struct fmd_device_t *fmd)
 {
     struct fmd_cache_t *cache;
+    u32 frame;
 
     BUG_ON(!fmd || !fmd->cache);
     cache = (struct fmd_cache_t *) fmd->cache;
 
-    printk(KERN_INFO "%s: %s\n", fmd->dev_name, __func__);
+    if (cache->nr_free <= cache->wmark_min) {
+	    cache->nr_direct_reclaimed +=
+		    fmd_reclaim_pages(fmd, cache->evict_num_entries, false);
+    }
+
+    if (fmd_frame_list_empty(cache, FMD_LIST_FREE)) {
+	    cache->nr_alloc_failed++;
+	    return FMD_FRAME_NONE;
+    }
 
-    if (index > cache->nr_pages_cache) {
-	    return NULL;
+    frame = fmd_frame_list_first(cache, FMD_LIST_FREE);
+    fmd_frame_list_del(cache, frame);
+    cache->nr_free--;
+
+    if (cache->nr_free < cache->wmark_low) {
+	    queue_work(cache->reclaim_wq, &cache->reclaim_work);
     }
 
-    BUG_ON (!cache->pagepool);
-    return (struct fmd_page_t *) &cache->pagepool[index];
+    BUG_ON (cache->state[frame]);
+    return frame;
+}
+
+/* Return a frame to the free list.  Caller holds fmd->lock. */
+static void fmd_free_frame(struct fmd_device_t *fmd, u32 frame)
+{
+    struct fmd_cache_t *cache = (struct fmd_cache_t *) fmd->cache;
+
+    cache->state[frame] = 0;
+    fmd_frame_list_add(cache, frame, FMD_LIST_FREE);
+    cache->nr_free++;
 }
 
 /*-------------------------------------------------------------*/
@@ -114,6 +286,7 @@ fmd_radix_tree_init(struct fmd_device_t *fmd)
 	printk(KERN_INFO "%s: %s\n", fmd->dev_name, __func__);
 
 	INIT_RADIX_TREE(&cache->tree, GFP_ATOMIC);
+	INIT_LIST_HEAD(&cache->around);
 }
 
 /* Free all pages in the radix tree, and eviction list */
@@ -122,8 +295,7 @@ fmd_radix_tree_free_pages(struct fmd_device_t *fmd)
 {
         unsigned long pos = 0;
         int nr_found;
-        struct fmd_page_t *batch[MAX_BATCH];
-        struct fmd_page_t *page;
+        u32 *batch[MAX_BATCH];
         struct fmd_cache_t *cache;
 
         BUG_ON(!fmd || !fmd->cache);
@@ -132,127 +304,470 @@ fmd_radix_tree_free_pages(struct fmd_device_t *fmd)
 	printk(KERN_INFO "%s: %s:\n", fmd->dev_name, __func__);
         do {
                 int i;
+		spin_lock(&fmd->lock);
                 nr_found = radix_tree_gang_lookup(&cache->tree, (void **)batch,
                                                   pos, MAX_BATCH);
-//XXX:
-printk(KERN_INFO "%s: %s: nr_found=%d\n", fmd->dev_name, __func__, nr_found);
                 for (i=0; i<nr_found; i++) {
-                        page = batch[i];
-                        WARN_ON(page->index < pos);
-                        pos = page->index;
-                        fmd_radix_tree_free_page(fmd, page);
+                        WARN_ON(*batch[i] < pos);
+                        pos = *batch[i];
+                        /* Gone with a shared frame freed earlier in the batch */
+                        if (radix_tree_lookup(&cache->tree, pos) != batch[i])
+                                continue;
+                        fmd_radix_tree_free_page(fmd, fmd_item_frame(cache, batch[i]));
                 }
+		spin_unlock(&fmd->lock);
                 pos++;
         }
         while (nr_found == MAX_BATCH);
 }
 
-/* Free the specified page from the radix tree and eviction list */
+/*
+ * Flush the specified frame and remove it from the radix tree and eviction
+ * or pin list, along with every page sharing it.  The frame returns to the
+ * free list once its last reference is dropped.  Caller holds fmd->lock.
+ */
 void
-fmd_radix_tree_free_page(struct fmd_device_t *fmd, struct fmd_page_t *page)
+fmd_radix_tree_free_page(struct fmd_device_t *fmd, u32 frame)
 {
         struct fmd_cache_t *cache;
-	struct fmd_page_t *ret;
+	void *ret;
 
-        BUG_ON(!fmd || !fmd->cache || !page);
+        BUG_ON(!fmd || !fmd->cache || frame == FMD_FRAME_NONE);
         cache = (struct fmd_cache_t *) fmd->cache;
 
-	printk(KERN_INFO "%s: %s\n", fmd->dev_name, __func__);
-
-        fmd_radix_tree_flush_dirty_page(fmd, page);
+        fmd_radix_tree_flush_dirty_page(fmd, frame);
 
         /* Remove page from eviction list, radix_tree and cache pool */
-        ret = radix_tree_delete(&cache->tree, page->index);
-        BUG_ON(!ret || ret != page);
-        if (page) {
-		printk(KERN_INFO "%s: %s: page %ld\n", fmd->dev_name, __func__, page->index);
-		fmd_evict_list_delete(fmd, page);
-        }
+	if (cache->state[frame] & FMD_FRAME_SHARED) {
+		fmd_dedup_drop_aliases(fmd, frame);
+	} else {
+		ret = radix_tree_delete(&cache->tree, cache->index[frame]);
+		BUG_ON(!ret || ret != fmd_frame_item(cache, frame));
+	}
+	if (cache->state[frame] & FMD_FRAME_HASHED)
+		fmd_dedup_unhash(cache, frame);
+	fmd_evict_list_delete(fmd, frame);
+	if (cache->state[frame] & FMD_FRAME_PINNED)
+		cache->nr_pinned--;
+
+	cache->state[frame] &= ~(FMD_FRAME_CACHED | FMD_FRAME_PINNED |
+				 FMD_FRAME_SHARED | FMD_FRAME_HASHED |
+				 FMD_FRAME_REFERENCED | FMD_FRAME_INVALID);
+	if (!fmd_frame_ref(cache, frame))
+		fmd_free_frame(fmd, frame);
 }
 
 /*
- * Look up and return a fmd's page for a given sector.
+ * Look up and return the frame caching a given sector, or FMD_FRAME_NONE.
+ * No reference is taken, so the caller must hold fmd->lock.
  */
-struct fmd_page_t *
+u32
 fmd_radix_tree_lookup_page(struct fmd_device_t *fmd, sector_t sector)
 {
         pgoff_t index;
-        struct fmd_page_t *page;
+        u32 *item;
 	struct fmd_cache_t *cache;
 
         BUG_ON(!fmd || !fmd->cache);
 
 	cache = (struct fmd_cache_t *) fmd->cache;
 
-	printk(KERN_INFO "%s: %s\n", fmd->dev_name, __func__);
-
-        rcu_read_lock();
         index = sector >> PAGE_SECTORS_SHIFT;  /* sector to page index */
-	printk(KERN_INFO "%s: %s: index %ld\n", fmd->dev_name, __func__, index);
-        page = (struct fmd_page_t *) radix_tree_lookup(&cache->tree, index);
-        rcu_read_unlock();
+        item = radix_tree_lookup(&cache->tree, index);
+        if (!item)
+                return FMD_FRAME_NONE;
+
+        BUG_ON(*item != index);
+        return fmd_item_frame(cache, item);
+}
+
+/*
+ * Look up the frame caching a given sector and take a reference on it,
+ * marking it referenced for reclaim.  Returns FMD_FRAME_NONE on a cache
+ * miss, or if the page is being written into a new frame.
+ */
+u32
+fmd_radix_tree_get_page(struct fmd_device_t *fmd, sector_t sector)
+{
+	struct fmd_cache_t *cache = (struct fmd_cache_t *) fmd->cache;
+        u32 frame;
+
+	spin_lock(&fmd->lock);
+	frame = fmd_radix_tree_lookup_page(fmd, sector);
+	if (frame != FMD_FRAME_NONE && (cache->state[frame] & FMD_FRAME_INVALID))
+		frame = FMD_FRAME_NONE;
+	if (frame != FMD_FRAME_NONE)
+		cache->state[frame] = (cache->state[frame] | FMD_FRAME_REFERENCED) + 1;
+	spin_unlock(&fmd->lock);
+
+        return frame;
+}
+
+/*
+ * Look up the frames caching nr page indices from index on and take a
+ * reference on each, with one gang lookup per FMD_WB_BATCH pages.
+ * frames[i] is the frame of index + i, or FMD_FRAME_NONE if it isn't
+ * cached.  Unless write is set, a frame still FMD_FRAME_INVALID is a
+ * miss: its old contents belong to another page.  Caller holds fmd->lock.
+ * Returns the number of frames found.
+ */
+static unsigned int
+fmd_radix_tree_gang_get(struct fmd_device_t *fmd, pgoff_t index,
+		unsigned int nr, u32 *frames, bool write)
+{
+	struct fmd_cache_t *cache = (struct fmd_cache_t *) fmd->cache;
+	u32 *items[FMD_WB_BATCH];
+	unsigned int found, want, hits = 0, i = 0, j;
+	u32 frame;
+
+	while (i < nr) {
+		want = min_t(unsigned int, nr - i, FMD_WB_BATCH);
+		found = radix_tree_gang_lookup(&cache->tree, (void **) items,
+					       index + i, want);
+		for (j = 0; j < found && *items[j] < index + nr; j++) {
+			while (index + i < *items[j])
+				frames[i++] = FMD_FRAME_NONE;
+			frame = fmd_item_frame(cache, items[j]);
+			if (!write && (cache->state[frame] & FMD_FRAME_INVALID)) {
+				frames[i++] = FMD_FRAME_NONE;
+				continue;
+			}
+			cache->state[frame] = (cache->state[frame] | FMD_FRAME_REFERENCED) + 1;
+			frames[i++] = frame;
+			hits++;
+		}
+
+		/* Nothing more is cached in the range */
+		if (j < want)
+			break;
+	}
+	while (i < nr)
+		frames[i++] = FMD_FRAME_NONE;
+
+	return hits;
+}
+
+/*
+ * Look up the cached frames of the n bytes starting at sector, see
+ * fmd_radix_tree_gang_get.  frames holds fmd_cache_nr_pages(sector, n)
+ * entries.  Returns the number of frames found.
+ */
+unsigned int
+fmd_radix_tree_get_pages(struct fmd_device_t *fmd, sector_t sector, size_t n,
+		u32 *frames)
+{
+	unsigned int hits;
+
+	spin_lock(&fmd->lock);
+	hits = fmd_radix_tree_gang_get(fmd, sector >> PAGE_SECTORS_SHIFT,
+				       fmd_cache_nr_pages(sector, n), frames, false);
+	spin_unlock(&fmd->lock);
+
+	return hits;
+}
+
+/* Drop a reference.  A writer has written the page by now, so a new
+ * frame's contents are valid.  Caller holds fmd->lock */
+static void
+__fmd_radix_tree_put_page(struct fmd_device_t *fmd, u32 frame, bool dirty)
+{
+	struct fmd_cache_t *cache = (struct fmd_cache_t *) fmd->cache;
+
+	BUG_ON(!fmd_frame_ref(cache, frame));
+	cache->state[frame] = (cache->state[frame] & ~FMD_FRAME_INVALID) - 1;
+	if (cache->state[frame] & FMD_FRAME_CACHED) {
+		if (dirty)
+			fmd_radix_tree_mark_dirty_page(fmd, frame);
+	} else if (!fmd_frame_ref(cache, frame)) {
+		/* Invalidated while in use, the frame is ours to free */
+		fmd_free_frame(fmd, frame);
+	}
+}
+
+/*
+ * Drop a reference taken by fmd_radix_tree_get_page or
+ * fmd_radix_tree_insert_page, marking the page dirty if it was written.
+ */
+void
+fmd_radix_tree_put_page(struct fmd_device_t *fmd, u32 frame, bool dirty)
+{
+	spin_lock(&fmd->lock);
+	__fmd_radix_tree_put_page(fmd, frame, dirty);
+	spin_unlock(&fmd->lock);
+}
+
+/* Drop the references on the entries of frames[nr] that hold a frame */
+void
+fmd_radix_tree_put_pages(struct fmd_device_t *fmd, u32 *frames,
+		unsigned int nr, bool dirty)
+{
+	unsigned int i;
+
+	spin_lock(&fmd->lock);
+	for (i = 0; i < nr; i++) {
+		if (frames[i] != FMD_FRAME_NONE)
+			__fmd_radix_tree_put_page(fmd, frames[i], dirty);
+	}
+	spin_unlock(&fmd->lock);
+}
+
+/*
+ * Drop the references of a write that goes around the cache after all,
+ * see fmd_radix_tree_insert_pages.  A new frame no other writer holds
+ * is deleted, as nothing was written to it.
+ */
+void
+fmd_radix_tree_drop_pages(struct fmd_device_t *fmd, u32 *frames,
+		unsigned int nr)
+{
+	struct fmd_cache_t *cache = (struct fmd_cache_t *) fmd->cache;
+	unsigned int i;
+
+	spin_lock(&fmd->lock);
+	for (i = 0; i < nr; i++) {
+		if (frames[i] == FMD_FRAME_NONE)
+			continue;
+		BUG_ON(!fmd_frame_ref(cache, frames[i]));
+		if (!(cache->state[frames[i]] & FMD_FRAME_INVALID)) {
+			__fmd_radix_tree_put_page(fmd, frames[i], false);
+			continue;
+		}
+		cache->state[frames[i]]--;
+		if (!fmd_frame_ref(cache, frames[i]))
+			fmd_radix_tree_free_page(fmd, frames[i]);
+	}
+	spin_unlock(&fmd->lock);
+}
+
+/* A page range fmd_cache_write_around is writing to the dsk */
+struct fmd_around_t {
+	struct list_head list;
+	pgoff_t first;
+	pgoff_t last;
+};
+
+/* Whether a write around the cache is writing page index, whose dsk
+ * contents can't be cached until it's done.  Caller holds fmd->lock */
+static bool
+fmd_cache_around_busy(struct fmd_cache_t *cache, pgoff_t index)
+{
+	struct fmd_around_t *a;
+
+	list_for_each_entry(a, &cache->around, list) {
+		if (index >= a->first && index <= a->last)
+			return true;
+	}
+	return false;
+}
+
+/* Read the dsk contents of a page into its cache frame, from the
+ * compressed pool if it has them */
+static void
+fmd_radix_tree_fill_page(struct fmd_device_t *fmd, u32 frame)
+{
+	struct fmd_cache_t *cache = (struct fmd_cache_t *) fmd->cache;
+	void *dst = (void __force *) fmd_cache_frame_virt(cache, frame);
+	u64 start = fmd_emul_begin(fmd);
+
+	if (!fmd_zcache_load(fmd, cache->index[frame], dst))
+		fmd_region_read(fmd, dst,
+				(sector_t) cache->index[frame] << PAGE_SECTORS_SHIFT,
+				PAGE_SIZE);
 
-	printk(KERN_INFO "%s: %s: page %p\n", fmd->dev_name, __func__, page);
-        BUG_ON(page && page->index != index);
-        return page;
+	/* The frame is written while the dsk is read */
+	fmd_emul_end(fmd, FMD_EMUL_DRAM, FMD_EMUL_WRITE, start, PAGE_SIZE);
 }
 
 /*
- * Look up and return a cached page for a given sector.
- * If one does not previously exist in cache, allocate an empty page, 
+ * Look up and return the frame caching a given sector, with a reference.
+ * If one does not previously exist in cache, allocate an empty frame, 
  * insert it into the radix tree and eviction list, then return it.
+ * If fill is set, a newly inserted page is first read from the dsk,
+ * otherwise it is FMD_FRAME_INVALID until the caller puts it.
+ * Returns FMD_FRAME_NONE if no frame or radix tree node could be allocated,
+ * or if the page is being written into a new frame or around the cache.
  */
-struct fmd_page_t *
-fmd_radix_tree_insert_page(struct fmd_device_t *fmd, sector_t sector)
+u32
+fmd_radix_tree_insert_page(struct fmd_device_t *fmd, sector_t sector, bool fill)
 {
         pgoff_t index;
-        struct fmd_page_t *page;
+        u32 frame;
+        u32 *item;
 	struct fmd_cache_t *cache;
-	int rval;
 
         BUG_ON(!fmd | !fmd->cache);
 	cache = (struct fmd_cache_t *) fmd->cache;
 
-	printk(KERN_INFO "%s: %s\n", fmd->dev_name, __func__);
-
         /* If page already exists in radix_tree, return it */
-        page = fmd_radix_tree_lookup_page(fmd, sector);
-        if (page) {
-                return page;
+        frame = fmd_radix_tree_get_page(fmd, sector);
+        if (frame != FMD_FRAME_NONE) {
+                return frame;
         }
 
-        /* Retrieve corresponding page for index */
-	index = sector >> PAGE_SECTORS_SHIFT;
-	page = fmd_alloc_page(fmd, index);
-        if (!page) {
-                return NULL;
-        }
-
-        /* Insert newly allocated page into radix_tree */
         if (radix_tree_preload(GFP_NOIO)) {
-                return NULL;
+                return FMD_FRAME_NONE;
         }
 
+	index = sector >> PAGE_SECTORS_SHIFT;
 	spin_lock(&fmd->lock);
-	rval =  radix_tree_insert(&cache->tree, index, page);
-        if (rval == -EEXIST) {
-                page = radix_tree_lookup(&cache->tree, index);
-                BUG_ON(!page);
-                BUG_ON(page->index != index);
-	} else if (rval == -ENOMEM) {
-                page = NULL;
+
+	/* Recheck under the lock in case of a racing insert */
+	item = radix_tree_lookup(&cache->tree, index);
+	if (item) {
+		frame = fmd_item_frame(cache, item);
+		if (cache->state[frame] & FMD_FRAME_INVALID)
+			frame = FMD_FRAME_NONE;
+		else
+			cache->state[frame] = (cache->state[frame] | FMD_FRAME_REFERENCED) + 1;
+		goto out;
+	}
+
+	if (fill && fmd_cache_around_busy(cache, index)) {
+		frame = FMD_FRAME_NONE;
+		goto out;
 	}
 
-	/* Insert page into eviction list */
-	if (page) {
-	    printk(KERN_INFO "%s: %s: page %ld\n", fmd->dev_name, __func__, page->index);
-	    fmd_evict_list_add(fmd, page);
+        /* Retrieve a free frame for index */
+	frame = fmd_alloc_page(fmd);
+	if (frame == FMD_FRAME_NONE)
+		goto out;
+
+	cache->index[frame] = index;
+	if (fill)
+		fmd_radix_tree_fill_page(fmd, frame);
+	else
+		fmd_zcache_invalidate(fmd, index);
+
+        /* Insert newly allocated frame into radix_tree */
+	if (radix_tree_insert(&cache->tree, index, fmd_frame_item(cache, frame))) {
+		fmd_free_frame(fmd, frame);
+		frame = FMD_FRAME_NONE;
+		goto out;
 	}
 
+	/* Insert frame into eviction list */
+	cache->state[frame] = FMD_FRAME_CACHED | (fill ? 0 : FMD_FRAME_INVALID) | 1;
+	fmd_evict_list_add(fmd, frame);
+
+out:
 	spin_unlock(&fmd->lock);
         radix_tree_preload_end();
 
-        return page;
+        return frame;
+}
+
+/*
+ * Look up the cache frames of the n bytes starting at sector with a gang
+ * lookup, and insert the pages that aren't cached, all with a reference.
+ * New pages are read from the dsk first if fill is set, otherwise only
+ * the first and last pages are, when the range covers them partially.
+ * Without fill the caller is about to write the pages, so pages sharing
+ * a dedup frame get a private copy and hashed pages are unhashed.  The
+ * pages it writes whole are FMD_FRAME_INVALID until it puts them, and
+ * other I/O finds them as misses; a write covering one of those only in
+ * part gets no frame for it.  If the caller doesn't write the pages after
+ * all it drops them with fmd_radix_tree_drop_pages.  Pages a write around
+ * the cache is writing aren't filled: a read leaves them to the dsk, a
+ * write gets no frame.
+ * With nowait nothing sleeps: the tree isn't preloaded, and a page whose
+ * index node can't be allocated atomically gets no frame.
+ * frames holds fmd_cache_nr_pages(sector, n) entries.  Insertion stops at
+ * the first page that gets no frame, leaving it and any later page that
+ * wasn't already cached FMD_FRAME_NONE.  Returns the number of frames set.
+ */
+unsigned int
+fmd_radix_tree_insert_pages(struct fmd_device_t *fmd, sector_t sector,
+		size_t n, u32 *frames, bool fill, bool nowait)
+{
+	struct fmd_cache_t *cache = (struct fmd_cache_t *) fmd->cache;
+	pgoff_t index = sector >> PAGE_SECTORS_SHIFT;
+	unsigned int nr = fmd_cache_nr_pages(sector, n);
+	unsigned int head = (sector & (PAGE_SECTORS-1)) << SECTOR_SHIFT;
+	unsigned int tail = ((sector << SECTOR_SHIFT) + n) & (PAGE_SIZE - 1);
+	unsigned int got, i;
+	bool whole;
+	u32 frame;
+	int err;
+
+	/* The tree allocates atomically, the preload only covers the
+	 * first insert */
+	if (!nowait && radix_tree_preload(GFP_NOIO)) {
+		for (i = 0; i < nr; i++)
+			frames[i] = FMD_FRAME_NONE;
+		return 0;
+	}
+
+	spin_lock(&fmd->lock);
+	got = fmd_radix_tree_gang_get(fmd, index, nr, frames, !fill);
+	for (i = 0; i < nr && !fill; i++) {
+		if (frames[i] == FMD_FRAME_NONE)
+			continue;
+		/* Another write's new frame, which this one wouldn't write
+		 * whole.  That write holds it, so just drop the reference */
+		whole = !((i == 0 && head) || (i == nr - 1 && tail));
+		if ((cache->state[frames[i]] & FMD_FRAME_INVALID) && !whole) {
+			cache->state[frames[i]]--;
+			frames[i] = FMD_FRAME_NONE;
+			got--;
+			goto out;
+		}
+		if (!cache->dedup)
+			continue;
+		/* The contents are about to change */
+		if (!(cache->state[frames[i]] & FMD_FRAME_SHARED)) {
+			if (cache->state[frames[i]] & FMD_FRAME_HASHED)
+				fmd_dedup_unhash(cache, frames[i]);
+			continue;
+		}
+		if (fmd_dedup_cow(fmd, index + i, &frames[i])) {
+			__fmd_radix_tree_put_page(fmd, frames[i], false);
+			frames[i] = FMD_FRAME_NONE;
+			got--;
+			goto out;
+		}
+	}
+	for (i = 0; i < nr && got < nr; i++) {
+		if (frames[i] != FMD_FRAME_NONE)
+			continue;
+
+		whole = !fill && !((i == 0 && head) || (i == nr - 1 && tail));
+		if (!whole && fmd_cache_around_busy(cache, index + i)) {
+			if (fill)
+				continue;
+			break;
+		}
+
+		/* Frames already referenced above are safe from reclaim */
+		frame = fmd_alloc_page(fmd);
+		if (frame == FMD_FRAME_NONE)
+			break;
+
+		cache->index[frame] = index + i;
+		if (!whole)
+			fmd_radix_tree_fill_page(fmd, frame);
+		else
+			fmd_zcache_invalidate(fmd, index + i);
+
+		err = radix_tree_insert(&cache->tree, index + i,
+					fmd_frame_item(cache, frame));
+		if (err) {
+			fmd_free_frame(fmd, frame);
+			/* A read missed a page being written into a new frame */
+			if (err == -EEXIST)
+				continue;
+			break;
+		}
+		cache->state[frame] = FMD_FRAME_CACHED | (whole ? FMD_FRAME_INVALID : 0) | 1;
+		fmd_evict_list_add(fmd, frame);
+		frames[i] = frame;
+		got++;
+	}
+out:
+	spin_unlock(&fmd->lock);
+	if (!nowait)
+		radix_tree_preload_end();
+
+	return got;
 }
 
 /*
@@ -260,53 +775,129 @@ fmd_radix_tree_insert_page(struct fmd_device_t *fmd, sector_t sector)
  * Writes are not written directly to the disk, but are written to cache. 
  * Some future event (sync, cache eviction, driver unload) will trigger dirty 
  * pages to be flushed (written) from the cache to the disk. 
+ * Caller holds fmd->lock.
  */
 inline void
-fmd_radix_tree_mark_dirty_page(struct fmd_device_t *fmd, struct fmd_page_t *page)
+fmd_radix_tree_mark_dirty_page(struct fmd_device_t *fmd, u32 frame)
 {
 	struct fmd_cache_t *cache;
 
 	BUG_ON(!fmd || !fmd->cache);
 
-	printk(KERN_INFO "%s: %s\n", fmd->dev_name, __func__);
-
 	cache = (struct fmd_cache_t *) fmd->cache;
-        radix_tree_tag_set(&cache->tree, page->index, PAGECACHE_TAG_DIRTY);
+
+	/* A page stays in the epoch it was first dirtied in until it is
+	 * written back */
+	if (!radix_tree_tag_get(&cache->tree, cache->index[frame], PAGECACHE_TAG_DIRTY)) {
+		cache->epoch[frame] = cache->flush_epoch;
+		radix_tree_tag_set(&cache->tree, cache->index[frame], PAGECACHE_TAG_DIRTY);
+	}
+}
+
+/*
+ * Copy a run of cache frames to the dsk pages from index on with the
+ * device's write routine, which streams to the flash tier instead of
+ * filling the CPU cache.
+ */
+static inline void
+fmd_writeback_copy(struct fmd_device_t *fmd, pgoff_t index,
+		   void __iomem *src, size_t len)
+{
+	u64 start = fmd_emul_begin(fmd);
+
+	fmd_region_write(fmd, (sector_t) index << PAGE_SECTORS_SHIFT,
+			 (void __force *) src, len);
+	fmd_emul_end(fmd, FMD_EMUL_DRAM, FMD_EMUL_READ, start, len);
+}
+
+/*
+ * Write back dirty pages from a batch of radix tree items sorted by page
+ * index.  Runs of pages with consecutive indices whose frames are also
+ * consecutive are copied as one large copy.  Clean pages are skipped.
+ * Caller holds fmd->lock.
+ *
+ * The dirty tag is cleared before the copy: a writer still copying into a
+ * frame sets it again when it puts the page, so its data is flushed later.
+ */
+static void
+fmd_writeback_pages(struct fmd_device_t *fmd, u32 **batch, int nr)
+{
+	struct fmd_cache_t *cache = (struct fmd_cache_t *) fmd->cache;
+	u32 *first = NULL;
+	u32 *item;
+	unsigned int run = 0;
+	int i;
+
+	for (i = 0; i <= nr; i++) {
+		item = (i < nr) ? batch[i] : NULL;
+		if (item && !radix_tree_tag_get(&cache->tree, *item, PAGECACHE_TAG_DIRTY))
+			item = NULL;
+
+		/* Extend the current run if this page continues it */
+		if (item && first &&
+		    *item == *first + run &&
+		    fmd_item_frame(cache, item) == fmd_item_frame(cache, first) + run) {
+			radix_tree_tag_clear(&cache->tree, *item, PAGECACHE_TAG_DIRTY);
+			run++;
+			continue;
+		}
+
+		/* Otherwise write out the current run and start a new one */
+		if (first) {
+			fmd_writeback_copy(fmd, *first,
+					   fmd_cache_frame_virt(cache, fmd_item_frame(cache, first)),
+					   run * PAGE_SIZE);
+			cache->nr_wb_pages += run;
+			cache->nr_wb_runs++;
+		}
+		first = item;
+		run = 0;
+		if (item) {
+			radix_tree_tag_clear(&cache->tree, *item, PAGECACHE_TAG_DIRTY);
+			run = 1;
+		}
+	}
 }
 
 /*
  * This function is called as a result of some event (sync, cache eviction, 
  * driver unload) will trigger dirty pages to be flushed (written) from the 
- * cache to the disk.
+ * cache to the disk.  A shared frame is written to each dirty page
+ * mapped to it.  Caller holds fmd->lock.
  */
 static void
-fmd_radix_tree_flush_dirty_page(struct fmd_device_t *fmd, struct fmd_page_t *page)
+fmd_radix_tree_flush_dirty_page(struct fmd_device_t *fmd, u32 frame)
 {
-        struct fmd_cache_t *cache;
-        BUG_ON(!fmd || !fmd->cache || !page);
+	struct fmd_cache_t *cache = (struct fmd_cache_t *) fmd->cache;
+	struct fmd_dedup_t *dedup = cache->dedup;
+	u32 *item;
+	u32 a;
 
-	printk(KERN_INFO "%s: %s: page %ld\n", fmd->dev_name, __func__, page->index);
+        BUG_ON(!fmd || !fmd->cache || frame == FMD_FRAME_NONE);
 
-        cache = (struct fmd_cache_t *) fmd->cache;
-        if (radix_tree_tag_get(&cache->tree, page->index, PAGECACHE_TAG_DIRTY)) {
-                /* Flush page to disk then clear tag */
-                int offset = page->virt - fmd->virt;
-                copy_page(fmd->virt + offset, cache->virt + offset);
-                radix_tree_tag_clear(&cache->tree, page->index, PAGECACHE_TAG_DIRTY);
-        }
+	if (!(cache->state[frame] & FMD_FRAME_SHARED)) {
+		item = fmd_frame_item(cache, frame);
+		fmd_writeback_pages(fmd, &item, 1);
+		return;
+	}
+	for (a = dedup->alias_head[frame]; a != FMD_FRAME_NONE; a = dedup->alias[a].next) {
+		item = &dedup->alias[a].index;
+		fmd_writeback_pages(fmd, &item, 1);
+	}
 }
 
 /* 
  * This function is called as a result of a sync.
  * All dirty cache pages will be flushed (written) to the disk.
+ * The tag lookup returns pages in index order, so the dsk is written
+ * sequentially and adjacent dirty pages coalesce.
  */
 void 
 fmd_radix_tree_flush_dirty_pages(struct fmd_device_t *fmd)
 {
         unsigned long pos = 0;
         int nr_found;
-        struct fmd_page_t *batch[MAX_BATCH];
-        struct fmd_page_t *page = NULL;
+        u32 *batch[FMD_WB_BATCH];
         struct fmd_cache_t *cache;
 
         BUG_ON(!fmd);
@@ -320,31 +911,111 @@ fmd_radix_tree_flush_dirty_pages(struct fmd_device_t *fmd)
 
         /* Find all dirty pages */
         do {
-                int i;
+		spin_lock(&fmd->lock);
                 nr_found = radix_tree_gang_lookup_tag(& cache->tree,
                                                       (void **)batch, pos, 
-                                                      MAX_BATCH, 
+                                                      FMD_WB_BATCH, 
                                                       PAGECACHE_TAG_DIRTY);
+		if (nr_found) {
+			BUG_ON(*batch[0] < pos);
+			pos = *batch[nr_found - 1];
+
+			/* Flush pages to disk then clear tags */
+			fmd_writeback_pages(fmd, batch, nr_found);
+		}
+		spin_unlock(&fmd->lock);
+		pos++;
+		cond_resched();
+        } while (nr_found == FMD_WB_BATCH);
+}
 
-                for (i=0; i<nr_found; i++) {
-                        page = batch[i];
-                        BUG_ON(page->index < pos);
-                        pos = page->index;
+/*
+ * This function is called for a REQ_PREFLUSH bio.  Starting a new epoch
+ * divides the dirty pages: those dirtied before the flush was issued are
+ * written back, while pages first dirtied during the flush are left for
+ * the next one.  Shared frames carry the epoch of only one of their pages
+ * and are always written.
+ */
+void
+fmd_cache_flush(struct fmd_device_t *fmd)
+{
+	struct fmd_cache_t *cache = (struct fmd_cache_t *) fmd->cache;
+	unsigned long pos = 0;
+	u32 *batch[FMD_WB_BATCH];
+	u64 wb_pages;
+	u32 epoch, frame;
+	int nr_found, nr, i;
 
-                        /* Flush page to disk then clear tag */
-                        fmd_radix_tree_flush_dirty_page(fmd, page);
-                }
+	spin_lock(&fmd->lock);
+	epoch = cache->flush_epoch++;
+	cache->nr_flushes++;
+	spin_unlock(&fmd->lock);
+
+	if (!radix_tree_tagged(&cache->tree, PAGECACHE_TAG_DIRTY))
+		return;
+
+	do {
+		spin_lock(&fmd->lock);
+		nr_found = radix_tree_gang_lookup_tag(&cache->tree,
+						      (void **)batch, pos,
+						      FMD_WB_BATCH,
+						      PAGECACHE_TAG_DIRTY);
+		if (nr_found) {
+			pos = *batch[nr_found - 1];
+
+			/* Keep the pages dirtied in this epoch or before */
+			for (i = 0, nr = 0; i < nr_found; i++) {
+				frame = fmd_item_frame(cache, batch[i]);
+				if ((cache->state[frame] & FMD_FRAME_SHARED) ||
+				    (s32)(epoch - cache->epoch[frame]) >= 0)
+					batch[nr++] = batch[i];
+				else
+					cache->nr_flush_skipped++;
+			}
+			wb_pages = cache->nr_wb_pages;
+			fmd_writeback_pages(fmd, batch, nr);
+			cache->nr_flush_pages += cache->nr_wb_pages - wb_pages;
+		}
+		spin_unlock(&fmd->lock);
 		pos++;
-        } while (nr_found == MAX_BATCH);
+		cond_resched();
+	} while (nr_found == FMD_WB_BATCH);
 }
 
 /*-------------------------------------------------------------*/
 /*---------------   Eviction List Functions   -----------------*/
 /*-------------------------------------------------------------*/
 
+static void fmd_reclaim_work(struct work_struct *work);
 
-void 
-fmd_evict_list_init(struct fmd_device_t *fmd, int hiwat, int evict)
+/* Convert watermark percentages of the cache frames to frame counts */
+int
+fmd_cache_set_wmarks(struct fmd_device_t *fmd, unsigned int min,
+		unsigned int low, unsigned int high)
+{
+	struct fmd_cache_t *cache = (struct fmd_cache_t *) fmd->cache;
+
+	if (min > low || low > high || high >= 100)
+		return -EINVAL;
+
+	spin_lock(&fmd->lock);
+	cache->wmark_pct[FMD_WMARK_MIN] = min;
+	cache->wmark_pct[FMD_WMARK_LOW] = low;
+	cache->wmark_pct[FMD_WMARK_HIGH] = high;
+	cache->wmark_min = div_u64((u64) cache->nr_pages_cache * min, 100);
+	cache->wmark_low = div_u64((u64) cache->nr_pages_cache * low, 100);
+	cache->wmark_high = div_u64((u64) cache->nr_pages_cache * high, 100);
+	if (cache->nr_free < cache->wmark_low)
+		queue_work(cache->reclaim_wq, &cache->reclaim_work);
+	spin_unlock(&fmd->lock);
+
+	printk(KERN_INFO "%s: %s: min %u low %u high %u frames\n", fmd->dev_name, __func__, cache->wmark_min, cache->wmark_low, cache->wmark_high);
+	return 0;
+}
+
+int 
+fmd_evict_list_init(struct fmd_device_t *fmd, int evict,
+		int wmark_min, int wmark_low, int wmark_high)
 {	
 	struct fmd_cache_t *cache;
 
@@ -354,67 +1025,1428 @@ fmd_evict_list_init(struct fmd_device_t *fmd, int hiwat, int evict)
 	printk(KERN_INFO "%s: %s\n", fmd->dev_name, __func__);
 
         /* Initialize variables used for cache eviction */
-        cache->evict_hiwat = hiwat;
-        cache->evict_num_entries = evict;
-        cache->page_cnt = 0;
-        INIT_LIST_HEAD(&cache->evict_list);
-}
+        cache->evict_num_entries = clamp(evict, 1, FMD_WB_BATCH);
+
+	cache->lru_batch = alloc_percpu(struct fmd_lru_batch_t);
+	if (!cache->lru_batch)
+		return -ENOMEM;
+
+	INIT_WORK(&cache->reclaim_work, fmd_reclaim_work);
+	cache->reclaim_wq = alloc_workqueue("%s_reclaim",
+					    WQ_MEM_RECLAIM | WQ_UNBOUND, 1,
+					    fmd->dev_name);
+	if (!cache->reclaim_wq)
+		return -ENOMEM;
+
+	if (fmd_cache_set_wmarks(fmd, wmark_min, wmark_low, wmark_high) != 0) {
+		printk(KERN_INFO "%s: %s: invalid watermarks %d/%d/%d, using %d/%d/%d\n", fmd->dev_name, __func__, wmark_min, wmark_low, wmark_high, FMD_WMARK_MIN_DEFAULT, FMD_WMARK_LOW_DEFAULT, FMD_WMARK_HIGH_DEFAULT);
+		fmd_cache_set_wmarks(fmd, FMD_WMARK_MIN_DEFAULT,
+				     FMD_WMARK_LOW_DEFAULT,
+				     FMD_WMARK_HIGH_DEFAULT);
+	}
 
-static inline void 
-fmd_evict_list_add(struct fmd_device_t *fmd, struct fmd_page_t *page) {
+	return 0;
+}
 
+/*
+ * Stop the reclaim worker and free the LRU batches.  Frames still
+ * batched are dropped with the radix tree.  Safe to call if
+ * fmd_evict_list_init failed.
+ */
+void
+fmd_evict_list_cleanup(struct fmd_device_t *fmd)
+{
 	struct fmd_cache_t *cache = (struct fmd_cache_t *) fmd->cache;
 
-	printk(KERN_INFO "%s: %s\n", fmd->dev_name, __func__);
+	if (cache->reclaim_wq) {
+		cancel_work_sync(&cache->reclaim_work);
+		destroy_workqueue(cache->reclaim_wq);
+		cache->reclaim_wq = NULL;
+	}
+	free_percpu(cache->lru_batch);
+	cache->lru_batch = NULL;
+}
+
+/* Move the frames of an LRU batch to the tail of the evict list.  Caller
+ * holds fmd->lock */
+static void
+fmd_lru_batch_drain(struct fmd_cache_t *cache, struct fmd_lru_batch_t *batch)
+{
+	unsigned int i;
+	u32 frame;
+
+	for (i = 0; i < batch->nr; i++) {
+		frame = batch->frames[i];
+		if (!(cache->state[frame] & FMD_FRAME_BATCHED))
+			continue;
+		cache->state[frame] &= ~FMD_FRAME_BATCHED;
+		fmd_frame_list_add_tail(cache, frame, FMD_LIST_EVICT);
+	}
+	batch->nr = 0;
+	cache->nr_lru_drains++;
+}
 
-	list_add_tail(&page->lru, &cache->evict_list);
+/* Drain every CPU's LRU batch, for reclaim that ran out of listed
+ * frames.  Caller holds fmd->lock */
+static void
+fmd_lru_drain_all(struct fmd_cache_t *cache)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		if (per_cpu_ptr(cache->lru_batch, cpu)->nr)
+			fmd_lru_batch_drain(cache, per_cpu_ptr(cache->lru_batch, cpu));
+	}
 }
 
+/* Queue a newly cached frame for the evict list.  Caller holds fmd->lock,
+ * which also keeps us on this CPU */
 static inline void 
-fmd_evict_list_delete(struct fmd_device_t *fmd, struct fmd_page_t *page) {
+fmd_evict_list_add(struct fmd_device_t *fmd, u32 frame) {
 
-	printk(KERN_INFO "%s: %s\n", fmd->dev_name, __func__);
+	struct fmd_cache_t *cache = (struct fmd_cache_t *) fmd->cache;
+	struct fmd_lru_batch_t *batch = this_cpu_ptr(cache->lru_batch);
 
-	list_del_init(&page->lru);
+	cache->state[frame] |= FMD_FRAME_BATCHED;
+	batch->frames[batch->nr++] = frame;
+	if (batch->nr == FMD_LRU_BATCH)
+		fmd_lru_batch_drain(cache, batch);
 }
 
-inline unsigned char 
-fmd_cache_full(struct fmd_device_t *fmd)
-{
-	unsigned char retval;
+/* Take a frame off the evict or pin list, or out of its LRU batch */
+static inline void 
+fmd_evict_list_delete(struct fmd_device_t *fmd, u32 frame) {
+
 	struct fmd_cache_t *cache = (struct fmd_cache_t *) fmd->cache;
 
-	retval = (cache->page_cnt >= cache->evict_hiwat);
-	return retval;
+	if (cache->state[frame] & FMD_FRAME_BATCHED)
+		cache->state[frame] &= ~FMD_FRAME_BATCHED;
+	else
+		fmd_frame_list_del(cache, frame);
 }
 
-void 
-fmd_evict_pages(struct fmd_device_t *fmd)
+/* Reclaim sort keys carry the page index above the frame number */
+static int
+fmd_page_index_cmp(const void *a, const void *b)
 {
-        int i;
-        struct fmd_page_t *page;
-	struct fmd_cache_t *cache;
+	u64 ka = *(const u64 *) a;
+	u64 kb = *(const u64 *) b;
 
-	BUG_ON(!fmd);
-        cache = (struct fmd_cache_t *) fmd->cache;
-
-	printk(KERN_INFO "%s: %s\n", fmd->dev_name, __func__);
+	if (ka < kb)
+		return -1;
+	return ka > kb;
+}
 
-        /* Retrieve page from head of list */
-        for (i=0; i<cache->evict_num_entries; i++) {
-                if (list_empty(&cache->evict_list)) {
-//XXX:
-printk(KERN_INFO "%s: %s: evict_list EMPTY!\n", fmd->dev_name, __func__);
+/*
+ * Reclaim up to nr frames from the head of the eviction list.  Frames in
+ * use by an I/O are rotated to the tail, as are referenced frames, which
+ * lose the flag.  Past a bound on those promotions referenced frames are
+ * reclaimed like the rest.  The victims are sorted by index
+ * before their dirty pages are flushed, so the dsk sees coalesced,
+ * sequential writes instead of eviction order.  With keep set, the
+ * private frames are staged for the compressed pool.
+ * Caller holds fmd->lock.  Returns the number of frames freed.
+ */
+static unsigned int
+fmd_reclaim_pages(struct fmd_device_t *fmd, unsigned int nr, bool keep)
+{
+	struct fmd_cache_t *cache = (struct fmd_cache_t *) fmd->cache;
+	u64 keys[FMD_WB_BATCH];
+	u32 *items[FMD_WB_BATCH];
+	u32 batch[FMD_WB_BATCH];
+	u32 frame;
+	unsigned int scan, promote, n = 0, nr_items = 0, i;
+	bool drained = false;
+
+	nr = min_t(unsigned int, nr, FMD_WB_BATCH);
+	scan = nr * 2;
+	promote = nr * 8;
+again:
+	while (n < nr && scan && !fmd_frame_list_empty(cache, FMD_LIST_EVICT)) {
+		frame = fmd_frame_list_first(cache, FMD_LIST_EVICT);
+		if ((cache->state[frame] & FMD_FRAME_REFERENCED) && promote) {
+			cache->state[frame] &= ~FMD_FRAME_REFERENCED;
+			fmd_frame_list_move_tail(cache, frame, FMD_LIST_EVICT);
+			cache->nr_promoted++;
+			promote--;
+			continue;
+		}
+		scan--;
+		if (fmd_frame_ref(cache, frame)) {
+			fmd_frame_list_move_tail(cache, frame, FMD_LIST_EVICT);
+			continue;
+		}
+		fmd_evict_list_delete(fmd, frame);
+		keys[n++] = ((u64) cache->index[frame] << 32) | frame;
+	}
 
-                        break;
-                }
+	/* The list ran out, look at the frames still batched */
+	if (n < nr && scan && !drained) {
+		drained = true;
+		fmd_lru_drain_all(cache);
+		goto again;
+	}
 
-                /* Evict pages from head of list */
-                page = list_entry(cache->evict_list.next, struct fmd_page_t, lru);
-                BUG_ON(!page);
+	/* Shared frames are written back to each of their pages as they
+	 * are freed */
+	sort(keys, n, sizeof(keys[0]), fmd_page_index_cmp, NULL);
+	for (i = 0; i < n; i++) {
+		batch[i] = (u32) keys[i];
+		if (!(cache->state[batch[i]] & FMD_FRAME_SHARED))
+			items[nr_items++] = fmd_frame_item(cache, batch[i]);
+	}
+	fmd_writeback_pages(fmd, items, nr_items);
+
+	/* delete pages (now clean) and free their frames, keeping a
+	 * compressed copy of private ones if asked to */
+	for (i = 0; i < n; i++) {
+		if (keep && !(cache->state[batch[i]] & FMD_FRAME_SHARED))
+			fmd_zcache_stage(fmd, cache->index[batch[i]],
+					 fmd_cache_frame_virt(cache, batch[i]));
+		fmd_radix_tree_free_page(fmd, batch[i]);
+	}
 
-                /* delete page (also flushes dirty page) */
-                fmd_radix_tree_free_page(fmd, page);
-        }
+	return n;
+}
+
+/* Background reclaim: bring free frames back up to the high watermark */
+static void
+fmd_reclaim_work(struct work_struct *work)
+{
+	struct fmd_cache_t *cache = container_of(work, struct fmd_cache_t, reclaim_work);
+	struct fmd_device_t *fmd = cache->fmd;
+	unsigned int freed;
+
+	spin_lock(&fmd->lock);
+	while (cache->nr_free < cache->wmark_high) {
+		freed = fmd_reclaim_pages(fmd, cache->evict_num_entries, true);
+		cache->nr_reclaimed += freed;
+
+		/* Let I/O in between batches, and compress outside the lock */
+		spin_unlock(&fmd->lock);
+		fmd_zcache_store_staged(fmd);
+		cond_resched();
+		spin_lock(&fmd->lock);
+		if (!freed)
+			break;
+	}
+	spin_unlock(&fmd->lock);
+	fmd_emul_settle(fmd, false);
+}
+
+/* Synchronously reclaim one batch of frames */
+void 
+fmd_evict_pages(struct fmd_device_t *fmd)
+{
+	struct fmd_cache_t *cache;
+
+	BUG_ON(!fmd);
+        cache = (struct fmd_cache_t *) fmd->cache;
+
+	printk(KERN_INFO "%s: %s\n", fmd->dev_name, __func__);
+
+	spin_lock(&fmd->lock);
+	cache->nr_direct_reclaimed +=
+		fmd_reclaim_pages(fmd, cache->evict_num_entries, false);
+	spin_unlock(&fmd->lock);
 }
 
+
+/*-------------------------------------------------------------*/
+/*-----------------   Write Policy Functions   ----------------*/
+/*-------------------------------------------------------------*/
+
+static const char *fmd_cache_mode_names[FMD_CACHE_NR_MODES] = {
+	[FMD_CACHE_MODE_WRITEBACK]	= "writeback",
+	[FMD_CACHE_MODE_WRITETHROUGH]	= "writethrough",
+	[FMD_CACHE_MODE_WRITEAROUND]	= "writearound",
+};
+
+int
+fmd_cache_mode_init(struct fmd_device_t *fmd, int mode)
+{
+	struct fmd_cache_t *cache;
+
+	BUG_ON(!fmd || !fmd->cache);
+	cache = (struct fmd_cache_t *) fmd->cache;
+
+	printk(KERN_INFO "%s: %s: mode %d\n", fmd->dev_name, __func__, mode);
+
+	if (mode < 0 || mode >= FMD_CACHE_NR_MODES) {
+		printk(KERN_INFO "%s: %s: invalid mode %d, using %s\n", fmd->dev_name, __func__, mode, fmd_cache_mode_names[FMD_CACHE_MODE_WRITEBACK]);
+		mode = FMD_CACHE_MODE_WRITEBACK;
+	}
+	cache->mode = mode;
+
+	/* Admission policy defaults */
+	spin_lock_init(&cache->seq_lock);
+	cache->seq_cutoff = FMD_SEQ_CUTOFF_DEFAULT;
+	cache->bypass_bio_size = 0;
+
+	return percpu_init_rwsem(&cache->mode_sem);
+}
+
+/* Safe to call on a zeroed cache whose mode was never initialized */
+void
+fmd_cache_mode_cleanup(struct fmd_device_t *fmd)
+{
+	struct fmd_cache_t *cache = (struct fmd_cache_t *) fmd->cache;
+
+	percpu_free_rwsem(&cache->mode_sem);
+}
+
+/*
+ * Switch write policy online.  New bios are held off while the bios in
+ * flight finish, and any dirty pages are flushed when leaving write-back,
+ * so no page is left dirty under a policy that never flushes.
+ */
+int
+fmd_cache_set_mode(struct fmd_device_t *fmd, int mode)
+{
+	struct fmd_cache_t *cache = (struct fmd_cache_t *) fmd->cache;
+
+	if (mode < 0 || mode >= FMD_CACHE_NR_MODES)
+		return -EINVAL;
+
+	printk(KERN_INFO "%s: %s: %s -> %s\n", fmd->dev_name, __func__, fmd_cache_mode_names[cache->mode], fmd_cache_mode_names[mode]);
+
+	percpu_down_write(&cache->mode_sem);
+	if (cache->mode == FMD_CACHE_MODE_WRITEBACK &&
+	    mode != FMD_CACHE_MODE_WRITEBACK)
+		fmd_radix_tree_flush_dirty_pages(fmd);
+	cache->mode = mode;
+	percpu_up_write(&cache->mode_sem);
+
+	return 0;
+}
+
+/*
+ * Admission policy.  Track the most recent sequential streams and decide
+ * whether a bio should skip the cache: either it is large by itself, or
+ * it continues a stream long enough that its data is unlikely to be
+ * reread before being evicted (bulk loads, backup restores).
+ */
+static bool
+fmd_cache_bypass(struct fmd_device_t *fmd, sector_t sector, unsigned int bytes)
+{
+	struct fmd_cache_t *cache = (struct fmd_cache_t *) fmd->cache;
+	struct fmd_seq_stream_t *stream, *lru;
+	unsigned int cutoff = READ_ONCE(cache->seq_cutoff);
+	unsigned int bio_size = READ_ONCE(cache->bypass_bio_size);
+	u64 seq;
+	int i;
+
+	if (!bytes)
+		return false;
+	if (bio_size && bytes >= bio_size)
+		return true;
+	if (!cutoff)
+		return false;
+
+	spin_lock(&cache->seq_lock);
+	lru = &cache->streams[0];
+	for (i = 0; i < FMD_SEQ_NR_STREAMS; i++) {
+		stream = &cache->streams[i];
+		if (stream->bytes && stream->next == sector)
+			break;
+		if (time_before(stream->last_jiffies, lru->last_jiffies))
+			lru = stream;
+	}
+	if (i == FMD_SEQ_NR_STREAMS) {
+		/* Not a continuation, start a new stream in place of the LRU */
+		stream = lru;
+		stream->bytes = 0;
+	}
+	stream->bytes += bytes;
+	stream->next = sector + (bytes >> SECTOR_SHIFT);
+	stream->last_jiffies = jiffies;
+	seq = stream->bytes;
+	spin_unlock(&cache->seq_lock);
+
+	return seq >= cutoff;
+}
+
+/*
+ * Pin the write policy for the duration of a bio and return the policy
+ * to apply to it: the device's mode, or FMD_CACHE_MODE_BYPASS if the
+ * admission policy keeps the bio out of the cache.  May sleep, unless
+ * nowait is set: then it returns -EAGAIN while the policy is changing.
+ */
+int
+fmd_cache_io_begin(struct fmd_device_t *fmd, sector_t sector,
+		unsigned int bytes, bool nowait)
+{
+	struct fmd_cache_t *cache = (struct fmd_cache_t *) fmd->cache;
+
+	if (!nowait)
+		percpu_down_read(&cache->mode_sem);
+	else if (!percpu_down_read_trylock(&cache->mode_sem))
+		return -EAGAIN;
+
+	if (fmd_cache_bypass(fmd, sector, bytes)) {
+		atomic64_inc(&cache->bypassed_bios);
+		atomic64_add(bytes, &cache->bypassed_bytes);
+		return FMD_CACHE_MODE_BYPASS;
+	}
+	return cache->mode;
+}
+
+void
+fmd_cache_io_end(struct fmd_device_t *fmd)
+{
+	struct fmd_cache_t *cache = (struct fmd_cache_t *) fmd->cache;
+
+	percpu_up_read(&cache->mode_sem);
+}
+
+#define FMD_AROUND_PAGES	32	/* pages looked up per lock hold */
+
+/*
+ * Write n bytes from src to the dsk around the cache, dropping any cached
+ * copy so it can't shadow them.  A page other I/O holds a reference on
+ * isn't dropped: a writer would go on copying into a frame that's no
+ * longer cached, and its data would be lost.  That frame takes the new
+ * data as well and is left dirty, so a write back racing with the dsk
+ * write that wrote the older contents is redone.  Frames of shared pages
+ * are only referenced by readers, writers copy them first.  A new frame
+ * another write is filling is left to it, unless this one covers the
+ * page whole.  Until the dsk write is done the pages can't be filled,
+ * which would cache the older contents again.
+ */
+void
+fmd_cache_write_around(struct fmd_device_t *fmd, sector_t sector,
+		const void *src, size_t n)
+{
+	struct fmd_cache_t *cache = (struct fmd_cache_t *) fmd->cache;
+	struct fmd_around_t around;
+	u32 frames[FMD_AROUND_PAGES];
+	unsigned int offset, tail, nr, i;
+	size_t len, copy, pos, hit;
+	pgoff_t index;
+	u32 frame;
+	u32 *item;
+	u64 start;
+
+	for (; n; sector += len >> SECTOR_SHIFT, src += len, n -= len) {
+		offset = (sector & (PAGE_SECTORS-1)) << SECTOR_SHIFT;
+		len = min_t(size_t, n, FMD_AROUND_PAGES * PAGE_SIZE - offset);
+		nr = fmd_cache_nr_pages(sector, len);
+		index = sector >> PAGE_SECTORS_SHIFT;
+		tail = ((sector << SECTOR_SHIFT) + len) & (PAGE_SIZE - 1);
+		around.first = index;
+		around.last = index + nr - 1;
+
+		spin_lock(&fmd->lock);
+		list_add(&around.list, &cache->around);
+		for (i = 0; i < nr; i++) {
+			frames[i] = FMD_FRAME_NONE;
+			item = radix_tree_lookup(&cache->tree, index + i);
+			if (!item) {
+				fmd_zcache_invalidate(fmd, index + i);
+				continue;
+			}
+			frame = fmd_item_frame(cache, item);
+			if ((cache->state[frame] & FMD_FRAME_INVALID) &&
+			    ((i == 0 && offset) || (i == nr - 1 && tail)))
+				continue;
+			if (fmd_frame_ref(cache, frame) &&
+			    !(cache->state[frame] & FMD_FRAME_SHARED)) {
+				if (cache->state[frame] & FMD_FRAME_HASHED)
+					fmd_dedup_unhash(cache, frame);
+				cache->state[frame]++;
+				frames[i] = frame;
+			} else {
+				fmd_radix_tree_free_page(fmd, frame);
+			}
+		}
+		spin_unlock(&fmd->lock);
+
+		fmd_region_write(fmd, sector, src, len);
+
+		start = fmd_emul_begin(fmd);
+		hit = 0;
+		for (i = 0, pos = 0; i < nr; i++, pos += copy, offset = 0) {
+			copy = min_t(size_t, len - pos, PAGE_SIZE - offset);
+			if (frames[i] == FMD_FRAME_NONE)
+				continue;
+			memcpy(fmd_cache_frame_virt(cache, frames[i]) + offset,
+			       src + pos, copy);
+			hit += copy;
+		}
+		if (hit)
+			fmd_emul_end(fmd, FMD_EMUL_DRAM, FMD_EMUL_WRITE, start, hit);
+
+		spin_lock(&fmd->lock);
+		list_del(&around.list);
+		for (i = 0; i < nr; i++) {
+			if (frames[i] != FMD_FRAME_NONE)
+				__fmd_radix_tree_put_page(fmd, frames[i], true);
+		}
+		spin_unlock(&fmd->lock);
+	}
+}
+
+/*-------------------------------------------------------------*/
+/*------------------   Deduplication Functions   --------------*/
+/*-------------------------------------------------------------*/
+
+/*
+ * Pages a write covers fully are hashed with crc32c from the writer's
+ * buffer before it puts them.  A page whose contents match a hashed frame
+ * is remapped to that frame and its own frame is freed.  Both pages then
+ * map the frame through aliases, which carry their page index and dirty
+ * tag.  Writing a page of a shared frame first copies the frame, and a
+ * frame left with one page becomes private again.  Evicting a shared
+ * frame writes it back to each dirty page and drops them all.  Frames in
+ * use by I/O or pinned are left alone, and every match is confirmed with
+ * memcmp.
+ *
+ * The hash and the compare run outside fmd->lock, the candidate frame
+ * read through a per CPU bounce page with the device's copy routine
+ * rather than with uncached loads.  Writes unhash a frame when they take
+ * it and hashing bumps its seq, so a candidate that is still hashed with
+ * the same seq when the lock is retaken still holds what was compared.
+ */
+
+/* Point the tree slot of index at another item, keeping its tags */
+static void
+fmd_radix_tree_replace(struct fmd_cache_t *cache, pgoff_t index, void *item)
+{
+	void **slot = (void **) radix_tree_lookup_slot(&cache->tree, index);
+
+	BUG_ON(!slot);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,10,0)
+	radix_tree_replace_slot(&cache->tree, slot, item);
+#else
+	radix_tree_replace_slot(slot, item);
+#endif
+}
+
+static u32
+fmd_dedup_alias_alloc(struct fmd_dedup_t *dedup, pgoff_t index, u32 frame)
+{
+	u32 a = dedup->free_alias;
+
+	BUG_ON(a == FMD_FRAME_NONE);
+	dedup->free_alias = dedup->alias[a].next;
+	dedup->nr_alias_used++;
+
+	dedup->alias[a].index = index;
+	dedup->alias[a].frame = frame;
+	dedup->alias[a].next = dedup->alias_head[frame];
+	dedup->alias_head[frame] = a;
+	dedup->nr_mapped[frame]++;
+	return a;
+}
+
+static void
+fmd_dedup_alias_free(struct fmd_dedup_t *dedup, u32 a)
+{
+	dedup->alias[a].next = dedup->free_alias;
+	dedup->free_alias = a;
+	dedup->nr_alias_used--;
+}
+
+/* Remove every page of a shared frame from the tree.  Caller holds
+ * fmd->lock and has written back the dirty ones */
+static void
+fmd_dedup_drop_aliases(struct fmd_device_t *fmd, u32 frame)
+{
+	struct fmd_cache_t *cache = (struct fmd_cache_t *) fmd->cache;
+	struct fmd_dedup_t *dedup = cache->dedup;
+	u32 a, next;
+
+	for (a = dedup->alias_head[frame]; a != FMD_FRAME_NONE; a = next) {
+		next = dedup->alias[a].next;
+		radix_tree_delete(&cache->tree, dedup->alias[a].index);
+		fmd_dedup_alias_free(dedup, a);
+	}
+	dedup->alias_head[frame] = FMD_FRAME_NONE;
+	dedup->nr_mapped[frame] = 0;
+	dedup->nr_shared--;
+}
+
+/*
+ * Unmap page index from a shared frame.  A frame left with one page is
+ * handed to it as a private frame.  Caller holds fmd->lock.
+ */
+static void
+fmd_dedup_unmap(struct fmd_device_t *fmd, u32 frame, pgoff_t index)
+{
+	struct fmd_cache_t *cache = (struct fmd_cache_t *) fmd->cache;
+	struct fmd_dedup_t *dedup = cache->dedup;
+	u32 *link = &dedup->alias_head[frame];
+	u32 a;
+
+	while (dedup->alias[*link].index != index)
+		link = &dedup->alias[*link].next;
+	a = *link;
+	*link = dedup->alias[a].next;
+	fmd_dedup_alias_free(dedup, a);
+
+	if (--dedup->nr_mapped[frame] > 1)
+		return;
+
+	a = dedup->alias_head[frame];
+	cache->index[frame] = dedup->alias[a].index;
+	fmd_radix_tree_replace(cache, cache->index[frame], fmd_frame_item(cache, frame));
+	fmd_dedup_alias_free(dedup, a);
+	dedup->alias_head[frame] = FMD_FRAME_NONE;
+	dedup->nr_mapped[frame] = 0;
+	dedup->nr_shared--;
+	cache->state[frame] &= ~FMD_FRAME_SHARED;
+
+	/* The epoch may be another page's, have the next flush write it */
+	cache->epoch[frame] = cache->flush_epoch - 1;
+}
+
+/*
+ * Give page index, which maps the shared *frame with a reference, a
+ * private copy before it is written.  The reference moves to the copy.
+ * Caller holds fmd->lock.  Returns -ENOSPC if no frame is free.
+ */
+static int
+fmd_dedup_cow(struct fmd_device_t *fmd, pgoff_t index, u32 *frame)
+{
+	struct fmd_cache_t *cache = (struct fmd_cache_t *) fmd->cache;
+	u32 old = *frame;
+	u32 copy;
+
+	copy = fmd_alloc_page(fmd);
+	if (copy == FMD_FRAME_NONE)
+		return -ENOSPC;
+
+	memcpy((void __force *) fmd_cache_frame_virt(cache, copy),
+	       (void __force *) fmd_cache_frame_virt(cache, old), PAGE_SIZE);
+	cache->index[copy] = index;
+	cache->state[copy] = FMD_FRAME_CACHED | 1;
+	cache->epoch[copy] = cache->flush_epoch - 1;
+	fmd_evict_list_add(fmd, copy);
+
+	fmd_radix_tree_replace(cache, index, fmd_frame_item(cache, copy));
+	fmd_dedup_unmap(fmd, old, index);
+	cache->state[old]--;
+	cache->dedup->nr_cow++;
+
+	*frame = copy;
+	return 0;
+}
+
+static inline u32
+fmd_dedup_bucket(struct fmd_dedup_t *dedup, u32 hash)
+{
+	return hash & ((1U << dedup->hash_bits) - 1);
+}
+
+static void
+fmd_dedup_unhash(struct fmd_cache_t *cache, u32 frame)
+{
+	struct fmd_dedup_t *dedup = cache->dedup;
+	u32 *link = &dedup->bucket[fmd_dedup_bucket(dedup, dedup->hash[frame])];
+
+	while (*link != frame)
+		link = &dedup->hash_next[*link];
+	*link = dedup->hash_next[frame];
+	cache->state[frame] &= ~FMD_FRAME_HASHED;
+}
+
+/* Can page frame's contents be shared with frame f?  Caller holds fmd->lock */
+static inline bool
+fmd_dedup_candidate(struct fmd_cache_t *cache, u32 frame, u32 f, u32 hash)
+{
+	return f != frame && cache->dedup->hash[f] == hash &&
+	       (cache->state[f] & FMD_FRAME_HASHED) && !fmd_frame_ref(cache, f) &&
+	       !(cache->state[f] & FMD_FRAME_PINNED);
+}
+
+/* Find a hashed frame other than frame with the same hash that no I/O
+ * uses.  Caller holds fmd->lock */
+static u32
+fmd_dedup_find(struct fmd_cache_t *cache, u32 frame, u32 hash)
+{
+	struct fmd_dedup_t *dedup = cache->dedup;
+	u32 f;
+
+	for (f = dedup->bucket[fmd_dedup_bucket(dedup, hash)]; f != FMD_FRAME_NONE;
+	     f = dedup->hash_next[f]) {
+		if (fmd_dedup_candidate(cache, frame, f, hash))
+			return f;
+	}
+	return FMD_FRAME_NONE;
+}
+
+/*
+ * Hash page index, just written from src into *frame, which the writer
+ * still references, and share a frame with identical contents if there
+ * is one.  The frame is then put, dirty if set, and *frame set to
+ * FMD_FRAME_NONE.
+ */
+static void
+fmd_dedup_page(struct fmd_device_t *fmd, pgoff_t index, const void *src,
+	       u32 *frame, bool dirty)
+{
+	struct fmd_cache_t *cache = (struct fmd_cache_t *) fmd->cache;
+	struct fmd_dedup_t *dedup = cache->dedup;
+	u32 f = *frame;
+	u32 match, hash, seq = 0;
+	bool same = false;
+	void *bounce;
+	void *item;
+
+	hash = crc32c(~0, src, PAGE_SIZE);
+
+	spin_lock(&fmd->lock);
+	match = fmd_dedup_find(cache, f, hash);
+	if (match != FMD_FRAME_NONE)
+		seq = dedup->seq[match];
+	spin_unlock(&fmd->lock);
+
+	if (match != FMD_FRAME_NONE) {
+		bounce = *get_cpu_ptr(dedup->bounce);
+		fmd_copy_from_io(fmd, bounce, fmd_cache_frame_virt(cache, match),
+				 PAGE_SIZE);
+		same = !memcmp(bounce, src, PAGE_SIZE);
+		put_cpu_ptr(dedup->bounce);
+	}
+
+	spin_lock(&fmd->lock);
+	/* Anyone else holding the frame may be writing other contents */
+	if (fmd_frame_ref(cache, f) != 1 ||
+	    (cache->state[f] & (FMD_FRAME_SHARED | FMD_FRAME_PINNED)))
+		goto out;
+	if (cache->state[f] & FMD_FRAME_HASHED)
+		fmd_dedup_unhash(cache, f);
+
+	if (!same || !fmd_dedup_candidate(cache, f, match, hash) ||
+	    dedup->seq[match] != seq ||
+	    dedup->nr_alias_used + 2 > dedup->nr_alias) {
+		dedup->hash[f] = hash;
+		dedup->seq[f]++;
+		dedup->hash_next[f] = dedup->bucket[fmd_dedup_bucket(dedup, hash)];
+		dedup->bucket[fmd_dedup_bucket(dedup, hash)] = f;
+		cache->state[f] |= FMD_FRAME_HASHED;
+		goto out;
+	}
+
+	/* Put the writer's reference, the dirty tag stays with the slot */
+	if (dirty)
+		fmd_radix_tree_mark_dirty_page(fmd, f);
+	cache->state[f]--;
+
+	/* The matching frame's own page becomes its first alias */
+	if (!(cache->state[match] & FMD_FRAME_SHARED)) {
+		item = &dedup->alias[fmd_dedup_alias_alloc(dedup, cache->index[match], match)].index;
+		fmd_radix_tree_replace(cache, cache->index[match], item);
+		cache->state[match] |= FMD_FRAME_SHARED;
+		dedup->nr_shared++;
+	}
+	item = &dedup->alias[fmd_dedup_alias_alloc(dedup, index, match)].index;
+	fmd_radix_tree_replace(cache, index, item);
+	if (!(cache->state[match] & (FMD_FRAME_PINNED | FMD_FRAME_BATCHED)))
+		fmd_frame_list_move_tail(cache, match, FMD_LIST_EVICT);
+
+	fmd_evict_list_delete(fmd, f);
+	fmd_free_frame(fmd, f);
+	dedup->nr_merged++;
+	*frame = FMD_FRAME_NONE;
+out:
+	spin_unlock(&fmd->lock);
+}
+
+/*
+ * Deduplicate the cache pages fully covered by a write of the n bytes
+ * from src starting at sector, before the writer puts frames, which
+ * holds fmd_cache_nr_pages(sector, n) entries.  Pages that get shared
+ * are put here, dirty if set, and their entry set to FMD_FRAME_NONE.
+ * No-op unless dedup is enabled.
+ */
+void
+fmd_cache_dedup(struct fmd_device_t *fmd, sector_t sector, size_t n,
+		const void *src, u32 *frames, bool dirty)
+{
+	struct fmd_cache_t *cache = (struct fmd_cache_t *) fmd->cache;
+	unsigned int head = (sector & (PAGE_SECTORS-1)) << SECTOR_SHIFT;
+	unsigned int nr = fmd_cache_nr_pages(sector, n);
+	pgoff_t index = sector >> PAGE_SECTORS_SHIFT;
+	unsigned int i;
+	size_t off;
+
+	if (!cache->dedup)
+		return;
+
+	for (i = head ? 1 : 0; i < nr; i++) {
+		off = (size_t) i * PAGE_SIZE - head;
+		if (off + PAGE_SIZE > n)
+			break;
+		if (frames[i] != FMD_FRAME_NONE)
+			fmd_dedup_page(fmd, index + i, src + off, &frames[i], dirty);
+	}
+}
+
+/*
+ * Enable dedup with room for an average of up to max_share pages per
+ * cache frame, 0 or 1 = disabled.
+ */
+int
+fmd_cache_dedup_init(struct fmd_device_t *fmd, unsigned int max_share)
+{
+	struct fmd_cache_t *cache;
+	struct fmd_dedup_t *dedup;
+	unsigned int nr = 0, i;
+	int cpu;
+
+	BUG_ON(!fmd || !fmd->cache);
+	cache = (struct fmd_cache_t *) fmd->cache;
+
+	printk(KERN_INFO "%s: %s\n", fmd->dev_name, __func__);
+
+	cache->dedup = NULL;
+	if (max_share <= 1)
+		return 0;
+	max_share = min_t(unsigned int, max_share, FMD_DEDUP_MAX_SHARE);
+
+	dedup = kzalloc(sizeof(struct fmd_dedup_t), GFP_KERNEL);
+	if (!dedup)
+		return -ENOMEM;
+	cache->dedup = dedup;
+
+	nr = cache->nr_pages_cache;
+	dedup->hash_bits = ilog2(roundup_pow_of_two(nr));
+	dedup->nr_alias = nr * max_share;
+	dedup->alias = vmalloc_node(dedup->nr_alias * sizeof(struct fmd_dedup_alias_t), cache->node);
+	dedup->alias_head = vmalloc_node(nr * sizeof(u32), cache->node);
+	dedup->nr_mapped = vzalloc_node(nr * sizeof(u32), cache->node);
+	dedup->hash = vmalloc_node(nr * sizeof(u32), cache->node);
+	dedup->hash_next = vmalloc_node(nr * sizeof(u32), cache->node);
+	dedup->seq = vzalloc_node(nr * sizeof(u32), cache->node);
+	dedup->bucket = vmalloc_node((1UL << dedup->hash_bits) * sizeof(u32), cache->node);
+	dedup->bounce = alloc_percpu(void *);
+	if (!dedup->alias || !dedup->alias_head || !dedup->nr_mapped ||
+	    !dedup->hash || !dedup->hash_next || !dedup->seq || !dedup->bucket ||
+	    !dedup->bounce)
+		goto err;
+	for_each_possible_cpu(cpu) {
+		void **bounce = per_cpu_ptr(dedup->bounce, cpu);
+
+		*bounce = kmalloc_node(PAGE_SIZE, GFP_KERNEL, cpu_to_node(cpu));
+		if (!*bounce)
+			goto err;
+	}
+
+	for (i = 0; i < dedup->nr_alias; i++)
+		dedup->alias[i].next = (i + 1 < dedup->nr_alias) ? i + 1 : FMD_FRAME_NONE;
+	dedup->free_alias = 0;
+	for (i = 0; i < nr; i++)
+		dedup->alias_head[i] = FMD_FRAME_NONE;
+	for (i = 0; i < (1U << dedup->hash_bits); i++)
+		dedup->bucket[i] = FMD_FRAME_NONE;
+
+	printk(KERN_INFO "%s: %s: %u aliases\n", fmd->dev_name, __func__, dedup->nr_alias);
+	return 0;
+
+err:
+	fmd_cache_dedup_cleanup(fmd);
+	return -ENOMEM;
+}
+
+/* Call after the cache is emptied.  Safe to call if init failed */
+void
+fmd_cache_dedup_cleanup(struct fmd_device_t *fmd)
+{
+	struct fmd_cache_t *cache = (struct fmd_cache_t *) fmd->cache;
+	struct fmd_dedup_t *dedup = cache->dedup;
+	int cpu;
+
+	if (!dedup)
+		return;
+
+	if (dedup->bounce) {
+		for_each_possible_cpu(cpu)
+			kfree(*per_cpu_ptr(dedup->bounce, cpu));
+		free_percpu(dedup->bounce);
+	}
+	vfree(dedup->bucket);
+	vfree(dedup->seq);
+	vfree(dedup->hash_next);
+	vfree(dedup->hash);
+	vfree(dedup->nr_mapped);
+	vfree(dedup->alias_head);
+	vfree(dedup->alias);
+	kfree(dedup);
+	cache->dedup = NULL;
+}
+
+/*-------------------------------------------------------------*/
+/*------------------   Access Hint Functions   ----------------*/
+/*-------------------------------------------------------------*/
+
+/* A WILLNEED range waiting to be prefetched */
+struct fmd_hint_work_t {
+	struct work_struct work;
+	struct fmd_device_t *fmd;
+	pgoff_t index;
+	pgoff_t last;
+};
+
+int
+fmd_cache_hint_init(struct fmd_device_t *fmd)
+{
+	struct fmd_cache_t *cache;
+
+	BUG_ON(!fmd || !fmd->cache);
+	cache = (struct fmd_cache_t *) fmd->cache;
+
+	printk(KERN_INFO "%s: %s\n", fmd->dev_name, __func__);
+
+	cache->nr_pinned = 0;
+	cache->pin_limit = div_u64((u64) cache->nr_pages_cache *
+				   FMD_PIN_LIMIT_PCT_DEFAULT, 100);
+	cache->nr_hint_pending = 0;
+	cache->hint_stop = false;
+
+	cache->hint_wq = alloc_workqueue("%s_hint", WQ_UNBOUND, 1, fmd->dev_name);
+	if (!cache->hint_wq)
+		return -ENOMEM;
+
+	return 0;
+}
+
+/* Stop prefetching.  Safe to call if fmd_cache_hint_init failed */
+void
+fmd_cache_hint_cleanup(struct fmd_device_t *fmd)
+{
+	struct fmd_cache_t *cache = (struct fmd_cache_t *) fmd->cache;
+
+	if (cache->hint_wq) {
+		WRITE_ONCE(cache->hint_stop, true);
+		destroy_workqueue(cache->hint_wq);
+		cache->hint_wq = NULL;
+	}
+}
+
+/*
+ * Bring page index into the cache, filled from the dsk, and optionally
+ * pin it.  The write policy is held like for a bio.  Returns -ENOSPC if
+ * no frame is available or the pin limit is reached.
+ */
+static int
+fmd_cache_hint_page(struct fmd_device_t *fmd, pgoff_t index, bool pin)
+{
+	struct fmd_cache_t *cache = (struct fmd_cache_t *) fmd->cache;
+	u32 frame;
+	int err = 0;
+
+	percpu_down_read(&cache->mode_sem);
+	frame = fmd_radix_tree_insert_page(fmd, (sector_t) index << PAGE_SECTORS_SHIFT, true);
+	if (frame == FMD_FRAME_NONE) {
+		percpu_up_read(&cache->mode_sem);
+		return -ENOSPC;
+	}
+
+	if (pin) {
+		spin_lock(&fmd->lock);
+		if ((cache->state[frame] & (FMD_FRAME_CACHED | FMD_FRAME_PINNED)) == FMD_FRAME_CACHED) {
+			if (cache->nr_pinned < cache->pin_limit) {
+				fmd_evict_list_delete(fmd, frame);
+				cache->state[frame] |= FMD_FRAME_PINNED;
+				fmd_frame_list_add_tail(cache, frame, FMD_LIST_PIN);
+				cache->nr_pinned++;
+			} else {
+				err = -ENOSPC;
+			}
+		}
+		spin_unlock(&fmd->lock);
+	}
+
+	fmd_radix_tree_put_page(fmd, frame, false);
+	percpu_up_read(&cache->mode_sem);
+	return err;
+}
+
+/*
+ * Prefetch a WILLNEED range.  At most the frames that are neither pinned
+ * nor kept free by the high watermark are filled, so a range larger than
+ * the cache doesn't evict its own head.
+ */
+static void
+fmd_cache_hint_work(struct work_struct *work)
+{
+	struct fmd_hint_work_t *hw = container_of(work, struct fmd_hint_work_t, work);
+	struct fmd_device_t *fmd = hw->fmd;
+	struct fmd_cache_t *cache = (struct fmd_cache_t *) fmd->cache;
+	unsigned long budget;
+	pgoff_t index;
+
+	spin_lock(&fmd->lock);
+	budget = cache->nr_pages_cache - cache->nr_pinned;
+	budget = budget > cache->wmark_high ? budget - cache->wmark_high : 0;
+	spin_unlock(&fmd->lock);
+
+	for (index = hw->index; index <= hw->last && budget; index++, budget--) {
+		if (READ_ONCE(cache->hint_stop))
+			break;
+		if (fmd_cache_hint_page(fmd, index, false))
+			break;
+
+		spin_lock(&fmd->lock);
+		cache->nr_prefetched++;
+		spin_unlock(&fmd->lock);
+		fmd_emul_settle(fmd, false);
+		cond_resched();
+	}
+
+	spin_lock(&fmd->lock);
+	cache->nr_hint_pending--;
+	spin_unlock(&fmd->lock);
+	kfree(hw);
+}
+
+/*
+ * Apply fn to each cached page in [index, last], a batch of pages per
+ * lock hold.  Returns the number of pages visited.
+ */
+static unsigned long
+fmd_cache_hint_range(struct fmd_device_t *fmd, pgoff_t index, pgoff_t last,
+		     void (*fn)(struct fmd_device_t *fmd, u32 frame))
+{
+	struct fmd_cache_t *cache = (struct fmd_cache_t *) fmd->cache;
+	u32 *batch[MAX_BATCH];
+	unsigned long nr = 0;
+	int nr_found, i;
+
+	do {
+		spin_lock(&fmd->lock);
+		nr_found = radix_tree_gang_lookup(&cache->tree, (void **) batch,
+						  index, MAX_BATCH);
+		for (i = 0; i < nr_found && *batch[i] <= last; i++) {
+			index = *batch[i];
+			if (radix_tree_lookup(&cache->tree, index) != batch[i])
+				continue;  /* dropped with a shared frame */
+			fn(fmd, fmd_item_frame(cache, batch[i]));
+			nr++;
+		}
+		spin_unlock(&fmd->lock);
+		if (i < nr_found || index == last)
+			break;
+		index++;
+		cond_resched();
+	} while (nr_found == MAX_BATCH);
+
+	return nr;
+}
+
+/* Write back and drop a page, unless I/O holds its frame: a writer
+ * would go on copying into a frame that's no longer cached */
+static void
+fmd_cache_drop_page(struct fmd_device_t *fmd, u32 frame)
+{
+	struct fmd_cache_t *cache = (struct fmd_cache_t *) fmd->cache;
+
+	if (fmd_frame_ref(cache, frame))
+		return;
+	fmd_radix_tree_free_page(fmd, frame);
+	cache->nr_dropped++;
+}
+
+/* Return a pinned page to the eviction list as most recently used */
+static void
+fmd_cache_unpin_page(struct fmd_device_t *fmd, u32 frame)
+{
+	struct fmd_cache_t *cache = (struct fmd_cache_t *) fmd->cache;
+
+	if (!(cache->state[frame] & FMD_FRAME_PINNED))
+		return;
+	cache->state[frame] &= ~FMD_FRAME_PINNED;
+	fmd_frame_list_move_tail(cache, frame, FMD_LIST_EVICT);
+	cache->nr_pinned--;
+}
+
+/*
+ * Apply an FMD_IOC_HINT access hint to nr_sectors starting at sector.
+ * WILLNEED queues the prefetch and returns, or fails with -EAGAIN while
+ * FMD_HINT_MAX_PENDING ranges are queued.  DONTNEED writes back and drops
+ * the range, including pinned pages but not pages in use by I/O.  PIN
+ * fails with -ENOSPC once pin_limit frames are pinned, leaving the pages
+ * pinned so far.  May sleep.
+ */
+int
+fmd_cache_hint(struct fmd_device_t *fmd, sector_t sector, u64 nr_sectors,
+	       int advice)
+{
+	struct fmd_cache_t *cache = (struct fmd_cache_t *) fmd->cache;
+	struct fmd_hint_work_t *hw;
+	pgoff_t index, last;
+	int err = 0;
+
+	if (!nr_sectors)
+		return 0;
+
+	index = sector >> PAGE_SECTORS_SHIFT;
+	last = (sector + nr_sectors - 1) >> PAGE_SECTORS_SHIFT;
+
+	switch (advice) {
+	case FMD_HINT_WILLNEED:
+		spin_lock(&fmd->lock);
+		if (cache->nr_hint_pending < FMD_HINT_MAX_PENDING)
+			cache->nr_hint_pending++;
+		else
+			err = -EAGAIN;
+		spin_unlock(&fmd->lock);
+		if (err)
+			return err;
+
+		hw = kmalloc(sizeof(*hw), GFP_KERNEL);
+		if (!hw) {
+			spin_lock(&fmd->lock);
+			cache->nr_hint_pending--;
+			spin_unlock(&fmd->lock);
+			return -ENOMEM;
+		}
+		INIT_WORK(&hw->work, fmd_cache_hint_work);
+		hw->fmd = fmd;
+		hw->index = index;
+		hw->last = last;
+		queue_work(cache->hint_wq, &hw->work);
+		break;
+
+	case FMD_HINT_DONTNEED:
+		fmd_cache_hint_range(fmd, index, last, fmd_cache_drop_page);
+		break;
+
+	case FMD_HINT_PIN:
+		if (last - index >= cache->pin_limit)
+			return -ENOSPC;
+		for (; index <= last && !err; index++) {
+			err = fmd_cache_hint_page(fmd, index, true);
+			cond_resched();
+		}
+		break;
+
+	case FMD_HINT_UNPIN:
+		fmd_cache_hint_range(fmd, index, last, fmd_cache_unpin_page);
+		break;
+
+	default:
+		err = -EINVAL;
+	}
+
+	return err;
+}
+
+/*-------------------------------------------------------------*/
+/*--------------------   Sysfs Functions   --------------------*/
+/*-------------------------------------------------------------*/
+
+static ssize_t mode_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct fmd_device_t *fmd = fmd_from_dev(dev);
+	struct fmd_cache_t *cache = (struct fmd_cache_t *) fmd->cache;
+	ssize_t len = 0;
+	int mode = READ_ONCE(cache->mode);
+	int i;
+
+	for (i = 0; i < FMD_CACHE_NR_MODES; i++)
+		len += sprintf(buf + len, (i == mode) ? "[%s] " : "%s ",
+			       fmd_cache_mode_names[i]);
+	buf[len - 1] = '\n';
+
+	return len;
+}
+
+static ssize_t mode_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t len)
+{
+	struct fmd_device_t *fmd = fmd_from_dev(dev);
+	int mode;
+	int err;
+
+	for (mode = 0; mode < FMD_CACHE_NR_MODES; mode++)
+		if (sysfs_streq(buf, fmd_cache_mode_names[mode]))
+			break;
+
+	err = fmd_cache_set_mode(fmd, mode);
+	return err ? err : len;
+}
+static DEVICE_ATTR_RW(mode);
+
+static ssize_t sequential_cutoff_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct fmd_device_t *fmd = fmd_from_dev(dev);
+	struct fmd_cache_t *cache = (struct fmd_cache_t *) fmd->cache;
+
+	return sprintf(buf, "%u\n", READ_ONCE(cache->seq_cutoff));
+}
+
+static ssize_t sequential_cutoff_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t len)
+{
+	struct fmd_device_t *fmd = fmd_from_dev(dev);
+	struct fmd_cache_t *cache = (struct fmd_cache_t *) fmd->cache;
+	unsigned int val;
+	int err;
+
+	err = kstrtouint(buf, 0, &val);
+	if (err)
+		return err;
+
+	WRITE_ONCE(cache->seq_cutoff, val);
+	return len;
+}
+static DEVICE_ATTR_RW(sequential_cutoff);
+
+static ssize_t bypass_bio_size_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct fmd_device_t *fmd = fmd_from_dev(dev);
+	struct fmd_cache_t *cache = (struct fmd_cache_t *) fmd->cache;
+
+	return sprintf(buf, "%u\n", READ_ONCE(cache->bypass_bio_size));
+}
+
+static ssize_t bypass_bio_size_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t len)
+{
+	struct fmd_device_t *fmd = fmd_from_dev(dev);
+	struct fmd_cache_t *cache = (struct fmd_cache_t *) fmd->cache;
+	unsigned int val;
+	int err;
+
+	err = kstrtouint(buf, 0, &val);
+	if (err)
+		return err;
+
+	WRITE_ONCE(cache->bypass_bio_size, val);
+	return len;
+}
+static DEVICE_ATTR_RW(bypass_bio_size);
+
+/* "<nr bypassed bios> <bypassed bytes>" */
+static ssize_t bypassed_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct fmd_device_t *fmd = fmd_from_dev(dev);
+	struct fmd_cache_t *cache = (struct fmd_cache_t *) fmd->cache;
+
+	return sprintf(buf, "%lld %lld\n",
+		       (long long) atomic64_read(&cache->bypassed_bios),
+		       (long long) atomic64_read(&cache->bypassed_bytes));
+}
+static DEVICE_ATTR_RO(bypassed);
+
+/* Free frame watermarks in percent of cache frames: "<min> <low> <high>" */
+static ssize_t watermarks_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct fmd_device_t *fmd = fmd_from_dev(dev);
+	struct fmd_cache_t *cache = (struct fmd_cache_t *) fmd->cache;
+
+	return sprintf(buf, "%u %u %u\n", cache->wmark_pct[FMD_WMARK_MIN],
+		       cache->wmark_pct[FMD_WMARK_LOW],
+		       cache->wmark_pct[FMD_WMARK_HIGH]);
+}
+
+static ssize_t watermarks_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t len)
+{
+	struct fmd_device_t *fmd = fmd_from_dev(dev);
+	unsigned int min, low, high;
+	int err;
+
+	if (sscanf(buf, "%u %u %u", &min, &low, &high) != 3)
+		return -EINVAL;
+
+	err = fmd_cache_set_wmarks(fmd, min, low, high);
+	return err ? err : len;
+}
+static DEVICE_ATTR_RW(watermarks);
+
+/* "<free frames> <total frames>" */
+static ssize_t frames_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct fmd_device_t *fmd = fmd_from_dev(dev);
+	struct fmd_cache_t *cache = (struct fmd_cache_t *) fmd->cache;
+
+	return sprintf(buf, "%u %u\n", READ_ONCE(cache->nr_free),
+		       cache->nr_pages_cache);
+}
+static DEVICE_ATTR_RO(frames);
+
+/* "<reclaimed by worker> <reclaimed directly> <allocation failures>" */
+static ssize_t reclaim_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct fmd_device_t *fmd = fmd_from_dev(dev);
+	struct fmd_cache_t *cache = (struct fmd_cache_t *) fmd->cache;
+	u64 bg, direct, failed;
+
+	spin_lock(&fmd->lock);
+	bg = cache->nr_reclaimed;
+	direct = cache->nr_direct_reclaimed;
+	failed = cache->nr_alloc_failed;
+	spin_unlock(&fmd->lock);
+
+	return sprintf(buf, "%llu %llu %llu\n", bg, direct, failed);
+}
+static DEVICE_ATTR_RO(reclaim);
+
+/* "<referenced frames promoted by reclaim> <LRU batches drained>" */
+static ssize_t lru_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct fmd_device_t *fmd = fmd_from_dev(dev);
+	struct fmd_cache_t *cache = (struct fmd_cache_t *) fmd->cache;
+	u64 promoted, drains;
+
+	spin_lock(&fmd->lock);
+	promoted = cache->nr_promoted;
+	drains = cache->nr_lru_drains;
+	spin_unlock(&fmd->lock);
+
+	return sprintf(buf, "%llu %llu\n", promoted, drains);
+}
+static DEVICE_ATTR_RO(lru);
+
+/* "<pages written back> <runs> <average run length in pages>" */
+static ssize_t writeback_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct fmd_device_t *fmd = fmd_from_dev(dev);
+	struct fmd_cache_t *cache = (struct fmd_cache_t *) fmd->cache;
+	u64 pages, runs, avg100 = 0;
+
+	spin_lock(&fmd->lock);
+	pages = cache->nr_wb_pages;
+	runs = cache->nr_wb_runs;
+	spin_unlock(&fmd->lock);
+
+	if (runs)
+		avg100 = div64_u64(pages * 100, runs);
+
+	return sprintf(buf, "%llu %llu %llu.%02llu\n", pages, runs,
+		       div_u64(avg100, 100), avg100 % 100);
+}
+static DEVICE_ATTR_RO(writeback);
+
+/* "<flushes> <pages written by flushes> <newer dirty pages left>" */
+static ssize_t flush_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct fmd_device_t *fmd = fmd_from_dev(dev);
+	struct fmd_cache_t *cache = (struct fmd_cache_t *) fmd->cache;
+	u64 flushes, pages, skipped;
+
+	spin_lock(&fmd->lock);
+	flushes = cache->nr_flushes;
+	pages = cache->nr_flush_pages;
+	skipped = cache->nr_flush_skipped;
+	spin_unlock(&fmd->lock);
+
+	return sprintf(buf, "%llu %llu %llu\n", flushes, pages, skipped);
+}
+static DEVICE_ATTR_RO(flush);
+
+/* Most cache frames that may be pinned, in bytes */
+static ssize_t pin_limit_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct fmd_device_t *fmd = fmd_from_dev(dev);
+	struct fmd_cache_t *cache = (struct fmd_cache_t *) fmd->cache;
+
+	return sprintf(buf, "%llu\n", (u64) READ_ONCE(cache->pin_limit) << PAGE_SHIFT);
+}
+
+/* Lowering the limit doesn't unpin pages, it only stops new pins */
+static ssize_t pin_limit_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t len)
+{
+	struct fmd_device_t *fmd = fmd_from_dev(dev);
+	struct fmd_cache_t *cache = (struct fmd_cache_t *) fmd->cache;
+	u64 val;
+	int err;
+
+	err = kstrtoull(buf, 0, &val);
+	if (err)
+		return err;
+
+	/* Leave enough unpinned frames for reclaim to reach the high watermark */
+	val >>= PAGE_SHIFT;
+	spin_lock(&fmd->lock);
+	if (val + cache->wmark_high >= cache->nr_pages_cache)
+		err = -EINVAL;
+	else
+		cache->pin_limit = val;
+	spin_unlock(&fmd->lock);
+
+	return err ? err : len;
+}
+static DEVICE_ATTR_RW(pin_limit);
+
+/* "<pinned bytes> <pages prefetched> <pages dropped>" */
+static ssize_t hints_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct fmd_device_t *fmd = fmd_from_dev(dev);
+	struct fmd_cache_t *cache = (struct fmd_cache_t *) fmd->cache;
+	u64 pinned, prefetched, dropped;
+
+	spin_lock(&fmd->lock);
+	pinned = (u64) cache->nr_pinned << PAGE_SHIFT;
+	prefetched = cache->nr_prefetched;
+	dropped = cache->nr_dropped;
+	spin_unlock(&fmd->lock);
+
+	return sprintf(buf, "%llu %llu %llu\n", pinned, prefetched, dropped);
+}
+static DEVICE_ATTR_RO(hints);
+
+/* "<cached pages> <frames holding them> <dedup ratio> <merged> <copied on write>" */
+static ssize_t dedup_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct fmd_device_t *fmd = fmd_from_dev(dev);
+	struct fmd_cache_t *cache = (struct fmd_cache_t *) fmd->cache;
+	struct fmd_dedup_t *dedup = cache->dedup;
+	u64 pages, frames, merged, cow, ratio100 = 100;
+
+	if (!dedup)
+		return -ENODEV;
+
+	spin_lock(&fmd->lock);
+	frames = cache->nr_pages_cache - cache->nr_free;
+	pages = frames - dedup->nr_shared + dedup->nr_alias_used;
+	merged = dedup->nr_merged;
+	cow = dedup->nr_cow;
+	spin_unlock(&fmd->lock);
+
+	if (frames)
+		ratio100 = div64_u64(pages * 100, frames);
+
+	return sprintf(buf, "%llu %llu %llu.%02llu %llu %llu\n", pages, frames,
+		       div_u64(ratio100, 100), ratio100 % 100, merged, cow);
+}
+static DEVICE_ATTR_RO(dedup);
+
+static struct attribute *fmd_cache_attrs[] = {
+	&dev_attr_mode.attr,
+	&dev_attr_watermarks.attr,
+	&dev_attr_frames.attr,
+	&dev_attr_reclaim.attr,
+	&dev_attr_lru.attr,
+	&dev_attr_writeback.attr,
+	&dev_attr_flush.attr,
+	&dev_attr_sequential_cutoff.attr,
+	&dev_attr_bypass_bio_size.attr,
+	&dev_attr_bypassed.attr,
+	&dev_attr_pin_limit.attr,
+	&dev_attr_hints.attr,
+	&dev_attr_dedup.attr,
+	NULL,
+};
+
+const struct attribute_group fmd_cache_attr_group = {
+	.name = "cache",
+	.attrs = fmd_cache_attrs,
+};
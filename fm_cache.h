@@ -19,12 +19,132 @@
 #ifndef FMDSK_CACHE_H
 #define FMDSK_CACHE_H
 
-struct fmd_page_t {
-    pgoff_t index;
-    void __iomem *virt;
-    struct list_head lru;
+#include <linux/list.h>
+#include <linux/radix-tree.h>
+#include <linux/percpu-rwsem.h>
+#include <linux/workqueue.h>
+#include <linux/sysfs.h>
+
+/* Cache write policies */
+#define FMD_CACHE_MODE_WRITEBACK	0  /* write cache, flush dsk later */
+#define FMD_CACHE_MODE_WRITETHROUGH	1  /* write cache and dsk */
+#define FMD_CACHE_MODE_WRITEAROUND	2  /* write dsk, drop cached copy */
+#define FMD_CACHE_NR_MODES		3
+#define FMD_CACHE_MODE_BYPASS		3  /* per-bio: go to dsk, don't allocate */
+
+/* Sequential stream detection */
+#define FMD_SEQ_NR_STREAMS		16
+#define FMD_SEQ_CUTOFF_DEFAULT		(4 << 20)  /* bytes */
+
+struct fmd_seq_stream_t {
+    sector_t next;		/* sector following the stream's last bio */
+    u64 bytes;			/* sequential bytes seen so far */
+    unsigned long last_jiffies;	/* for replacing the least recent stream */
+};
+
+/* Free frame watermarks, in percent of the cache frames */
+#define FMD_WMARK_MIN		0  /* allocating I/O reclaims directly */
+#define FMD_WMARK_LOW		1  /* reclaim worker is woken */
+#define FMD_WMARK_HIGH		2  /* reclaim worker stops */
+#define FMD_NR_WMARKS		3
+#define FMD_WMARK_MIN_DEFAULT	1
+#define FMD_WMARK_LOW_DEFAULT	5
+#define FMD_WMARK_HIGH_DEFAULT	10
+
+#define FMD_WB_BATCH		32  /* max pages written back per lock hold */
+
+/*
+ * Frame metadata is a struct of arrays indexed by frame number.  A
+ * frame's state packs the references held by I/O with its flags.
+ */
+#define FMD_FRAME_REF_MASK	0x00ffffffU
+#define FMD_FRAME_CACHED	0x01000000U  /* in the radix tree */
+#define FMD_FRAME_PINNED	0x02000000U  /* on the pin list, not evicted */
+#define FMD_FRAME_SHARED	0x04000000U  /* mapped only by dedup aliases */
+#define FMD_FRAME_HASHED	0x08000000U  /* in the dedup hash index */
+#define FMD_FRAME_REFERENCED	0x10000000U  /* hit since it was last scanned */
+#define FMD_FRAME_BATCHED	0x20000000U  /* in an LRU batch, off the lists */
+#define FMD_FRAME_INVALID	0x40000000U  /* inserted for a write, not written yet */
+
+#define FMD_FRAME_NONE		0xffffffffU  /* no frame */
+
+#define FMD_PIN_LIMIT_PCT_DEFAULT	25  /* of the cache frames */
+#define FMD_HINT_MAX_PENDING		64  /* WILLNEED ranges queued per device */
+
+/* Frame lists.  Cached frames are on the evict or pin list, others on
+ * the free list */
+#define FMD_LIST_FREE		0
+#define FMD_LIST_EVICT		1
+#define FMD_LIST_PIN		2
+#define FMD_NR_LISTS		3
+
+/* Links of a circular frame list, the list heads follow the frames */
+struct fmd_frame_link_t {
+    u32 prev;
+    u32 next;
+};
+
+/*
+ * Newly cached frames collect in a per-CPU batch and join the tail of the
+ * evict list together, so the list's tail is written once per batch
+ * instead of once per page.  Entries whose frame lost FMD_FRAME_BATCHED
+ * in the meantime are stale and skipped.
+ */
+#define FMD_LRU_BATCH		16
+
+struct fmd_lru_batch_t {
+    unsigned int nr;
+    u32 frames[FMD_LRU_BATCH];
+};
+
+/*
+ * Alias of a shared frame, one per page index mapped to it.  Radix tree
+ * items point at the index of an alias like at that of a private frame.
+ */
+struct fmd_dedup_alias_t {
+    u32 index;
+    u32 frame;
+    u32 next;		/* next alias of the frame, or next free alias */
+};
+
+#define FMD_DEDUP_MAX_SHARE	16  /* average pages per frame */
+
+/* Frames shared by written pages of identical contents */
+struct fmd_dedup_t {
+    struct fmd_dedup_alias_t *alias;
+    unsigned int nr_alias;
+    unsigned int nr_alias_used;
+    u32 free_alias;
+
+    /* Per frame: aliases of a shared frame, crc32c of a hashed one and
+     * a count of the times it was hashed */
+    u32 *alias_head;
+    u32 *nr_mapped;
+    u32 *hash;
+    u32 *hash_next;
+    u32 *seq;
+
+    /* Per CPU page a candidate frame is copied to for the compare */
+    void * __percpu *bounce;
+
+    /* Hash index, chains of hashed frames */
+    u32 *bucket;
+    unsigned int hash_bits;
+
+    /* Statistics */
+    unsigned int nr_shared;
+    u64 nr_merged;
+    u64 nr_cow;
 };
 
+/* Cache pages spanned by the n bytes starting at sector */
+static inline unsigned int fmd_cache_nr_pages(sector_t sector, size_t n)
+{
+	u64 start = (u64) sector << SECTOR_SHIFT;
+
+	return ((start + n - 1) >> PAGE_SHIFT) - (start >> PAGE_SHIFT) + 1;
+}
+
 struct fmd_cache_t {
     /* Physically contiguous memory used for cache.  Allocated at system boot.
      * Discovered by driver */
@@ -32,12 +152,18 @@ struct fmd_cache_t {
     void __iomem *virt;
     unsigned int nr_pages_total;
     unsigned int nr_pages_cache;
-    unsigned int nr_pages_pagepool;
+    struct fmd_device_t *fmd;
 
-    /* Pool of page structs.  Each page struct maps to a PAGE_SIZE segment of contiguous
-     * memory
-     */
-    struct fmd_page_t *pagepool;
+    /* Frame metadata, in node local memory rather than the uncached
+     * window.  Frame f caches page index[f] of the dsk at
+     * virt + f * PAGE_SIZE.  The radix tree maps a page index to
+     * &index[f] */
+    int node;
+    u32 *index;
+    struct fmd_frame_link_t *link;	/* nr_pages_cache + FMD_NR_LISTS */
+    u32 *state;
+    u32 *epoch;				/* flush epoch a dirty page was dirtied in */
+    unsigned int nr_free;
 
 
     /* Cache Radix tree used to manage pages.
@@ -52,26 +178,127 @@ struct fmd_cache_t {
     struct radix_tree_root tree;
 
     /* Cache eviction variables */
-    struct list_head evict_list;
-    unsigned char evict_hiwat;
-    unsigned char evict_num_entries;
-    unsigned char page_cnt;
-    unsigned char rsvd;
+    unsigned int evict_num_entries;	/* frames reclaimed per batch */
+    unsigned int wmark_pct[FMD_NR_WMARKS];
+    unsigned int wmark_min;		/* watermarks in free frames */
+    unsigned int wmark_low;
+    unsigned int wmark_high;
+    struct workqueue_struct *reclaim_wq;
+    struct work_struct reclaim_work;
+    u64 nr_reclaimed;			/* by the reclaim worker */
+    u64 nr_direct_reclaimed;		/* by allocating I/O */
+    u64 nr_alloc_failed;
+
+    /* LRU maintenance.  Hits only set FMD_FRAME_REFERENCED; reclaim
+     * gives those frames another pass down the list instead of moving
+     * them on every hit */
+    struct fmd_lru_batch_t __percpu *lru_batch;
+    u64 nr_lru_drains;
+    u64 nr_promoted;
+
+    /* Writeback statistics */
+    u64 nr_wb_pages;
+    u64 nr_wb_runs;			/* coalesced copies */
+
+    /* Flushes write back only pages dirtied before the current epoch,
+     * which each flush starts */
+    u32 flush_epoch;
+    u64 nr_flushes;
+    u64 nr_flush_pages;
+    u64 nr_flush_skipped;		/* dirtied during the flush */
+
+    /* Write policy.  Held for read across each bio, and for write while
+     * switching policy so dirty pages can be drained */
+    int mode;
+    struct percpu_rw_semaphore mode_sem;
+
+    /* Page ranges a write around the cache is writing to the dsk, which
+     * fills must not cache.  Protected by fmd->lock */
+    struct list_head around;
+
+    /* Cache admission.  Bios continuing a stream that is already
+     * seq_cutoff bytes long, or larger than bypass_bio_size, skip the cache.
+     * 0 disables either test */
+    spinlock_t seq_lock;
+    struct fmd_seq_stream_t streams[FMD_SEQ_NR_STREAMS];
+    unsigned int seq_cutoff;
+    unsigned int bypass_bio_size;
+    atomic64_t bypassed_bios;
+    atomic64_t bypassed_bytes;
+
+    /* Access hints.  Pinned pages live on the pin list instead of the
+     * evict list, up to pin_limit frames.  WILLNEED prefetches run on
+     * hint_wq */
+    unsigned int nr_pinned;
+    unsigned int pin_limit;
+    struct workqueue_struct *hint_wq;
+    unsigned int nr_hint_pending;
+    bool hint_stop;
+    u64 nr_prefetched;
+    u64 nr_dropped;
+
+    /* Deduplication of written pages, NULL if disabled */
+    struct fmd_dedup_t *dedup;
+
+    /* Compressed copies of reclaimed pages, NULL if disabled */
+    struct fmd_zcache_t *zcache;
 };
 
 int fmd_pagepool_init(struct fmd_device_t *fmd);
+void fmd_pagepool_cleanup(struct fmd_device_t *fmd);
+
+/* Address of a frame in the cache window */
+static inline void __iomem *fmd_cache_frame_virt(struct fmd_cache_t *cache, u32 frame)
+{
+	return cache->virt + ((size_t) frame << PAGE_SHIFT);
+}
 
 void fmd_radix_tree_init(struct fmd_device_t *fmd);
 void fmd_radix_tree_free_pages(struct fmd_device_t *fmd);
-void fmd_radix_tree_free_page(struct fmd_device_t *fmd, struct fmd_page_t *page);
-struct fmd_page_t *fmd_radix_tree_insert_page(struct fmd_device_t *fmd, sector_t sector);
-struct fmd_page_t *fmd_radix_tree_lookup_page(struct fmd_device_t *fmd, sector_t sector);
-inline void fmd_radix_tree_mark_dirty_page(struct fmd_device_t *fmd, struct fmd_page_t *page);
+void fmd_radix_tree_free_page(struct fmd_device_t *fmd, u32 frame);
+u32 fmd_radix_tree_insert_page(struct fmd_device_t *fmd, sector_t sector, bool fill);
+u32 fmd_radix_tree_lookup_page(struct fmd_device_t *fmd, sector_t sector);
+u32 fmd_radix_tree_get_page(struct fmd_device_t *fmd, sector_t sector);
+void fmd_radix_tree_put_page(struct fmd_device_t *fmd, u32 frame, bool dirty);
+unsigned int fmd_radix_tree_insert_pages(struct fmd_device_t *fmd, sector_t sector, size_t n,
+		u32 *frames, bool fill, bool nowait);
+unsigned int fmd_radix_tree_get_pages(struct fmd_device_t *fmd, sector_t sector, size_t n,
+		u32 *frames);
+void fmd_radix_tree_put_pages(struct fmd_device_t *fmd, u32 *frames,
+		unsigned int nr, bool dirty);
+void fmd_radix_tree_drop_pages(struct fmd_device_t *fmd, u32 *frames,
+		unsigned int nr);
+inline void fmd_radix_tree_mark_dirty_page(struct fmd_device_t *fmd, u32 frame);
 void fmd_radix_tree_flush_dirty_pages(struct fmd_device_t *fmd);
+void fmd_cache_flush(struct fmd_device_t *fmd);
 
-void fmd_evict_list_init(struct fmd_device_t *fmd, int hiwat, int evict);
-inline unsigned char fmd_cache_full(struct fmd_device_t *fmd);
+int fmd_evict_list_init(struct fmd_device_t *fmd, int evict,
+		int wmark_min, int wmark_low, int wmark_high);
+void fmd_evict_list_cleanup(struct fmd_device_t *fmd);
+int fmd_cache_set_wmarks(struct fmd_device_t *fmd, unsigned int min,
+		unsigned int low, unsigned int high);
 void fmd_evict_pages(struct fmd_device_t *fmd);
 
+int fmd_cache_mode_init(struct fmd_device_t *fmd, int mode);
+void fmd_cache_mode_cleanup(struct fmd_device_t *fmd);
+int fmd_cache_set_mode(struct fmd_device_t *fmd, int mode);
+int fmd_cache_io_begin(struct fmd_device_t *fmd, sector_t sector,
+		unsigned int bytes, bool nowait);
+void fmd_cache_io_end(struct fmd_device_t *fmd);
+void fmd_cache_write_around(struct fmd_device_t *fmd, sector_t sector,
+		const void *src, size_t n);
+
+int fmd_cache_dedup_init(struct fmd_device_t *fmd, unsigned int dedup);
+void fmd_cache_dedup_cleanup(struct fmd_device_t *fmd);
+void fmd_cache_dedup(struct fmd_device_t *fmd, sector_t sector, size_t n,
+		const void *src, u32 *frames, bool dirty);
+
+int fmd_cache_hint_init(struct fmd_device_t *fmd);
+void fmd_cache_hint_cleanup(struct fmd_device_t *fmd);
+int fmd_cache_hint(struct fmd_device_t *fmd, sector_t sector, u64 nr_sectors,
+		int advice);
+
+extern const struct attribute_group fmd_cache_attr_group;
+
 #endif /* FMDSK_CACHE_H */
 
@@ -0,0 +1,247 @@
+/*************************************************************************
+ *
+ * Fusion Memory Confidential
+ * __________________
+ *
+ *  Fusion Memory Incorporated
+ *  All Rights Reserved.
+ *
+ * NOTICE:  All information contained herein is, and remains
+ * the property of Fusion Memory and its suppliers, if any.
+ * The intellectual and technical concepts contained herein are
+ * proprietary to Fusion Memory and its suppliers and may be covered by
+ * U.S. and Foreign Patents, patents in process, and are protected by
+ * trade secret or copyright law. Dissemination of this information or
+ * reproduction of this material is strictly forbidden unless prior
+ * written permission is obtained from Fusion Memory.
+ */
+
+
+/*
+ * fm_chr - Character device for zero-copy userspace access
+ *
+ * mmap of /dev/fmdsk0c maps the device's physical region straight into
+ * the process, so a storage engine can use loads and stores on its hot
+ * path with no syscalls and no copies.  Mappings are aligned so that
+ * 2 MB aligned parts of the region are mapped with huge pages.
+ *
+ * Only available without CACHE_PAGES: with a DRAM cache the region would
+ * not be coherent with dirty cache pages.
+ */
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/fs.h>
+#include <linux/mm.h>
+#include <linux/mman.h>
+#include <linux/huge_mm.h>
+#include <linux/pfn_t.h>
+#include <linux/slab.h>
+#include "fm_dsk.h"
+#include "fm_chr.h"
+
+static inline struct fmd_device_t *fmd_chr_from_file(struct file *file)
+{
+	struct miscdevice *misc = file->private_data;
+
+	return container_of(misc, struct fmd_chr_t, misc)->fmd;
+}
+
+/*-------------------------------------------------------------*/
+/*---------------------   Fault Functions   -------------------*/
+/*-------------------------------------------------------------*/
+
+#if FMD_CHR_FAULT
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4,17,0)
+/* vm_fault_t and vmf_insert_pfn are 4.17's, vm_insert_pfn is gone in 4.20 */
+typedef int vm_fault_t;
+#endif
+
+static vm_fault_t fmd_chr_fault(struct vm_fault *vmf)
+{
+	struct vm_area_struct *vma = vmf->vma;
+	struct fmd_device_t *fmd = fmd_chr_from_file(vma->vm_file);
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4,17,0)
+	int err;
+#endif
+
+	if (vmf->pgoff >= fmd->nr_pages)
+		return VM_FAULT_SIGBUS;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,17,0)
+	return vmf_insert_pfn(vma, vmf->address, PHYS_PFN(fmd->phys) + vmf->pgoff);
+#else
+	err = vm_insert_pfn(vma, vmf->address, PHYS_PFN(fmd->phys) + vmf->pgoff);
+	if (err == -ENOMEM)
+		return VM_FAULT_OOM;
+	if (err < 0 && err != -EBUSY)
+		return VM_FAULT_SIGBUS;
+
+	return VM_FAULT_NOPAGE;
+#endif
+}
+
+#if FMD_CHR_HUGE_FAULT
+/* Map 2 MB at once where the vma and the physical region are aligned */
+static vm_fault_t fmd_chr_pmd_fault(struct vm_fault *vmf)
+{
+	struct vm_area_struct *vma = vmf->vma;
+	struct fmd_device_t *fmd = fmd_chr_from_file(vma->vm_file);
+	unsigned long pmd_addr = vmf->address & PMD_MASK;
+	pgoff_t pgoff;
+	phys_addr_t phys;
+
+	if (pmd_addr < vma->vm_start || pmd_addr + PMD_SIZE > vma->vm_end)
+		return VM_FAULT_FALLBACK;
+
+	pgoff = vma->vm_pgoff + ((pmd_addr - vma->vm_start) >> PAGE_SHIFT);
+	if (pgoff + (PMD_SIZE >> PAGE_SHIFT) > fmd->nr_pages)
+		return VM_FAULT_FALLBACK;
+
+	phys = fmd->phys + ((phys_addr_t) pgoff << PAGE_SHIFT);
+	if (!IS_ALIGNED(phys, PMD_SIZE))
+		return VM_FAULT_FALLBACK;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,2,0)
+	return vmf_insert_pfn_pmd(vmf, phys_to_pfn_t(phys, PFN_DEV),
+				  vmf->flags & FAULT_FLAG_WRITE);
+#else
+	return vmf_insert_pfn_pmd(vma, pmd_addr, vmf->pmd,
+				  phys_to_pfn_t(phys, PFN_DEV),
+				  vmf->flags & FAULT_FLAG_WRITE);
+#endif
+}
+
+static vm_fault_t fmd_chr_huge_fault(struct vm_fault *vmf,
+		enum page_entry_size pe_size)
+{
+	switch (pe_size) {
+	case PE_SIZE_PTE:
+		return fmd_chr_fault(vmf);
+	case PE_SIZE_PMD:
+		return fmd_chr_pmd_fault(vmf);
+	default:
+		return VM_FAULT_FALLBACK;
+	}
+}
+#endif /* FMD_CHR_HUGE_FAULT */
+
+static const struct vm_operations_struct fmd_chr_vm_ops = {
+	.fault		= fmd_chr_fault,
+#if FMD_CHR_HUGE_FAULT
+	.huge_fault	= fmd_chr_huge_fault,
+#endif
+};
+#endif /* FMD_CHR_FAULT */
+
+/*-------------------------------------------------------------*/
+/*-------------------   File Operations   ---------------------*/
+/*-------------------------------------------------------------*/
+
+static int fmd_chr_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct fmd_device_t *fmd = fmd_chr_from_file(file);
+
+	/* Stores must reach the region, so only shared mappings */
+	if (!(vma->vm_flags & VM_SHARED))
+		return -EINVAL;
+	if (vma->vm_pgoff + vma_pages(vma) > fmd->nr_pages)
+		return -EINVAL;
+
+	vma->vm_flags |= VM_PFNMAP | VM_DONTEXPAND | VM_DONTDUMP;
+#if FMD_CHR_FAULT
+	vma->vm_flags |= VM_HUGEPAGE;
+	vma->vm_ops = &fmd_chr_vm_ops;
+	return 0;
+#else
+	/* No fault handler support, map the whole range up front */
+	return remap_pfn_range(vma, vma->vm_start,
+			       PHYS_PFN(fmd->phys) + vma->vm_pgoff,
+			       vma->vm_end - vma->vm_start, vma->vm_page_prot);
+#endif
+}
+
+/*
+ * Place mappings so the virtual address is congruent to the physical
+ * address modulo 2 MB, which lets the PMD fault handler use huge pages.
+ */
+static unsigned long fmd_chr_get_unmapped_area(struct file *file,
+		unsigned long addr, unsigned long len, unsigned long pgoff,
+		unsigned long flags)
+{
+	struct fmd_device_t *fmd = fmd_chr_from_file(file);
+	unsigned long phys_off;
+
+	if (addr || (flags & MAP_FIXED) || len < PMD_SIZE)
+		return current->mm->get_unmapped_area(file, addr, len, pgoff, flags);
+
+	addr = current->mm->get_unmapped_area(file, 0, len + PMD_SIZE, pgoff, flags);
+	if (IS_ERR_VALUE(addr))
+		return addr;
+
+	phys_off = (fmd->phys + ((phys_addr_t) pgoff << PAGE_SHIFT)) & (PMD_SIZE - 1);
+	return addr + ((phys_off - addr) & (PMD_SIZE - 1));
+}
+
+/* SEEK_END reports the size of the region, for sizing mappings */
+static loff_t fmd_chr_llseek(struct file *file, loff_t offset, int whence)
+{
+	struct fmd_device_t *fmd = fmd_chr_from_file(file);
+
+	return fixed_size_llseek(file, offset, whence,
+				 (loff_t) fmd->nr_pages << PAGE_SHIFT);
+}
+
+static const struct file_operations fmd_chr_fops = {
+	.owner			= THIS_MODULE,
+	.mmap			= fmd_chr_mmap,
+	.get_unmapped_area	= fmd_chr_get_unmapped_area,
+	.llseek			= fmd_chr_llseek,
+};
+
+/*-------------------------------------------------------------*/
+/*---------------   Initialization Functions   ----------------*/
+/*-------------------------------------------------------------*/
+
+int fmd_chr_init(struct fmd_device_t *fmd)
+{
+	struct fmd_chr_t *chr;
+	int err;
+
+	BUG_ON(!fmd);
+	printk(KERN_INFO "%s: %s\n", fmd->dev_name, __func__);
+
+	chr = kzalloc(sizeof(struct fmd_chr_t), GFP_KERNEL);
+	if (!chr)
+		return -ENOMEM;
+
+	chr->fmd = fmd;
+	snprintf(chr->name, sizeof(chr->name), "%s%s", fmd->dev_name, FMD_CHR_SUFFIX);
+	chr->misc.minor = MISC_DYNAMIC_MINOR;
+	chr->misc.name = chr->name;
+	chr->misc.fops = &fmd_chr_fops;
+
+	err = misc_register(&chr->misc);
+	if (err) {
+		printk(KERN_ERR "%s: %s: ERROR: Unable to register %s (%d)\n", fmd->dev_name, __func__, chr->name, err);
+		kfree(chr);
+		return err;
+	}
+
+	fmd->chr = chr;
+	return 0;
+}
+
+void fmd_chr_exit(struct fmd_device_t *fmd)
+{
+	struct fmd_chr_t *chr = (struct fmd_chr_t *) fmd->chr;
+
+	if (!chr)
+		return;
+
+	printk(KERN_INFO "%s: %s\n", fmd->dev_name, __func__);
+
+	misc_deregister(&chr->misc);
+	kfree(chr);
+	fmd->chr = NULL;
+}
@@ -0,0 +1,51 @@
+/*************************************************************************
+ *
+ * Fusion Memory Confidential
+ * __________________
+ *
+ *  Fusion Memory Incorporated
+ *  All Rights Reserved.
+ *
+ * NOTICE:  All information contained herein is, and remains
+ * the property of Fusion Memory and its suppliers, if any.
+ * The intellectual and technical concepts contained herein are
+ * proprietary to Fusion Memory and its suppliers and may be covered by
+ * U.S. and Foreign Patents, patents in process, and are protected by
+ * trade secret or copyright law. Dissemination of this information or
+ * reproduction of this material is strictly forbidden unless prior
+ * written permission is obtained from Fusion Memory.
+ */
+
+#ifndef FM_CHR_H
+#define FM_CHR_H
+
+#include <linux/version.h>
+#include <linux/miscdevice.h>
+#include "fm_dsk.h"
+
+#define FMD_CHR_SUFFIX "c"	/* fmdsk0 -> /dev/fmdsk0c */
+
+/* Huge (PMD) mappings need the vm_fault based fault handlers */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,11,0)
+#define FMD_CHR_FAULT 1
+#ifdef CONFIG_TRANSPARENT_HUGEPAGE
+#define FMD_CHR_HUGE_FAULT 1
+#else
+#define FMD_CHR_HUGE_FAULT 0
+#endif
+#else
+#define FMD_CHR_FAULT 0
+#define FMD_CHR_HUGE_FAULT 0
+#endif
+
+/* Character device giving userspace load/store access to a region */
+struct fmd_chr_t {
+	struct miscdevice misc;
+	struct fmd_device_t *fmd;
+	char name[DEV_NAME_LEN + sizeof(FMD_CHR_SUFFIX)];
+};
+
+int fmd_chr_init(struct fmd_device_t *fmd);
+void fmd_chr_exit(struct fmd_device_t *fmd);
+
+#endif /* FM_CHR_H */
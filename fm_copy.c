@@ -0,0 +1,519 @@
+/*************************************************************************
+ *
+ * Fusion Memory Confidential
+ * __________________
+ *
+ *  Fusion Memory Incorporated
+ *  All Rights Reserved.
+ *
+ * NOTICE:  All information contained herein is, and remains
+ * the property of Fusion Memory and its suppliers, if any.
+ * The intellectual and technical concepts contained herein are
+ * proprietary to Fusion Memory and its suppliers and may be covered by
+ * U.S. and Foreign Patents, patents in process, and are protected by
+ * trade secret or copyright law. Dissemination of this information or
+ * reproduction of this material is strictly forbidden unless prior
+ * written permission is obtained from Fusion Memory.
+ */
+
+
+/*
+ * fm_copy - Copy routines between memory and the device region
+ *
+ * The region is mapped uncached or write-combined, and the best way to
+ * move data in and out depends on both the CPU and the memory behind the
+ * mapping: rep movsb, or non-temporal vector stores and streaming loads of
+ * 16, 32 or 64 bytes.  At load each routine the CPU supports is timed on
+ * the device's own region and the fastest one for each direction is used
+ * for large copies.  Vector routines run under kernel_fpu_begin, which is
+ * only worth paying for copies of FMD_COPY_MIN bytes or more.
+ *
+ * The routine is reached through a function pointer table rather than a
+ * static_call, which needs 5.10.
+ */
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/version.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/ktime.h>
+#include <linux/sched.h>
+#include <linux/string.h>
+#ifdef CONFIG_X86_64
+#include <asm/cpufeature.h>
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,2,0)
+#include <asm/fpu/api.h>
+#else
+#include <asm/i387.h>
+#endif
+#endif
+#include "fm_dsk.h"
+#include "fm_copy.h"
+#include "fm_sysfs.h"
+#include "fm_stripe.h"
+
+extern int copy_calibrate;
+
+/* Assembler support for the vector extensions */
+#if defined(CONFIG_X86_64) && \
+    (defined(CONFIG_AS_AVX2) || LINUX_VERSION_CODE >= KERNEL_VERSION(5,10,0))
+#define FMD_COPY_HAVE_AVX2 1
+#else
+#define FMD_COPY_HAVE_AVX2 0
+#endif
+#if defined(CONFIG_X86_64) && \
+    (defined(CONFIG_AS_AVX512) || LINUX_VERSION_CODE >= KERNEL_VERSION(5,10,0))
+#define FMD_COPY_HAVE_AVX512 1
+#else
+#define FMD_COPY_HAVE_AVX512 0
+#endif
+
+#define FMD_COPY_ALIGN	64	/* vector loops start on a cache line */
+
+/*
+ * A copy routine.  The vector loops copy whole multiples of step bytes
+ * with the region side (dst on writes, src on reads) aligned to
+ * FMD_COPY_ALIGN; fmd_copy_large does the unaligned head and tail.
+ */
+struct fmd_copy_routine_t {
+	const char *name;
+	bool fpu;		/* uses vector registers */
+	size_t step;		/* bytes per loop iteration, 0 = any length */
+	bool (*usable)(int dir);
+	void (*copy[2])(void *dst, const void *src, size_t n);
+};
+
+/*-------------------------------------------------------------*/
+/*--------------------   Copy Routines   ----------------------*/
+/*-------------------------------------------------------------*/
+
+static bool fmd_copy_io_usable(int dir)
+{
+	return true;
+}
+
+static void fmd_copy_io_read(void *dst, const void *src, size_t n)
+{
+	memcpy_fromio(dst, (const void __iomem __force *) src, n);
+}
+
+static void fmd_copy_io_write(void *dst, const void *src, size_t n)
+{
+	memcpy_toio((void __iomem __force *) dst, src, n);
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,13,0)
+static bool fmd_copy_flushcache_usable(int dir)
+{
+	return dir == FMD_COPY_WRITE;
+}
+
+static void fmd_copy_flushcache_write(void *dst, const void *src, size_t n)
+{
+	memcpy_flushcache(dst, src, n);
+}
+#endif
+
+#ifdef CONFIG_X86_64
+static bool fmd_copy_movsb_usable(int dir)
+{
+	return boot_cpu_has(X86_FEATURE_ERMS);
+}
+
+static void fmd_copy_movsb(void *dst, const void *src, size_t n)
+{
+	asm volatile("rep movsb"
+		     : "+D" (dst), "+S" (src), "+c" (n)
+		     : : "memory");
+}
+
+/* Streaming loads need SSE4.1 */
+static bool fmd_copy_sse2_usable(int dir)
+{
+	return dir == FMD_COPY_WRITE || boot_cpu_has(X86_FEATURE_XMM4_1);
+}
+
+static void fmd_copy_sse2_read(void *dst, const void *src, size_t n)
+{
+	for (; n; n -= 64, dst += 64, src += 64)
+		asm volatile("movntdqa   (%1), %%xmm0\n\t"
+			     "movntdqa 16(%1), %%xmm1\n\t"
+			     "movntdqa 32(%1), %%xmm2\n\t"
+			     "movntdqa 48(%1), %%xmm3\n\t"
+			     "movdqu %%xmm0,   (%0)\n\t"
+			     "movdqu %%xmm1, 16(%0)\n\t"
+			     "movdqu %%xmm2, 32(%0)\n\t"
+			     "movdqu %%xmm3, 48(%0)\n\t"
+			     : : "r" (dst), "r" (src) : "memory");
+}
+
+static void fmd_copy_sse2_write(void *dst, const void *src, size_t n)
+{
+	for (; n; n -= 64, dst += 64, src += 64)
+		asm volatile("movdqu   (%1), %%xmm0\n\t"
+			     "movdqu 16(%1), %%xmm1\n\t"
+			     "movdqu 32(%1), %%xmm2\n\t"
+			     "movdqu 48(%1), %%xmm3\n\t"
+			     "movntdq %%xmm0,   (%0)\n\t"
+			     "movntdq %%xmm1, 16(%0)\n\t"
+			     "movntdq %%xmm2, 32(%0)\n\t"
+			     "movntdq %%xmm3, 48(%0)\n\t"
+			     : : "r" (dst), "r" (src) : "memory");
+}
+#endif
+
+#if FMD_COPY_HAVE_AVX2
+static bool fmd_copy_avx2_usable(int dir)
+{
+	return boot_cpu_has(X86_FEATURE_AVX2);
+}
+
+static void fmd_copy_avx2_read(void *dst, const void *src, size_t n)
+{
+	for (; n; n -= 128, dst += 128, src += 128)
+		asm volatile("vmovntdqa   (%1), %%ymm0\n\t"
+			     "vmovntdqa 32(%1), %%ymm1\n\t"
+			     "vmovntdqa 64(%1), %%ymm2\n\t"
+			     "vmovntdqa 96(%1), %%ymm3\n\t"
+			     "vmovdqu %%ymm0,   (%0)\n\t"
+			     "vmovdqu %%ymm1, 32(%0)\n\t"
+			     "vmovdqu %%ymm2, 64(%0)\n\t"
+			     "vmovdqu %%ymm3, 96(%0)\n\t"
+			     : : "r" (dst), "r" (src) : "memory");
+}
+
+static void fmd_copy_avx2_write(void *dst, const void *src, size_t n)
+{
+	for (; n; n -= 128, dst += 128, src += 128)
+		asm volatile("vmovdqu   (%1), %%ymm0\n\t"
+			     "vmovdqu 32(%1), %%ymm1\n\t"
+			     "vmovdqu 64(%1), %%ymm2\n\t"
+			     "vmovdqu 96(%1), %%ymm3\n\t"
+			     "vmovntdq %%ymm0,   (%0)\n\t"
+			     "vmovntdq %%ymm1, 32(%0)\n\t"
+			     "vmovntdq %%ymm2, 64(%0)\n\t"
+			     "vmovntdq %%ymm3, 96(%0)\n\t"
+			     : : "r" (dst), "r" (src) : "memory");
+}
+#endif
+
+#if FMD_COPY_HAVE_AVX512
+static bool fmd_copy_avx512_usable(int dir)
+{
+	return boot_cpu_has(X86_FEATURE_AVX512F);
+}
+
+static void fmd_copy_avx512_read(void *dst, const void *src, size_t n)
+{
+	for (; n; n -= 256, dst += 256, src += 256)
+		asm volatile("vmovntdqa    (%1), %%zmm0\n\t"
+			     "vmovntdqa  64(%1), %%zmm1\n\t"
+			     "vmovntdqa 128(%1), %%zmm2\n\t"
+			     "vmovntdqa 192(%1), %%zmm3\n\t"
+			     "vmovdqu64 %%zmm0,    (%0)\n\t"
+			     "vmovdqu64 %%zmm1,  64(%0)\n\t"
+			     "vmovdqu64 %%zmm2, 128(%0)\n\t"
+			     "vmovdqu64 %%zmm3, 192(%0)\n\t"
+			     : : "r" (dst), "r" (src) : "memory");
+}
+
+static void fmd_copy_avx512_write(void *dst, const void *src, size_t n)
+{
+	for (; n; n -= 256, dst += 256, src += 256)
+		asm volatile("vmovdqu64    (%1), %%zmm0\n\t"
+			     "vmovdqu64  64(%1), %%zmm1\n\t"
+			     "vmovdqu64 128(%1), %%zmm2\n\t"
+			     "vmovdqu64 192(%1), %%zmm3\n\t"
+			     "vmovntdq %%zmm0,    (%0)\n\t"
+			     "vmovntdq %%zmm1,  64(%0)\n\t"
+			     "vmovntdq %%zmm2, 128(%0)\n\t"
+			     "vmovntdq %%zmm3, 192(%0)\n\t"
+			     : : "r" (dst), "r" (src) : "memory");
+}
+#endif
+
+static const struct fmd_copy_routine_t fmd_copy_routines[FMD_COPY_NR] = {
+	[FMD_COPY_IO] = {
+		.name = "io", .usable = fmd_copy_io_usable,
+		.copy = { fmd_copy_io_read, fmd_copy_io_write },
+	},
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,13,0)
+	[FMD_COPY_FLUSHCACHE] = {
+		.name = "flushcache", .usable = fmd_copy_flushcache_usable,
+		.copy = { NULL, fmd_copy_flushcache_write },
+	},
+#endif
+#ifdef CONFIG_X86_64
+	[FMD_COPY_MOVSB] = {
+		.name = "movsb", .usable = fmd_copy_movsb_usable,
+		.copy = { fmd_copy_movsb, fmd_copy_movsb },
+	},
+	[FMD_COPY_SSE2] = {
+		.name = "sse2", .fpu = true, .step = 64,
+		.usable = fmd_copy_sse2_usable,
+		.copy = { fmd_copy_sse2_read, fmd_copy_sse2_write },
+	},
+#endif
+#if FMD_COPY_HAVE_AVX2
+	[FMD_COPY_AVX2] = {
+		.name = "avx2", .fpu = true, .step = 128,
+		.usable = fmd_copy_avx2_usable,
+		.copy = { fmd_copy_avx2_read, fmd_copy_avx2_write },
+	},
+#endif
+#if FMD_COPY_HAVE_AVX512
+	[FMD_COPY_AVX512] = {
+		.name = "avx512", .fpu = true, .step = 256,
+		.usable = fmd_copy_avx512_usable,
+		.copy = { fmd_copy_avx512_read, fmd_copy_avx512_write },
+	},
+#endif
+};
+
+static bool fmd_copy_usable(int r, int dir)
+{
+	const struct fmd_copy_routine_t *routine = &fmd_copy_routines[r];
+
+	return routine->name && routine->copy[dir] && routine->usable(dir);
+}
+
+/* Copy with a given routine.  Vector loops fall back to the io routine
+ * when the FPU can't be used in this context */
+static void fmd_copy_run(int r, int dir, void *dst, const void *src, size_t n)
+{
+	const struct fmd_copy_routine_t *routine = &fmd_copy_routines[r];
+	const void *region = (dir == FMD_COPY_WRITE) ? dst : src;
+	size_t head, body;
+
+	if (!routine->step) {
+		routine->copy[dir](dst, src, n);
+		return;
+	}
+
+#ifdef CONFIG_X86_64
+	if (routine->fpu && !irq_fpu_usable())
+		routine = &fmd_copy_routines[FMD_COPY_IO];
+#endif
+
+	head = min_t(size_t, n, -(unsigned long) region & (FMD_COPY_ALIGN - 1));
+	body = (n - head) & ~(routine->step - 1);
+
+	if (head)
+		fmd_copy_routines[FMD_COPY_IO].copy[dir](dst, src, head);
+	if (body) {
+#ifdef CONFIG_X86_64
+		kernel_fpu_begin();
+		routine->copy[dir](dst + head, src + head, body);
+		kernel_fpu_end();
+		/* Order the non-temporal stores before the bio completes */
+		if (dir == FMD_COPY_WRITE)
+			wmb();
+#endif
+	}
+	if (n - head - body)
+		fmd_copy_routines[FMD_COPY_IO].copy[dir](dst + head + body,
+				src + head + body, n - head - body);
+}
+
+void fmd_copy_large(struct fmd_copy_t *copy, int dir, void *dst,
+		    const void *src, size_t n)
+{
+	fmd_copy_run(READ_ONCE(copy->routine[dir]), dir, dst, src, n);
+}
+
+/*-------------------------------------------------------------*/
+/*--------------------   Calibration   ------------------------*/
+/*-------------------------------------------------------------*/
+
+/*
+ * Time a routine copying len bytes between buf and the start of the
+ * region, one page at a time.  Writes copy back what was read from the
+ * region, so its contents are preserved.  Returns MB/s.
+ */
+static unsigned int fmd_copy_measure(void *region, int r, int dir,
+				     void *buf, size_t len)
+{
+	ktime_t start;
+	u64 ns;
+	size_t off;
+	int loop;
+
+	start = ktime_get();
+	for (loop = 0; loop < FMD_COPY_CAL_LOOPS; loop++) {
+		for (off = 0; off < len; off += PAGE_SIZE) {
+			if (dir == FMD_COPY_WRITE)
+				fmd_copy_run(r, dir, region + off, buf + off, PAGE_SIZE);
+			else
+				fmd_copy_run(r, dir, buf + len + off, region + off, PAGE_SIZE);
+		}
+		cond_resched();
+	}
+	ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+
+	/* bytes per ns is GB/s */
+	return (unsigned int) div64_u64((u64) len * FMD_COPY_CAL_LOOPS * 1000, ns ? ns : 1);
+}
+
+/* Measure every usable routine and pick the fastest for each direction */
+static void fmd_copy_calibrate(struct fmd_device_t *fmd, struct fmd_copy_t *copy)
+{
+	size_t len = min_t(size_t, FMD_COPY_CAL_BYTES, (size_t) fmd->nr_pages << PAGE_SHIFT);
+	void __iomem *region;
+	void *buf;
+	int r, dir;
+
+	/* Stay within the first stripe unit of a striped device */
+	region = fmd_region_addr(fmd, 0, &len);
+
+	/* First half holds the region's contents, second half receives reads */
+	buf = vmalloc(2 * len);
+	if (!buf) {
+		printk(KERN_INFO "%s: %s: no calibration buffer, using io\n", fmd->dev_name, __func__);
+		return;
+	}
+	memcpy_fromio(buf, region, len);
+
+	for (dir = FMD_COPY_READ; dir <= FMD_COPY_WRITE; dir++) {
+		for (r = 0; r < FMD_COPY_NR; r++) {
+			if (!fmd_copy_usable(r, dir))
+				continue;
+			copy->mbps[r][dir] = fmd_copy_measure((void __force *) region, r, dir, buf, len);
+			if (copy->mbps[r][dir] > copy->mbps[copy->routine[dir]][dir])
+				copy->routine[dir] = r;
+		}
+		printk(KERN_INFO "%s: %s: %s %s %u MB/s\n", fmd->dev_name, __func__,
+		       dir == FMD_COPY_WRITE ? "write" : "read",
+		       fmd_copy_routines[copy->routine[dir]].name,
+		       copy->mbps[copy->routine[dir]][dir]);
+	}
+
+	vfree(buf);
+}
+
+/* Must be called before the disk is added, calibration writes the region */
+int fmd_copy_init(struct fmd_device_t *fmd)
+{
+	struct fmd_copy_t *copy;
+
+	BUG_ON(!fmd || (!fmd->virt && !fmd->stripe));
+	printk(KERN_INFO "%s: %s\n", fmd->dev_name, __func__);
+
+	copy = kzalloc(sizeof(struct fmd_copy_t), GFP_KERNEL);
+	if (!copy)
+		return -ENOMEM;
+
+	copy->routine[FMD_COPY_READ] = FMD_COPY_IO;
+	copy->routine[FMD_COPY_WRITE] = FMD_COPY_IO;
+	if (copy_calibrate)
+		fmd_copy_calibrate(fmd, copy);
+
+	fmd->copy = copy;
+	return 0;
+}
+
+void fmd_copy_cleanup(struct fmd_device_t *fmd)
+{
+	printk(KERN_INFO "%s: %s\n", fmd->dev_name, __func__);
+
+	kfree(fmd->copy);
+	fmd->copy = NULL;
+}
+
+/*-------------------------------------------------------------*/
+/*--------------------   Sysfs Functions   --------------------*/
+/*-------------------------------------------------------------*/
+
+static ssize_t fmd_copy_routine_show(struct fmd_device_t *fmd, int dir, char *buf)
+{
+	struct fmd_copy_t *copy = (struct fmd_copy_t *) fmd->copy;
+
+	return sprintf(buf, "%s\n", fmd_copy_routines[READ_ONCE(copy->routine[dir])].name);
+}
+
+/* Force a routine the CPU supports, i.e. to compare them under load */
+static ssize_t fmd_copy_routine_store(struct fmd_device_t *fmd, int dir,
+				      const char *buf, size_t len)
+{
+	struct fmd_copy_t *copy = (struct fmd_copy_t *) fmd->copy;
+	int r;
+
+	for (r = 0; r < FMD_COPY_NR; r++) {
+		if (fmd_copy_routines[r].name &&
+		    sysfs_streq(buf, fmd_copy_routines[r].name))
+			break;
+	}
+	if (r == FMD_COPY_NR || !fmd_copy_usable(r, dir))
+		return -EINVAL;
+
+	WRITE_ONCE(copy->routine[dir], r);
+	printk(KERN_INFO "%s: %s: %s=%s\n", fmd->dev_name, __func__,
+	       dir == FMD_COPY_WRITE ? "write" : "read", fmd_copy_routines[r].name);
+	return len;
+}
+
+static ssize_t read_routine_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	return fmd_copy_routine_show(fmd_from_dev(dev), FMD_COPY_READ, buf);
+}
+
+static ssize_t read_routine_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t len)
+{
+	return fmd_copy_routine_store(fmd_from_dev(dev), FMD_COPY_READ, buf, len);
+}
+static DEVICE_ATTR_RW(read_routine);
+
+static ssize_t write_routine_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	return fmd_copy_routine_show(fmd_from_dev(dev), FMD_COPY_WRITE, buf);
+}
+
+static ssize_t write_routine_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t len)
+{
+	return fmd_copy_routine_store(fmd_from_dev(dev), FMD_COPY_WRITE, buf, len);
+}
+static DEVICE_ATTR_RW(write_routine);
+
+/* One line per usable routine: "<name> <read GB/s> <write GB/s>" */
+static ssize_t bandwidth_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct fmd_device_t *fmd = fmd_from_dev(dev);
+	struct fmd_copy_t *copy = (struct fmd_copy_t *) fmd->copy;
+	ssize_t len = 0;
+	int r, dir;
+
+	for (r = 0; r < FMD_COPY_NR; r++) {
+		if (!copy->mbps[r][FMD_COPY_READ] && !copy->mbps[r][FMD_COPY_WRITE])
+			continue;
+		len += scnprintf(buf + len, PAGE_SIZE - len, "%s", fmd_copy_routines[r].name);
+		for (dir = FMD_COPY_READ; dir <= FMD_COPY_WRITE; dir++) {
+			if (copy->mbps[r][dir])
+				len += scnprintf(buf + len, PAGE_SIZE - len, " %u.%02u",
+						 copy->mbps[r][dir] / 1000,
+						 copy->mbps[r][dir] % 1000 / 10);
+			else
+				len += scnprintf(buf + len, PAGE_SIZE - len, " -");
+		}
+		len += scnprintf(buf + len, PAGE_SIZE - len, "\n");
+	}
+
+	return len;
+}
+static DEVICE_ATTR_RO(bandwidth);
+
+static struct attribute *fmd_copy_attrs[] = {
+	&dev_attr_read_routine.attr,
+	&dev_attr_write_routine.attr,
+	&dev_attr_bandwidth.attr,
+	NULL,
+};
+
+const struct attribute_group fmd_copy_attr_group = {
+	.name = "copy",
+	.attrs = fmd_copy_attrs,
+};
@@ -0,0 +1,85 @@
+/*************************************************************************
+ *
+ * Fusion Memory Confidential
+ * __________________
+ *
+ *  Fusion Memory Incorporated
+ *  All Rights Reserved.
+ *
+ * NOTICE:  All information contained herein is, and remains
+ * the property of Fusion Memory and its suppliers, if any.
+ * The intellectual and technical concepts contained herein are
+ * proprietary to Fusion Memory and its suppliers and may be covered by
+ * U.S. and Foreign Patents, patents in process, and are protected by
+ * trade secret or copyright law. Dissemination of this information or
+ * reproduction of this material is strictly forbidden unless prior
+ * written permission is obtained from Fusion Memory.
+ */
+
+
+#ifndef FM_COPY_H
+#define FM_COPY_H
+
+#include <linux/version.h>
+#include <linux/io.h>
+#include <linux/sysfs.h>
+#include "fm_dsk.h"
+
+/* Copy routines, in order of preference when bandwidths tie */
+#define FMD_COPY_IO		0	/* memcpy_toio / memcpy_fromio */
+#define FMD_COPY_FLUSHCACHE	1	/* memcpy_flushcache, writes only */
+#define FMD_COPY_MOVSB		2	/* rep movsb (ERMS) */
+#define FMD_COPY_SSE2		3	/* movntdq stores / movntdqa loads */
+#define FMD_COPY_AVX2		4	/* vmovntdq / vmovntdqa ymm */
+#define FMD_COPY_AVX512		5	/* vmovntdq / vmovntdqa zmm */
+#define FMD_COPY_NR		6
+
+#define FMD_COPY_READ		0
+#define FMD_COPY_WRITE		1
+
+#define FMD_COPY_MIN		2048		/* smaller copies use the io routine */
+#define FMD_COPY_CAL_BYTES	(1UL << 20)	/* calibration copy size */
+#define FMD_COPY_CAL_LOOPS	4
+
+/*
+ * Copy routine selection of a device.  Each direction uses the routine
+ * that was fastest on the device's own region at load, measured in
+ * PAGE_SIZE copies like the I/O path does them.
+ */
+struct fmd_copy_t {
+	int routine[2];				/* indexed by FMD_COPY_READ/WRITE */
+	unsigned int mbps[FMD_COPY_NR][2];	/* measured MB/s, 0 = unusable */
+};
+
+int fmd_copy_init(struct fmd_device_t *fmd);
+void fmd_copy_cleanup(struct fmd_device_t *fmd);
+void fmd_copy_large(struct fmd_copy_t *copy, int dir, void *dst,
+		    const void *src, size_t n);
+
+/* Copy n bytes from memory to the device region */
+static inline void
+fmd_copy_to_io(struct fmd_device_t *fmd, void __iomem *dst, const void *src, size_t n)
+{
+	struct fmd_copy_t *copy = (struct fmd_copy_t *) fmd->copy;
+
+	if (n >= FMD_COPY_MIN && copy)
+		fmd_copy_large(copy, FMD_COPY_WRITE, (void __force *) dst, src, n);
+	else
+		memcpy_toio(dst, src, n);
+}
+
+/* Copy n bytes from the device region to memory */
+static inline void
+fmd_copy_from_io(struct fmd_device_t *fmd, void *dst, const void __iomem *src, size_t n)
+{
+	struct fmd_copy_t *copy = (struct fmd_copy_t *) fmd->copy;
+
+	if (n >= FMD_COPY_MIN && copy)
+		fmd_copy_large(copy, FMD_COPY_READ, dst, (const void __force *) src, n);
+	else
+		memcpy_fromio(dst, src, n);
+}
+
+extern const struct attribute_group fmd_copy_attr_group;
+
+#endif /* FM_COPY_H */
@@ -29,12 +29,26 @@
 #include <linux/fs.h>
 #include <linux/slab.h>
 #include <linux/hdreg.h>
+#include <linux/capability.h>
 #include <linux/dma-contiguous.h>
 #include <asm/uaccess.h>
 
 #include "fm_dsk.h"
 #include "fm_mem.h"
 #include "fm_cache.h"
+#include "fm_qos.h"
+#include "fm_sysfs.h"
+#include "fm_chr.h"
+#include "fm_copy.h"
+#include "fm_ioctl.h"
+#include "fm_zone.h"
+#include "fm_stripe.h"
+#include "fm_tier.h"
+#include "fm_split.h"
+#include "fm_wipe.h"
+#include "fm_emul.h"
+#include "fm_backing.h"
+#include "fm_image.h"
 
 #define FM_DRIVER_VERSION "0.5"
 
@@ -47,19 +61,100 @@ uint dsk_nr_pages = 2097152;
 module_param(dsk_nr_pages, uint, S_IRUGO);
 MODULE_PARM_DESC(dsk_nr_pages, "Size of RAM Disk in nr_pages. (Default=8GB)");
 
-int hiwat = 5;
-module_param(hiwat, int, S_IRUGO);
-MODULE_PARM_DESC(hiwat, "Cache eviction high water mark. (Default=5)");
+uint mem_nr_pages = 0;
+module_param(mem_nr_pages, uint, S_IRUGO);
+MODULE_PARM_DESC(mem_nr_pages, "Size of DRAM device fmmem, or of the DRAM tier, in nr_pages, 0 = none. Unused when caching. (Default=0)");
 
-int evict = 10;
+int evict = 32;
 module_param(evict, int, S_IRUGO);
-MODULE_PARM_DESC(evict, "Cache eviction number of entries. (Default=10)");
+MODULE_PARM_DESC(evict, "Cache frames reclaimed per batch. (Default=32)");
+
+int wmark_min = FMD_WMARK_MIN_DEFAULT;
+module_param(wmark_min, int, S_IRUGO);
+MODULE_PARM_DESC(wmark_min, "Percent free cache frames below which I/O reclaims directly. (Default=1)");
+
+int wmark_low = FMD_WMARK_LOW_DEFAULT;
+module_param(wmark_low, int, S_IRUGO);
+MODULE_PARM_DESC(wmark_low, "Percent free cache frames below which background reclaim starts. (Default=5)");
+
+int wmark_high = FMD_WMARK_HIGH_DEFAULT;
+module_param(wmark_high, int, S_IRUGO);
+MODULE_PARM_DESC(wmark_high, "Percent free cache frames at which background reclaim stops. (Default=10)");
+
+int cache_mode = FMD_CACHE_MODE_WRITEBACK;
+module_param(cache_mode, int, S_IRUGO);
+MODULE_PARM_DESC(cache_mode, "Cache write policy: 0=write-back 1=write-through 2=write-around. (Default=0)");
+
+int chr_dev = 0;
+module_param(chr_dev, int, S_IRUGO);
+MODULE_PARM_DESC(chr_dev, "Create an mmap-able character device per block device, e.g. /dev/fmdsk0c. Not available when caching. (Default=0)");
+
+int copy_calibrate = 1;
+module_param(copy_calibrate, int, S_IRUGO);
+MODULE_PARM_DESC(copy_calibrate, "Time the copy routines at load and use the fastest, 0 = always memcpy_toio/fromio. (Default=1)");
+
+uint zone_size_mb = 0;
+module_param(zone_size_mb, uint, S_IRUGO);
+MODULE_PARM_DESC(zone_size_mb, "Make fmdsk a host-managed zoned device with zones of this many MB, rounded down to a power of 2. 0 = conventional. (Default=0)");
+
+uint stripe_members = 1;
+module_param(stripe_members, uint, S_IRUGO);
+MODULE_PARM_DESC(stripe_members, "Stripe fmdsk across this many discovered regions, 1 = one contiguous region. (Max=8, Default=1)");
+
+uint stripe_unit_kb = FMD_STRIPE_UNIT_KB_DEFAULT;
+module_param(stripe_unit_kb, uint, S_IRUGO);
+MODULE_PARM_DESC(stripe_unit_kb, "Stripe unit in KB, a power of 2 of at least a page. (Default=64)");
+
+int stripe_numa = 0;
+module_param(stripe_numa, int, S_IRUGO);
+MODULE_PARM_DESC(stripe_numa, "Only stripe across regions on different NUMA nodes. (Default=0)");
+
+int tier = 0;
+module_param(tier, int, S_IRUGO);
+MODULE_PARM_DESC(tier, "Make fmdsk an exclusive DRAM/flash tiered device over its own region and the mem_nr_pages DRAM region, instead of creating fmmem. Needs mem_nr_pages. Not available when caching. (Default=0)");
+
+uint tier_interval_ms = FMD_TIER_INTERVAL_MS_DEFAULT;
+module_param(tier_interval_ms, uint, S_IRUGO);
+MODULE_PARM_DESC(tier_interval_ms, "Tier migration interval in ms, 0 = no migration. (Default=1000)");
+
+uint tier_migrate_pages = FMD_TIER_MIGRATE_PAGES_DEFAULT;
+module_param(tier_migrate_pages, uint, S_IRUGO);
+MODULE_PARM_DESC(tier_migrate_pages, "Most pages swapped between tiers per interval. (Default=4096)");
+
+uint split_kb = FMD_SPLIT_KB_DEFAULT;
+module_param(split_kb, uint, S_IRUGO);
+MODULE_PARM_DESC(split_kb, "Copy bios larger than this many KB in parallel chunks, 0 = never. (Default=1024)");
+
+uint split_chunk_kb = FMD_SPLIT_CHUNK_KB_DEFAULT;
+module_param(split_chunk_kb, uint, S_IRUGO);
+MODULE_PARM_DESC(split_chunk_kb, "Size of the chunks of a split bio in KB, at least a page. (Default=256)");
+
+uint dedup = 0;
+module_param(dedup, uint, S_IRUGO);
+MODULE_PARM_DESC(dedup, "Share cache frames among written pages of equal contents, up to this many pages per frame on average, 0 = off. (Default=0)");
+
+uint zcache_pct = 0;
+module_param(zcache_pct, uint, S_IRUGO);
+MODULE_PARM_DESC(zcache_pct, "Keep LZ4 compressed copies of reclaimed cache pages in up to this percent of the cache size, 0 = off. (Default=0)");
+
+uint wipe = 0;
+module_param(wipe, uint, S_IRUGO);
+MODULE_PARM_DESC(wipe, "Zero each device's region in the background at load with this many workers, reading unzeroed parts as zeros. 0 = use the region as found. Not available with tier, not needed with backing other than 0. (Max=16, Default=0)");
+
+uint backing = FMD_BACKING_E820;
+module_param(backing, uint, S_IRUGO);
+MODULE_PARM_DESC(backing, "What holds the regions: 0 = E820 PMEM ranges, 1 = vmalloc, 2 = vmalloc in huge pages (5.18+), 3 = as 1 with fmdsk's region loaded from and saved to backing_file. Striping needs 0. (Default=0)");
+
+char *backing_file = NULL;
+module_param(backing_file, charp, S_IRUGO);
+MODULE_PARM_DESC(backing_file, "File holding fmdsk's region with backing=3, created if missing.");
 
 static int max_part;
 module_param(max_part, int, S_IRUGO);
 MODULE_PARM_DESC(max_part, "Maximum number of partitions per RAM disk");
 
 static int fmd_major_num = 0;
+static int fmd_nr_minors = 0;
 static LIST_HEAD(fmd_devices);
 static DEFINE_MUTEX(fmd_devices_mutex); /* protects list of devices */
 static DEFINE_MUTEX(fmd_mutex);
@@ -67,18 +162,45 @@ static DEFINE_MUTEX(fmd_mutex);
 /* Defines to cleanly view bio structure changes between kernels */
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(3,14,0)
 #define BIO_SECTOR(bio)		bio->bi_iter.bi_sector
+#define BIO_SIZE(bio)		bio->bi_iter.bi_size
 #define BV_CUR_SECTORS(bvec) 	((bvec.bv_len) >> SECTOR_SHIFT)
 #define BV_LEN(bvec)		(bvec.bv_len)
 #define BV_PAGE(bvec)		(bvec.bv_page)
 #define BV_OFFSET(bvec)		(bvec.bv_offset)
 #else
 #define BIO_SECTOR(bio)		bio->bi_sector
+#define BIO_SIZE(bio)		bio->bi_size
 #define BV_CUR_SECTORS(bvec) 	((bvec->bv_len) >> SECTOR_SHIFT)
 #define BV_LEN(bvec)		(bvec->bv_len)
 #define BV_PAGE(bvec)		(bvec->bv_page)
 #define BV_OFFSET(bvec)		(bvec->bv_offset)
 #endif
 
+/* Multi-page bvecs (5.1+) can only be mapped whole without highmem */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,1,0) && !defined(CONFIG_HIGHMEM)
+#define BIO_FOR_EACH_BVEC(bvec, bio, iter)	bio_for_each_bvec(bvec, bio, iter)
+#define __BIO_FOR_EACH_BVEC(bvec, bio, iter, start)	__bio_for_each_bvec(bvec, bio, iter, start)
+#else
+#define BIO_FOR_EACH_BVEC(bvec, bio, iter)	bio_for_each_segment(bvec, bio, iter)
+#define __BIO_FOR_EACH_BVEC(bvec, bio, iter, start)	__bio_for_each_segment(bvec, bio, iter, start)
+#endif
+
+/* Flush requests, empty or ahead of a write */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,8,0)
+#define BIO_IS_PREFLUSH(bio)	(!!((bio)->bi_opf & REQ_PREFLUSH))
+#else
+#define BIO_IS_PREFLUSH(bio)	(!!((bio)->bi_rw & REQ_FLUSH))
+#endif
+
+/* REQ_NOWAIT bios (4.13+) get BLK_STS_AGAIN where they would sleep */
+#ifdef REQ_NOWAIT
+#define FMD_NOWAIT		1
+#define BIO_NOWAIT(bio)		(!!((bio)->bi_opf & REQ_NOWAIT))
+#else
+#define FMD_NOWAIT		0
+#define BIO_NOWAIT(bio)		false
+#endif
+
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(3,4,0)
 #define	BIO_KMAP_ATOMIC(page, usr)  kmap_atomic(page)
 #define	BIO_KUNMAP_ATOMIC(dst, usr) kunmap_atomic(dst)
@@ -113,6 +235,8 @@ static long fmd_direct_access(struct block_device *bdev, sector_t sector,
 
 	if (!fmd)
 		return -ENODEV;
+	if (fmd->stripe || fmd->tier || !fmd->phys)	/* no single linear mapping */
+		return -EOPNOTSUPP;
 
 	*kaddr = (void __force *) fmd->virt + offset;
 	//FIXME: *pfn = (fmd->phys + offset) >> PAGE_SHIFT;
@@ -139,7 +263,76 @@ static const struct dax_operations fmd_dax_ops = {
 #endif  /* CONFIG_BLK_DEV_RAM_DAX */
 #endif  /* DAX_SUPPORT */
 
-/* TODO: IOCTL support not yet added !!! This is just a placeholder. */
+/*
+ * FMD_IOC_HINT: apply an access hint to a sector range of the opened
+ * device.  Pinning takes cache frames from everyone else, so it is
+ * limited to CAP_SYS_ADMIN.
+ */
+static int fmd_ioctl_hint(struct block_device *bdev, struct fmd_device_t *fmd,
+			  void __user *argp)
+{
+	struct fmd_ioc_hint hint;
+	u64 nr_sects;
+
+	if (copy_from_user(&hint, argp, sizeof(hint)))
+		return -EFAULT;
+	if (hint.reserved)
+		return -EINVAL;
+
+	nr_sects = i_size_read(bdev->bd_inode) >> SECTOR_SHIFT;
+	if (hint.sector > nr_sects || hint.nr_sectors > nr_sects - hint.sector)
+		return -EINVAL;
+
+	if ((hint.advice == FMD_HINT_PIN || hint.advice == FMD_HINT_UNPIN) &&
+	    !capable(CAP_SYS_ADMIN))
+		return -EPERM;
+
+#if CACHE_PAGES
+	return fmd_cache_hint(fmd, get_start_sect(bdev) + hint.sector,
+			      hint.nr_sectors, hint.advice);
+#else
+	/* Nothing to warm or pin without a cache */
+	return -EOPNOTSUPP;
+#endif
+}
+
+/*
+ * FMD_IOC_SAVE, FMD_IOC_RESTORE: stream the whole device to or from a
+ * file.  A restore overwrites the device under its users, so both are
+ * limited to CAP_SYS_ADMIN, and to the whole disk: partitions start
+ * past sector 0.
+ */
+static int fmd_ioctl_image(struct block_device *bdev, struct fmd_device_t *fmd,
+			   unsigned int cmd, void __user *argp)
+{
+	struct fmd_ioc_image io;
+	int err;
+
+	if (!capable(CAP_SYS_ADMIN))
+		return -EPERM;
+	if (copy_from_user(&io, argp, sizeof(io)))
+		return -EFAULT;
+	if (io.reserved || (io.flags & ~FMD_IMAGE_LZ4) ||
+	    io.queue_depth > FMD_IMAGE_DEPTH_MAX || get_start_sect(bdev))
+		return -EINVAL;
+
+	/* The region isn't in logical order, or isn't all there is */
+	if (fmd->tier || fmd->zoned)
+		return -EOPNOTSUPP;
+
+	mutex_lock(&fmd_mutex);
+	if (cmd == FMD_IOC_SAVE)
+		err = fmd_image_save(fmd, &io);
+	else
+		err = fmd_image_restore(fmd, &io);
+	mutex_unlock(&fmd_mutex);
+
+	if (!err && copy_to_user(argp, &io, sizeof(io)))
+		err = -EFAULT;
+	return err;
+}
+
+/* Only the FMD_IOC_* ioctls are supported, others return -ENOTTY */
 
 static int fmd_ioctl(struct block_device *bdev, fmode_t mode,
 			unsigned int cmd, unsigned long arg)
@@ -148,6 +341,11 @@ static int fmd_ioctl(struct block_device *bdev, fmode_t mode,
 	struct fmd_device_t *fmd = bdev->bd_disk->private_data;
 	printk(KERN_INFO "%s: %s: 0x%x\n", fmd->dev_name, __func__, cmd);
 
+	if (cmd == FMD_IOC_HINT)
+		return fmd_ioctl_hint(bdev, fmd, (void __user *) arg);
+	if (cmd == FMD_IOC_SAVE || cmd == FMD_IOC_RESTORE)
+		return fmd_ioctl_image(bdev, fmd, cmd, (void __user *) arg);
+
 	//if (cmd != BLKFLSBUF)
 		return -ENOTTY;
 
@@ -179,6 +377,9 @@ static int fmd_ioctl(struct block_device *bdev, fmode_t mode,
 static const struct block_device_operations fmd_fops = {
 	.owner =		THIS_MODULE,
 	.ioctl =		fmd_ioctl,
+#if FMD_ZONED && !FMD_ZONE_REPORT_BIO
+	.report_zones =		fmd_zone_report_zones,
+#endif
 #if DAX_SUPPORT && !CACHE_PAGES && LINUX_VERSION_CODE < KERNEL_VERSION(4,12,0)
 #ifdef CONFIG_BLK_DEV_RAM_DAX
 	.direct_access =	fmd_direct_access,
@@ -192,100 +393,160 @@ static const struct block_device_operations fmd_fops = {
 /*-------------------------------------------------------------*/
 
 #if CACHE_PAGES
+#define FMD_SEG_PAGES	32	/* cache pages handled per gang lookup */
+
 /* 
  * WRITE: 
- * Copy n bytes from src to the fmd starting at sector. Does not sleep. 
+ * Copy n bytes from src to the fmd cache pages starting at sector.
+ * Does not sleep. 
  *  
- * We don't actually write the page to the dsk at this point, 
- * instead we write the page to our internal cache. 
- * We mark the cache page dirty and flush the contents to the dsk later.
+ * In write-back mode we don't actually write the page to the dsk at this
+ * point, instead we write the page to our internal cache. 
+ * The cache pages are marked dirty when they are put and the contents
+ * are flushed to the dsk later.
+ * In write-through mode the cache pages are left clean and the caller
+ * writes the dsk in the same bio.
  */
 static void copy_to_fmd(struct fmd_device_t *fmd, const void *src,
-			sector_t sector, size_t n)
+			sector_t sector, size_t n, u32 *frames)
 {
-	struct fmd_page_t *page;
+	struct fmd_cache_t *cache = (struct fmd_cache_t *) fmd->cache;
 	unsigned int offset = (sector & (PAGE_SECTORS-1)) << SECTOR_SHIFT;
+	u64 start = fmd_emul_begin(fmd);
+	size_t total = n;
 	size_t copy;
 
-	copy = min_t(size_t, n, PAGE_SIZE - offset);
-
-	page = fmd_radix_tree_lookup_page(fmd, sector);
-	BUG_ON(!page);
-
-	memcpy(page->virt + offset, src, copy);
-	fmd_radix_tree_mark_dirty_page(fmd, page);
-
-	if (copy < n) {
+	for (; n; frames++) {
+		copy = min_t(size_t, n, PAGE_SIZE - offset);
+		memcpy(fmd_cache_frame_virt(cache, *frames) + offset, src, copy);
 		src += copy;
-		sector += copy >> SECTOR_SHIFT;
-		offset = (sector & (PAGE_SECTORS-1)) << SECTOR_SHIFT;
-		copy = n - copy;
-		page = fmd_radix_tree_lookup_page(fmd, sector);
-		BUG_ON(!page);
-
-		memcpy(page->virt + offset, src, copy);
-		fmd_radix_tree_mark_dirty_page(fmd, page);
+		n -= copy;
+		offset = 0;
 	}
+	fmd_emul_end(fmd, FMD_EMUL_DRAM, FMD_EMUL_WRITE, start, total);
 }
 
 /*
  * READ: 
  * Copy n bytes to dst from the fmd cache starting at sector. Does not sleep.
+ * Pages that could not be brought into the cache are read from the dsk,
+ * consecutive misses in a single copy.
  */
 static void copy_from_fmd(void *dst, struct fmd_device_t *fmd,
-			sector_t sector, size_t n)
+			sector_t sector, size_t n, u32 *frames)
 {
-	struct fmd_page_t *page;
+	struct fmd_cache_t *cache = (struct fmd_cache_t *) fmd->cache;
 	unsigned int offset = (sector & (PAGE_SECTORS-1)) << SECTOR_SHIFT;
+	void *miss_dst = NULL;
+	sector_t miss_sector = 0;
+	u64 start = fmd_emul_begin(fmd);
+	size_t miss = 0;
+	size_t hit = 0;
 	size_t copy;
 
-	copy = min_t(size_t, n, PAGE_SIZE - offset);
-	page = fmd_radix_tree_lookup_page(fmd, sector);
-
-	if (page) {  /* cache hit */
-                memcpy(dst, page->virt + offset, copy);
-        } else { /* cache miss */
-                memset(dst, 0, copy);  /* FIXME: Page Fault*/
-        }
+	for (; n; frames++) {
+		copy = min_t(size_t, n, PAGE_SIZE - offset);
+
+		if (*frames != FMD_FRAME_NONE) {  /* cache hit */
+			if (miss) {
+				fmd_region_read(fmd, miss_dst, miss_sector, miss);
+				miss = 0;
+			}
+			memcpy(dst, fmd_cache_frame_virt(cache, *frames) + offset, copy);
+			hit += copy;
+		} else {  /* cache miss */
+			if (!miss) {
+				miss_dst = dst;
+				miss_sector = sector;
+			}
+			miss += copy;
+		}
 
-        if (copy < n) {
 		dst += copy;
 		sector += copy >> SECTOR_SHIFT;
-		offset = (sector & (PAGE_SECTORS-1)) << SECTOR_SHIFT;
-		copy = n - copy;
-
-		page = fmd_radix_tree_lookup_page(fmd, sector);
-		if (page) {  /* cache hit */
-			memcpy(dst, page->virt + offset, copy);
-		} else { /* cache miss */
-			memset(dst, 0, copy);
-		}
-        }
+		n -= copy;
+		offset = 0;
+	}
+	if (miss)
+		fmd_region_read(fmd, miss_dst, miss_sector, miss);
+	if (hit)
+		fmd_emul_end(fmd, FMD_EMUL_DRAM, FMD_EMUL_READ, start, hit);
 }
 
 /* 
  * WRITE PREP: 
- * copy_to_fmd_setup must be called before copy_to_fmd. It may sleep.
+ * copy_to_fmd_setup must be called before copy_to_fmd. It may sleep,
+ * unless nowait is set.
+ * Returns the cache frames of the write, referenced, in frames.
+ * Pages only partially covered by the write are filled from the dsk first.
  */
-static int copy_to_fmd_setup(struct fmd_device_t *fmd, sector_t sector, size_t n)
+static int copy_to_fmd_setup(struct fmd_device_t *fmd, sector_t sector, size_t n,
+			u32 *frames, bool nowait)
 {
-	unsigned int offset = (sector & (PAGE_SECTORS-1)) << SECTOR_SHIFT;
-	size_t copy;
+	unsigned int nr = fmd_cache_nr_pages(sector, n);
 
-	copy = min_t(size_t, n, PAGE_SIZE - offset);
-	if (!fmd_radix_tree_insert_page(fmd, sector))
+	if (fmd_radix_tree_insert_pages(fmd, sector, n, frames, false, nowait) < nr) {
+		fmd_radix_tree_drop_pages(fmd, frames, nr);
 		return -ENOSPC;
-	if (copy < n) {
-		sector += copy >> SECTOR_SHIFT;
-		if (!fmd_radix_tree_insert_page(fmd, sector))
-			return -ENOSPC;
 	}
 	return 0;
 }
 
+/* 
+ * READ PREP: 
+ * Look up the cache pages of a read, referenced, and if alloc is set
+ * bring missing pages into the cache.  It may sleep, unless nowait is set.
+ * Best effort: copy_from_fmd reads any page that isn't cached from the dsk.
+ */
+static void copy_from_fmd_setup(struct fmd_device_t *fmd, sector_t sector, size_t n,
+			u32 *frames, bool alloc, bool nowait)
+{
+	if (alloc)
+		fmd_radix_tree_insert_pages(fmd, sector, n, frames, true, nowait);
+	else
+		fmd_radix_tree_get_pages(fmd, sector, n, frames);
+}
 
 /*
- * Process a single bvec of a bio.
+ * Process up to FMD_SEG_PAGES cache pages of a bvec.
+ * mode is the cache policy fmd_cache_io_begin chose for the whole bio.
+ * A bypassed bio is handled like write-around and its reads don't allocate.
+ * A write that can't get cache frames also goes around the cache, so
+ * a nowait bio never has to wait for them.
+ */
+static void fmd_do_seg(struct fmd_device_t *fmd, void *mem, unsigned int len,
+		       bool write, sector_t sector, int mode, bool nowait)
+{
+	u32 frames[FMD_SEG_PAGES];
+	unsigned int nr = fmd_cache_nr_pages(sector, len);
+	bool around = (mode == FMD_CACHE_MODE_WRITEAROUND ||
+		       mode == FMD_CACHE_MODE_BYPASS);
+
+	if (write) {
+		if (!around && copy_to_fmd_setup(fmd, sector, len, frames, nowait))
+			around = true;
+		if (around) {
+			fmd_cache_write_around(fmd, sector, mem, len);
+			return;
+		}
+		copy_to_fmd(fmd, mem, sector, len, frames);
+		if (mode != FMD_CACHE_MODE_WRITEBACK)
+			fmd_region_write(fmd, sector, mem, len);
+	} else {
+		copy_from_fmd_setup(fmd, sector, len, frames,
+				    mode != FMD_CACHE_MODE_BYPASS, nowait);
+		copy_from_fmd(mem, fmd, sector, len, frames);
+	}
+
+	if (write)
+		fmd_cache_dedup(fmd, sector, len, mem, frames,
+				mode == FMD_CACHE_MODE_WRITEBACK);
+	fmd_radix_tree_put_pages(fmd, frames, nr, write && mode == FMD_CACHE_MODE_WRITEBACK);
+}
+
+/*
+ * Process a single bvec of a bio, which may span many pages.  Each
+ * FMD_SEG_PAGES of it cost one gang lookup/insert and one pass of copies.
  */
 static int fmd_do_bvec(struct fmd_device_t *fmd, struct page *page,
 		       unsigned int len, unsigned int off, 
@@ -294,53 +555,58 @@ static int fmd_do_bvec(struct fmd_device_t *fmd, struct page *page,
 #else
 		       int rw,
 #endif
-		       sector_t sector)
+		       sector_t sector, int mode, bool nowait)
 {
+	unsigned int offset = (sector & (PAGE_SECTORS-1)) << SECTOR_SHIFT;
+	unsigned int seg;
 	void *mem;
-	int err = 0;
 
 	/* FIXME: Page Fault */
-	if (BIO_IS_WRITE(rw)) {
-		err = copy_to_fmd_setup(fmd, sector, len);
-		if (err)
-			goto out;
-	}
-
 	mem = BIO_KMAP_ATOMIC(page, KM_USER0);  /* map kernel's memory */
-	if (BIO_IS_READ(rw)) {
-		copy_from_fmd(mem + off, fmd, sector, len);
+	if (BIO_IS_WRITE(rw))
 		flush_dcache_page(page);
 
-	} else {
-		flush_dcache_page(page);
-		copy_to_fmd(fmd, mem + off, sector, len);
+	while (len) {
+		seg = min_t(unsigned int, len, FMD_SEG_PAGES * PAGE_SIZE - offset);
+		fmd_do_seg(fmd, mem + off, seg, BIO_IS_WRITE(rw), sector, mode, nowait);
+		off += seg;
+		len -= seg;
+		sector += seg >> SECTOR_SHIFT;
+		offset = 0;
 	}
-	BIO_KUNMAP_ATOMIC(mem, KM_USER0);
 
+	if (BIO_IS_READ(rw))
+		flush_dcache_page(page);
+	BIO_KUNMAP_ATOMIC(mem, KM_USER0);
 
-out:
-	return err;
+	return 0;
 }
 #else  /* !CACHE_PAGES */
 
+/*
+ * Process a single bvec of a bio.
+ * mode is unused without a cache.
+ */
 static int fmd_do_bvec(struct fmd_device_t *fmd, struct page *page,
 		       unsigned int len, unsigned int off, 
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(4,8,0)
-		       bool rw, sector_t sector)
+		       bool rw, sector_t sector, int mode, bool nowait)
 #else
-		       int rw, sector_t sector)
+		       int rw, sector_t sector, int mode, bool nowait)
 #endif
 {
 	void *mem;
 	int err = 0;
 
 	mem = BIO_KMAP_ATOMIC(page, KM_USER0);  /* map kernel's memory */
-	if (BIO_IS_READ(rw)) {
+	if (fmd->tier) {
+		err = fmd_tier_rw(fmd, mem + off, sector, len, BIO_IS_WRITE(rw), nowait);
+	} else if (BIO_IS_READ(rw)) {
 		//printk(KERN_INFO "%s: %s: READ mem=0x%p virt=0x%p len=0x%x\n", fmd->name, __func__, mem + off, fmd->virt + sector, len);
-		memcpy_fromio(mem + off, fmd->virt + sector, len);
+		fmd_region_read(fmd, mem + off, sector, len);
 	} else {
 		//printk(KERN_INFO "%s: %s: WRITE virt=0x%p mem=0x%p len=0x%x\n", fmd->name, __func__, fmd->virt + sector, mem + off, len);
-		memcpy_toio(fmd->virt + sector, mem + off, len);
+		fmd_region_write(fmd, sector, mem + off, len);
 	}
 	BIO_KUNMAP_ATOMIC(mem, KM_USER0);
 
@@ -348,6 +614,27 @@ static int fmd_do_bvec(struct fmd_device_t *fmd, struct page *page,
 }
 #endif
 
+#if FMD_SPLIT
+/* Copy the bvecs of a bio from start on, all of a bio or a chunk of it */
+static int fmd_do_bio_iter(struct fmd_device_t *fmd, struct bio *bio,
+			   struct bvec_iter start, bool write, int mode)
+{
+	struct bio_vec bvec;
+	struct bvec_iter iter;
+	bool nowait = BIO_NOWAIT(bio);
+	int err = 0;
+
+	__BIO_FOR_EACH_BVEC(bvec, bio, iter, start) {
+		err = fmd_do_bvec(fmd, BV_PAGE(bvec), BV_LEN(bvec), BV_OFFSET(bvec),
+				  write, iter.bi_sector, mode, nowait);
+		if (err)
+			break;
+	}
+	fmd_emul_settle(fmd, nowait);
+	return err;
+}
+#endif
+
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(3,2,0)
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(4,4,0)
 static blk_qc_t
@@ -366,16 +653,59 @@ fmd_make_request(struct request_queue *q, struct bio *bio)
 #else
 	int rw;
 #endif
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,14,0)
-	struct bio_vec bvec;
-	struct bvec_iter iter;
-#else
+#if !FMD_SPLIT
 	struct bio_vec *bvec;
 	int iter;
 #endif
 	sector_t sector;
+	bool nowait = BIO_NOWAIT(bio);
+	int mode = 0;
 	int err = -EIO;
 
+#if FMD_ZONED
+	/* chunk_sectors only splits requests, a bio crossing a zone is
+	 * split here and the rest resubmitted */
+	if (fmd->zoned) {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,13,0)
+		blk_queue_split(q, &bio);
+#else
+		blk_queue_split(q, &bio, q->bio_split);
+#endif
+	}
+#endif
+
+	/* Write back the pages dirtied before the flush, then any data */
+	if (BIO_IS_PREFLUSH(bio)) {
+		int ret;
+
+#if CACHE_PAGES
+		fmd_cache_flush(fmd);
+		fmd_emul_settle(fmd, nowait);
+#endif
+		ret = fmd_backing_save(fmd, nowait);
+		if (ret || !BIO_SIZE(bio)) {
+			err = ret;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,3,0)
+			if (err)
+				goto io_error;
+#endif
+			goto out;
+		}
+	}
+
+#if FMD_ZONED
+	/* Zone management completes here, writes must follow the pointer */
+	if (fmd->zoned) {
+		err = fmd_zone_bio(fmd, bio);
+		if (err < 0)
+			goto io_error;
+		if (err) {
+			err = 0;
+			goto out;
+		}
+	}
+#endif
+
 	sector = BIO_SECTOR(bio);
 	if (bio_end_sector(bio) > get_capacity(bdev->bd_disk))
 		goto out;
@@ -388,25 +718,50 @@ fmd_make_request(struct request_queue *q, struct bio *bio)
 	if (rw == READA)
 		rw = READ;
 #endif
+	err = 0;
 
-	bio_for_each_segment(bvec, bio, iter) {
+	/* Enforce bandwidth/IOPS limits before doing any copying */
+	err = fmd_qos_throttle(fmd, bio, BIO_IS_WRITE(rw), BIO_SIZE(bio), nowait);
+#if FMD_NOWAIT
+	if (err)
+		goto io_error;
+#endif
+
+#if CACHE_PAGES
+	mode = fmd_cache_io_begin(fmd, sector, BIO_SIZE(bio), nowait);
+#if FMD_NOWAIT
+	if (mode < 0) {
+		err = mode;
+		goto io_error;
+	}
+#endif
+#endif
+#if FMD_SPLIT
+	/* Large bios are copied by several CPUs, if the submitter may wait
+	 * for them */
+	if (nowait)
+		err = fmd_do_bio_iter(fmd, bio, bio->bi_iter, BIO_IS_WRITE(rw), mode);
+	else
+		err = fmd_split_bio(fmd, bio, fmd_do_bio_iter, BIO_IS_WRITE(rw), mode);
+#else
+	BIO_FOR_EACH_BVEC(bvec, bio, iter) {
 		unsigned int len = BV_LEN(bvec);
 		
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,14,0)
 		err = fmd_do_bvec(fmd, BV_PAGE(bvec), len, BV_OFFSET(bvec), 
-				rw, iter.bi_sector << SECTOR_SHIFT);
-#else
-		err = fmd_do_bvec(fmd, BV_PAGE(bvec), len, BV_OFFSET(bvec), 
-				rw, sector);
-#endif		
+				rw, sector, mode, nowait);
 		if (err)
-#if LINUX_VERSION_CODE < KERNEL_VERSION(4,3,0)
 			break;
-#else
-			goto io_error;
-#endif
 		sector += len >> SECTOR_SHIFT;
 	}
+	fmd_emul_settle(fmd, nowait);
+#endif
+#if CACHE_PAGES
+	fmd_cache_io_end(fmd);
+#endif
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,3,0)
+	if (err)
+		goto io_error;
+#endif
 
 out:
 #if LINUX_VERSION_CODE < KERNEL_VERSION(4,3,0)
@@ -420,6 +775,12 @@ out:
 	return;
 #endif
 io_error:
+#if FMD_NOWAIT
+	if (err == -EAGAIN) {
+		bio_wouldblock_error(bio);
+		return BLK_QC_T_NONE;
+	}
+#endif
 	bio_io_error(bio);
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(4,4,0)
 	return BLK_QC_T_NONE;
@@ -454,7 +815,7 @@ static struct fmd_device_t *fmd_alloc_dev(int i, int dev_type)
 	fmd->num = i;
 	fmd->dev_type = dev_type;
 #if CACHE_PAGES
-	fmd->cache = fmd + sizeof(struct fmd_device_t);
+	fmd->cache = (void *) (fmd + 1);
 #endif
 	sprintf(fmd->dev_name, "%s%d", (dev_type == FMD_DEV_TYPE_DSK) ? DEV_NAME_DSK : DEV_NAME_MEM, i);
 	spin_lock_init(&fmd->lock);
@@ -475,8 +836,20 @@ static struct fmd_device_t *fmd_alloc_dev(int i, int dev_type)
 	/* Tell block layer flush capability of the q
 	 * REQ_FLUSH = supports flushing
 	 * REQ_FUA   = supports bypassing write cache for individual writes */
-	//blk_queue_flush(q, REQ_FLUSH); 
+#if CACHE_PAGES
+	/* The DRAM cache is a volatile write cache, flushed on REQ_PREFLUSH.
+	 * FUA writes become a write and a flush */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,7,0)
+	blk_queue_write_cache(q, true, false);
+#else
+	blk_queue_flush(q, REQ_FLUSH);
+#endif
+#endif
 	queue_flag_set_unlocked(QUEUE_FLAG_NONROT, q);
+#ifdef QUEUE_FLAG_NOWAIT
+	/* Bio based queues only get REQ_NOWAIT bios if they ask (5.10+) */
+	blk_queue_flag_set(QUEUE_FLAG_NOWAIT, q);
+#endif
 
 	/* Create gendisk structure */
 	disk = alloc_disk(1);
@@ -485,30 +858,76 @@ static struct fmd_device_t *fmd_alloc_dev(int i, int dev_type)
 
 	fmd->disk = disk;
 	disk->major		= fmd_major_num;
-	disk->first_minor	= i;
+	disk->first_minor	= fmd_nr_minors++;
 	disk->fops		= &fmd_fops;
 	disk->private_data	= fmd;
 	disk->queue		= q;
 	disk->flags |= GENHD_FL_EXT_DEVT;
 	sprintf(disk->disk_name, "%s", fmd->dev_name);
-	set_capacity(disk, dsk_nr_pages * (PAGE_SIZE / 512));  /* capacity in 512 byte sectors */
 
 	/* Allocate or discover memory */
 #if CACHE_PAGES
 	/* For testing purposes, use part of the dsk for the cache.
 	 * Currently only the dsk can be discovered on the test system. */
 	if (fmd_memory_alloc_manual_dsk(fmd, E820_TYPE_PMEM,  dsk_nr_pages - cache_nr_pages) != 0)
-		goto out_free_queue;
+		goto out_free_disk;
 	if (fmd_memory_alloc_manual_cache(fmd, E820_TYPE_PMEM,  cache_nr_pages) != 0)
-		goto out_free_queue;
+		goto out_free_disk;
 #else
-	if (fmd_memory_alloc_manual_dsk(fmd, E820_TYPE_PMEM,  dsk_nr_pages) != 0)
-		goto out_free_queue;
+	if (dev_type == FMD_DEV_TYPE_MEM) {
+		if (fmd_memory_alloc_manual_mem(fmd, E820_TYPE_PMEM,  mem_nr_pages) != 0)
+			goto out_free_disk;
+	} else {
+		if (fmd_memory_alloc_manual_dsk(fmd, E820_TYPE_PMEM,  dsk_nr_pages) != 0)
+			goto out_free_disk;
+		if (tier && fmd_memory_alloc_manual_tier(fmd, E820_TYPE_PMEM,  mem_nr_pages) != 0)
+			goto out_free_disk;
+	}
 #endif
+	/* A file backed region is only durable once REQ_PREFLUSH saves it */
+	if (fmd->backing) {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,7,0)
+		blk_queue_write_cache(q, true, false);
+#else
+		blk_queue_flush(q, REQ_FLUSH);
+#endif
+	}
 
+	/* Capacity in 512 byte sectors.  A cache is inclusive, so only the
+	 * device's own region adds capacity.  Tiers are exclusive, so the
+	 * DRAM tier adds its own */
+	set_capacity(disk, (fmd->nr_pages + fmd_tier_nr_pages(fmd)) * (PAGE_SIZE / 512));
+
+	if (dev_type == FMD_DEV_TYPE_DSK && fmd_zone_init(fmd, zone_size_mb) != 0)
+		goto out_free_mem;
+	if (fmd_copy_init(fmd) != 0)
+		goto out_free_zone;
+	if (fmd_qos_init(fmd) != 0)
+		goto out_free_copy;
+	if (fmd_emul_init(fmd) != 0)
+		goto out_free_qos;
+	if (fmd_split_init(fmd, split_kb, split_chunk_kb) != 0)
+		goto out_free_emul;
+	/* After the copy routines are chosen, the workers use them */
+	if (fmd_wipe_init(fmd, wipe) != 0)
+		goto out_free_split;
 
 	return fmd;
 
+out_free_split:
+	fmd_split_cleanup(fmd);
+out_free_emul:
+	fmd_emul_cleanup(fmd);
+out_free_qos:
+	fmd_qos_cleanup(fmd);
+out_free_copy:
+	fmd_copy_cleanup(fmd);
+out_free_zone:
+	fmd_zone_cleanup(fmd);
+out_free_mem:
+	fmd_memory_cleanup_manual(fmd);
+out_free_disk:
+	put_disk(disk);
 out_free_queue:
 	blk_cleanup_queue(fmd->queue);
 out_free_dev:
@@ -521,6 +940,11 @@ static void fmd_free_dev(struct fmd_device_t *fmd)
 {
 	printk(KERN_INFO "%s: %s\n", fmd->dev_name, __func__);
 
+	fmd_chr_exit(fmd);
+	if (fmd->disk)
+		fmd_sysfs_exit(fmd);
+
+	fmd_wipe_cleanup(fmd);
 	fmd_memory_cleanup_manual(fmd);
 
 	if (fmd->disk) {
@@ -530,6 +954,11 @@ static void fmd_free_dev(struct fmd_device_t *fmd)
 	if (fmd->queue) {
 	    blk_cleanup_queue(fmd->queue);
 	}
+	fmd_split_cleanup(fmd);
+	fmd_emul_cleanup(fmd);
+	fmd_qos_cleanup(fmd);
+	fmd_copy_cleanup(fmd);
+	fmd_zone_cleanup(fmd);
 	kfree(fmd);
 }
 
@@ -555,19 +984,44 @@ static int __init fmd_init(void)
 	mutex_lock(&fmd_devices_mutex);
 	list_add_tail(&fmd->list, &fmd_devices);
 	mutex_unlock(&fmd_devices_mutex);
+
+#if !CACHE_PAGES
+	/* Publish the DRAM window as its own device when it isn't the cache
+	 * or a tier.  The flash device is still usable if no DRAM region is
+	 * found. */
+	if (mem_nr_pages && !tier) {
+		fmd = fmd_alloc_dev(i, FMD_DEV_TYPE_MEM);
+		if (fmd) {
+			mutex_lock(&fmd_devices_mutex);
+			list_add_tail(&fmd->list, &fmd_devices);
+			mutex_unlock(&fmd_devices_mutex);
+		} else {
+			printk(KERN_INFO "%s: %s%d not available\n", DRIVER_NAME, DEV_NAME_MEM, i);
+		}
+	}
+#endif
 	
 	/* Add to kernel's list of active devices
 	 * I/O can occur at this point */
 	list_for_each_entry(fmd, &fmd_devices, list) {
 		printk(KERN_INFO "%s: Add device %s addr 0x%llx size 0x%lx (%lu GB)\n", DRIVER_NAME, fmd->dev_name, fmd->phys, fmd->nr_pages * PAGE_SIZE, (unsigned long int) (fmd->nr_pages * PAGE_SIZE)/ (1024 * 1024 * 1024));
 		add_disk(fmd->disk);
+		fmd_sysfs_init(fmd);
+#if !CACHE_PAGES
+		/* A mapping would bypass the zone write pointers,
+		 * the tier map, a running wipe and the backing file's
+		 * dirty pages, and needs one contiguous physical region */
+		if (chr_dev && fmd->phys && !fmd->zoned && !fmd->stripe && !fmd->tier &&
+		    !fmd->wipe)
+			fmd_chr_init(fmd);
+#endif
 	}
 
 	printk(KERN_INFO "%s: module loaded\n", DRIVER_NAME);
 	return 0;
 
 out_free:
-	unregister_blkdev(RAMDISK_MAJOR, DRIVER_NAME);
+	unregister_blkdev(fmd_major_num, DRIVER_NAME);
 
 	return -ENOMEM;
 }
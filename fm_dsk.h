@@ -22,8 +22,8 @@
 /* Driver features support */
 #define CACHE_PAGES 0   /* 1 = support paging of flash memory via DRAM window */
                         /*     FIXME: Not fully coded/tested */
-			/* 0 = FUTURE: flash memory and DRAM memory two separate devices
-			       NOW: Detect flash memory only and support as a single device*/
+			/* 0 = flash memory and DRAM memory two separate devices
+			       (fmdsk and fmmem, fmmem only if mem_nr_pages != 0) */
 #define DAX_SUPPORT 0	/* 1 = support DAX byte addressibility (direct_access) */
 			/* Do NOT enable if CACHE_PAGES == 1 */
 
@@ -58,6 +58,16 @@ struct fmd_device_t {
         unsigned int nr_pages;
 	
 	void *cache;
+	void *qos;
+	void *chr;
+	void *copy;
+	void *zoned;
+	void *stripe;
+	void *tier;
+	void *split;
+	void *wipe;
+	void *emul;
+	void *backing;
 };
 
 
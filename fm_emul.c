@@ -0,0 +1,322 @@
+/*************************************************************************
+ *
+ * Fusion Memory Confidential
+ * __________________
+ *
+ *  Fusion Memory Incorporated
+ *  All Rights Reserved.
+ *
+ * NOTICE:  All information contained herein is, and remains
+ * the property of Fusion Memory and its suppliers, if any.
+ * The intellectual and technical concepts contained herein are
+ * proprietary to Fusion Memory and its suppliers and may be covered by
+ * U.S. and Foreign Patents, patents in process, and are protected by
+ * trade secret or copyright law. Dissemination of this information or
+ * reproduction of this material is strictly forbidden unless prior
+ * written permission is obtained from Fusion Memory.
+ */
+
+
+/*
+ * fm_emul - Media latency and bandwidth emulation
+ *
+ * With CACHE_PAGES on a host without the flash tier both the region and
+ * the cache frames are DRAM, so a cache hit costs the same as a miss and
+ * writeback and eviction look free.  Each copy to or from a tier is timed
+ * and then held until the emulated media would have finished it: the
+ * transfer is queued behind the tier's earlier transfers at the set
+ * bandwidth, and completes the set latency after it ends.  The copy's
+ * own time counts against the emulated one.
+ *
+ * In spin mode the copy busy-waits where it is made, which is exact but
+ * holds whatever locks the copy path holds.  In hrtimer mode the deadline
+ * is left to the CPU and the bio sleeps until its latest deadline before
+ * it completes.  Everything is set per device in sysfs and is off while
+ * all of it is 0.
+ */
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/sched.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/percpu.h>
+#include <linux/math64.h>
+#include "fm_dsk.h"
+#include "fm_emul.h"
+#include "fm_sysfs.h"
+
+static const char *fmd_emul_mode_names[] = {
+	[FMD_EMUL_SPIN]		= "spin",
+	[FMD_EMUL_HRTIMER]	= "hrtimer",
+};
+
+/*-------------------------------------------------------------*/
+/*-------------------   I/O Path Functions   ------------------*/
+/*-------------------------------------------------------------*/
+
+/* Wait until deadline, sleeping if allowed and worth it */
+static void fmd_emul_wait(struct fmd_emul_t *emul, u64 deadline, bool may_sleep)
+{
+	u64 now = ktime_get_ns();
+	ktime_t expires;
+
+	if (deadline <= now)
+		return;
+
+	atomic64_inc(&emul->nr_delayed);
+	atomic64_add(deadline - now, &emul->delayed_ns);
+
+	if (!may_sleep || deadline - now < FMD_EMUL_SLEEP_MIN_NS) {
+		while (ktime_get_ns() < deadline)
+			cpu_relax();
+		return;
+	}
+
+	expires = ns_to_ktime(deadline);
+	set_current_state(TASK_UNINTERRUPTIBLE);
+	schedule_hrtimeout(&expires, HRTIMER_MODE_ABS);
+}
+
+/*
+ * Queue a copy of n bytes begun at start on a tier's channel and wait for,
+ * or in hrtimer mode defer, the time it completes on the emulated media.
+ */
+void __fmd_emul_end(struct fmd_device_t *fmd, int tier, int dir, u64 start, size_t n)
+{
+	struct fmd_emul_t *emul = (struct fmd_emul_t *) fmd->emul;
+	struct fmd_emul_chan_t *chan = &emul->chan[tier][dir];
+	unsigned int mbps = READ_ONCE(chan->mbps);
+	u64 end = start;
+	u64 deadline;
+	u64 *pending;
+	s64 old;
+
+	/* MB/s is bytes per us */
+	if (mbps) {
+		u64 xfer = div_u64((u64) n * NSEC_PER_USEC, mbps);
+
+		do {
+			old = atomic64_read(&chan->busy_until);
+			end = max_t(u64, old, start) + xfer;
+		} while (atomic64_cmpxchg(&chan->busy_until, old, end) != old);
+	}
+	deadline = end + READ_ONCE(chan->lat_ns);
+
+	if (READ_ONCE(emul->mode) == FMD_EMUL_SPIN) {
+		fmd_emul_wait(emul, deadline, false);
+		return;
+	}
+
+	pending = get_cpu_ptr(emul->pending);
+	if (deadline > *pending)
+		*pending = deadline;
+	put_cpu_ptr(emul->pending);
+}
+
+/*
+ * A task that moved CPUs since its copies leaves their deadline behind,
+ * and the next settle on that CPU waits for it instead.
+ */
+void __fmd_emul_settle(struct fmd_device_t *fmd, bool nowait)
+{
+	struct fmd_emul_t *emul = (struct fmd_emul_t *) fmd->emul;
+
+	fmd_emul_wait(emul, this_cpu_xchg(*emul->pending, 0), !nowait);
+}
+
+/*-------------------------------------------------------------*/
+/*---------------   Initialization Functions   ----------------*/
+/*-------------------------------------------------------------*/
+
+int fmd_emul_init(struct fmd_device_t *fmd)
+{
+	struct fmd_emul_t *emul;
+
+	BUG_ON(!fmd);
+	printk(KERN_INFO "%s: %s\n", fmd->dev_name, __func__);
+
+	emul = kzalloc(sizeof(struct fmd_emul_t), GFP_KERNEL);
+	if (!emul)
+		return -ENOMEM;
+
+	spin_lock_init(&emul->lock);
+	emul->mode = FMD_EMUL_SPIN;
+	emul->pending = alloc_percpu(u64);
+	if (!emul->pending) {
+		kfree(emul);
+		return -ENOMEM;
+	}
+
+	fmd->emul = emul;
+	return 0;
+}
+
+void fmd_emul_cleanup(struct fmd_device_t *fmd)
+{
+	struct fmd_emul_t *emul = (struct fmd_emul_t *) fmd->emul;
+
+	printk(KERN_INFO "%s: %s\n", fmd->dev_name, __func__);
+
+	if (!emul)
+		return;
+
+	fmd->emul = NULL;
+	free_percpu(emul->pending);
+	kfree(emul);
+}
+
+/*-------------------------------------------------------------*/
+/*--------------------   Sysfs Functions   --------------------*/
+/*-------------------------------------------------------------*/
+
+/* Emulation is on while any channel has a latency or bandwidth set.
+ * Caller holds emul->lock */
+static void fmd_emul_update(struct fmd_emul_t *emul)
+{
+	bool active = false;
+	int t, d;
+
+	for (t = 0; t < FMD_EMUL_NR_TIERS; t++)
+		for (d = 0; d < 2; d++)
+			if (emul->chan[t][d].lat_ns || emul->chan[t][d].mbps)
+				active = true;
+	WRITE_ONCE(emul->active, active);
+}
+
+static ssize_t fmd_emul_chan_show(struct fmd_device_t *fmd, int tier, int dir,
+		bool lat, char *buf)
+{
+	struct fmd_emul_t *emul = (struct fmd_emul_t *) fmd->emul;
+	struct fmd_emul_chan_t *chan;
+
+	if (!emul)
+		return -ENODEV;
+	chan = &emul->chan[tier][dir];
+	if (lat)
+		return sprintf(buf, "%llu\n", READ_ONCE(chan->lat_ns));
+	return sprintf(buf, "%u\n", READ_ONCE(chan->mbps));
+}
+
+static ssize_t fmd_emul_chan_store(struct fmd_device_t *fmd, int tier, int dir,
+		bool lat, const char *buf, size_t len)
+{
+	struct fmd_emul_t *emul = (struct fmd_emul_t *) fmd->emul;
+	struct fmd_emul_chan_t *chan;
+	u64 val;
+	int err;
+
+	if (!emul)
+		return -ENODEV;
+	err = kstrtoull(buf, 0, &val);
+	if (err)
+		return err;
+	if (!lat && val > UINT_MAX)
+		return -EINVAL;
+
+	chan = &emul->chan[tier][dir];
+	spin_lock(&emul->lock);
+	if (lat) {
+		WRITE_ONCE(chan->lat_ns, val);
+	} else {
+		WRITE_ONCE(chan->mbps, val);
+		atomic64_set(&chan->busy_until, 0);
+	}
+	fmd_emul_update(emul);
+	spin_unlock(&emul->lock);
+
+	printk(KERN_INFO "%s: %s: %s %s %s=%llu\n", fmd->dev_name, __func__,
+	       tier == FMD_EMUL_DSK ? "dsk" : "dram",
+	       dir == FMD_EMUL_READ ? "read" : "write",
+	       lat ? "lat_ns" : "mbps", val);
+	return len;
+}
+
+#define FMD_EMUL_CHAN_ATTR(_name, _tier, _dir, _lat)				\
+static ssize_t _name##_show(struct device *dev,					\
+		struct device_attribute *attr, char *buf)			\
+{										\
+	return fmd_emul_chan_show(fmd_from_dev(dev), _tier, _dir, _lat, buf);	\
+}										\
+static ssize_t _name##_store(struct device *dev,				\
+		struct device_attribute *attr, const char *buf, size_t len)	\
+{										\
+	return fmd_emul_chan_store(fmd_from_dev(dev), _tier, _dir, _lat,	\
+				   buf, len);					\
+}										\
+static DEVICE_ATTR_RW(_name)
+
+FMD_EMUL_CHAN_ATTR(dsk_read_lat_ns, FMD_EMUL_DSK, FMD_EMUL_READ, true);
+FMD_EMUL_CHAN_ATTR(dsk_write_lat_ns, FMD_EMUL_DSK, FMD_EMUL_WRITE, true);
+FMD_EMUL_CHAN_ATTR(dsk_read_mbps, FMD_EMUL_DSK, FMD_EMUL_READ, false);
+FMD_EMUL_CHAN_ATTR(dsk_write_mbps, FMD_EMUL_DSK, FMD_EMUL_WRITE, false);
+FMD_EMUL_CHAN_ATTR(dram_read_lat_ns, FMD_EMUL_DRAM, FMD_EMUL_READ, true);
+FMD_EMUL_CHAN_ATTR(dram_write_lat_ns, FMD_EMUL_DRAM, FMD_EMUL_WRITE, true);
+FMD_EMUL_CHAN_ATTR(dram_read_mbps, FMD_EMUL_DRAM, FMD_EMUL_READ, false);
+FMD_EMUL_CHAN_ATTR(dram_write_mbps, FMD_EMUL_DRAM, FMD_EMUL_WRITE, false);
+
+static ssize_t mode_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct fmd_emul_t *emul = (struct fmd_emul_t *) fmd_from_dev(dev)->emul;
+
+	if (!emul)
+		return -ENODEV;
+	return sprintf(buf, "%s\n", fmd_emul_mode_names[READ_ONCE(emul->mode)]);
+}
+
+/* "spin" or "hrtimer" */
+static ssize_t mode_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t len)
+{
+	struct fmd_device_t *fmd = fmd_from_dev(dev);
+	struct fmd_emul_t *emul = (struct fmd_emul_t *) fmd->emul;
+	int mode;
+
+	if (!emul)
+		return -ENODEV;
+	for (mode = 0; mode < ARRAY_SIZE(fmd_emul_mode_names); mode++)
+		if (sysfs_streq(buf, fmd_emul_mode_names[mode]))
+			break;
+	if (mode == ARRAY_SIZE(fmd_emul_mode_names))
+		return -EINVAL;
+
+	WRITE_ONCE(emul->mode, mode);
+	printk(KERN_INFO "%s: %s: %s\n", fmd->dev_name, __func__,
+	       fmd_emul_mode_names[mode]);
+	return len;
+}
+static DEVICE_ATTR_RW(mode);
+
+/* "<nr copies delayed> <total ns delayed>" */
+static ssize_t delayed_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct fmd_emul_t *emul = (struct fmd_emul_t *) fmd_from_dev(dev)->emul;
+
+	if (!emul)
+		return -ENODEV;
+	return sprintf(buf, "%lld %lld\n", (long long) atomic64_read(&emul->nr_delayed),
+		       (long long) atomic64_read(&emul->delayed_ns));
+}
+static DEVICE_ATTR_RO(delayed);
+
+static struct attribute *fmd_emul_attrs[] = {
+	&dev_attr_dsk_read_lat_ns.attr,
+	&dev_attr_dsk_write_lat_ns.attr,
+	&dev_attr_dsk_read_mbps.attr,
+	&dev_attr_dsk_write_mbps.attr,
+	&dev_attr_dram_read_lat_ns.attr,
+	&dev_attr_dram_write_lat_ns.attr,
+	&dev_attr_dram_read_mbps.attr,
+	&dev_attr_dram_write_mbps.attr,
+	&dev_attr_mode.attr,
+	&dev_attr_delayed.attr,
+	NULL,
+};
+
+const struct attribute_group fmd_emul_attr_group = {
+	.name = "emul",
+	.attrs = fmd_emul_attrs,
+};
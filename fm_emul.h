@@ -0,0 +1,111 @@
+/*************************************************************************
+ *
+ * Fusion Memory Confidential
+ * __________________
+ *
+ *  Fusion Memory Incorporated
+ *  All Rights Reserved.
+ *
+ * NOTICE:  All information contained herein is, and remains
+ * the property of Fusion Memory and its suppliers, if any.
+ * The intellectual and technical concepts contained herein are
+ * proprietary to Fusion Memory and its suppliers and may be covered by
+ * U.S. and Foreign Patents, patents in process, and are protected by
+ * trade secret or copyright law. Dissemination of this information or
+ * reproduction of this material is strictly forbidden unless prior
+ * written permission is obtained from Fusion Memory.
+ */
+
+
+#ifndef FM_EMUL_H
+#define FM_EMUL_H
+
+#include <linux/types.h>
+#include <linux/atomic.h>
+#include <linux/ktime.h>
+#include <linux/spinlock.h>
+#include <linux/sysfs.h>
+#include "fm_dsk.h"
+
+/* Emulated tiers */
+#define FMD_EMUL_DSK		0	/* the device region, fmd->virt */
+#define FMD_EMUL_DRAM		1	/* cache frames or the DRAM tier */
+#define FMD_EMUL_NR_TIERS	2
+
+#define FMD_EMUL_READ		0
+#define FMD_EMUL_WRITE		1
+
+/* How a copy waits out the rest of its emulated time */
+#define FMD_EMUL_SPIN		0	/* busy-wait where the copy is made */
+#define FMD_EMUL_HRTIMER	1	/* sleep before the bio completes */
+
+#define FMD_EMUL_SLEEP_MIN_NS	10000	/* shorter waits spin in either mode */
+
+/*
+ * One direction of a tier.  Transfers are queued on the channel at mbps:
+ * busy_until is when the transfers queued so far end.  A copy is
+ * complete lat_ns after its own transfer ends.
+ */
+struct fmd_emul_chan_t {
+	u64 lat_ns;
+	unsigned int mbps;		/* MB/s, 0 = unlimited */
+	atomic64_t busy_until;		/* ktime_get_ns() */
+};
+
+/*
+ * Media emulation of a device.  Copies to and from each tier are made
+ * at DRAM speed and then delayed until the time the emulated media would
+ * have taken, so a DRAM-only host shows the tier ratios of real flash.
+ */
+struct fmd_emul_t {
+	bool active;			/* some latency or bandwidth is set */
+	int mode;			/* FMD_EMUL_SPIN/HRTIMER */
+	spinlock_t lock;		/* serializes sysfs stores */
+	struct fmd_emul_chan_t chan[FMD_EMUL_NR_TIERS][2];
+	u64 __percpu *pending;		/* hrtimer mode: deadline not waited for */
+
+	/* Statistics */
+	atomic64_t nr_delayed;
+	atomic64_t delayed_ns;
+};
+
+static inline bool fmd_emul_active(struct fmd_device_t *fmd)
+{
+	struct fmd_emul_t *emul = (struct fmd_emul_t *) fmd->emul;
+
+	return emul && READ_ONCE(emul->active);
+}
+
+void __fmd_emul_end(struct fmd_device_t *fmd, int tier, int dir, u64 start, size_t n);
+void __fmd_emul_settle(struct fmd_device_t *fmd, bool nowait);
+
+/* Start timing a copy, returns 0 if there's nothing to emulate */
+static inline u64 fmd_emul_begin(struct fmd_device_t *fmd)
+{
+	return fmd_emul_active(fmd) ? ktime_get_ns() : 0;
+}
+
+/* Delay a copy of n bytes begun at start by the emulated media time */
+static inline void
+fmd_emul_end(struct fmd_device_t *fmd, int tier, int dir, u64 start, size_t n)
+{
+	if (unlikely(start))
+		__fmd_emul_end(fmd, tier, dir, start, n);
+}
+
+/*
+ * Wait for the copies this CPU deferred in hrtimer mode.  Called where
+ * the I/O path may sleep, or spins if nowait is set.
+ */
+static inline void fmd_emul_settle(struct fmd_device_t *fmd, bool nowait)
+{
+	if (unlikely(fmd_emul_active(fmd)))
+		__fmd_emul_settle(fmd, nowait);
+}
+
+int fmd_emul_init(struct fmd_device_t *fmd);
+void fmd_emul_cleanup(struct fmd_device_t *fmd);
+
+extern const struct attribute_group fmd_emul_attr_group;
+
+#endif /* FM_EMUL_H */
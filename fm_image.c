@@ -0,0 +1,638 @@
+/*************************************************************************
+ *
+ * Fusion Memory Confidential
+ * __________________
+ *
+ *  Fusion Memory Incorporated
+ *  All Rights Reserved.
+ *
+ * NOTICE:  All information contained herein is, and remains
+ * the property of Fusion Memory and its suppliers, if any.
+ * The intellectual and technical concepts contained herein are
+ * proprietary to Fusion Memory and its suppliers and may be covered by
+ * U.S. and Foreign Patents, patents in process, and are protected by
+ * trade secret or copyright law. Dissemination of this information or
+ * reproduction of this material is strictly forbidden unless prior
+ * written permission is obtained from Fusion Memory.
+ */
+
+
+/*
+ * fm_image - Save and restore of the device image
+ *
+ * FMD_IOC_SAVE streams the region of a device to a file and
+ * FMD_IOC_RESTORE streams it back, so a volatile device can be
+ * checkpointed across a reboot much faster than with dd: pages that
+ * are all zeros (never written, discarded or wiped) aren't stored,
+ * chunks of FMD_IMAGE_CHUNK_PAGES pages are written with O_DIRECT,
+ * queue_depth of them in flight, and they can be LZ4 compressed.  The
+ * region is copied through buffers with fmd_region_read/write like any
+ * other I/O, as E820 memory has no struct pages to hand the file.
+ *
+ * The device's queue is frozen while the region is copied, so a save
+ * is of one point in time and I/O doesn't see a restore half done.  A
+ * restore still changes the device under its users, it is meant for a
+ * device that isn't in use.  The file mustn't be on the device itself.
+ */
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/version.h>
+#include <linux/fs.h>
+#include <linux/file.h>
+#include <linux/uio.h>
+#include <linux/bio.h>
+#include <linux/blk-mq.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/string.h>
+#include <linux/completion.h>
+#include <linux/sched.h>
+#include "fm_dsk.h"
+#include "fm_image.h"
+#include "fm_stripe.h"
+#include "fm_emul.h"
+#if CACHE_PAGES
+#include "fm_cache.h"
+#endif
+
+#if FMD_IMAGE
+
+#if FMD_IMAGE_COMPRESS
+#include <linux/lz4.h>
+#endif
+
+#define FMD_IMAGE_CHUNK_BYTES	(FMD_IMAGE_CHUNK_PAGES << PAGE_SHIFT)
+/* Room for a chunk LZ4 couldn't shrink, n + n / 255 + 16 */
+#define FMD_IMAGE_BUF_BYTES	(FMD_IMAGE_CHUNK_BYTES + 2 * PAGE_SIZE)
+#define FMD_IMAGE_BUF_PAGES	(FMD_IMAGE_BUF_BYTES >> PAGE_SHIFT)
+
+struct fmd_image_slot_t {
+	struct kiocb iocb;
+	struct bio_vec bvec[FMD_IMAGE_BUF_PAGES];
+	void *buf;			/* FMD_IMAGE_BUF_BYTES, vmalloc */
+	size_t len;			/* of the I/O in flight */
+	long ret;
+	bool busy;
+	struct completion done;
+};
+
+struct fmd_image_t {
+	struct fmd_device_t *fmd;
+	struct file *file;
+	bool direct;
+	unsigned int depth;
+	struct fmd_image_hdr_t hdr;
+	struct fmd_image_chunk_t *table;
+	size_t table_bytes;
+	void *scratch;			/* FMD_IMAGE_BUF_BYTES, vmalloc */
+	void *wrkmem;			/* for LZ4, if compressing */
+	struct fmd_image_slot_t slot[FMD_IMAGE_DEPTH_MAX];
+};
+
+static inline bool fmd_image_zero(struct fmd_image_chunk_t *e, unsigned int i)
+{
+	return (e->zero[i / 64] >> (i % 64)) & 1;
+}
+
+/* Pages of a chunk, the last one may be short */
+static inline unsigned int fmd_image_chunk_pages(struct fmd_device_t *fmd,
+		u64 chunk)
+{
+	return min_t(u64, FMD_IMAGE_CHUNK_PAGES,
+		     fmd->nr_pages - chunk * FMD_IMAGE_CHUNK_PAGES);
+}
+
+static unsigned int fmd_image_data_pages(struct fmd_image_chunk_t *e,
+		unsigned int nr)
+{
+	unsigned int i, data = 0;
+
+	for (i = 0; i < nr; i++)
+		data += !fmd_image_zero(e, i);
+	return data;
+}
+
+/*--------------------------------------------------------------------------*/
+/* File I/O, asynchronous with O_DIRECT like loop's */
+
+static bool fmd_image_can_direct(struct file *file)
+{
+#ifdef FMODE_CAN_ODIRECT
+	return file->f_mode & FMODE_CAN_ODIRECT;
+#else
+	return file->f_mapping->a_ops && file->f_mapping->a_ops->direct_IO;
+#endif
+}
+
+static void fmd_image_done(struct fmd_image_slot_t *slot, long ret)
+{
+	slot->ret = ret;
+	complete(&slot->done);
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,16,0)
+static void fmd_image_complete(struct kiocb *iocb, long ret)
+#else
+static void fmd_image_complete(struct kiocb *iocb, long ret, long ret2)
+#endif
+{
+	fmd_image_done(container_of(iocb, struct fmd_image_slot_t, iocb), ret);
+}
+
+static void fmd_image_submit(struct fmd_image_t *img,
+		struct fmd_image_slot_t *slot, int rw, loff_t pos, size_t len)
+{
+	unsigned int i, nr = DIV_ROUND_UP(len, PAGE_SIZE);
+	struct iov_iter iter;
+	ssize_t ret;
+
+	for (i = 0; i < nr; i++) {
+		slot->bvec[i].bv_page = vmalloc_to_page(slot->buf + i * PAGE_SIZE);
+		slot->bvec[i].bv_offset = 0;
+		slot->bvec[i].bv_len = min_t(size_t, len - i * PAGE_SIZE,
+					     PAGE_SIZE);
+	}
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,20,0)
+	iov_iter_bvec(&iter, rw, slot->bvec, nr, len);
+#else
+	iov_iter_bvec(&iter, ITER_BVEC | rw, slot->bvec, nr, len);
+#endif
+
+	init_sync_kiocb(&slot->iocb, img->file);
+	slot->iocb.ki_pos = pos;
+	slot->iocb.ki_flags &= ~IOCB_APPEND;
+	if (img->direct) {
+		slot->iocb.ki_flags |= IOCB_DIRECT;
+		slot->iocb.ki_complete = fmd_image_complete;
+	}
+	reinit_completion(&slot->done);
+	slot->len = len;
+	slot->busy = true;
+
+	if (rw == WRITE)
+		ret = img->file->f_op->write_iter(&slot->iocb, &iter);
+	else
+		ret = img->file->f_op->read_iter(&slot->iocb, &iter);
+	if (ret != -EIOCBQUEUED)
+		fmd_image_done(slot, ret);
+}
+
+static int fmd_image_wait(struct fmd_image_slot_t *slot)
+{
+	if (!slot->busy)
+		return 0;
+	wait_for_completion(&slot->done);
+	slot->busy = false;
+
+	if (slot->ret < 0)
+		return slot->ret;
+	/* Short, the image was truncated */
+	if (slot->ret != slot->len)
+		return -EIO;
+	return 0;
+}
+
+/* Wait for everything in flight, returning the first error */
+static int fmd_image_drain(struct fmd_image_t *img)
+{
+	unsigned int i;
+	int err = 0, ret;
+
+	for (i = 0; i < img->depth; i++) {
+		ret = fmd_image_wait(&img->slot[i]);
+		if (ret && !err)
+			err = ret;
+	}
+	return err;
+}
+
+static int fmd_image_sync_io(struct fmd_image_t *img, int rw, loff_t pos,
+		size_t len)
+{
+	fmd_image_submit(img, &img->slot[0], rw, pos, len);
+	return fmd_image_wait(&img->slot[0]);
+}
+
+/* The chunk table, through slot 0's buffer */
+static int fmd_image_table_io(struct fmd_image_t *img, int rw)
+{
+	size_t done, n;
+	int err;
+
+	for (done = 0; done < img->table_bytes; done += n) {
+		n = min_t(size_t, img->table_bytes - done, FMD_IMAGE_CHUNK_BYTES);
+		if (rw == WRITE)
+			memcpy(img->slot[0].buf, (void *) img->table + done, n);
+		err = fmd_image_sync_io(img, rw, img->hdr.table_off + done, n);
+		if (err)
+			return err;
+		if (rw == READ)
+			memcpy((void *) img->table + done, img->slot[0].buf, n);
+	}
+	return 0;
+}
+
+static void fmd_image_close(struct fmd_image_t *img)
+{
+	unsigned int i;
+
+	for (i = 0; i < img->depth; i++)
+		vfree(img->slot[i].buf);
+	vfree(img->scratch);
+	vfree(img->wrkmem);
+	vfree(img->table);
+	fput(img->file);
+	vfree(img);
+}
+
+static struct fmd_image_t *fmd_image_open(struct fmd_device_t *fmd,
+		struct fmd_ioc_image *io, int rw)
+{
+	struct fmd_image_t *img;
+	struct file *file;
+	umode_t mode;
+	unsigned int i;
+	int err = -EBADF;
+
+	file = fget(io->fd);
+	if (!file)
+		return ERR_PTR(-EBADF);
+	if (!(file->f_mode & (rw == WRITE ? FMODE_WRITE : FMODE_READ)))
+		goto out_fput;
+
+	err = -EINVAL;
+	mode = file_inode(file)->i_mode;
+	if ((!S_ISREG(mode) && !S_ISBLK(mode)) ||
+	    !file->f_op->read_iter || !file->f_op->write_iter)
+		goto out_fput;
+
+	err = -ENOMEM;
+	img = vzalloc(sizeof(struct fmd_image_t));
+	if (!img)
+		goto out_fput;
+
+	img->fmd = fmd;
+	img->file = file;
+	img->direct = fmd_image_can_direct(file);
+	img->depth = io->queue_depth ? io->queue_depth : FMD_IMAGE_DEPTH_DEFAULT;
+	for (i = 0; i < img->depth; i++) {
+		img->slot[i].buf = vmalloc(FMD_IMAGE_BUF_BYTES);
+		if (!img->slot[i].buf)
+			goto out_close;
+		init_completion(&img->slot[i].done);
+	}
+	img->scratch = vmalloc(FMD_IMAGE_BUF_BYTES);
+	if (!img->scratch)
+		goto out_close;
+
+	if (io->flags & FMD_IMAGE_LZ4) {
+#if FMD_IMAGE_COMPRESS
+		img->wrkmem = vmalloc(LZ4_MEM_COMPRESS);
+		if (!img->wrkmem)
+			goto out_close;
+#else
+		err = -EOPNOTSUPP;
+		goto out_close;
+#endif
+	}
+
+	if (!img->direct)
+		io->flags |= FMD_IMAGE_BUFFERED;
+	return img;
+
+out_close:
+	fmd_image_close(img);
+	return ERR_PTR(err);
+
+out_fput:
+	fput(file);
+	return ERR_PTR(err);
+}
+
+/*--------------------------------------------------------------------------*/
+/* Save */
+
+/*
+ * Read a chunk of the device into slot's buffer and pack it for the
+ * image, returning the bytes to store.  The buffer is swapped with the
+ * scratch one if compressing helped.
+ */
+static size_t fmd_image_pack(struct fmd_image_t *img,
+		struct fmd_image_slot_t *slot, u64 chunk,
+		struct fmd_image_chunk_t *e)
+{
+	struct fmd_device_t *fmd = img->fmd;
+	u64 first = chunk * FMD_IMAGE_CHUNK_PAGES;
+	unsigned int nr = fmd_image_chunk_pages(fmd, chunk);
+	unsigned int i, data = 0;
+	size_t len;
+
+	fmd_region_read(fmd, slot->buf, (sector_t) first << PAGE_SECTORS_SHIFT,
+			(size_t) nr << PAGE_SHIFT);
+	fmd_emul_settle(fmd, false);
+
+	/* Squeeze out the zero pages */
+	for (i = 0; i < nr; i++) {
+		void *page = slot->buf + i * PAGE_SIZE;
+
+		if (!memchr_inv(page, 0, PAGE_SIZE)) {
+			e->zero[i / 64] |= 1ULL << (i % 64);
+			continue;
+		}
+		if (data != i)
+			memcpy(slot->buf + data * PAGE_SIZE, page, PAGE_SIZE);
+		data++;
+	}
+	img->hdr.nr_data_pages += data;
+	len = (size_t) data << PAGE_SHIFT;
+
+#if FMD_IMAGE_COMPRESS
+	if (data && img->wrkmem) {
+		int clen = LZ4_compress_default(slot->buf, img->scratch, len,
+				FMD_IMAGE_BUF_BYTES, img->wrkmem);
+
+		if (clen > 0 && round_up(clen, FMD_IMAGE_ALIGN) < len) {
+			swap(slot->buf, img->scratch);
+			e->flags |= FMD_IMAGE_CHUNK_LZ4;
+			len = clen;
+		}
+	}
+#endif
+
+	e->len = len;
+	return len;
+}
+
+int fmd_image_save(struct fmd_device_t *fmd, struct fmd_ioc_image *io)
+{
+	struct fmd_image_t *img;
+	struct fmd_image_hdr_t *hdr;
+	u64 chunk, off;
+	int err, ret;
+
+	printk(KERN_INFO "%s: %s\n", fmd->dev_name, __func__);
+
+	img = fmd_image_open(fmd, io, WRITE);
+	if (IS_ERR(img))
+		return PTR_ERR(img);
+
+	hdr = &img->hdr;
+	hdr->magic = FMD_IMAGE_MAGIC;
+	hdr->version = FMD_IMAGE_VERSION;
+	hdr->page_size = PAGE_SIZE;
+	hdr->chunk_pages = FMD_IMAGE_CHUNK_PAGES;
+	hdr->nr_pages = fmd->nr_pages;
+	hdr->nr_chunks = DIV_ROUND_UP(hdr->nr_pages, FMD_IMAGE_CHUNK_PAGES);
+	hdr->table_off = FMD_IMAGE_ALIGN;
+	img->table_bytes = round_up(hdr->nr_chunks * sizeof(struct fmd_image_chunk_t),
+				    FMD_IMAGE_ALIGN);
+	hdr->data_off = hdr->table_off + img->table_bytes;
+
+	err = -ENOMEM;
+	img->table = vzalloc(img->table_bytes);
+	if (!img->table)
+		goto out_close;
+
+	file_start_write(img->file);
+
+	/* A save that fails half way mustn't leave an image that looks valid */
+	memset(img->slot[0].buf, 0, FMD_IMAGE_ALIGN);
+	err = fmd_image_sync_io(img, WRITE, 0, FMD_IMAGE_ALIGN);
+	if (err)
+		goto out_end;
+
+	/* Writes wait until the region is read */
+	blk_mq_freeze_queue(fmd->queue);
+#if CACHE_PAGES
+	/* The region is what's saved */
+	fmd_cache_flush(fmd);
+	fmd_emul_settle(fmd, false);
+#endif
+
+	off = hdr->data_off;
+	for (chunk = 0; chunk < hdr->nr_chunks; chunk++) {
+		struct fmd_image_slot_t *slot = &img->slot[chunk % img->depth];
+		size_t len, padded;
+
+		err = fmd_image_wait(slot);
+		if (err)
+			break;
+		if (fatal_signal_pending(current)) {
+			err = -EINTR;
+			break;
+		}
+
+		len = fmd_image_pack(img, slot, chunk, &img->table[chunk]);
+		if (!len)
+			continue;
+
+		padded = round_up(len, FMD_IMAGE_ALIGN);
+		memset(slot->buf + len, 0, padded - len);
+		img->table[chunk].off = off;
+		fmd_image_submit(img, slot, WRITE, off, padded);
+		off += padded;
+	}
+	ret = fmd_image_drain(img);
+	blk_mq_unfreeze_queue(fmd->queue);
+	if (!err)
+		err = ret;
+	if (err)
+		goto out_end;
+
+	err = fmd_image_table_io(img, WRITE);
+	if (err)
+		goto out_end;
+	err = vfs_fsync(img->file, 0);
+	if (err)
+		goto out_end;
+
+	/* Last, once everything it describes is stable */
+	hdr->bytes = off;
+	memset(img->slot[0].buf, 0, FMD_IMAGE_ALIGN);
+	memcpy(img->slot[0].buf, hdr, sizeof(*hdr));
+	err = fmd_image_sync_io(img, WRITE, 0, FMD_IMAGE_ALIGN);
+	if (!err)
+		err = vfs_fsync(img->file, 0);
+
+	io->nr_pages = hdr->nr_data_pages;
+	io->nr_zero_pages = hdr->nr_pages - hdr->nr_data_pages;
+	io->bytes = hdr->bytes;
+
+out_end:
+	file_end_write(img->file);
+out_close:
+	fmd_image_close(img);
+	return err;
+}
+
+/*--------------------------------------------------------------------------*/
+/* Restore */
+
+static int fmd_image_check(struct fmd_image_t *img)
+{
+	struct fmd_device_t *fmd = img->fmd;
+	struct fmd_image_hdr_t *hdr = &img->hdr;
+
+	if (hdr->magic != FMD_IMAGE_MAGIC || hdr->version != FMD_IMAGE_VERSION ||
+	    hdr->page_size != PAGE_SIZE ||
+	    hdr->chunk_pages != FMD_IMAGE_CHUNK_PAGES ||
+	    hdr->nr_pages != fmd->nr_pages ||
+	    hdr->nr_chunks != DIV_ROUND_UP(hdr->nr_pages, FMD_IMAGE_CHUNK_PAGES) ||
+	    hdr->table_off != FMD_IMAGE_ALIGN)
+		return -EINVAL;
+
+	img->table_bytes = round_up(hdr->nr_chunks * sizeof(struct fmd_image_chunk_t),
+				    FMD_IMAGE_ALIGN);
+	if (hdr->data_off < hdr->table_off + img->table_bytes)
+		return -EINVAL;
+	return 0;
+}
+
+static int fmd_image_check_chunk(struct fmd_image_t *img, u64 chunk)
+{
+	struct fmd_image_chunk_t *e = &img->table[chunk];
+	unsigned int nr = fmd_image_chunk_pages(img->fmd, chunk);
+	size_t data = (size_t) fmd_image_data_pages(e, nr) << PAGE_SHIFT;
+
+	if (e->flags & ~FMD_IMAGE_CHUNK_LZ4)
+		return -EINVAL;
+	if (e->flags & FMD_IMAGE_CHUNK_LZ4) {
+#if FMD_IMAGE_COMPRESS
+		if (!data || !e->len || e->len > FMD_IMAGE_BUF_BYTES)
+			return -EINVAL;
+#else
+		return -EOPNOTSUPP;
+#endif
+	} else if (e->len != data) {
+		return -EINVAL;
+	}
+	if (e->len && (e->off < img->hdr.data_off || e->off % FMD_IMAGE_ALIGN))
+		return -EINVAL;
+	return 0;
+}
+
+/* Unpack a chunk read into slot's buffer and write it to the device */
+static int fmd_image_unpack(struct fmd_image_t *img,
+		struct fmd_image_slot_t *slot, u64 chunk)
+{
+	struct fmd_device_t *fmd = img->fmd;
+	struct fmd_image_chunk_t *e = &img->table[chunk];
+	sector_t sector = (sector_t) chunk * FMD_IMAGE_CHUNK_PAGES << PAGE_SECTORS_SHIFT;
+	unsigned int nr = fmd_image_chunk_pages(fmd, chunk);
+	unsigned int i, data = fmd_image_data_pages(e, nr);
+	void *buf = slot->buf;
+
+#if FMD_IMAGE_COMPRESS
+	if (e->flags & FMD_IMAGE_CHUNK_LZ4) {
+		int n = LZ4_decompress_safe(slot->buf, img->scratch, e->len,
+					    data << PAGE_SHIFT);
+
+		if (n != data << PAGE_SHIFT)
+			return -EIO;
+		buf = img->scratch;
+	}
+#endif
+	if (!e->len)
+		buf = img->scratch;
+
+	/* Put the pages back in their places, from the end */
+	for (i = nr; i-- > 0; ) {
+		if (fmd_image_zero(e, i)) {
+			memset(buf + i * PAGE_SIZE, 0, PAGE_SIZE);
+			continue;
+		}
+		data--;
+		if (data != i)
+			memcpy(buf + i * PAGE_SIZE, buf + data * PAGE_SIZE,
+			       PAGE_SIZE);
+	}
+
+#if CACHE_PAGES
+	fmd_cache_write_around(fmd, sector, buf, (size_t) nr << PAGE_SHIFT);
+#else
+	fmd_region_write(fmd, sector, buf, (size_t) nr << PAGE_SHIFT);
+#endif
+	fmd_emul_settle(fmd, false);
+	return 0;
+}
+
+int fmd_image_restore(struct fmd_device_t *fmd, struct fmd_ioc_image *io)
+{
+	struct fmd_image_t *img;
+	struct fmd_image_hdr_t *hdr;
+	u64 chunk, next;
+	int err, ret;
+
+	printk(KERN_INFO "%s: %s\n", fmd->dev_name, __func__);
+
+	if (io->flags & FMD_IMAGE_LZ4)
+		return -EINVAL;
+
+	img = fmd_image_open(fmd, io, READ);
+	if (IS_ERR(img))
+		return PTR_ERR(img);
+	hdr = &img->hdr;
+
+	err = fmd_image_sync_io(img, READ, 0, FMD_IMAGE_ALIGN);
+	if (err)
+		goto out_close;
+	memcpy(hdr, img->slot[0].buf, sizeof(*hdr));
+	err = fmd_image_check(img);
+	if (err)
+		goto out_close;
+
+	err = -ENOMEM;
+	img->table = vmalloc(img->table_bytes);
+	if (!img->table)
+		goto out_close;
+	err = fmd_image_table_io(img, READ);
+	if (err)
+		goto out_close;
+	for (chunk = 0; chunk < hdr->nr_chunks; chunk++) {
+		err = fmd_image_check_chunk(img, chunk);
+		if (err)
+			goto out_close;
+	}
+
+	/* Read ahead up to depth chunks, write them to the device in order */
+	blk_mq_freeze_queue(fmd->queue);
+	next = 0;
+	for (chunk = 0; chunk < hdr->nr_chunks; chunk++) {
+		struct fmd_image_slot_t *slot = &img->slot[chunk % img->depth];
+
+		for (; next < hdr->nr_chunks && next < chunk + img->depth; next++) {
+			struct fmd_image_chunk_t *e = &img->table[next];
+
+			if (e->len)
+				fmd_image_submit(img, &img->slot[next % img->depth],
+						 READ, e->off,
+						 round_up(e->len, FMD_IMAGE_ALIGN));
+		}
+
+		err = fmd_image_wait(slot);
+		if (err)
+			break;
+		if (fatal_signal_pending(current)) {
+			err = -EINTR;
+			break;
+		}
+		err = fmd_image_unpack(img, slot, chunk);
+		if (err)
+			break;
+	}
+	ret = fmd_image_drain(img);
+	blk_mq_unfreeze_queue(fmd->queue);
+	if (!err)
+		err = ret;
+
+	io->nr_pages = hdr->nr_data_pages;
+	io->nr_zero_pages = hdr->nr_pages - hdr->nr_data_pages;
+	io->bytes = hdr->bytes;
+
+out_close:
+	fmd_image_close(img);
+	return err;
+}
+
+#endif /* FMD_IMAGE */
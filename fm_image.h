@@ -0,0 +1,98 @@
+/*************************************************************************
+ *
+ * Fusion Memory Confidential
+ * __________________
+ *
+ *  Fusion Memory Incorporated
+ *  All Rights Reserved.
+ *
+ * NOTICE:  All information contained herein is, and remains
+ * the property of Fusion Memory and its suppliers, if any.
+ * The intellectual and technical concepts contained herein are
+ * proprietary to Fusion Memory and its suppliers and may be covered by
+ * U.S. and Foreign Patents, patents in process, and are protected by
+ * trade secret or copyright law. Dissemination of this information or
+ * reproduction of this material is strictly forbidden unless prior
+ * written permission is obtained from Fusion Memory.
+ */
+
+
+/*
+ * fm_image - Save and restore of the device image
+ */
+
+#ifndef FM_IMAGE_H
+#define FM_IMAGE_H
+
+#include <linux/version.h>
+#include <linux/types.h>
+#include "fm_dsk.h"
+#include "fm_ioctl.h"
+
+/* kiocb->ki_flags and IOCB_DIRECT are 4.1's, freezing a bio based
+ * queue 4.4's */
+#define FMD_IMAGE		(LINUX_VERSION_CODE >= KERNEL_VERSION(4,4,0))
+
+/* The LZ4_compress_default API is 4.11's */
+#define FMD_IMAGE_COMPRESS	(LINUX_VERSION_CODE >= KERNEL_VERSION(4,11,0) && \
+				 IS_ENABLED(CONFIG_LZ4_COMPRESS) && \
+				 IS_ENABLED(CONFIG_LZ4_DECOMPRESS))
+
+#define FMD_IMAGE_MAGIC		0x49444d46	/* "FMDI" */
+#define FMD_IMAGE_VERSION	1
+
+#define FMD_IMAGE_ALIGN		4096		/* of everything in the file */
+#define FMD_IMAGE_CHUNK_PAGES	256
+#define FMD_IMAGE_DEPTH_DEFAULT	8		/* chunks in flight */
+#define FMD_IMAGE_DEPTH_MAX	32
+
+/*
+ * The image file: this header in the first FMD_IMAGE_ALIGN bytes, a
+ * table with an entry per chunk of FMD_IMAGE_CHUNK_PAGES device pages
+ * at table_off, and the chunks' data from data_off.  A chunk stores its
+ * nonzero pages only, in order, LZ4 compressed if that made them
+ * smaller.  Everything is in the byte order of the host.
+ */
+struct fmd_image_hdr_t {
+	u32 magic;
+	u32 version;
+	u32 page_size;
+	u32 chunk_pages;
+	u64 nr_pages;
+	u64 nr_chunks;
+	u64 table_off;
+	u64 data_off;
+	u64 nr_data_pages;		/* stored, the others are zero */
+	u64 bytes;			/* of the whole image */
+};
+
+#define FMD_IMAGE_CHUNK_LZ4	0x1
+
+struct fmd_image_chunk_t {
+	u64 off;			/* of the chunk's data */
+	u32 len;			/* bytes stored, 0 if every page is zero */
+	u32 flags;			/* FMD_IMAGE_CHUNK_* */
+	u64 zero[FMD_IMAGE_CHUNK_PAGES / 64];	/* pages not stored */
+};
+
+#if FMD_IMAGE
+
+int fmd_image_save(struct fmd_device_t *fmd, struct fmd_ioc_image *io);
+int fmd_image_restore(struct fmd_device_t *fmd, struct fmd_ioc_image *io);
+
+#else  /* !FMD_IMAGE */
+
+static inline int fmd_image_save(struct fmd_device_t *fmd,
+				 struct fmd_ioc_image *io)
+{
+	return -EOPNOTSUPP;
+}
+static inline int fmd_image_restore(struct fmd_device_t *fmd,
+				    struct fmd_ioc_image *io)
+{
+	return -EOPNOTSUPP;
+}
+
+#endif /* FMD_IMAGE */
+
+#endif /* FM_IMAGE_H */
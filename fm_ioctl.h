@@ -0,0 +1,71 @@
+/*************************************************************************
+ *
+ * Fusion Memory Confidential
+ * __________________
+ *
+ *  Fusion Memory Incorporated
+ *  All Rights Reserved.
+ *
+ * NOTICE:  All information contained herein is, and remains
+ * the property of Fusion Memory and its suppliers, if any.
+ * The intellectual and technical concepts contained herein are
+ * proprietary to Fusion Memory and its suppliers and may be covered by
+ * U.S. and Foreign Patents, patents in process, and are protected by
+ * trade secret or copyright law. Dissemination of this information or
+ * reproduction of this material is strictly forbidden unless prior
+ * written permission is obtained from Fusion Memory.
+ */
+
+
+/*
+ * fm_ioctl - fmdsk block device ioctls, shared with userspace
+ */
+
+#ifndef FM_IOCTL_H
+#define FM_IOCTL_H
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+/* Access hints for FMD_IOC_HINT */
+#define FMD_HINT_WILLNEED	1  /* bring the range into the cache, async */
+#define FMD_HINT_DONTNEED	2  /* write back and drop the range */
+#define FMD_HINT_PIN		3  /* bring in and exempt from eviction */
+#define FMD_HINT_UNPIN		4  /* make the range evictable again */
+
+/*
+ * Sector range relative to the opened block device (partition or whole
+ * disk), in 512 byte sectors.  Pages partially covered by the range are
+ * included.
+ */
+struct fmd_ioc_hint {
+	__u64 sector;
+	__u64 nr_sectors;
+	__u32 advice;		/* FMD_HINT_* */
+	__u32 reserved;		/* must be 0 */
+};
+
+/* Flags of struct fmd_ioc_image */
+#define FMD_IMAGE_LZ4		0x1  /* save: compress chunks that shrink */
+#define FMD_IMAGE_BUFFERED	0x2  /* out: the file couldn't do O_DIRECT */
+
+/*
+ * Save the whole device to, or restore it from, an open file.  Pages
+ * that are all zeros aren't stored.  The counts are filled in on return.
+ */
+struct fmd_ioc_image {
+	__s32 fd;
+	__u32 flags;		/* FMD_IMAGE_* */
+	__u32 queue_depth;	/* chunks in flight, 0 = default */
+	__u32 reserved;		/* must be 0 */
+	__u64 nr_pages;		/* out: pages stored */
+	__u64 nr_zero_pages;	/* out: pages skipped */
+	__u64 bytes;		/* out: size of the image */
+};
+
+#define FMD_IOC_MAGIC	0xF3
+#define FMD_IOC_HINT	_IOW(FMD_IOC_MAGIC, 1, struct fmd_ioc_hint)
+#define FMD_IOC_SAVE	_IOWR(FMD_IOC_MAGIC, 2, struct fmd_ioc_image)
+#define FMD_IOC_RESTORE	_IOWR(FMD_IOC_MAGIC, 3, struct fmd_ioc_image)
+
+#endif /* FM_IOCTL_H */
@@ -29,10 +29,17 @@
 #include <linux/mempool.h>
 #include <linux/dma-contiguous.h>
 #include <linux/blkdev.h>
+#include <linux/log2.h>
+#include <linux/numa.h>
+#include <linux/memory_hotplug.h>
 #include <asm/uaccess.h>
 #include "fm_dsk.h"
 #include "fm_mem.h"
 #include "fm_cache.h"
+#include "fm_stripe.h"
+#include "fm_tier.h"
+#include "fm_zcache.h"
+#include "fm_backing.h"
 
 
 /* Globals used for manual memory detection */
@@ -40,8 +47,20 @@ uint64_t phys_search_start = 0x100000000;  /* 4 GB */
 uint64_t phys_search_end = 0x480000000; /* 18 GB */
 uint64_t phys_cur = 0x100000000;
 
-extern int hiwat;
 extern int evict;
+extern int wmark_min;
+extern int wmark_low;
+extern int wmark_high;
+extern int cache_mode;
+extern uint stripe_members;
+extern uint stripe_unit_kb;
+extern int stripe_numa;
+extern uint tier_interval_ms;
+extern uint tier_migrate_pages;
+extern uint dedup;
+extern uint zcache_pct;
+extern uint backing;
+extern char *backing_file;
 
 static uint64_t fmd_locate_physical_mem(int e820_type, unsigned int nr_pages)
 {
@@ -86,27 +105,67 @@ static uint64_t fmd_locate_physical_mem(int e820_type, unsigned int nr_pages)
         return 0;
 }
 
-int fmd_memory_alloc_manual_dsk(struct fmd_device_t *fmd, int e820_type, unsigned int nr_pages)
+/*
+ * Discover and map a region of nr_pages, or with backing= other than
+ * E820 allocate it from kernel memory.  *phys is 0 for kernel memory.
+ * Returns the mapping, or NULL with nothing left to release.
+ */
+static void __iomem *fmd_region_map(struct fmd_device_t *fmd, int e820_type,
+				    unsigned int nr_pages, phys_addr_t *phys)
 {
-        BUG_ON (!fmd);
-	printk(KERN_INFO "%s: %s\n", fmd->dev_name, __func__);
+	void __iomem *virt;
 
-        fmd->nr_pages = nr_pages;
-	fmd->phys = fmd_locate_physical_mem(e820_type, nr_pages);
+	*phys = 0;
+	if (backing != FMD_BACKING_E820)
+		return fmd_backing_alloc(fmd, backing, nr_pages);
 
-	if (fmd->phys == 0) {
+	*phys = fmd_locate_physical_mem(e820_type, nr_pages);
+	if (*phys == 0) {
 		printk(KERN_INFO "%s: %s: ERROR: Unable to manually locate physical memory\n", fmd->dev_name, __func__);
-		goto err_alloc_manual_dsk;
+		return NULL;
 	}
-	if (!request_mem_region(fmd->phys, fmd->nr_pages * PAGE_SIZE, DRIVER_NAME)) {
+	if (!request_mem_region(*phys, nr_pages * PAGE_SIZE, DRIVER_NAME)) {
 		printk(KERN_INFO "%s: %s: ERROR: Unable to request mem region\n", fmd->dev_name, __func__);
-		goto err_alloc_manual_dsk;
+		*phys = 0;
+		return NULL;
 	}
-	fmd->virt = ioremap(fmd->phys, fmd->nr_pages * PAGE_SIZE);
-	if (!fmd->virt) {
+	virt = ioremap(*phys, nr_pages * PAGE_SIZE);
+	if (!virt) {
 		printk(KERN_INFO "%s: %s: ERROR: Unable to ioremap mem region\n", fmd->dev_name, __func__);
-		goto err_alloc_manual_dsk;
+		release_mem_region(*phys, nr_pages * PAGE_SIZE);
+		*phys = 0;
 	}
+	return virt;
+}
+
+/* Release a region mapped by fmd_region_map */
+static void fmd_region_unmap(void __iomem *virt, phys_addr_t phys, unsigned int nr_pages)
+{
+	if (!virt)
+		return;
+	if (!phys) {
+		fmd_backing_free(virt);
+		return;
+	}
+	iounmap(virt);
+	release_mem_region(phys, nr_pages * PAGE_SIZE);
+}
+
+/* Discover and map a device's own region (flash dsk or DRAM mem) */
+static int fmd_memory_alloc_manual(struct fmd_device_t *fmd, int e820_type, unsigned int nr_pages)
+{
+        BUG_ON (!fmd);
+	printk(KERN_INFO "%s: %s\n", fmd->dev_name, __func__);
+
+	fmd->virt = fmd_region_map(fmd, e820_type, nr_pages, &fmd->phys);
+	if (!fmd->virt)
+		goto err_alloc_manual_dsk;
+        fmd->nr_pages = nr_pages;
+
+	/* Only fmdsk's region persists in the file */
+	if (backing == FMD_BACKING_FILE && fmd->dev_type == FMD_DEV_TYPE_DSK &&
+	    fmd_backing_file_init(fmd, backing_file) != 0)
+		goto err_alloc_manual_dsk;
 
         return 0;
 
@@ -115,6 +174,179 @@ err_alloc_manual_dsk:
         return -ENOMEM;
 }
 
+/* NUMA node a physical region belongs to, NUMA_NO_NODE if unknown */
+int fmd_phys_to_node(phys_addr_t phys)
+{
+	if (!phys)	/* kernel memory backing */
+		return NUMA_NO_NODE;
+#if defined(CONFIG_NUMA) && LINUX_VERSION_CODE >= KERNEL_VERSION(5,10,0)
+	return phys_to_target_node(phys);
+#elif defined(CONFIG_NUMA) && defined(CONFIG_MEMORY_HOTPLUG)
+	return memory_add_physaddr_to_nid(phys);
+#else
+	return NUMA_NO_NODE;
+#endif
+}
+
+/*
+ * Discover stripe_members regions of an equal number of whole stripe
+ * units and stripe the device across them.  With stripe_numa, regions on
+ * a node that already has a member are skipped, so each member sits
+ * behind different memory controllers.
+ */
+static int fmd_memory_alloc_stripe(struct fmd_device_t *fmd, int e820_type, unsigned int nr_pages)
+{
+	struct fmd_stripe_t *stripe;
+	struct fmd_stripe_member_t *member;
+	unsigned int unit_pages, member_pages, i;
+	phys_addr_t phys;
+	int node;
+
+	printk(KERN_INFO "%s: %s: %u members, %u KB stripe unit\n", fmd->dev_name, __func__, stripe_members, stripe_unit_kb);
+
+	if (backing != FMD_BACKING_E820) {
+		printk(KERN_INFO "%s: %s: ERROR: striping needs E820 regions\n", fmd->dev_name, __func__);
+		return -EINVAL;
+	}
+	if (stripe_members > FMD_STRIPE_MAX || !is_power_of_2(stripe_unit_kb) ||
+	    stripe_unit_kb < (PAGE_SIZE >> 10)) {
+		printk(KERN_INFO "%s: %s: ERROR: invalid stripe geometry\n", fmd->dev_name, __func__);
+		return -EINVAL;
+	}
+	unit_pages = stripe_unit_kb >> (PAGE_SHIFT - 10);
+	member_pages = rounddown(nr_pages / stripe_members, unit_pages);
+	if (!member_pages)
+		return -EINVAL;
+
+	stripe = kzalloc(sizeof(struct fmd_stripe_t), GFP_KERNEL);
+	if (!stripe)
+		return -ENOMEM;
+	stripe->unit_shift = ilog2(stripe_unit_kb) + 10;
+	fmd->stripe = stripe;
+
+	while (stripe->nr_members < stripe_members) {
+		phys = fmd_locate_physical_mem(e820_type, member_pages);
+		if (phys == 0) {
+			printk(KERN_INFO "%s: %s: ERROR: found only %u members\n", fmd->dev_name, __func__, stripe->nr_members);
+			goto err_alloc_stripe;
+		}
+
+		node = fmd_phys_to_node(phys);
+		if (stripe_numa && node != NUMA_NO_NODE) {
+			for (i = 0; i < stripe->nr_members; i++)
+				if (stripe->member[i].node == node)
+					break;
+			if (i < stripe->nr_members) {
+				printk(KERN_INFO "%s: %s: skip 0x%llx, node %d in use\n", fmd->dev_name, __func__, (u64) phys, node);
+				continue;
+			}
+		}
+
+		if (!request_mem_region(phys, member_pages * PAGE_SIZE, DRIVER_NAME)) {
+			printk(KERN_INFO "%s: %s: ERROR: Unable to request mem region\n", fmd->dev_name, __func__);
+			goto err_alloc_stripe;
+		}
+		member = &stripe->member[stripe->nr_members++];
+		member->phys = phys;
+		member->nr_pages = member_pages;
+		member->node = node;
+		member->virt = ioremap(phys, member_pages * PAGE_SIZE);
+		if (!member->virt) {
+			printk(KERN_INFO "%s: %s: ERROR: Unable to ioremap mem region\n", fmd->dev_name, __func__);
+			goto err_alloc_stripe;
+		}
+		printk(KERN_INFO "%s: %s: member %u addr 0x%llx node %d\n", fmd->dev_name, __func__, stripe->nr_members - 1, (u64) phys, node);
+	}
+
+	fmd->nr_pages = member_pages * stripe->nr_members;
+	return 0;
+
+err_alloc_stripe:
+	fmd_memory_cleanup_manual(fmd);
+	return -ENOMEM;
+}
+
+/* Release the member regions of a striped device */
+static void fmd_memory_cleanup_stripe(struct fmd_device_t *fmd)
+{
+	struct fmd_stripe_t *stripe = (struct fmd_stripe_t *) fmd->stripe;
+	struct fmd_stripe_member_t *member;
+	unsigned int i;
+
+	for (i = 0; i < stripe->nr_members; i++) {
+		member = &stripe->member[i];
+		if (member->virt)
+			iounmap(member->virt);
+		release_mem_region(member->phys, member->nr_pages * PAGE_SIZE);
+	}
+
+	kfree(stripe);
+	fmd->stripe = NULL;
+	fmd->nr_pages = 0;
+}
+
+int fmd_memory_alloc_manual_dsk(struct fmd_device_t *fmd, int e820_type, unsigned int nr_pages)
+{
+	BUG_ON (!fmd || fmd->dev_type != FMD_DEV_TYPE_DSK);
+	if (stripe_members > 1)
+		return fmd_memory_alloc_stripe(fmd, e820_type, nr_pages);
+	return fmd_memory_alloc_manual(fmd, e820_type, nr_pages);
+}
+
+/*
+ * Discover and map the DRAM region of a tiered dsk, which would otherwise
+ * be fmmem, and set up the tier maps over it and the dsk's own region.
+ */
+int fmd_memory_alloc_manual_tier(struct fmd_device_t *fmd, int e820_type, unsigned int nr_pages)
+{
+	struct fmd_tier_t *tier;
+
+	BUG_ON (!fmd || fmd->dev_type != FMD_DEV_TYPE_DSK || !fmd->nr_pages);
+	printk(KERN_INFO "%s: %s\n", fmd->dev_name, __func__);
+
+	if (!nr_pages) {
+		printk(KERN_ERR "%s: %s: ERROR: tier needs mem_nr_pages\n", fmd->dev_name, __func__);
+		return -EINVAL;
+	}
+
+	tier = kzalloc(sizeof(struct fmd_tier_t), GFP_KERNEL);
+	if (!tier)
+		return -ENOMEM;
+	fmd->tier = tier;
+
+	tier->nr_pages = nr_pages;
+	tier->virt = fmd_region_map(fmd, e820_type, nr_pages, &tier->phys);
+	if (!tier->virt)
+		goto err_alloc_manual_tier;
+
+	if (fmd_tier_init(fmd, tier_interval_ms, tier_migrate_pages) != 0)
+		goto err_alloc_manual_tier;
+
+	return 0;
+
+err_alloc_manual_tier:
+	fmd_memory_cleanup_manual(fmd);
+	return -ENOMEM;
+}
+
+/* Release the DRAM region of a tiered dsk */
+static void fmd_memory_cleanup_tier(struct fmd_device_t *fmd)
+{
+	struct fmd_tier_t *tier = (struct fmd_tier_t *) fmd->tier;
+
+	fmd_tier_cleanup(fmd);
+	fmd_region_unmap(tier->virt, tier->phys, tier->nr_pages);
+
+	kfree(tier);
+	fmd->tier = NULL;
+}
+
+int fmd_memory_alloc_manual_mem(struct fmd_device_t *fmd, int e820_type, unsigned int nr_pages)
+{
+	BUG_ON (!fmd || fmd->dev_type != FMD_DEV_TYPE_MEM);
+	return fmd_memory_alloc_manual(fmd, e820_type, nr_pages);
+}
+
 int fmd_memory_alloc_manual_cache(struct fmd_device_t *fmd, int e820_type, unsigned int nr_pages)
 {
 	struct fmd_cache_t *cache;
@@ -123,30 +355,33 @@ int fmd_memory_alloc_manual_cache(struct fmd_device_t *fmd, int e820_type, unsig
 	printk(KERN_INFO "%s: %s\n", fmd->dev_name, __func__);
 
 	cache = (struct fmd_cache_t *) fmd->cache;
+	cache->virt = fmd_region_map(fmd, e820_type, nr_pages, &cache->phys);
+	if (!cache->virt)
+		goto err_alloc_manual_dsk;
 	cache->nr_pages_total = nr_pages;
-	cache->phys = fmd_locate_physical_mem(e820_type, nr_pages);
 
-	if (cache->phys == 0) {
-		printk(KERN_INFO "%s: %s: ERROR: Unable to manually locate physical memory\n", fmd->dev_name, __func__);
+	/* Allocate the frame metadata next to the cache memory */
+	cache->node = fmd_phys_to_node(cache->phys);
+	if (fmd_pagepool_init(fmd) != 0) {
 		goto err_alloc_manual_dsk;
 	}
-	if (!request_mem_region(cache->phys, nr_pages * PAGE_SIZE, DRIVER_NAME)) {
-		printk(KERN_INFO "%s: %s: ERROR: Unable to request mem region\n", fmd->dev_name, __func__);
+
+	fmd_radix_tree_init(fmd);
+	if (fmd_evict_list_init(fmd, evict, wmark_min, wmark_low, wmark_high) != 0) {
 		goto err_alloc_manual_dsk;
 	}
-	cache->virt = ioremap(cache->phys, nr_pages * PAGE_SIZE);
-	if (!fmd->virt) {
-		printk(KERN_INFO "%s: %s: ERROR: Unable to ioremap mem region\n", fmd->dev_name, __func__);
+	if (fmd_cache_mode_init(fmd, cache_mode) != 0) {
 		goto err_alloc_manual_dsk;
 	}
-
-	/* Allocate cache page pool */
-	if (fmd_pagepool_init(fmd) != 0) {
+	if (fmd_cache_hint_init(fmd) != 0) {
+		goto err_alloc_manual_dsk;
+	}
+	if (fmd_cache_dedup_init(fmd, dedup) != 0) {
+		goto err_alloc_manual_dsk;
+	}
+	if (fmd_zcache_init(fmd, zcache_pct) != 0) {
 		goto err_alloc_manual_dsk;
 	}
-
-	fmd_radix_tree_init(fmd);
-	fmd_evict_list_init(fmd, hiwat, evict);
 
         return 0;
 
@@ -165,33 +400,42 @@ void fmd_memory_cleanup_manual(struct fmd_device_t *fmd)
 
 	printk(KERN_INFO "%s: %s\n", fmd->dev_name, __func__);
 
-	if (cache && cache->pagepool) {
+	if (cache) {
+	    fmd_cache_hint_cleanup(fmd);
+	    fmd_evict_list_cleanup(fmd);
+	}
+	if (cache && cache->index) {
 	    fmd_radix_tree_free_pages(fmd);
+	    fmd_cache_dedup_cleanup(fmd);
+	    fmd_zcache_cleanup(fmd);
+	    fmd_pagepool_cleanup(fmd);
+	}
+	if (cache) {
+	    fmd_cache_mode_cleanup(fmd);
 	}
 
-	if (fmd->phys != 0 && fmd->nr_pages != 0) {
-	    release_mem_region(fmd->phys, fmd->nr_pages * PAGE_SIZE);
-            fmd->phys = 0;
-	    fmd->nr_pages = 0;
+	if (fmd->tier) {
+	    fmd_memory_cleanup_tier(fmd);
+	}
+	if (fmd->stripe) {
+	    fmd_memory_cleanup_stripe(fmd);
+	}
+	if (fmd->backing) {
+	    fmd_backing_file_cleanup(fmd);
 	}
 	if (fmd->virt) {
-	    iounmap(fmd->virt);
+	    fmd_region_unmap(fmd->virt, fmd->phys, fmd->nr_pages);
 	    fmd->virt = NULL;
+	    fmd->phys = 0;
+	    fmd->nr_pages = 0;
 	}
 
-	if (cache) {
-		if (cache->phys != 0 && cache->nr_pages_total != 0) {
-		    release_mem_region(cache->phys,
-			cache->nr_pages_total * PAGE_SIZE);
-		    cache->phys = 0;
-		    cache->nr_pages_total = 0;
-		    cache->nr_pages_cache = 0;
-		    cache->nr_pages_pagepool = 0;
-		}
-		if (cache->virt) {
-		    iounmap(cache->virt);
-		    cache->virt = NULL;
-		}
+	if (cache && cache->virt) {
+	    fmd_region_unmap(cache->virt, cache->phys, cache->nr_pages_total);
+	    cache->virt = NULL;
+	    cache->phys = 0;
+	    cache->nr_pages_total = 0;
+	    cache->nr_pages_cache = 0;
 	}
 }
 
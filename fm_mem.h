@@ -34,7 +34,10 @@
 //int e820_types[NUM_E820_TYPES] = { E820_TYPE_PMEM, E820_TYPE_RESERVED_KERN };
 
 int fmd_memory_alloc_manual_dsk(struct fmd_device_t *fmd, int e820_type, unsigned int nr_pages);
+int fmd_memory_alloc_manual_mem(struct fmd_device_t *fmd, int e820_type, unsigned int nr_pages);
+int fmd_memory_alloc_manual_tier(struct fmd_device_t *fmd, int e820_type, unsigned int nr_pages);
 int fmd_memory_alloc_manual_cache(struct fmd_device_t *fmd, int e820_type, unsigned int nr_pages);
 void fmd_memory_cleanup_manual(struct fmd_device_t *fmd);
+int fmd_phys_to_node(phys_addr_t phys);
 
 #endif /* FM_MEM */
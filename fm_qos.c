@@ -0,0 +1,545 @@
+/*************************************************************************
+ *
+ * Fusion Memory Confidential
+ * __________________
+ *
+ *  Fusion Memory Incorporated
+ *  All Rights Reserved.
+ *
+ * NOTICE:  All information contained herein is, and remains
+ * the property of Fusion Memory and its suppliers, if any.
+ * The intellectual and technical concepts contained herein are
+ * proprietary to Fusion Memory and its suppliers and may be covered by
+ * U.S. and Foreign Patents, patents in process, and are protected by
+ * trade secret or copyright law. Dissemination of this information or
+ * reproduction of this material is strictly forbidden unless prior
+ * written permission is obtained from Fusion Memory.
+ */
+
+
+/*
+ * fm_qos - Bandwidth and IOPS limits
+ *
+ * fmd_make_request runs synchronously in the submitter's context, so a
+ * tenant issuing large I/O can monopolize the memory channels.  Token
+ * buckets limit each device, and optionally each blkcg, to a configured
+ * rate of bytes and I/Os per second for reads and writes separately.  A
+ * submitter that exceeds its rate sleeps before its bio is processed.
+ */
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/blkdev.h>
+#include <linux/bio.h>
+#include <linux/slab.h>
+#include <linux/delay.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/rculist.h>
+#include "fm_dsk.h"
+#include "fm_qos.h"
+#include "fm_sysfs.h"
+#if FMD_QOS_BLKCG
+#include <linux/cgroup.h>
+#include <linux/blk-cgroup.h>
+#endif
+
+static const char *fmd_qos_bucket_names[FMD_QOS_NR_BUCKETS] = {
+	"rbps", "wbps", "riops", "wiops"
+};
+
+/*-------------------------------------------------------------*/
+/*-----------------   Token Bucket Functions   ----------------*/
+/*-------------------------------------------------------------*/
+
+/* Compute a * b / c without overflowing the intermediate product */
+static u64 fmd_qos_scale(u64 a, u64 b, u64 c)
+{
+	u64 rem;
+	u64 q;
+
+	/* Keep the remainder product below 2^64 for very large divisors */
+	while (c > (1ULL << 32)) {
+		a >>= 1;
+		c >>= 1;
+	}
+
+	q = div64_u64_rem(a, c, &rem);
+	return q * b + div64_u64(rem * b, c);
+}
+
+static int fmd_qos_bucket_init(struct fmd_qos_bucket_t *b)
+{
+	spin_lock_init(&b->lock);
+	b->rate = 0;
+	b->cache = alloc_percpu(u64);
+	if (!b->cache)
+		return -ENOMEM;
+	return 0;
+}
+
+static void fmd_qos_bucket_free(struct fmd_qos_bucket_t *b)
+{
+	free_percpu(b->cache);
+	b->cache = NULL;
+}
+
+/* Change the rate of a bucket and start it out full */
+static void fmd_qos_bucket_set(struct fmd_qos_bucket_t *b, u64 rate)
+{
+	int cpu;
+
+	spin_lock(&b->lock);
+	b->burst = max_t(u64, div_u64(rate, FMD_QOS_BURST_DIV), 1);
+	b->batch = min_t(u64, div_u64(rate, FMD_QOS_BATCH_DIV),
+			 div_u64(b->burst, num_possible_cpus()));
+	b->tokens = b->burst;
+	b->last_ns = ktime_get_ns();
+
+	/* Racy against a CPU spending its cache, which at worst gains or
+	 * loses one batch of tokens across the change */
+	for_each_possible_cpu(cpu)
+		*per_cpu_ptr(b->cache, cpu) = 0;
+
+	WRITE_ONCE(b->rate, rate);
+	spin_unlock(&b->lock);
+}
+
+/*
+ * Add the tokens accumulated since the last refill, paying off any debt
+ * first.  Caller holds b->lock.
+ */
+static void fmd_qos_bucket_refill(struct fmd_qos_bucket_t *b, u64 now)
+{
+	u64 elapsed = now - b->last_ns;
+	u64 full;
+
+	b->last_ns = now;
+	if (b->tokens >= (s64) b->burst)
+		return;
+	if (!b->rate) {
+		b->tokens = b->burst;
+		return;
+	}
+
+	/* Past the time to refill up to burst the bucket is full, which
+	 * also keeps rate * elapsed in range */
+	full = fmd_qos_scale(b->burst - b->tokens, NSEC_PER_SEC, b->rate);
+	if (elapsed >= full) {
+		b->tokens = b->burst;
+		return;
+	}
+
+	b->tokens += b->rate * div64_u64_rem(elapsed, NSEC_PER_SEC, &elapsed);
+	b->tokens += fmd_qos_scale(b->rate, elapsed, NSEC_PER_SEC);
+	if (b->tokens > (s64) b->burst)
+		b->tokens = b->burst;
+}
+
+/*
+ * Charge cost tokens to the bucket.
+ * Returns the number of ns the caller must wait for the bucket to recover.
+ */
+static u64 fmd_qos_bucket_charge(struct fmd_qos_bucket_t *b, u64 cost)
+{
+	u64 *local;
+	u64 wait = 0;
+
+	if (!READ_ONCE(b->rate))
+		return 0;
+
+	/* Fast path: spend tokens this CPU already holds */
+	local = get_cpu_ptr(b->cache);
+	if (*local >= cost) {
+		*local -= cost;
+		put_cpu_ptr(b->cache);
+		return 0;
+	}
+	cost -= *local;
+	*local = 0;
+
+	/* Slow path: take the cost plus a new batch from the shared bucket */
+	spin_lock(&b->lock);
+	fmd_qos_bucket_refill(b, ktime_get_ns());
+	if (b->tokens >= (s64) (cost + b->batch)) {
+		b->tokens -= cost + b->batch;
+		*local = b->batch;
+	} else {
+		b->tokens -= cost;
+		if (b->tokens < 0)
+			wait = fmd_qos_scale(-b->tokens, NSEC_PER_SEC, b->rate);
+	}
+	spin_unlock(&b->lock);
+	put_cpu_ptr(b->cache);
+
+	return wait;
+}
+
+/* Give back the tokens of a charge whose bio isn't processed after all */
+static void fmd_qos_bucket_refund(struct fmd_qos_bucket_t *b, u64 cost)
+{
+	if (!READ_ONCE(b->rate))
+		return;
+
+	spin_lock(&b->lock);
+	b->tokens = min_t(s64, b->tokens + cost, b->burst);
+	spin_unlock(&b->lock);
+}
+
+/*-------------------------------------------------------------*/
+/*-----------------   Cgroup Limit Functions   ----------------*/
+/*-------------------------------------------------------------*/
+
+static void fmd_qos_group_free(struct fmd_qos_group_t *grp)
+{
+	int i;
+
+	for (i = 0; i < FMD_QOS_NR_BUCKETS; i++)
+		fmd_qos_bucket_free(&grp->bucket[i]);
+	kfree(grp);
+}
+
+static void fmd_qos_group_free_rcu(struct rcu_head *rcu)
+{
+	fmd_qos_group_free(container_of(rcu, struct fmd_qos_group_t, rcu));
+}
+
+static struct fmd_qos_group_t *fmd_qos_group_alloc(u64 ino)
+{
+	struct fmd_qos_group_t *grp;
+	int i;
+
+	grp = kzalloc(sizeof(struct fmd_qos_group_t), GFP_KERNEL);
+	if (!grp)
+		return NULL;
+
+	grp->ino = ino;
+	for (i = 0; i < FMD_QOS_NR_BUCKETS; i++) {
+		if (fmd_qos_bucket_init(&grp->bucket[i])) {
+			fmd_qos_group_free(grp);
+			return NULL;
+		}
+	}
+	return grp;
+}
+
+/* Caller holds rcu_read_lock or qos->groups_mutex */
+static struct fmd_qos_group_t *fmd_qos_group_find(struct fmd_qos_t *qos, u64 ino)
+{
+	struct fmd_qos_group_t *grp;
+
+	hash_for_each_possible_rcu(qos->groups, grp, node, ino) {
+		if (grp->ino == ino)
+			return grp;
+	}
+	return NULL;
+}
+
+#if FMD_QOS_BLKCG
+/* Identify the bio's blkcg by its cgroup inode, as seen in cgroupfs.  A
+ * bio without one is charged to the root blkcg */
+static u64 fmd_qos_bio_ino(struct bio *bio)
+{
+	struct blkcg *blkcg;
+	u64 ino;
+
+	rcu_read_lock();
+	blkcg = bio_blkcg(bio);
+	if (!blkcg)
+		blkcg = &blkcg_root;
+	ino = cgroup_ino(blkcg->css.cgroup);
+	rcu_read_unlock();
+
+	return ino;
+}
+#endif
+
+/*-------------------------------------------------------------*/
+/*-------------------   I/O Path Functions   ------------------*/
+/*-------------------------------------------------------------*/
+
+static void fmd_qos_sleep(u64 ns)
+{
+	unsigned long us = div_u64(ns, NSEC_PER_USEC);
+
+	if (!us)
+		return;
+	if (us <= 20000)
+		usleep_range(us, us + (us >> 3) + 1);
+	else
+		msleep(DIV_ROUND_UP(us, USEC_PER_MSEC));
+}
+
+static u64 fmd_qos_charge(struct fmd_qos_bucket_t *bucket, int is_write,
+		unsigned int bytes)
+{
+	u64 bps_wait, iops_wait;
+
+	bps_wait = fmd_qos_bucket_charge(&bucket[is_write ? FMD_QOS_WRITE_BPS :
+					 FMD_QOS_READ_BPS], bytes);
+	iops_wait = fmd_qos_bucket_charge(&bucket[is_write ? FMD_QOS_WRITE_IOPS :
+					  FMD_QOS_READ_IOPS], 1);
+	return max(bps_wait, iops_wait);
+}
+
+static void fmd_qos_refund(struct fmd_qos_bucket_t *bucket, int is_write,
+		unsigned int bytes)
+{
+	fmd_qos_bucket_refund(&bucket[is_write ? FMD_QOS_WRITE_BPS :
+			      FMD_QOS_READ_BPS], bytes);
+	fmd_qos_bucket_refund(&bucket[is_write ? FMD_QOS_WRITE_IOPS :
+			      FMD_QOS_READ_IOPS], 1);
+}
+
+/*
+ * Charge a bio against the device and blkcg limits, sleeping until the
+ * submitter is back within its rate.  Called before the bio is processed.
+ * A nowait bio over its rate is not charged and gets -EAGAIN instead.
+ * Empty bios, such as a bare flush, aren't charged.
+ */
+int fmd_qos_throttle(struct fmd_device_t *fmd, struct bio *bio, int is_write,
+		unsigned int bytes, bool nowait)
+{
+	struct fmd_qos_t *qos = (struct fmd_qos_t *) fmd->qos;
+	u64 wait;
+
+	if (!bytes)
+		return 0;
+
+	wait = fmd_qos_charge(qos->bucket, is_write, bytes);
+
+#if FMD_QOS_BLKCG
+	if (READ_ONCE(qos->nr_groups)) {
+		struct fmd_qos_group_t *grp;
+		u64 grp_wait;
+
+		rcu_read_lock();
+		grp = fmd_qos_group_find(qos, fmd_qos_bio_ino(bio));
+		if (grp) {
+			grp_wait = fmd_qos_charge(grp->bucket, is_write, bytes);
+			if (nowait && (wait || grp_wait))
+				fmd_qos_refund(grp->bucket, is_write, bytes);
+			wait = max(wait, grp_wait);
+		}
+		rcu_read_unlock();
+	}
+#endif
+
+	if (!wait)
+		return 0;
+	if (nowait) {
+		fmd_qos_refund(qos->bucket, is_write, bytes);
+		return -EAGAIN;
+	}
+
+	atomic64_inc(&qos->nr_throttled);
+	atomic64_add(wait, &qos->throttled_ns);
+	fmd_qos_sleep(wait);
+	return 0;
+}
+
+/*-------------------------------------------------------------*/
+/*---------------   Initialization Functions   ----------------*/
+/*-------------------------------------------------------------*/
+
+int fmd_qos_init(struct fmd_device_t *fmd)
+{
+	struct fmd_qos_t *qos;
+	int i;
+
+	BUG_ON(!fmd);
+	printk(KERN_INFO "%s: %s\n", fmd->dev_name, __func__);
+
+	qos = kzalloc(sizeof(struct fmd_qos_t), GFP_KERNEL);
+	if (!qos)
+		return -ENOMEM;
+	fmd->qos = qos;
+
+	mutex_init(&qos->groups_mutex);
+	hash_init(qos->groups);
+	for (i = 0; i < FMD_QOS_NR_BUCKETS; i++) {
+		if (fmd_qos_bucket_init(&qos->bucket[i])) {
+			fmd_qos_cleanup(fmd);
+			return -ENOMEM;
+		}
+	}
+
+	return 0;
+}
+
+void fmd_qos_cleanup(struct fmd_device_t *fmd)
+{
+	struct fmd_qos_t *qos = (struct fmd_qos_t *) fmd->qos;
+	struct fmd_qos_group_t *grp;
+	struct hlist_node *tmp;
+	int i;
+
+	printk(KERN_INFO "%s: %s\n", fmd->dev_name, __func__);
+
+	if (!qos)
+		return;
+
+	/* Wait for groups removed through sysfs, then free the rest
+	 * immediately since no I/O can be in flight */
+	rcu_barrier();
+	hash_for_each_safe(qos->groups, i, tmp, grp, node) {
+		hash_del(&grp->node);
+		fmd_qos_group_free(grp);
+	}
+	for (i = 0; i < FMD_QOS_NR_BUCKETS; i++)
+		fmd_qos_bucket_free(&qos->bucket[i]);
+
+	kfree(qos);
+	fmd->qos = NULL;
+}
+
+/*-------------------------------------------------------------*/
+/*--------------------   Sysfs Functions   --------------------*/
+/*-------------------------------------------------------------*/
+
+static ssize_t fmd_qos_limit_show(struct fmd_device_t *fmd, int slot, char *buf)
+{
+	struct fmd_qos_t *qos = (struct fmd_qos_t *) fmd->qos;
+
+	return sprintf(buf, "%llu\n", READ_ONCE(qos->bucket[slot].rate));
+}
+
+static ssize_t fmd_qos_limit_store(struct fmd_device_t *fmd, int slot,
+		const char *buf, size_t len)
+{
+	struct fmd_qos_t *qos = (struct fmd_qos_t *) fmd->qos;
+	u64 rate;
+	int err;
+
+	err = kstrtoull(buf, 0, &rate);
+	if (err)
+		return err;
+
+	fmd_qos_bucket_set(&qos->bucket[slot], rate);
+	printk(KERN_INFO "%s: %s: %s=%llu\n", fmd->dev_name, __func__,
+	       fmd_qos_bucket_names[slot], rate);
+	return len;
+}
+
+#define FMD_QOS_LIMIT_ATTR(_name, _slot)					\
+static ssize_t _name##_show(struct device *dev,					\
+		struct device_attribute *attr, char *buf)			\
+{										\
+	return fmd_qos_limit_show(fmd_from_dev(dev), _slot, buf);		\
+}										\
+static ssize_t _name##_store(struct device *dev,				\
+		struct device_attribute *attr, const char *buf, size_t len)	\
+{										\
+	return fmd_qos_limit_store(fmd_from_dev(dev), _slot, buf, len);	\
+}										\
+static DEVICE_ATTR_RW(_name)
+
+FMD_QOS_LIMIT_ATTR(read_bps, FMD_QOS_READ_BPS);
+FMD_QOS_LIMIT_ATTR(write_bps, FMD_QOS_WRITE_BPS);
+FMD_QOS_LIMIT_ATTR(read_iops, FMD_QOS_READ_IOPS);
+FMD_QOS_LIMIT_ATTR(write_iops, FMD_QOS_WRITE_IOPS);
+
+/* One line per cgroup: "<cgroup ino> <rbps> <wbps> <riops> <wiops>" */
+static ssize_t cgroup_limits_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct fmd_device_t *fmd = fmd_from_dev(dev);
+	struct fmd_qos_t *qos = (struct fmd_qos_t *) fmd->qos;
+	struct fmd_qos_group_t *grp;
+	ssize_t len = 0;
+	int bkt, i;
+
+	mutex_lock(&qos->groups_mutex);
+	hash_for_each(qos->groups, bkt, grp, node) {
+		len += scnprintf(buf + len, PAGE_SIZE - len, "%llu", grp->ino);
+		for (i = 0; i < FMD_QOS_NR_BUCKETS; i++)
+			len += scnprintf(buf + len, PAGE_SIZE - len, " %llu",
+					 grp->bucket[i].rate);
+		len += scnprintf(buf + len, PAGE_SIZE - len, "\n");
+	}
+	mutex_unlock(&qos->groups_mutex);
+
+	return len;
+}
+
+/* Set a cgroup's limits with the same format.  All zero limits remove it */
+static ssize_t cgroup_limits_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t len)
+{
+	struct fmd_device_t *fmd = fmd_from_dev(dev);
+	struct fmd_qos_t *qos = (struct fmd_qos_t *) fmd->qos;
+	struct fmd_qos_group_t *grp;
+	u64 ino, rate[FMD_QOS_NR_BUCKETS];
+	bool unlimited = true;
+	int i;
+
+	if (!FMD_QOS_BLKCG)
+		return -EOPNOTSUPP;
+
+	if (sscanf(buf, "%llu %llu %llu %llu %llu", &ino, &rate[0], &rate[1],
+		   &rate[2], &rate[3]) != 5)
+		return -EINVAL;
+	for (i = 0; i < FMD_QOS_NR_BUCKETS; i++)
+		if (rate[i])
+			unlimited = false;
+
+	mutex_lock(&qos->groups_mutex);
+	grp = fmd_qos_group_find(qos, ino);
+	if (unlimited) {
+		if (grp) {
+			hash_del_rcu(&grp->node);
+			WRITE_ONCE(qos->nr_groups, qos->nr_groups - 1);
+			call_rcu(&grp->rcu, fmd_qos_group_free_rcu);
+		}
+		mutex_unlock(&qos->groups_mutex);
+		return len;
+	}
+
+	if (!grp) {
+		grp = fmd_qos_group_alloc(ino);
+		if (!grp) {
+			mutex_unlock(&qos->groups_mutex);
+			return -ENOMEM;
+		}
+		for (i = 0; i < FMD_QOS_NR_BUCKETS; i++)
+			fmd_qos_bucket_set(&grp->bucket[i], rate[i]);
+		hash_add_rcu(qos->groups, &grp->node, ino);
+		WRITE_ONCE(qos->nr_groups, qos->nr_groups + 1);
+	} else {
+		for (i = 0; i < FMD_QOS_NR_BUCKETS; i++)
+			fmd_qos_bucket_set(&grp->bucket[i], rate[i]);
+	}
+	mutex_unlock(&qos->groups_mutex);
+
+	printk(KERN_INFO "%s: %s: cgroup %llu rbps=%llu wbps=%llu riops=%llu wiops=%llu\n",
+	       fmd->dev_name, __func__, ino, rate[0], rate[1], rate[2], rate[3]);
+	return len;
+}
+static DEVICE_ATTR_RW(cgroup_limits);
+
+/* "<nr throttled bios> <total ns slept>" */
+static ssize_t throttled_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct fmd_device_t *fmd = fmd_from_dev(dev);
+	struct fmd_qos_t *qos = (struct fmd_qos_t *) fmd->qos;
+
+	return sprintf(buf, "%lld %lld\n", (long long) atomic64_read(&qos->nr_throttled),
+		       (long long) atomic64_read(&qos->throttled_ns));
+}
+static DEVICE_ATTR_RO(throttled);
+
+static struct attribute *fmd_qos_attrs[] = {
+	&dev_attr_read_bps.attr,
+	&dev_attr_write_bps.attr,
+	&dev_attr_read_iops.attr,
+	&dev_attr_write_iops.attr,
+	&dev_attr_cgroup_limits.attr,
+	&dev_attr_throttled.attr,
+	NULL,
+};
+
+const struct attribute_group fmd_qos_attr_group = {
+	.name = "qos",
+	.attrs = fmd_qos_attrs,
+};
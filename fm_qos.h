@@ -0,0 +1,98 @@
+/*************************************************************************
+ *
+ * Fusion Memory Confidential
+ * __________________
+ *
+ *  Fusion Memory Incorporated
+ *  All Rights Reserved.
+ *
+ * NOTICE:  All information contained herein is, and remains
+ * the property of Fusion Memory and its suppliers, if any.
+ * The intellectual and technical concepts contained herein are
+ * proprietary to Fusion Memory and its suppliers and may be covered by
+ * U.S. and Foreign Patents, patents in process, and are protected by
+ * trade secret or copyright law. Dissemination of this information or
+ * reproduction of this material is strictly forbidden unless prior
+ * written permission is obtained from Fusion Memory.
+ */
+
+#ifndef FM_QOS_H
+#define FM_QOS_H
+
+#include <linux/version.h>
+#include <linux/spinlock.h>
+#include <linux/mutex.h>
+#include <linux/atomic.h>
+#include <linux/percpu.h>
+#include <linux/hashtable.h>
+#include <linux/sysfs.h>
+#include "fm_dsk.h"
+
+struct bio;
+
+/* blkcg limits need the bio's css and cgroup_ino() */
+#if defined(CONFIG_BLK_CGROUP) && LINUX_VERSION_CODE >= KERNEL_VERSION(4,5,0)
+#define FMD_QOS_BLKCG 1
+#else
+#define FMD_QOS_BLKCG 0
+#endif
+
+/* Bucket slots, indexed by direction and unit */
+#define FMD_QOS_READ_BPS	0
+#define FMD_QOS_WRITE_BPS	1
+#define FMD_QOS_READ_IOPS	2
+#define FMD_QOS_WRITE_IOPS	3
+#define FMD_QOS_NR_BUCKETS	4
+
+#define FMD_QOS_BURST_DIV	10	/* bucket depth = 100ms of tokens */
+#define FMD_QOS_BATCH_DIV	256	/* per-CPU refill = ~4ms of tokens */
+#define FMD_QOS_GROUP_BITS	4	/* blkcg hash table size (1 << bits) */
+
+/*
+ * Token bucket.  Tokens are bytes or I/Os depending on the slot.
+ *
+ * The shared bucket is refilled lazily from the elapsed time whenever a
+ * CPU runs out of locally cached tokens.  Each CPU then takes a batch of
+ * tokens at once so that the common case is a per-CPU subtraction with no
+ * shared cache line touched.  The shared count may go negative; the
+ * submitter that drives it negative sleeps off the debt.
+ */
+struct fmd_qos_bucket_t {
+	spinlock_t lock;
+	u64 rate;		/* tokens per second, 0 = unlimited */
+	u64 burst;		/* max tokens held by the shared bucket */
+	u64 batch;		/* tokens moved into a per-CPU cache at once */
+	s64 tokens;		/* shared tokens available (negative = debt) */
+	u64 last_ns;		/* time of last refill */
+	u64 __percpu *cache;	/* per-CPU cached tokens */
+};
+
+/* Limits applied to the bios of a single blkcg */
+struct fmd_qos_group_t {
+	struct hlist_node node;
+	struct rcu_head rcu;
+	u64 ino;		/* cgroup inode number */
+	struct fmd_qos_bucket_t bucket[FMD_QOS_NR_BUCKETS];
+};
+
+struct fmd_qos_t {
+	struct fmd_qos_bucket_t bucket[FMD_QOS_NR_BUCKETS];
+
+	/* Per-cgroup limits, looked up under RCU in the I/O path */
+	struct mutex groups_mutex;
+	DECLARE_HASHTABLE(groups, FMD_QOS_GROUP_BITS);
+	unsigned int nr_groups;
+
+	/* Statistics */
+	atomic64_t nr_throttled;
+	atomic64_t throttled_ns;
+};
+
+int fmd_qos_init(struct fmd_device_t *fmd);
+void fmd_qos_cleanup(struct fmd_device_t *fmd);
+int fmd_qos_throttle(struct fmd_device_t *fmd, struct bio *bio, int is_write,
+		unsigned int bytes, bool nowait);
+
+extern const struct attribute_group fmd_qos_attr_group;
+
+#endif /* FM_QOS_H */
@@ -0,0 +1,336 @@
+/*************************************************************************
+ *
+ * Fusion Memory Confidential
+ * __________________
+ *
+ *  Fusion Memory Incorporated
+ *  All Rights Reserved.
+ *
+ * NOTICE:  All information contained herein is, and remains
+ * the property of Fusion Memory and its suppliers, if any.
+ * The intellectual and technical concepts contained herein are
+ * proprietary to Fusion Memory and its suppliers and may be covered by
+ * U.S. and Foreign Patents, patents in process, and are protected by
+ * trade secret or copyright law. Dissemination of this information or
+ * reproduction of this material is strictly forbidden unless prior
+ * written permission is obtained from Fusion Memory.
+ */
+
+/*
+ * fm_split - Parallel copy of large bios
+ *
+ * A single large bio would otherwise be copied by the submitting CPU
+ * alone, at one core's copy bandwidth.  Bios larger than the threshold
+ * are cut into chunks that end on multiples of the chunk size in the
+ * device.  The submitter copies the first chunk and queues the others
+ * on an unbound workqueue, each on the NUMA node of the memory it
+ * copies, then waits for them.  So the bio still completes in
+ * fmd_make_request, after all of its chunks are copied.
+ */
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/cpumask.h>
+#include <linux/math64.h>
+#include "fm_dsk.h"
+#include "fm_mem.h"
+#include "fm_cache.h"
+#include "fm_stripe.h"
+#include "fm_split.h"
+#include "fm_sysfs.h"
+
+#if FMD_SPLIT
+
+/*-------------------------------------------------------------*/
+/*--------------------   I/O Functions   ----------------------*/
+/*-------------------------------------------------------------*/
+
+struct fmd_split_io_t;
+
+struct fmd_split_chunk_t {
+	struct work_struct work;
+	struct fmd_split_io_t *io;
+	struct bvec_iter iter;
+};
+
+/* A bio being copied in chunks.  The first error of any chunk fails it */
+struct fmd_split_io_t {
+	struct fmd_device_t *fmd;
+	struct bio *bio;
+	fmd_split_fn_t *fn;
+	bool write;
+	int mode;
+	int err;
+	atomic_t pending;
+	struct completion done;
+	struct fmd_split_chunk_t chunk[];
+};
+
+static void fmd_split_chunk_done(struct fmd_split_io_t *io, int err)
+{
+	if (err)
+		cmpxchg(&io->err, 0, err);
+	if (atomic_dec_and_test(&io->pending))
+		complete(&io->done);
+}
+
+static void fmd_split_work(struct work_struct *work)
+{
+	struct fmd_split_chunk_t *c = container_of(work, struct fmd_split_chunk_t, work);
+	struct fmd_split_io_t *io = c->io;
+
+	fmd_split_chunk_done(io, io->fn(io->fmd, io->bio, c->iter, io->write, io->mode));
+}
+
+/* NUMA node of the memory holding sector, NUMA_NO_NODE if unknown */
+static int fmd_split_node(struct fmd_device_t *fmd, sector_t sector)
+{
+	struct fmd_split_t *split = (struct fmd_split_t *) fmd->split;
+	struct fmd_stripe_t *stripe = (struct fmd_stripe_t *) fmd->stripe;
+	u32 m;
+
+	if (!stripe)
+		return split->node;
+
+	div_u64_rem(((u64) sector << SECTOR_SHIFT) >> stripe->unit_shift,
+		    stripe->nr_members, &m);
+	return stripe->member[m].node;
+}
+
+static void fmd_split_queue(struct fmd_split_t *split, int node,
+			    struct work_struct *work)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,0,0)
+	if (node != NUMA_NO_NODE) {
+		queue_work_node(node, split->wq, work);
+		return;
+	}
+#endif
+	queue_work(split->wq, work);
+}
+
+/*
+ * Copy a bio with fn, in parallel chunks if it is larger than the
+ * threshold.  Falls back to copying the whole bio on the submitting CPU
+ * if the chunks can't be allocated.  May sleep.  Returns the first error
+ * fn returned.
+ */
+int fmd_split_bio(struct fmd_device_t *fmd, struct bio *bio, fmd_split_fn_t *fn,
+		bool write, int mode)
+{
+	struct fmd_split_t *split = (struct fmd_split_t *) fmd->split;
+	struct bvec_iter iter = bio->bi_iter;
+	struct fmd_split_io_t *io;
+	struct fmd_split_chunk_t *c;
+	unsigned int threshold, chunk, nr, len, i;
+	u32 in;
+	int err;
+
+	threshold = split ? READ_ONCE(split->threshold) : 0;
+	if (!threshold || iter.bi_size <= threshold || num_online_cpus() < 2)
+		return fn(fmd, bio, iter, write, mode);
+
+	/* Cap the number of chunks by making them larger */
+	chunk = max_t(unsigned int, READ_ONCE(split->chunk),
+		      round_up(DIV_ROUND_UP(iter.bi_size, FMD_SPLIT_MAX_CHUNKS),
+			       PAGE_SIZE));
+	nr = DIV_ROUND_UP(iter.bi_size, chunk) + 1;
+
+	io = kmalloc(sizeof(*io) + nr * sizeof(io->chunk[0]), GFP_NOIO);
+	if (!io)
+		return fn(fmd, bio, iter, write, mode);
+
+	io->fmd = fmd;
+	io->bio = bio;
+	io->fn = fn;
+	io->write = write;
+	io->mode = mode;
+	io->err = 0;
+	init_completion(&io->done);
+
+	/* Chunks end on multiples of chunk in the device, so none splits a
+	 * cache page or stripe unit it doesn't have to */
+	div_u64_rem((u64) iter.bi_sector << SECTOR_SHIFT, chunk, &in);
+	len = chunk - in;
+	for (nr = 0; iter.bi_size; nr++) {
+		c = &io->chunk[nr];
+		c->io = io;
+		c->iter = iter;
+		c->iter.bi_size = min(len, iter.bi_size);
+		bio_advance_iter(bio, &iter, c->iter.bi_size);
+		len = chunk;
+	}
+
+	atomic_set(&io->pending, nr);
+	for (i = 1; i < nr; i++) {
+		c = &io->chunk[i];
+		INIT_WORK(&c->work, fmd_split_work);
+		fmd_split_queue(split, fmd_split_node(fmd, c->iter.bi_sector),
+				&c->work);
+	}
+
+	/* Copy the first chunk while the workers copy the rest */
+	fmd_split_chunk_done(io, fn(fmd, bio, io->chunk[0].iter, write, mode));
+	wait_for_completion(&io->done);
+
+	err = io->err;
+	kfree(io);
+
+	atomic64_inc(&split->nr_split);
+	atomic64_add(nr, &split->nr_chunks);
+	return err;
+}
+
+/*-------------------------------------------------------------*/
+/*-----------------   Init/Cleanup Functions   ----------------*/
+/*-------------------------------------------------------------*/
+
+int fmd_split_init(struct fmd_device_t *fmd, unsigned int split_kb,
+		unsigned int chunk_kb)
+{
+	struct fmd_split_t *split;
+
+	BUG_ON(!fmd);
+	printk(KERN_INFO "%s: %s\n", fmd->dev_name, __func__);
+
+	if (split_kb > UINT_MAX >> 10 || chunk_kb > UINT_MAX >> 10)
+		return -EINVAL;
+
+	split = kzalloc(sizeof(struct fmd_split_t), GFP_KERNEL);
+	if (!split)
+		return -ENOMEM;
+
+	split->threshold = split_kb << 10;
+	split->chunk = max_t(unsigned int, round_down(chunk_kb << 10, PAGE_SIZE),
+			     PAGE_SIZE);
+#if CACHE_PAGES
+	split->node = ((struct fmd_cache_t *) fmd->cache)->node;
+#else
+	split->node = fmd_phys_to_node(fmd->phys);
+#endif
+
+	/* Chunks of writeback and swap bios must make progress under
+	 * memory pressure */
+	split->wq = alloc_workqueue("%s_split", WQ_UNBOUND | WQ_MEM_RECLAIM, 0,
+				    fmd->dev_name);
+	if (!split->wq) {
+		kfree(split);
+		return -ENOMEM;
+	}
+
+	fmd->split = split;
+	return 0;
+}
+
+void fmd_split_cleanup(struct fmd_device_t *fmd)
+{
+	struct fmd_split_t *split = (struct fmd_split_t *) fmd->split;
+
+	printk(KERN_INFO "%s: %s\n", fmd->dev_name, __func__);
+
+	if (!split)
+		return;
+
+	destroy_workqueue(split->wq);
+	kfree(split);
+	fmd->split = NULL;
+}
+
+#endif /* FMD_SPLIT */
+
+/*-------------------------------------------------------------*/
+/*--------------------   Sysfs Functions   --------------------*/
+/*-------------------------------------------------------------*/
+
+static ssize_t threshold_kb_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct fmd_split_t *split = (struct fmd_split_t *) fmd_from_dev(dev)->split;
+
+	if (!split)
+		return -ENODEV;
+	return sprintf(buf, "%u\n", READ_ONCE(split->threshold) >> 10);
+}
+
+static ssize_t threshold_kb_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t len)
+{
+	struct fmd_device_t *fmd = fmd_from_dev(dev);
+	struct fmd_split_t *split = (struct fmd_split_t *) fmd->split;
+	unsigned int val;
+	int err;
+
+	if (!split)
+		return -ENODEV;
+
+	err = kstrtouint(buf, 0, &val);
+	if (err)
+		return err;
+	if (val > UINT_MAX >> 10)
+		return -EINVAL;
+
+	WRITE_ONCE(split->threshold, val << 10);
+	printk(KERN_INFO "%s: %s: %u KB\n", fmd->dev_name, __func__, val);
+	return len;
+}
+static DEVICE_ATTR_RW(threshold_kb);
+
+static ssize_t chunk_kb_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct fmd_split_t *split = (struct fmd_split_t *) fmd_from_dev(dev)->split;
+
+	if (!split)
+		return -ENODEV;
+	return sprintf(buf, "%u\n", READ_ONCE(split->chunk) >> 10);
+}
+
+/* A multiple of the page size */
+static ssize_t chunk_kb_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t len)
+{
+	struct fmd_device_t *fmd = fmd_from_dev(dev);
+	struct fmd_split_t *split = (struct fmd_split_t *) fmd->split;
+	unsigned int val;
+	int err;
+
+	if (!split)
+		return -ENODEV;
+
+	err = kstrtouint(buf, 0, &val);
+	if (err)
+		return err;
+	if (!val || val > UINT_MAX >> 10 || (val << 10) & (PAGE_SIZE - 1))
+		return -EINVAL;
+
+	WRITE_ONCE(split->chunk, val << 10);
+	printk(KERN_INFO "%s: %s: %u KB\n", fmd->dev_name, __func__, val);
+	return len;
+}
+static DEVICE_ATTR_RW(chunk_kb);
+
+/* "<bios split> <chunks>" */
+static ssize_t split_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct fmd_split_t *split = (struct fmd_split_t *) fmd_from_dev(dev)->split;
+
+	if (!split)
+		return -ENODEV;
+	return sprintf(buf, "%lld %lld\n", (long long) atomic64_read(&split->nr_split),
+		       (long long) atomic64_read(&split->nr_chunks));
+}
+static DEVICE_ATTR_RO(split);
+
+static struct attribute *fmd_split_attrs[] = {
+	&dev_attr_threshold_kb.attr,
+	&dev_attr_chunk_kb.attr,
+	&dev_attr_split.attr,
+	NULL,
+};
+
+const struct attribute_group fmd_split_attr_group = {
+	.name = "split",
+	.attrs = fmd_split_attrs,
+};
@@ -0,0 +1,74 @@
+/*************************************************************************
+ *
+ * Fusion Memory Confidential
+ * __________________
+ *
+ *  Fusion Memory Incorporated
+ *  All Rights Reserved.
+ *
+ * NOTICE:  All information contained herein is, and remains
+ * the property of Fusion Memory and its suppliers, if any.
+ * The intellectual and technical concepts contained herein are
+ * proprietary to Fusion Memory and its suppliers and may be covered by
+ * U.S. and Foreign Patents, patents in process, and are protected by
+ * trade secret or copyright law. Dissemination of this information or
+ * reproduction of this material is strictly forbidden unless prior
+ * written permission is obtained from Fusion Memory.
+ */
+
+#ifndef FM_SPLIT_H
+#define FM_SPLIT_H
+
+#include <linux/version.h>
+#include <linux/blkdev.h>
+#include <linux/bio.h>
+#include <linux/atomic.h>
+#include <linux/completion.h>
+#include <linux/workqueue.h>
+#include <linux/sysfs.h>
+#include "fm_dsk.h"
+
+/* Chunks are described by a bvec_iter into the bio, which needs 3.14 */
+#define FMD_SPLIT	(LINUX_VERSION_CODE >= KERNEL_VERSION(3,14,0))
+
+#define FMD_SPLIT_KB_DEFAULT		1024	/* split bios larger than this */
+#define FMD_SPLIT_CHUNK_KB_DEFAULT	256
+#define FMD_SPLIT_MAX_CHUNKS		16	/* larger bios get larger chunks */
+
+struct fmd_split_t {
+	unsigned int threshold;		/* bytes, 0 = never split */
+	unsigned int chunk;		/* bytes, multiple of PAGE_SIZE */
+	int node;			/* of the memory bios are copied to/from */
+	struct workqueue_struct *wq;
+
+	/* Statistics */
+	atomic64_t nr_split;
+	atomic64_t nr_chunks;
+};
+
+#if FMD_SPLIT
+
+/* Copy the part of a bio described by iter */
+typedef int (fmd_split_fn_t)(struct fmd_device_t *fmd, struct bio *bio,
+			     struct bvec_iter iter, bool write, int mode);
+
+int fmd_split_init(struct fmd_device_t *fmd, unsigned int split_kb,
+		unsigned int chunk_kb);
+void fmd_split_cleanup(struct fmd_device_t *fmd);
+int fmd_split_bio(struct fmd_device_t *fmd, struct bio *bio, fmd_split_fn_t *fn,
+		bool write, int mode);
+
+#else  /* !FMD_SPLIT */
+
+static inline int fmd_split_init(struct fmd_device_t *fmd, unsigned int split_kb,
+		unsigned int chunk_kb)
+{
+	return 0;
+}
+static inline void fmd_split_cleanup(struct fmd_device_t *fmd) { }
+
+#endif /* FMD_SPLIT */
+
+extern const struct attribute_group fmd_split_attr_group;
+
+#endif /* FM_SPLIT_H */
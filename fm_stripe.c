@@ -0,0 +1,87 @@
+/*************************************************************************
+ *
+ * Fusion Memory Confidential
+ * __________________
+ *
+ *  Fusion Memory Incorporated
+ *  All Rights Reserved.
+ *
+ * NOTICE:  All information contained herein is, and remains
+ * the property of Fusion Memory and its suppliers, if any.
+ * The intellectual and technical concepts contained herein are
+ * proprietary to Fusion Memory and its suppliers and may be covered by
+ * U.S. and Foreign Patents, patents in process, and are protected by
+ * trade secret or copyright law. Dissemination of this information or
+ * reproduction of this material is strictly forbidden unless prior
+ * written permission is obtained from Fusion Memory.
+ */
+
+
+/*
+ * fm_stripe - Striping a device across several memory regions
+ *
+ * A single region is served by whichever memory controllers back its
+ * physical range.  A striped device spreads consecutive stripe units
+ * round robin over member regions, so large I/O is split across all of
+ * their channels.  Regions are discovered and mapped in fm_mem.c; the
+ * I/O path maps each copy through fmd_region_addr.
+ */
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/numa.h>
+#include "fm_dsk.h"
+#include "fm_stripe.h"
+#include "fm_sysfs.h"
+
+/*-------------------------------------------------------------*/
+/*--------------------   Sysfs Functions   --------------------*/
+/*-------------------------------------------------------------*/
+
+/* Stripe unit in bytes, 0 if the device is one contiguous region */
+static ssize_t stripe_unit_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct fmd_device_t *fmd = fmd_from_dev(dev);
+	struct fmd_stripe_t *stripe = (struct fmd_stripe_t *) fmd->stripe;
+
+	return sprintf(buf, "%lu\n", stripe ? 1UL << stripe->unit_shift : 0);
+}
+static DEVICE_ATTR_RO(stripe_unit);
+
+/* One line per region: "<phys addr> <bytes> <NUMA node, -1 = unknown>" */
+static ssize_t members_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct fmd_device_t *fmd = fmd_from_dev(dev);
+	struct fmd_stripe_t *stripe = (struct fmd_stripe_t *) fmd->stripe;
+	struct fmd_stripe_member_t *member;
+	ssize_t len = 0;
+	unsigned int i;
+
+	if (!stripe)
+		return sprintf(buf, "0x%llx %llu %d\n", (u64) fmd->phys,
+			       (u64) fmd->nr_pages << PAGE_SHIFT, NUMA_NO_NODE);
+
+	for (i = 0; i < stripe->nr_members; i++) {
+		member = &stripe->member[i];
+		len += scnprintf(buf + len, PAGE_SIZE - len, "0x%llx %llu %d\n",
+				 (u64) member->phys,
+				 (u64) member->nr_pages << PAGE_SHIFT,
+				 member->node);
+	}
+
+	return len;
+}
+static DEVICE_ATTR_RO(members);
+
+static struct attribute *fmd_stripe_attrs[] = {
+	&dev_attr_stripe_unit.attr,
+	&dev_attr_members.attr,
+	NULL,
+};
+
+const struct attribute_group fmd_stripe_attr_group = {
+	.name = "stripe",
+	.attrs = fmd_stripe_attrs,
+};
@@ -0,0 +1,146 @@
+/*************************************************************************
+ *
+ * Fusion Memory Confidential
+ * __________________
+ *
+ *  Fusion Memory Incorporated
+ *  All Rights Reserved.
+ *
+ * NOTICE:  All information contained herein is, and remains
+ * the property of Fusion Memory and its suppliers, if any.
+ * The intellectual and technical concepts contained herein are
+ * proprietary to Fusion Memory and its suppliers and may be covered by
+ * U.S. and Foreign Patents, patents in process, and are protected by
+ * trade secret or copyright law. Dissemination of this information or
+ * reproduction of this material is strictly forbidden unless prior
+ * written permission is obtained from Fusion Memory.
+ */
+
+
+#ifndef FM_STRIPE_H
+#define FM_STRIPE_H
+
+#include <linux/kernel.h>
+#include <linux/math64.h>
+#include <linux/sysfs.h>
+#include "fm_dsk.h"
+#include "fm_copy.h"
+#include "fm_wipe.h"
+#include "fm_emul.h"
+#include "fm_backing.h"
+
+#define FMD_STRIPE_MAX			8	/* member regions */
+#define FMD_STRIPE_UNIT_KB_DEFAULT	64
+
+struct fmd_stripe_member_t {
+	phys_addr_t phys;
+	void __iomem *virt;
+	unsigned int nr_pages;
+	int node;			/* NUMA_NO_NODE if unknown */
+};
+
+/*
+ * A device striped across member regions.  Stripe unit n of the device
+ * is unit n / nr_members of member n % nr_members.
+ */
+struct fmd_stripe_t {
+	unsigned int nr_members;
+	unsigned int unit_shift;	/* log2 of the stripe unit in bytes */
+	struct fmd_stripe_member_t member[FMD_STRIPE_MAX];
+};
+
+/*
+ * Map byte offset off of the device to its address in the region that
+ * holds it.  *len is clipped so the range doesn't cross a stripe unit.
+ */
+static inline void __iomem *
+fmd_region_addr(struct fmd_device_t *fmd, u64 off, size_t *len)
+{
+	struct fmd_stripe_t *stripe = (struct fmd_stripe_t *) fmd->stripe;
+	size_t unit, in;
+	u64 row;
+	u32 m;
+
+	if (!stripe)
+		return fmd->virt + off;
+
+	unit = (size_t) 1 << stripe->unit_shift;
+	in = off & (unit - 1);
+	row = div_u64_rem(off >> stripe->unit_shift, stripe->nr_members, &m);
+	*len = min(*len, unit - in);
+	return stripe->member[m].virt + (row << stripe->unit_shift) + in;
+}
+
+/* Copy n bytes of the device from sector to dst */
+static inline void
+__fmd_region_read(struct fmd_device_t *fmd, void *dst, sector_t sector, size_t n)
+{
+	u64 off = (u64) sector << SECTOR_SHIFT;
+	void __iomem *src;
+	size_t len;
+
+	while (n) {
+		len = n;
+		src = fmd_region_addr(fmd, off, &len);
+		fmd_copy_from_io(fmd, dst, src, len);
+		dst += len;
+		off += len;
+		n -= len;
+	}
+}
+
+/* Copy n bytes from src to the device at sector */
+static inline void
+__fmd_region_write(struct fmd_device_t *fmd, sector_t sector, const void *src, size_t n)
+{
+	u64 off = (u64) sector << SECTOR_SHIFT;
+	void __iomem *dst;
+	size_t len;
+
+	while (n) {
+		len = n;
+		dst = fmd_region_addr(fmd, off, &len);
+		fmd_copy_to_io(fmd, dst, src, len);
+		src += len;
+		off += len;
+		n -= len;
+	}
+}
+
+/*
+ * As __fmd_region_read, but parts a wipe hasn't zeroed yet read as zeros,
+ * at the emulated speed of the media if set
+ */
+static inline void
+fmd_region_read(struct fmd_device_t *fmd, void *dst, sector_t sector, size_t n)
+{
+	u64 start = fmd_emul_begin(fmd);
+
+	if (unlikely(fmd_wipe_active(fmd)))
+		fmd_wipe_read(fmd, dst, sector, n);
+	else
+		__fmd_region_read(fmd, dst, sector, n);
+	fmd_emul_end(fmd, FMD_EMUL_DSK, FMD_EMUL_READ, start, n);
+}
+
+/*
+ * As __fmd_region_write, keeping track of what a wipe needn't zero and
+ * what a backing file must be sent
+ */
+static inline void
+fmd_region_write(struct fmd_device_t *fmd, sector_t sector, const void *src, size_t n)
+{
+	u64 start = fmd_emul_begin(fmd);
+
+	if (unlikely(fmd_wipe_active(fmd)))
+		fmd_wipe_write(fmd, sector, src, n);
+	else
+		__fmd_region_write(fmd, sector, src, n);
+	if (unlikely(fmd->backing))
+		fmd_backing_dirty(fmd, sector, n);
+	fmd_emul_end(fmd, FMD_EMUL_DSK, FMD_EMUL_WRITE, start, n);
+}
+
+extern const struct attribute_group fmd_stripe_attr_group;
+
+#endif /* FM_STRIPE_H */
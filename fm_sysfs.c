@@ -0,0 +1,80 @@
+/*************************************************************************
+ *
+ * Fusion Memory Confidential
+ * __________________
+ *
+ *  Fusion Memory Incorporated
+ *  All Rights Reserved.
+ *
+ * NOTICE:  All information contained herein is, and remains
+ * the property of Fusion Memory and its suppliers, if any.
+ * The intellectual and technical concepts contained herein are
+ * proprietary to Fusion Memory and its suppliers and may be covered by
+ * U.S. and Foreign Patents, patents in process, and are protected by
+ * trade secret or copyright law. Dissemination of this information or
+ * reproduction of this material is strictly forbidden unless prior
+ * written permission is obtained from Fusion Memory.
+ */
+
+
+/*
+ * fm_sysfs - Per-device sysfs attributes
+ *
+ * Each driver feature publishes its tunables and counters as a named
+ * attribute group, which appears as a subdirectory of the disk's sysfs
+ * device (i.e. /sys/block/fmdsk0/<group>/<attribute>).
+ */
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/blkdev.h>
+#include "fm_dsk.h"
+#include "fm_sysfs.h"
+#include "fm_cache.h"
+#include "fm_qos.h"
+#include "fm_copy.h"
+#include "fm_stripe.h"
+#include "fm_tier.h"
+#include "fm_split.h"
+#include "fm_zcache.h"
+#include "fm_wipe.h"
+#include "fm_emul.h"
+#include "fm_backing.h"
+
+static const struct attribute_group *fmd_attr_groups[] = {
+	&fmd_qos_attr_group,
+	&fmd_copy_attr_group,
+	&fmd_stripe_attr_group,
+	&fmd_tier_attr_group,
+	&fmd_split_attr_group,
+	&fmd_wipe_attr_group,
+	&fmd_emul_attr_group,
+	&fmd_backing_attr_group,
+#if CACHE_PAGES
+	&fmd_cache_attr_group,
+	&fmd_zcache_attr_group,
+#endif
+	NULL,
+};
+
+int fmd_sysfs_init(struct fmd_device_t *fmd)
+{
+	int err;
+
+	BUG_ON(!fmd || !fmd->disk);
+	printk(KERN_INFO "%s: %s\n", fmd->dev_name, __func__);
+
+	err = sysfs_create_groups(&disk_to_dev(fmd->disk)->kobj, fmd_attr_groups);
+	if (err)
+		printk(KERN_ERR "%s: %s: ERROR: Unable to create sysfs groups (%d)\n", fmd->dev_name, __func__, err);
+
+	return err;
+}
+
+void fmd_sysfs_exit(struct fmd_device_t *fmd)
+{
+	BUG_ON(!fmd || !fmd->disk);
+	printk(KERN_INFO "%s: %s\n", fmd->dev_name, __func__);
+
+	sysfs_remove_groups(&disk_to_dev(fmd->disk)->kobj, fmd_attr_groups);
+}
@@ -0,0 +1,36 @@
+/*************************************************************************
+ *
+ * Fusion Memory Confidential
+ * __________________
+ *
+ *  Fusion Memory Incorporated
+ *  All Rights Reserved.
+ *
+ * NOTICE:  All information contained herein is, and remains
+ * the property of Fusion Memory and its suppliers, if any.
+ * The intellectual and technical concepts contained herein are
+ * proprietary to Fusion Memory and its suppliers and may be covered by
+ * U.S. and Foreign Patents, patents in process, and are protected by
+ * trade secret or copyright law. Dissemination of this information or
+ * reproduction of this material is strictly forbidden unless prior
+ * written permission is obtained from Fusion Memory.
+ */
+
+#ifndef FM_SYSFS_H
+#define FM_SYSFS_H
+
+#include <linux/device.h>
+#include <linux/genhd.h>
+#include <linux/sysfs.h>
+#include "fm_dsk.h"
+
+/* Retrieve the fmd device that owns a gendisk's sysfs device */
+static inline struct fmd_device_t *fmd_from_dev(struct device *dev)
+{
+	return (struct fmd_device_t *) dev_to_disk(dev)->private_data;
+}
+
+int fmd_sysfs_init(struct fmd_device_t *fmd);
+void fmd_sysfs_exit(struct fmd_device_t *fmd);
+
+#endif /* FM_SYSFS_H */
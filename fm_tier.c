@@ -0,0 +1,550 @@
+/*************************************************************************
+ *
+ * Fusion Memory Confidential
+ * __________________
+ *
+ *  Fusion Memory Incorporated
+ *  All Rights Reserved.
+ *
+ * NOTICE:  All information contained herein is, and remains
+ * the property of Fusion Memory and its suppliers, if any.
+ * The intellectual and technical concepts contained herein are
+ * proprietary to Fusion Memory and its suppliers and may be covered by
+ * U.S. and Foreign Patents, patents in process, and are protected by
+ * trade secret or copyright law. Dissemination of this information or
+ * reproduction of this material is strictly forbidden unless prior
+ * written permission is obtained from Fusion Memory.
+ */
+
+
+
+/*
+ * fm_tier - Exclusive DRAM/flash tiering
+ *
+ * Unlike the cache, which keeps an inclusive DRAM copy of flash pages,
+ * a tiered fmdsk maps every logical page to a single frame in either
+ * the DRAM or the flash region, so both add capacity.  I/O bumps a
+ * per-page heat counter.  Every interval the migration worker halves
+ * the counters, works out from a heat histogram of each tier how many
+ * flash pages are hotter than DRAM pages, and swaps up to migrate_pages
+ * of those pairs, a batch at a time.  The map is kept in DRAM only, so
+ * when the device goes away every page is moved back to the frame it
+ * started in, where the next load expects it.
+ */
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/io.h>
+#include <linux/rwsem.h>
+#include <linux/workqueue.h>
+#include <linux/jiffies.h>
+#include "fm_dsk.h"
+#include "fm_tier.h"
+#include "fm_copy.h"
+#include "fm_stripe.h"
+#include "fm_emul.h"
+#include "fm_sysfs.h"
+
+/*-------------------------------------------------------------*/
+/*--------------------   I/O Functions   ----------------------*/
+/*-------------------------------------------------------------*/
+
+/*
+ * Copy len bytes at offset within the frames from loc on, which hold
+ * consecutive logical pages.  DRAM frames are copied with
+ * memcpy_toio/fromio, flash frames with the device's copy routines.
+ */
+static void fmd_tier_copy(struct fmd_device_t *fmd, struct fmd_tier_t *tier,
+			  u32 loc, unsigned int offset, void *buf, size_t len,
+			  bool write)
+{
+	u64 off = ((u64) FMD_TIER_FRAME(loc) << PAGE_SHIFT) + offset;
+	u64 start;
+
+	if (FMD_TIER_OF(loc) == FMD_TIER_DRAM) {
+		start = fmd_emul_begin(fmd);
+		if (write)
+			memcpy_toio(tier->virt + off, buf, len);
+		else
+			memcpy_fromio(buf, tier->virt + off, len);
+		fmd_emul_end(fmd, FMD_EMUL_DRAM, write ? FMD_EMUL_WRITE : FMD_EMUL_READ,
+			     start, len);
+	} else {
+		if (write)
+			fmd_region_write(fmd, off >> SECTOR_SHIFT, buf, len);
+		else
+			fmd_region_read(fmd, buf, off >> SECTOR_SHIFT, len);
+	}
+}
+
+/*
+ * Read or write n bytes of the device starting at sector.  Logical pages
+ * in consecutive frames of the same tier are copied together.
+ * Returns -EAGAIN if nowait is set and a migration is in progress.
+ */
+int fmd_tier_rw(struct fmd_device_t *fmd, void *buf, sector_t sector,
+		size_t n, bool write, bool nowait)
+{
+	struct fmd_tier_t *tier = (struct fmd_tier_t *) fmd->tier;
+	pgoff_t index = sector >> PAGE_SECTORS_SHIFT;
+	unsigned int offset = (sector & (PAGE_SECTORS-1)) << SECTOR_SHIFT;
+	unsigned int run_offset = offset, pages = 0;
+	u32 loc, run = 0;
+	size_t copy, len = 0;
+	u8 heat;
+
+	if (!nowait)
+		down_read(&tier->migrate_sem);
+	else if (!down_read_trylock(&tier->migrate_sem))
+		return -EAGAIN;
+
+	for (; n; index++) {
+		copy = min_t(size_t, n, PAGE_SIZE - offset);
+		loc = tier->map[index];
+
+		/* Racing updates may lose a count, which is harmless */
+		heat = READ_ONCE(tier->heat[index]);
+		if (heat < FMD_TIER_HEAT_MAX)
+			WRITE_ONCE(tier->heat[index], heat + 1);
+
+		if (len && loc != run + pages) {
+			fmd_tier_copy(fmd, tier, run, run_offset, buf, len, write);
+			atomic64_add(pages, &tier->accesses[FMD_TIER_OF(run)]);
+			buf += len;
+			len = 0;
+		}
+		if (!len) {
+			run = loc;
+			run_offset = offset;
+			pages = 0;
+		}
+		len += copy;
+		pages++;
+		n -= copy;
+		offset = 0;
+	}
+	if (len) {
+		fmd_tier_copy(fmd, tier, run, run_offset, buf, len, write);
+		atomic64_add(pages, &tier->accesses[FMD_TIER_OF(run)]);
+	}
+	up_read(&tier->migrate_sem);
+	return 0;
+}
+
+/*-------------------------------------------------------------*/
+/*--------------------   Migration   --------------------------*/
+/*-------------------------------------------------------------*/
+
+/* Halve every heat counter and take a histogram of each tier's heat */
+static void fmd_tier_decay(struct fmd_tier_t *tier)
+{
+	unsigned int i;
+	u8 heat;
+
+	memset(tier->hist, 0, sizeof(tier->hist));
+	for (i = 0; i < tier->nr_logical; i++) {
+		heat = READ_ONCE(tier->heat[i]) >> 1;
+		WRITE_ONCE(tier->heat[i], heat);
+		tier->hist[FMD_TIER_OF(tier->map[i])][heat]++;
+		if (!(i & 0xffff))
+			cond_resched();
+	}
+}
+
+/*
+ * Pair the hottest flash pages with the coldest DRAM pages, for as long
+ * as the flash page is hotter by more than FMD_TIER_HYST.  Returns the
+ * number of pairs, at most migrate_pages, and the heat thresholds that
+ * select them.
+ */
+static unsigned int fmd_tier_pick(struct fmd_tier_t *tier, unsigned int *hot_min,
+				  unsigned int *cold_max)
+{
+	u32 *flash = tier->hist[FMD_TIER_FLASH];
+	u32 *dram = tier->hist[FMD_TIER_DRAM];
+	unsigned int budget = READ_ONCE(tier->migrate_pages);
+	int hot = FMD_TIER_HEAT_MAX, cold = 0;
+	u32 left_hot = flash[hot], left_cold = dram[cold];
+	unsigned int nr = 0, take;
+
+	while (nr < budget) {
+		while (!left_hot && hot > 0)
+			left_hot = flash[--hot];
+		while (!left_cold && cold < FMD_TIER_HEAT_MAX)
+			left_cold = dram[++cold];
+		if (!left_hot || !left_cold || hot <= cold + FMD_TIER_HYST)
+			break;
+
+		take = min3(left_hot, left_cold, budget - nr);
+		left_hot -= take;
+		left_cold -= take;
+		nr += take;
+	}
+
+	*hot_min = hot;
+	*cold_max = cold;
+	return nr;
+}
+
+/*
+ * Collect up to max logical pages held by frames of tier t, starting at
+ * frame *cursor, whose heat is at least thresh if hot, else at most.
+ */
+static unsigned int fmd_tier_collect(struct fmd_tier_t *tier, int t,
+				     unsigned int *cursor, u32 *pages,
+				     unsigned int max, bool hot, unsigned int thresh)
+{
+	unsigned int n = 0;
+	u32 page;
+	u8 heat;
+
+	for (; n < max && *cursor < tier->nr_frames[t]; (*cursor)++) {
+		page = tier->owner[t][*cursor];
+		heat = READ_ONCE(tier->heat[page]);
+		if (hot ? heat >= thresh : heat <= thresh)
+			pages[n++] = page;
+	}
+	return n;
+}
+
+/*
+ * Exchange the frames of logical page hot, on flash, and logical page
+ * cold, in DRAM.  Caller holds migrate_sem for write.
+ */
+static void fmd_tier_swap(struct fmd_device_t *fmd, struct fmd_tier_t *tier,
+			  u32 hot, u32 cold)
+{
+	u32 flash = FMD_TIER_FRAME(tier->map[hot]);
+	u32 dram = tier->map[cold];
+	void __iomem *addr = tier->virt + ((size_t) dram << PAGE_SHIFT);
+	sector_t sector = (sector_t) flash << PAGE_SECTORS_SHIFT;
+
+	memcpy_fromio(tier->bounce, addr, PAGE_SIZE);
+	fmd_region_read(fmd, (void __force *) addr, sector, PAGE_SIZE);
+	fmd_region_write(fmd, sector, tier->bounce, PAGE_SIZE);
+
+	tier->map[hot] = dram;
+	tier->map[cold] = flash | FMD_TIER_FLASH_BIT;
+	tier->owner[FMD_TIER_DRAM][dram] = hot;
+	tier->owner[FMD_TIER_FLASH][flash] = cold;
+}
+
+/* Swap up to nr pairs selected by the thresholds, a batch at a time */
+static unsigned int fmd_tier_migrate(struct fmd_device_t *fmd,
+				     struct fmd_tier_t *tier, unsigned int nr,
+				     unsigned int hot_min, unsigned int cold_max)
+{
+	u32 hot[FMD_TIER_BATCH], cold[FMD_TIER_BATCH];
+	unsigned int flash_cur = 0, dram_cur = 0;
+	unsigned int done = 0, n, i;
+
+	while (done < nr && !READ_ONCE(tier->stop)) {
+		n = fmd_tier_collect(tier, FMD_TIER_FLASH, &flash_cur, hot,
+				     min_t(unsigned int, nr - done, FMD_TIER_BATCH),
+				     true, hot_min);
+		n = fmd_tier_collect(tier, FMD_TIER_DRAM, &dram_cur, cold, n,
+				     false, cold_max);
+		if (!n)
+			break;
+
+		/* Heat may have moved since the pages were picked */
+		down_write(&tier->migrate_sem);
+		for (i = 0; i < n; i++) {
+			if (tier->heat[hot[i]] > tier->heat[cold[i]]) {
+				fmd_tier_swap(fmd, tier, hot[i], cold[i]);
+				done++;
+			}
+		}
+		up_write(&tier->migrate_sem);
+		cond_resched();
+	}
+	return done;
+}
+
+static void fmd_tier_migrate_work(struct work_struct *work)
+{
+	struct fmd_tier_t *tier = container_of(to_delayed_work(work),
+					       struct fmd_tier_t, migrate_work);
+	unsigned int hot_min, cold_max, nr, interval;
+
+	fmd_tier_decay(tier);
+	nr = fmd_tier_pick(tier, &hot_min, &cold_max);
+	if (nr) {
+		nr = fmd_tier_migrate(tier->fmd, tier, nr, hot_min, cold_max);
+		tier->nr_swapped += nr;
+		tier->nr_runs += !!nr;
+	}
+	fmd_emul_settle(tier->fmd, false);
+
+	interval = READ_ONCE(tier->interval_ms);
+	if (interval && !READ_ONCE(tier->stop))
+		queue_delayed_work(tier->wq, &tier->migrate_work,
+				   msecs_to_jiffies(interval));
+}
+
+/* The frame a logical page starts in, see fmd_tier_init */
+static inline u32 fmd_tier_home(struct fmd_tier_t *tier, u32 page)
+{
+	u32 nr_flash = tier->nr_frames[FMD_TIER_FLASH];
+
+	return page < nr_flash ? page | FMD_TIER_FLASH_BIT : page - nr_flash;
+}
+
+/* The logical page that starts in the frame at loc */
+static inline u32 fmd_tier_home_page(struct fmd_tier_t *tier, u32 loc)
+{
+	return FMD_TIER_OF(loc) == FMD_TIER_FLASH ? FMD_TIER_FRAME(loc) :
+		loc + tier->nr_frames[FMD_TIER_FLASH];
+}
+
+/*
+ * Move every migrated page back to the frame it started in, a cycle of
+ * the map at a time: the page in the first frame is set aside in the
+ * bounce page, then each frame of the cycle takes its own page from
+ * where it is, and the page set aside goes to the last one.  Caller has
+ * stopped migration and no I/O is left.
+ */
+static void fmd_tier_unwind(struct fmd_device_t *fmd, struct fmd_tier_t *tier)
+{
+	void *saved = tier->bounce;
+	void *buf = tier->bounce + PAGE_SIZE;
+	u32 page, first, loc, from, p;
+	unsigned int nr = 0;
+
+	for (page = 0; page < tier->nr_logical; page++) {
+		first = fmd_tier_home(tier, page);
+		if (tier->map[page] == first)
+			continue;
+
+		fmd_tier_copy(fmd, tier, first, 0, saved, PAGE_SIZE, false);
+		for (loc = first; ; loc = from) {
+			p = fmd_tier_home_page(tier, loc);
+			from = tier->map[p];
+			tier->map[p] = loc;
+			nr++;
+			if (from == first)
+				break;
+			fmd_tier_copy(fmd, tier, from, 0, buf, PAGE_SIZE, false);
+			fmd_tier_copy(fmd, tier, loc, 0, buf, PAGE_SIZE, true);
+		}
+		fmd_tier_copy(fmd, tier, loc, 0, saved, PAGE_SIZE, true);
+		cond_resched();
+	}
+	fmd_emul_settle(fmd, false);
+
+	printk(KERN_INFO "%s: %s: %u pages moved back\n", fmd->dev_name, __func__, nr);
+}
+
+/*
+ * Set up the maps of a device whose DRAM region fm_mem.c has mapped.
+ * The flash region starts out at the front of the device, where an
+ * untiered fmdsk has it, and the DRAM region follows.
+ */
+int fmd_tier_init(struct fmd_device_t *fmd, unsigned int interval_ms,
+		  unsigned int migrate_pages)
+{
+	struct fmd_tier_t *tier = (struct fmd_tier_t *) fmd->tier;
+	unsigned int nr_flash = fmd->nr_pages;
+	unsigned int i;
+
+	printk(KERN_INFO "%s: %s: %u DRAM pages, %u flash pages\n", fmd->dev_name, __func__, tier->nr_pages, nr_flash);
+
+	if ((u64) tier->nr_pages + nr_flash >= FMD_TIER_FLASH_BIT)
+		return -EINVAL;
+
+	tier->fmd = fmd;
+	tier->nr_frames[FMD_TIER_DRAM] = tier->nr_pages;
+	tier->nr_frames[FMD_TIER_FLASH] = nr_flash;
+	tier->nr_logical = tier->nr_pages + nr_flash;
+	tier->interval_ms = interval_ms;
+	tier->migrate_pages = migrate_pages;
+	init_rwsem(&tier->migrate_sem);
+
+	tier->map = vmalloc(tier->nr_logical * sizeof(u32));
+	tier->owner[FMD_TIER_DRAM] = vmalloc(tier->nr_pages * sizeof(u32));
+	tier->owner[FMD_TIER_FLASH] = vmalloc(nr_flash * sizeof(u32));
+	tier->heat = vzalloc(tier->nr_logical);
+	tier->bounce = kmalloc(2 * PAGE_SIZE, GFP_KERNEL);
+	if (!tier->map || !tier->owner[FMD_TIER_DRAM] ||
+	    !tier->owner[FMD_TIER_FLASH] || !tier->heat || !tier->bounce)
+		goto err;
+
+	for (i = 0; i < nr_flash; i++) {
+		tier->map[i] = i | FMD_TIER_FLASH_BIT;
+		tier->owner[FMD_TIER_FLASH][i] = i;
+	}
+	for (i = 0; i < tier->nr_pages; i++) {
+		tier->map[nr_flash + i] = i;
+		tier->owner[FMD_TIER_DRAM][i] = nr_flash + i;
+	}
+
+	INIT_DELAYED_WORK(&tier->migrate_work, fmd_tier_migrate_work);
+	tier->wq = alloc_workqueue("%s_tier", WQ_UNBOUND, 1, fmd->dev_name);
+	if (!tier->wq)
+		goto err;
+	if (interval_ms)
+		queue_delayed_work(tier->wq, &tier->migrate_work,
+				   msecs_to_jiffies(interval_ms));
+
+	return 0;
+
+err:
+	fmd_tier_cleanup(fmd);
+	return -ENOMEM;
+}
+
+/*
+ * Stop migration, put the pages back where they started and free the
+ * maps.  Safe to call if fmd_tier_init failed
+ */
+void fmd_tier_cleanup(struct fmd_device_t *fmd)
+{
+	struct fmd_tier_t *tier = (struct fmd_tier_t *) fmd->tier;
+
+	if (tier->wq) {
+		WRITE_ONCE(tier->stop, true);
+		cancel_delayed_work_sync(&tier->migrate_work);
+		destroy_workqueue(tier->wq);
+		tier->wq = NULL;
+	}
+	/* Only a map that was set up can have swapped pages */
+	if (tier->nr_swapped)
+		fmd_tier_unwind(fmd, tier);
+	kfree(tier->bounce);
+	vfree(tier->heat);
+	vfree(tier->owner[FMD_TIER_FLASH]);
+	vfree(tier->owner[FMD_TIER_DRAM]);
+	vfree(tier->map);
+	tier->bounce = NULL;
+	tier->heat = NULL;
+	tier->owner[FMD_TIER_FLASH] = NULL;
+	tier->owner[FMD_TIER_DRAM] = NULL;
+	tier->map = NULL;
+}
+
+/*-------------------------------------------------------------*/
+/*--------------------   Sysfs Functions   --------------------*/
+/*-------------------------------------------------------------*/
+
+/* "<DRAM pages> <flash pages>" */
+static ssize_t frames_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct fmd_device_t *fmd = fmd_from_dev(dev);
+	struct fmd_tier_t *tier = (struct fmd_tier_t *) fmd->tier;
+
+	if (!tier)
+		return -ENODEV;
+	return sprintf(buf, "%u %u\n", tier->nr_frames[FMD_TIER_DRAM],
+		       tier->nr_frames[FMD_TIER_FLASH]);
+}
+static DEVICE_ATTR_RO(frames);
+
+/* Migration interval in ms, 0 = no migration */
+static ssize_t interval_ms_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct fmd_device_t *fmd = fmd_from_dev(dev);
+	struct fmd_tier_t *tier = (struct fmd_tier_t *) fmd->tier;
+
+	if (!tier)
+		return -ENODEV;
+	return sprintf(buf, "%u\n", READ_ONCE(tier->interval_ms));
+}
+
+static ssize_t interval_ms_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t len)
+{
+	struct fmd_device_t *fmd = fmd_from_dev(dev);
+	struct fmd_tier_t *tier = (struct fmd_tier_t *) fmd->tier;
+	unsigned int val;
+	int err;
+
+	if (!tier)
+		return -ENODEV;
+	err = kstrtouint(buf, 0, &val);
+	if (err)
+		return err;
+
+	WRITE_ONCE(tier->interval_ms, val);
+	if (val)
+		mod_delayed_work(tier->wq, &tier->migrate_work,
+				 msecs_to_jiffies(val));
+	return len;
+}
+static DEVICE_ATTR_RW(interval_ms);
+
+/* Most pages swapped per interval */
+static ssize_t migrate_pages_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct fmd_device_t *fmd = fmd_from_dev(dev);
+	struct fmd_tier_t *tier = (struct fmd_tier_t *) fmd->tier;
+
+	if (!tier)
+		return -ENODEV;
+	return sprintf(buf, "%u\n", READ_ONCE(tier->migrate_pages));
+}
+
+static ssize_t migrate_pages_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t len)
+{
+	struct fmd_device_t *fmd = fmd_from_dev(dev);
+	struct fmd_tier_t *tier = (struct fmd_tier_t *) fmd->tier;
+	unsigned int val;
+	int err;
+
+	if (!tier)
+		return -ENODEV;
+	err = kstrtouint(buf, 0, &val);
+	if (err)
+		return err;
+
+	WRITE_ONCE(tier->migrate_pages, val);
+	return len;
+}
+static DEVICE_ATTR_RW(migrate_pages);
+
+/* "<DRAM page accesses> <flash page accesses>" */
+static ssize_t accesses_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct fmd_device_t *fmd = fmd_from_dev(dev);
+	struct fmd_tier_t *tier = (struct fmd_tier_t *) fmd->tier;
+
+	if (!tier)
+		return -ENODEV;
+	return sprintf(buf, "%lld %lld\n",
+		       (long long) atomic64_read(&tier->accesses[FMD_TIER_DRAM]),
+		       (long long) atomic64_read(&tier->accesses[FMD_TIER_FLASH]));
+}
+static DEVICE_ATTR_RO(accesses);
+
+/* "<pages swapped> <intervals that swapped>" */
+static ssize_t migrated_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct fmd_device_t *fmd = fmd_from_dev(dev);
+	struct fmd_tier_t *tier = (struct fmd_tier_t *) fmd->tier;
+
+	if (!tier)
+		return -ENODEV;
+	return sprintf(buf, "%llu %llu\n", tier->nr_swapped, tier->nr_runs);
+}
+static DEVICE_ATTR_RO(migrated);
+
+static struct attribute *fmd_tier_attrs[] = {
+	&dev_attr_frames.attr,
+	&dev_attr_interval_ms.attr,
+	&dev_attr_migrate_pages.attr,
+	&dev_attr_accesses.attr,
+	&dev_attr_migrated.attr,
+	NULL,
+};
+
+const struct attribute_group fmd_tier_attr_group = {
+	.name = "tier",
+	.attrs = fmd_tier_attrs,
+};
@@ -0,0 +1,100 @@
+/*************************************************************************
+ *
+ * Fusion Memory Confidential
+ * __________________
+ *
+ *  Fusion Memory Incorporated
+ *  All Rights Reserved.
+ *
+ * NOTICE:  All information contained herein is, and remains
+ * the property of Fusion Memory and its suppliers, if any.
+ * The intellectual and technical concepts contained herein are
+ * proprietary to Fusion Memory and its suppliers and may be covered by
+ * U.S. and Foreign Patents, patents in process, and are protected by
+ * trade secret or copyright law. Dissemination of this information or
+ * reproduction of this material is strictly forbidden unless prior
+ * written permission is obtained from Fusion Memory.
+ */
+
+
+#ifndef FM_TIER_H
+#define FM_TIER_H
+
+#include <linux/types.h>
+#include <linux/rwsem.h>
+#include <linux/workqueue.h>
+#include <linux/atomic.h>
+#include <linux/sysfs.h>
+#include "fm_dsk.h"
+
+#define FMD_TIER_DRAM		0
+#define FMD_TIER_FLASH		1
+#define FMD_NR_TIERS		2
+
+/* Location of a logical page: a frame number, flash frames tagged */
+#define FMD_TIER_FLASH_BIT	0x80000000U
+#define FMD_TIER_FRAME(loc)	((loc) & ~FMD_TIER_FLASH_BIT)
+#define FMD_TIER_OF(loc)	((loc) & FMD_TIER_FLASH_BIT ? FMD_TIER_FLASH : FMD_TIER_DRAM)
+
+#define FMD_TIER_HEAT_MAX	255	/* access counters saturate */
+#define FMD_TIER_HYST		1	/* heat a swap must gain */
+#define FMD_TIER_BATCH		32	/* swaps per migrate_sem hold */
+
+#define FMD_TIER_INTERVAL_MS_DEFAULT	1000
+#define FMD_TIER_MIGRATE_PAGES_DEFAULT	4096	/* per interval */
+
+/*
+ * An exclusive two tier device.  Each logical page lives in exactly one
+ * DRAM or flash frame, so the capacity is the sum of both regions.
+ * Page accesses bump a per-page heat counter; every interval the
+ * migration worker halves all counters and swaps the hottest flash
+ * pages with the coldest DRAM pages.
+ */
+struct fmd_tier_t {
+	/* DRAM region.  The flash region is the device's own */
+	phys_addr_t phys;
+	void __iomem *virt;
+	unsigned int nr_pages;
+
+	struct fmd_device_t *fmd;
+	unsigned int nr_frames[FMD_NR_TIERS];
+	unsigned int nr_logical;	/* DRAM + flash frames */
+	u32 *map;			/* logical page -> location */
+	u32 *owner[FMD_NR_TIERS];	/* frame -> logical page */
+	u8 *heat;			/* per logical page */
+
+	/* Held for read by I/O, for write by the worker while it moves a
+	 * batch of pages */
+	struct rw_semaphore migrate_sem;
+
+	struct workqueue_struct *wq;
+	struct delayed_work migrate_work;
+	bool stop;
+	unsigned int interval_ms;	/* 0 = no migration */
+	unsigned int migrate_pages;	/* most swaps per interval */
+	void *bounce;			/* two pages, worker and cleanup only */
+	u32 hist[FMD_NR_TIERS][FMD_TIER_HEAT_MAX + 1];
+
+	/* Statistics */
+	atomic64_t accesses[FMD_NR_TIERS];	/* pages accessed by I/O */
+	u64 nr_swapped;
+	u64 nr_runs;				/* intervals that swapped */
+};
+
+/* DRAM pages a tiered device adds to its capacity */
+static inline unsigned int fmd_tier_nr_pages(struct fmd_device_t *fmd)
+{
+	struct fmd_tier_t *tier = (struct fmd_tier_t *) fmd->tier;
+
+	return tier ? tier->nr_pages : 0;
+}
+
+int fmd_tier_init(struct fmd_device_t *fmd, unsigned int interval_ms,
+		  unsigned int migrate_pages);
+void fmd_tier_cleanup(struct fmd_device_t *fmd);
+int fmd_tier_rw(struct fmd_device_t *fmd, void *buf, sector_t sector,
+		size_t n, bool write, bool nowait);
+
+extern const struct attribute_group fmd_tier_attr_group;
+
+#endif /* FM_TIER_H */
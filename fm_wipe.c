@@ -0,0 +1,448 @@
+/*************************************************************************
+ *
+ * Fusion Memory Confidential
+ * __________________
+ *
+ *  Fusion Memory Incorporated
+ *  All Rights Reserved.
+ *
+ * NOTICE:  All information contained herein is, and remains
+ * the property of Fusion Memory and its suppliers, if any.
+ * The intellectual and technical concepts contained herein are
+ * proprietary to Fusion Memory and its suppliers and may be covered by
+ * U.S. and Foreign Patents, patents in process, and are protected by
+ * trade secret or copyright law. Dissemination of this information or
+ * reproduction of this material is strictly forbidden unless prior
+ * written permission is obtained from Fusion Memory.
+ */
+
+
+/*
+ * fm_wipe - Background zeroing of a region at load
+ *
+ * A region discovered at load holds whatever the memory held before, and
+ * zeroing all of it through the block device takes seconds per device.
+ * With wipe=N the device is usable as soon as it is added: N workers zero
+ * the region a chunk at a time with the device's copy routine, streaming
+ * from a buffer of zeros, while fmd_region_read returns zeros for pages
+ * they haven't reached and fmd_region_write marks the pages it writes as
+ * done.  A write covering part of a page that isn't done zeroes the rest
+ * of the page first.  Once every chunk is done the I/O path stops looking
+ * at the wipe.
+ */
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/bitops.h>
+#include <linux/bit_spinlock.h>
+#include <linux/ktime.h>
+#include <linux/log2.h>
+#include <linux/numa.h>
+#include <linux/math64.h>
+#include "fm_dsk.h"
+#include "fm_mem.h"
+#include "fm_stripe.h"
+#include "fm_wipe.h"
+#include "fm_sysfs.h"
+#include "fm_backing.h"
+
+extern uint backing;
+
+/*-------------------------------------------------------------*/
+/*--------------------   Chunk Functions   --------------------*/
+/*-------------------------------------------------------------*/
+
+/* Pages [*first, *last) of chunk c */
+static void fmd_wipe_chunk_pages(struct fmd_wipe_t *wipe, unsigned int c,
+				 unsigned long *first, unsigned long *last)
+{
+	unsigned int shift = wipe->chunk_shift - PAGE_SHIFT;
+
+	*first = (unsigned long) c << shift;
+	*last = min_t(unsigned long, *first + (1UL << shift), wipe->fmd->nr_pages);
+}
+
+/* Chunk c needs no locking once this returns true */
+static inline bool fmd_wipe_chunk_done(struct fmd_wipe_t *wipe, unsigned int c)
+{
+	if (!test_bit(c, wipe->done))
+		return false;
+	smp_rmb();
+	return true;
+}
+
+/* Mark nr pages from page on as done.  Atomically, as small chunks share
+ * words of the bitmap */
+static void fmd_wipe_set_pages(struct fmd_wipe_t *wipe, unsigned long page,
+			       unsigned long nr)
+{
+	while (nr--)
+		set_bit(page++, wipe->page_done);
+}
+
+/* Zero n bytes of the region from byte offset off */
+static void fmd_wipe_zero(struct fmd_wipe_t *wipe, u64 off, size_t n)
+{
+	size_t len;
+
+	while (n) {
+		len = min_t(size_t, n, FMD_WIPE_ZERO_BYTES);
+		__fmd_region_write(wipe->fmd, off >> SECTOR_SHIFT, wipe->zero, len);
+		off += len;
+		n -= len;
+	}
+}
+
+/*
+ * Mark chunk c done if all of its pages are.  The last chunk completes
+ * the wipe.  Caller holds the chunk lock.
+ */
+static void fmd_wipe_mark_chunk(struct fmd_wipe_t *wipe, unsigned int c)
+{
+	struct fmd_device_t *fmd = wipe->fmd;
+	unsigned long first, last;
+
+	fmd_wipe_chunk_pages(wipe, c, &first, &last);
+	if (find_next_zero_bit(wipe->page_done, last, first) < last)
+		return;
+
+	/* The zeros must be visible before the lock free path reads them */
+	smp_mb__before_atomic();
+	if (test_and_set_bit(c, wipe->done))
+		return;
+	if (atomic_inc_return(&wipe->nr_done) < wipe->nr_chunks)
+		return;
+
+	wipe->elapsed_ns = ktime_get_ns() - wipe->start_ns;
+	WRITE_ONCE(wipe->complete, true);
+	printk(KERN_INFO "%s: %s: region zeroed in %llu ms\n", fmd->dev_name, __func__,
+	       div_u64(wipe->elapsed_ns, NSEC_PER_MSEC));
+}
+
+/* Zero the pages of chunk c that nothing has written yet */
+static void fmd_wipe_chunk(struct fmd_wipe_t *wipe, unsigned int c)
+{
+	unsigned long first, last, page, end;
+
+	bit_spin_lock(c, wipe->lock);
+	fmd_wipe_chunk_pages(wipe, c, &first, &last);
+	page = first;
+	while ((page = find_next_zero_bit(wipe->page_done, last, page)) < last) {
+		end = find_next_bit(wipe->page_done, last, page);
+		fmd_wipe_zero(wipe, (u64) page << PAGE_SHIFT,
+			      (size_t) (end - page) << PAGE_SHIFT);
+		fmd_wipe_set_pages(wipe, page, end - page);
+		atomic64_add(end - page, &wipe->nr_zeroed);
+		page = end;
+	}
+	fmd_wipe_mark_chunk(wipe, c);
+	bit_spin_unlock(c, wipe->lock);
+}
+
+/*-------------------------------------------------------------*/
+/*--------------------   I/O Functions   ----------------------*/
+/*-------------------------------------------------------------*/
+
+/* Read len bytes at off within one chunk, zeros for pages not done.
+ * Caller holds the chunk lock */
+static void fmd_wipe_read_chunk(struct fmd_wipe_t *wipe, void *dst, u64 off,
+				size_t len)
+{
+	unsigned long page = off >> PAGE_SHIFT;
+	bool done;
+	size_t n;
+
+	while (len) {
+		/* A run of pages in the same state */
+		done = test_bit(page, wipe->page_done);
+		do {
+			page++;
+		} while (((u64) page << PAGE_SHIFT) < off + len &&
+			 test_bit(page, wipe->page_done) == done);
+		n = min_t(u64, off + len, (u64) page << PAGE_SHIFT) - off;
+
+		if (done) {
+			__fmd_region_read(wipe->fmd, dst, off >> SECTOR_SHIFT, n);
+		} else {
+			memset(dst, 0, n);
+			atomic64_add(DIV_ROUND_UP(n, PAGE_SIZE), &wipe->nr_zero_reads);
+		}
+		dst += n;
+		off += n;
+		len -= n;
+	}
+}
+
+/* Write len bytes at off within chunk c.  Caller holds the chunk lock */
+static void fmd_wipe_write_chunk(struct fmd_wipe_t *wipe, unsigned int c,
+				 u64 off, const void *src, size_t len)
+{
+	unsigned long first = off >> PAGE_SHIFT;
+	unsigned long last = (off + len - 1) >> PAGE_SHIFT;
+	unsigned int head = off & (PAGE_SIZE - 1);
+	unsigned int tail = (off + len) & (PAGE_SIZE - 1);
+
+	if (head && !test_bit(first, wipe->page_done))
+		fmd_wipe_zero(wipe, off - head, head);
+	if (tail && !test_bit(last, wipe->page_done))
+		fmd_wipe_zero(wipe, off + len, PAGE_SIZE - tail);
+	__fmd_region_write(wipe->fmd, off >> SECTOR_SHIFT, src, len);
+
+	fmd_wipe_set_pages(wipe, first, last - first + 1);
+	fmd_wipe_mark_chunk(wipe, c);
+}
+
+/*
+ * Copy n bytes of the device from sector to dst while a wipe is running.
+ * Chunks that are done are read without the lock.
+ */
+void fmd_wipe_read(struct fmd_device_t *fmd, void *dst, sector_t sector, size_t n)
+{
+	struct fmd_wipe_t *wipe = (struct fmd_wipe_t *) fmd->wipe;
+	u64 off = (u64) sector << SECTOR_SHIFT;
+	unsigned int c;
+	size_t len;
+
+	while (n) {
+		c = off >> wipe->chunk_shift;
+		len = min_t(u64, n, ((u64) (c + 1) << wipe->chunk_shift) - off);
+		if (fmd_wipe_chunk_done(wipe, c)) {
+			__fmd_region_read(fmd, dst, off >> SECTOR_SHIFT, len);
+		} else {
+			bit_spin_lock(c, wipe->lock);
+			fmd_wipe_read_chunk(wipe, dst, off, len);
+			bit_spin_unlock(c, wipe->lock);
+		}
+		dst += len;
+		off += len;
+		n -= len;
+	}
+}
+
+/* Copy n bytes from src to the device at sector while a wipe is running */
+void fmd_wipe_write(struct fmd_device_t *fmd, sector_t sector, const void *src, size_t n)
+{
+	struct fmd_wipe_t *wipe = (struct fmd_wipe_t *) fmd->wipe;
+	u64 off = (u64) sector << SECTOR_SHIFT;
+	unsigned int c;
+	size_t len;
+
+	while (n) {
+		c = off >> wipe->chunk_shift;
+		len = min_t(u64, n, ((u64) (c + 1) << wipe->chunk_shift) - off);
+		if (fmd_wipe_chunk_done(wipe, c)) {
+			__fmd_region_write(fmd, off >> SECTOR_SHIFT, src, len);
+		} else {
+			bit_spin_lock(c, wipe->lock);
+			fmd_wipe_write_chunk(wipe, c, off, src, len);
+			bit_spin_unlock(c, wipe->lock);
+		}
+		src += len;
+		off += len;
+		n -= len;
+	}
+}
+
+/*-------------------------------------------------------------*/
+/*--------------------   Worker Functions   -------------------*/
+/*-------------------------------------------------------------*/
+
+/* Zero the chunks of a lane, shared with the lane's other workers */
+static void fmd_wipe_work(struct work_struct *work)
+{
+	struct fmd_wipe_worker_t *w = container_of(work, struct fmd_wipe_worker_t, work);
+	struct fmd_wipe_t *wipe = w->wipe;
+	u64 c;
+
+	while (!READ_ONCE(wipe->stop)) {
+		c = w->lane + (u64) (atomic_inc_return(&wipe->cursor[w->lane]) - 1) *
+			      wipe->nr_lanes;
+		if (c >= wipe->nr_chunks)
+			break;
+		fmd_wipe_chunk(wipe, c);
+		cond_resched();
+	}
+}
+
+/* NUMA node of the memory of a lane, NUMA_NO_NODE if unknown */
+static int fmd_wipe_lane_node(struct fmd_device_t *fmd, unsigned int lane)
+{
+	struct fmd_stripe_t *stripe = (struct fmd_stripe_t *) fmd->stripe;
+
+	if (!stripe)
+		return fmd_phys_to_node(fmd->phys);
+	return stripe->member[lane].node;
+}
+
+static void fmd_wipe_queue(struct fmd_wipe_t *wipe, int node,
+			   struct work_struct *work)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,0,0)
+	if (node != NUMA_NO_NODE) {
+		queue_work_node(node, wipe->wq, work);
+		return;
+	}
+#endif
+	queue_work(wipe->wq, work);
+}
+
+/*-------------------------------------------------------------*/
+/*-----------------   Init/Cleanup Functions   ----------------*/
+/*-------------------------------------------------------------*/
+
+static void fmd_wipe_free(struct fmd_wipe_t *wipe)
+{
+	kfree(wipe->cursor);
+	kfree(wipe->zero);
+	vfree(wipe->page_done);
+	vfree(wipe->lock);
+	vfree(wipe->done);
+	kfree(wipe);
+}
+
+/*
+ * Start zeroing the device's region with nr_workers workers, at least
+ * one per stripe member.  0 = the region is used as found.  A tiered
+ * device isn't wiped: its DRAM tier isn't reached through
+ * fmd_region_read/write.
+ */
+int fmd_wipe_init(struct fmd_device_t *fmd, unsigned int nr_workers)
+{
+	struct fmd_stripe_t *stripe = (struct fmd_stripe_t *) fmd->stripe;
+	struct fmd_wipe_t *wipe;
+	struct fmd_wipe_worker_t *w;
+	unsigned int i;
+
+	BUG_ON(!fmd);
+	printk(KERN_INFO "%s: %s\n", fmd->dev_name, __func__);
+
+	if (!nr_workers || !fmd->nr_pages)
+		return 0;
+	if (fmd->tier) {
+		printk(KERN_INFO "%s: %s: not available with a tier, region used as found\n", fmd->dev_name, __func__);
+		return 0;
+	}
+	/* vzalloc zeroed the region, or it holds what backing_file held */
+	if (fmd->backing || backing != FMD_BACKING_E820) {
+		printk(KERN_INFO "%s: %s: not needed with backing=%u, region used as allocated\n", fmd->dev_name, __func__, backing);
+		return 0;
+	}
+
+	wipe = kzalloc(sizeof(struct fmd_wipe_t), GFP_KERNEL);
+	if (!wipe)
+		return -ENOMEM;
+
+	/* Chunks of a striped device are its stripe units, so each is
+	 * zeroed from its member's node */
+	wipe->fmd = fmd;
+	wipe->nr_lanes = stripe ? stripe->nr_members : 1;
+	wipe->chunk_shift = stripe ? stripe->unit_shift : ilog2(FMD_WIPE_CHUNK_KB) + 10;
+	wipe->nr_chunks = DIV_ROUND_UP_ULL((u64) fmd->nr_pages << PAGE_SHIFT,
+					   1ULL << wipe->chunk_shift);
+	wipe->nr_workers = clamp_t(unsigned int, nr_workers, wipe->nr_lanes,
+				   FMD_WIPE_MAX_WORKERS);
+
+	wipe->done = vzalloc(BITS_TO_LONGS(wipe->nr_chunks) * sizeof(long));
+	wipe->lock = vzalloc(BITS_TO_LONGS(wipe->nr_chunks) * sizeof(long));
+	wipe->page_done = vzalloc(BITS_TO_LONGS(fmd->nr_pages) * sizeof(long));
+	wipe->zero = kzalloc(FMD_WIPE_ZERO_BYTES, GFP_KERNEL);
+	wipe->cursor = kcalloc(wipe->nr_lanes, sizeof(atomic_t), GFP_KERNEL);
+	if (!wipe->done || !wipe->lock || !wipe->page_done || !wipe->zero ||
+	    !wipe->cursor)
+		goto err;
+
+	wipe->wq = alloc_workqueue("%s_wipe", WQ_UNBOUND, 0, fmd->dev_name);
+	if (!wipe->wq)
+		goto err;
+
+	fmd->wipe = wipe;
+	wipe->start_ns = ktime_get_ns();
+	for (i = 0; i < wipe->nr_workers; i++) {
+		w = &wipe->worker[i];
+		w->wipe = wipe;
+		w->lane = i % wipe->nr_lanes;
+		INIT_WORK(&w->work, fmd_wipe_work);
+		fmd_wipe_queue(wipe, fmd_wipe_lane_node(fmd, w->lane), &w->work);
+	}
+
+	printk(KERN_INFO "%s: %s: %u chunks of %u KB, %u workers\n", fmd->dev_name, __func__, wipe->nr_chunks, 1U << (wipe->chunk_shift - 10), wipe->nr_workers);
+	return 0;
+
+err:
+	fmd_wipe_free(wipe);
+	return -ENOMEM;
+}
+
+/* Stop the workers, even if the wipe isn't complete */
+void fmd_wipe_cleanup(struct fmd_device_t *fmd)
+{
+	struct fmd_wipe_t *wipe = (struct fmd_wipe_t *) fmd->wipe;
+
+	printk(KERN_INFO "%s: %s\n", fmd->dev_name, __func__);
+
+	if (!wipe)
+		return;
+
+	WRITE_ONCE(wipe->stop, true);
+	destroy_workqueue(wipe->wq);
+	fmd->wipe = NULL;
+	fmd_wipe_free(wipe);
+}
+
+/*-------------------------------------------------------------*/
+/*--------------------   Sysfs Functions   --------------------*/
+/*-------------------------------------------------------------*/
+
+/* "<chunks done> <chunks> <chunk bytes>" */
+static ssize_t progress_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct fmd_wipe_t *wipe = (struct fmd_wipe_t *) fmd_from_dev(dev)->wipe;
+
+	if (!wipe)
+		return -ENODEV;
+	return sprintf(buf, "%d %u %lu\n", atomic_read(&wipe->nr_done),
+		       wipe->nr_chunks, 1UL << wipe->chunk_shift);
+}
+static DEVICE_ATTR_RO(progress);
+
+/* "<pages zeroed by the workers> <pages read as zeros>" */
+static ssize_t pages_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct fmd_wipe_t *wipe = (struct fmd_wipe_t *) fmd_from_dev(dev)->wipe;
+
+	if (!wipe)
+		return -ENODEV;
+	return sprintf(buf, "%lld %lld\n", (long long) atomic64_read(&wipe->nr_zeroed),
+		       (long long) atomic64_read(&wipe->nr_zero_reads));
+}
+static DEVICE_ATTR_RO(pages);
+
+/* Time the wipe took, 0 while it runs */
+static ssize_t time_ms_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct fmd_wipe_t *wipe = (struct fmd_wipe_t *) fmd_from_dev(dev)->wipe;
+
+	if (!wipe)
+		return -ENODEV;
+	if (!READ_ONCE(wipe->complete))
+		return sprintf(buf, "0\n");
+	return sprintf(buf, "%llu\n", div_u64(wipe->elapsed_ns, NSEC_PER_MSEC));
+}
+static DEVICE_ATTR_RO(time_ms);
+
+static struct attribute *fmd_wipe_attrs[] = {
+	&dev_attr_progress.attr,
+	&dev_attr_pages.attr,
+	&dev_attr_time_ms.attr,
+	NULL,
+};
+
+const struct attribute_group fmd_wipe_attr_group = {
+	.name = "wipe",
+	.attrs = fmd_wipe_attrs,
+};
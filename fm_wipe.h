@@ -0,0 +1,91 @@
+/*************************************************************************
+ *
+ * Fusion Memory Confidential
+ * __________________
+ *
+ *  Fusion Memory Incorporated
+ *  All Rights Reserved.
+ *
+ * NOTICE:  All information contained herein is, and remains
+ * the property of Fusion Memory and its suppliers, if any.
+ * The intellectual and technical concepts contained herein are
+ * proprietary to Fusion Memory and its suppliers and may be covered by
+ * U.S. and Foreign Patents, patents in process, and are protected by
+ * trade secret or copyright law. Dissemination of this information or
+ * reproduction of this material is strictly forbidden unless prior
+ * written permission is obtained from Fusion Memory.
+ */
+
+
+#ifndef FM_WIPE_H
+#define FM_WIPE_H
+
+#include <linux/types.h>
+#include <linux/atomic.h>
+#include <linux/workqueue.h>
+#include <linux/sysfs.h>
+#include "fm_dsk.h"
+
+#define FMD_WIPE_CHUNK_KB	256	/* zeroed per chunk lock hold */
+#define FMD_WIPE_ZERO_BYTES	(64 << 10)	/* zeros copied at once */
+#define FMD_WIPE_MAX_WORKERS	16
+
+struct fmd_wipe_t;
+
+struct fmd_wipe_worker_t {
+	struct work_struct work;
+	struct fmd_wipe_t *wipe;
+	unsigned int lane;
+};
+
+/*
+ * Background zeroing of a device's region.  The region is cut into
+ * chunks, each zeroed under its own bit lock.  Pages written or zeroed
+ * are marked in page_done; reads of other pages return zeros.  Once a
+ * chunk has no pages left to zero it is marked in done, and I/O to it
+ * no longer takes the lock.
+ *
+ * With a striped device chunks are stripe units, and the chunks of each
+ * member are a lane zeroed by workers on the member's node.
+ */
+struct fmd_wipe_t {
+	struct fmd_device_t *fmd;
+	unsigned int nr_chunks;
+	unsigned int chunk_shift;	/* log2 of the chunk size in bytes */
+	unsigned int nr_lanes;
+	unsigned long *done;		/* per chunk */
+	unsigned long *lock;		/* per chunk */
+	unsigned long *page_done;	/* per page, under the chunk lock */
+	void *zero;			/* FMD_WIPE_ZERO_BYTES of zeros */
+
+	struct workqueue_struct *wq;
+	unsigned int nr_workers;
+	struct fmd_wipe_worker_t worker[FMD_WIPE_MAX_WORKERS];
+	atomic_t *cursor;		/* next chunk of each lane */
+	bool stop;
+	bool complete;			/* every chunk done */
+	u64 start_ns;
+	u64 elapsed_ns;
+
+	/* Statistics */
+	atomic_t nr_done;		/* chunks */
+	atomic64_t nr_zeroed;		/* pages zeroed by the workers */
+	atomic64_t nr_zero_reads;	/* pages read before they were zeroed */
+};
+
+/* True while reads and writes must go through the wipe's bookkeeping */
+static inline bool fmd_wipe_active(struct fmd_device_t *fmd)
+{
+	struct fmd_wipe_t *wipe = (struct fmd_wipe_t *) fmd->wipe;
+
+	return wipe && !READ_ONCE(wipe->complete);
+}
+
+int fmd_wipe_init(struct fmd_device_t *fmd, unsigned int nr_workers);
+void fmd_wipe_cleanup(struct fmd_device_t *fmd);
+void fmd_wipe_read(struct fmd_device_t *fmd, void *dst, sector_t sector, size_t n);
+void fmd_wipe_write(struct fmd_device_t *fmd, sector_t sector, const void *src, size_t n);
+
+extern const struct attribute_group fmd_wipe_attr_group;
+
+#endif /* FM_WIPE_H */
@@ -0,0 +1,441 @@
+/*************************************************************************
+ *
+ * Fusion Memory Confidential
+ * __________________
+ *
+ *  Fusion Memory Incorporated
+ *  All Rights Reserved.
+ *
+ * NOTICE:  All information contained herein is, and remains
+ * the property of Fusion Memory and its suppliers, if any.
+ * The intellectual and technical concepts contained herein are
+ * proprietary to Fusion Memory and its suppliers and may be covered by
+ * U.S. and Foreign Patents, patents in process, and are protected by
+ * trade secret or copyright law. Dissemination of this information or
+ * reproduction of this material is strictly forbidden unless prior
+ * written permission is obtained from Fusion Memory.
+ */
+
+
+/*
+ * fm_zcache - Compressed pool of reclaimed cache pages
+ *
+ * Reclaim writes dirty pages back before it frees their frames, so the
+ * frames it frees hold clean copies of the dsk.  With a pool configured,
+ * each is LZ4 compressed into it, and a later miss on the page
+ * decompresses it into the new frame instead of reading the flash tier.
+ * A page is either in a frame or in the pool: loads remove the entry, as
+ * do writes that give the page a new frame without reading it and
+ * writes that go around the cache.  Entries are clean, so making room
+ * just drops the oldest.
+ *
+ * Entries come from slab caches of FMD_ZCACHE_CLASS_SIZE steps; a page
+ * that doesn't compress into the largest class is not kept.  The pool is
+ * protected by fmd->lock, but compressing isn't done under it: only the
+ * reclaim worker keeps pages, copying the frames it frees out with the
+ * device's copy routine and compressing them once it has dropped the
+ * lock.  Until then the pages are pending in the pool, and a write or a
+ * miss on one cancels it.  Direct reclaim doesn't keep pages.
+ */
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include "fm_dsk.h"
+#include "fm_cache.h"
+#include "fm_copy.h"
+#include "fm_zcache.h"
+#include "fm_sysfs.h"
+
+#if FMD_ZCACHE
+#include <linux/lz4.h>
+
+/* Most compressed bytes an entry can hold */
+#define FMD_ZCACHE_MAX_LEN \
+	(FMD_ZCACHE_NR_CLASSES * FMD_ZCACHE_CLASS_SIZE - offsetof(struct fmd_zentry_t, data))
+
+/* Tree entry of a page staged but not compressed yet */
+static struct fmd_zentry_t fmd_zcache_pending;
+#define FMD_ZCACHE_PENDING	(&fmd_zcache_pending)
+
+static inline unsigned int fmd_zcache_class_bytes(unsigned int class)
+{
+	return (class + 1) * FMD_ZCACHE_CLASS_SIZE;
+}
+
+/* Remove an entry from the pool and free it */
+static void
+fmd_zcache_free(struct fmd_zcache_t *z, struct fmd_zentry_t *e)
+{
+	radix_tree_delete(&z->tree, e->index);
+	list_del(&e->lru);
+	z->nr_bytes -= fmd_zcache_class_bytes(e->class);
+	z->nr_entries--;
+	kmem_cache_free(z->class[e->class], e);
+}
+
+/* Drop the oldest entries until size more bytes fit */
+static bool
+fmd_zcache_make_room(struct fmd_zcache_t *z, unsigned int size)
+{
+	while (z->nr_bytes + size > z->max_bytes && !list_empty(&z->lru)) {
+		fmd_zcache_free(z, list_first_entry(&z->lru, struct fmd_zentry_t, lru));
+		z->nr_dropped++;
+	}
+	return z->nr_bytes + size <= z->max_bytes;
+}
+
+/*
+ * Stage page index, whose clean contents are in the frame at src, for
+ * fmd_zcache_store_staged.  Caller is the reclaim worker, holds fmd->lock
+ * and is about to free the page's frame.
+ */
+void
+fmd_zcache_stage(struct fmd_device_t *fmd, pgoff_t index,
+		const void __iomem *src)
+{
+	struct fmd_cache_t *cache = (struct fmd_cache_t *) fmd->cache;
+	struct fmd_zcache_t *z = cache->zcache;
+
+	if (!z || z->nr_staged == FMD_ZCACHE_STAGE_PAGES)
+		return;
+	if (radix_tree_insert(&z->tree, index, FMD_ZCACHE_PENDING)) {
+		z->nr_rejected++;
+		return;
+	}
+	fmd_copy_from_io(fmd, z->stage + z->nr_staged * PAGE_SIZE, src, PAGE_SIZE);
+	z->stage_index[z->nr_staged++] = index;
+}
+
+/*
+ * Compress the staged pages into the pool, unless they were written or
+ * missed on meanwhile.  Called by the reclaim worker without fmd->lock.
+ */
+void
+fmd_zcache_store_staged(struct fmd_device_t *fmd)
+{
+	struct fmd_cache_t *cache = (struct fmd_cache_t *) fmd->cache;
+	struct fmd_zcache_t *z = cache->zcache;
+	struct fmd_zentry_t *e;
+	unsigned int class = 0, i;
+	pgoff_t index;
+	void **slot;
+	u64 start, ns;
+	int len;
+
+	if (!z)
+		return;
+
+	for (i = 0; i < z->nr_staged; i++) {
+		index = z->stage_index[i];
+		e = NULL;
+
+		start = ktime_get_ns();
+		len = LZ4_compress_default(z->stage + i * PAGE_SIZE, z->dst, PAGE_SIZE,
+					   FMD_ZCACHE_MAX_LEN, z->wrkmem);
+		ns = ktime_get_ns() - start;
+		if (len > 0) {
+			class = DIV_ROUND_UP(offsetof(struct fmd_zentry_t, data) + len,
+					     FMD_ZCACHE_CLASS_SIZE) - 1;
+			e = kmem_cache_alloc(z->class[class], GFP_NOIO | __GFP_NOWARN);
+		}
+		if (e) {
+			e->index = index;
+			e->len = len;
+			e->class = class;
+			memcpy(e->data, z->dst, len);
+		}
+
+		spin_lock(&fmd->lock);
+		z->compress_ns += ns;
+		slot = (void **) radix_tree_lookup_slot(&z->tree, index);
+		if (!slot || radix_tree_deref_slot(slot) != FMD_ZCACHE_PENDING) {
+			/* Cancelled */
+		} else if (!e || !fmd_zcache_make_room(z, fmd_zcache_class_bytes(class))) {
+			radix_tree_delete(&z->tree, index);
+			z->nr_rejected++;
+		} else {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,10,0)
+			radix_tree_replace_slot(&z->tree, slot, e);
+#else
+			radix_tree_replace_slot(slot, e);
+#endif
+			list_add_tail(&e->lru, &z->lru);
+			z->nr_bytes += fmd_zcache_class_bytes(class);
+			z->nr_entries++;
+			z->nr_stored++;
+			e = NULL;
+		}
+		spin_unlock(&fmd->lock);
+
+		if (e)
+			kmem_cache_free(z->class[class], e);
+	}
+	z->nr_staged = 0;
+}
+
+/*
+ * Decompress page index into dst, a new frame for it, and remove it
+ * from the pool.  Returns false if the pool doesn't have the page.
+ * Caller holds fmd->lock.
+ */
+bool
+fmd_zcache_load(struct fmd_device_t *fmd, pgoff_t index, void *dst)
+{
+	struct fmd_cache_t *cache = (struct fmd_cache_t *) fmd->cache;
+	struct fmd_zcache_t *z = cache->zcache;
+	struct fmd_zentry_t *e;
+	u64 start;
+	int len;
+
+	if (!z)
+		return false;
+	e = radix_tree_lookup(&z->tree, index);
+	if (!e)
+		return false;
+	if (e == FMD_ZCACHE_PENDING) {
+		radix_tree_delete(&z->tree, index);
+		return false;
+	}
+
+	start = ktime_get_ns();
+	len = LZ4_decompress_safe(e->data, dst, e->len, PAGE_SIZE);
+	z->decompress_ns += ktime_get_ns() - start;
+	fmd_zcache_free(z, e);
+
+	if (WARN_ON_ONCE(len != PAGE_SIZE))
+		return false;
+	z->nr_loaded++;
+	return true;
+}
+
+/* Forget page index, which is being written.  Caller holds fmd->lock */
+void
+fmd_zcache_invalidate(struct fmd_device_t *fmd, pgoff_t index)
+{
+	struct fmd_cache_t *cache = (struct fmd_cache_t *) fmd->cache;
+	struct fmd_zcache_t *z = cache->zcache;
+	struct fmd_zentry_t *e;
+
+	if (!z)
+		return;
+	e = radix_tree_lookup(&z->tree, index);
+	if (e == FMD_ZCACHE_PENDING)
+		radix_tree_delete(&z->tree, index);
+	else if (e)
+		fmd_zcache_free(z, e);
+}
+
+/*
+ * Enable the pool with room for pct percent of the cache size in
+ * compressed pages, 0 = disabled.
+ */
+int
+fmd_zcache_init(struct fmd_device_t *fmd, unsigned int pct)
+{
+	struct fmd_cache_t *cache;
+	struct fmd_zcache_t *z;
+	char name[32];
+	unsigned int i;
+
+	BUG_ON(!fmd || !fmd->cache);
+	cache = (struct fmd_cache_t *) fmd->cache;
+
+	printk(KERN_INFO "%s: %s\n", fmd->dev_name, __func__);
+
+	cache->zcache = NULL;
+	if (!pct)
+		return 0;
+	if (pct > FMD_ZCACHE_MAX_PCT)
+		return -EINVAL;
+
+	z = kzalloc(sizeof(struct fmd_zcache_t), GFP_KERNEL);
+	if (!z)
+		return -ENOMEM;
+	cache->zcache = z;
+
+	INIT_RADIX_TREE(&z->tree, GFP_ATOMIC);
+	INIT_LIST_HEAD(&z->lru);
+	z->max_bytes = div_u64((u64) cache->nr_pages_cache * PAGE_SIZE * pct, 100);
+
+	for (i = 0; i < FMD_ZCACHE_NR_CLASSES; i++) {
+		snprintf(name, sizeof(name), "%s_z%u", fmd->dev_name,
+			 fmd_zcache_class_bytes(i));
+		z->class[i] = kmem_cache_create(name, fmd_zcache_class_bytes(i), 0, 0, NULL);
+		if (!z->class[i])
+			goto err;
+	}
+
+	z->stage = vmalloc(FMD_ZCACHE_STAGE_PAGES * PAGE_SIZE);
+	z->wrkmem = vmalloc(LZ4_MEM_COMPRESS);
+	z->dst = kmalloc(FMD_ZCACHE_MAX_LEN, GFP_KERNEL);
+	if (!z->stage || !z->wrkmem || !z->dst)
+		goto err;
+
+	printk(KERN_INFO "%s: %s: %llu MB pool\n", fmd->dev_name, __func__,
+	       z->max_bytes >> 20);
+	return 0;
+
+err:
+	fmd_zcache_cleanup(fmd);
+	return -ENOMEM;
+}
+
+/* Empty and free the pool.  Safe to call if init failed */
+void
+fmd_zcache_cleanup(struct fmd_device_t *fmd)
+{
+	struct fmd_cache_t *cache = (struct fmd_cache_t *) fmd->cache;
+	struct fmd_zcache_t *z = cache->zcache;
+	unsigned int i;
+
+	if (!z)
+		return;
+
+	while (!list_empty(&z->lru))
+		fmd_zcache_free(z, list_first_entry(&z->lru, struct fmd_zentry_t, lru));
+
+	kfree(z->dst);
+	vfree(z->wrkmem);
+	vfree(z->stage);
+	for (i = 0; i < FMD_ZCACHE_NR_CLASSES; i++) {
+		if (z->class[i])
+			kmem_cache_destroy(z->class[i]);
+	}
+	kfree(z);
+	cache->zcache = NULL;
+}
+
+#endif /* FMD_ZCACHE */
+
+/*-------------------------------------------------------------*/
+/*--------------------   Sysfs Functions   --------------------*/
+/*-------------------------------------------------------------*/
+
+static inline struct fmd_zcache_t *fmd_zcache_from_dev(struct device *dev)
+{
+	return ((struct fmd_cache_t *) fmd_from_dev(dev)->cache)->zcache;
+}
+
+/* Most bytes the pool may allocate */
+static ssize_t max_bytes_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct fmd_zcache_t *z = fmd_zcache_from_dev(dev);
+
+	if (!z)
+		return -ENODEV;
+	return sprintf(buf, "%llu\n", READ_ONCE(z->max_bytes));
+}
+
+/* Lowering the limit drops the oldest pages */
+static ssize_t max_bytes_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t len)
+{
+	struct fmd_device_t *fmd = fmd_from_dev(dev);
+	struct fmd_zcache_t *z = fmd_zcache_from_dev(dev);
+	u64 val;
+	int err;
+
+	if (!z)
+		return -ENODEV;
+
+	err = kstrtoull(buf, 0, &val);
+	if (err)
+		return err;
+
+	spin_lock(&fmd->lock);
+	z->max_bytes = val;
+#if FMD_ZCACHE
+	fmd_zcache_make_room(z, 0);
+#endif
+	spin_unlock(&fmd->lock);
+
+	printk(KERN_INFO "%s: %s: %llu\n", fmd->dev_name, __func__, val);
+	return len;
+}
+static DEVICE_ATTR_RW(max_bytes);
+
+/* "<pages> <bytes allocated> <compression ratio>" */
+static ssize_t pool_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct fmd_device_t *fmd = fmd_from_dev(dev);
+	struct fmd_zcache_t *z = fmd_zcache_from_dev(dev);
+	u64 pages, bytes, ratio100 = 0;
+
+	if (!z)
+		return -ENODEV;
+
+	spin_lock(&fmd->lock);
+	pages = z->nr_entries;
+	bytes = z->nr_bytes;
+	spin_unlock(&fmd->lock);
+
+	if (bytes)
+		ratio100 = div64_u64(pages * PAGE_SIZE * 100, bytes);
+
+	return sprintf(buf, "%llu %llu %llu.%02llu\n", pages, bytes,
+		       div_u64(ratio100, 100), ratio100 % 100);
+}
+static DEVICE_ATTR_RO(pool);
+
+/* "<stored> <rejected> <loaded> <dropped>" */
+static ssize_t pages_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct fmd_device_t *fmd = fmd_from_dev(dev);
+	struct fmd_zcache_t *z = fmd_zcache_from_dev(dev);
+	u64 stored, rejected, loaded, dropped;
+
+	if (!z)
+		return -ENODEV;
+
+	spin_lock(&fmd->lock);
+	stored = z->nr_stored;
+	rejected = z->nr_rejected;
+	loaded = z->nr_loaded;
+	dropped = z->nr_dropped;
+	spin_unlock(&fmd->lock);
+
+	return sprintf(buf, "%llu %llu %llu %llu\n", stored, rejected, loaded, dropped);
+}
+static DEVICE_ATTR_RO(pages);
+
+/* "<average compress ns> <average decompress ns>" */
+static ssize_t latency_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct fmd_device_t *fmd = fmd_from_dev(dev);
+	struct fmd_zcache_t *z = fmd_zcache_from_dev(dev);
+	u64 comp = 0, decomp = 0;
+
+	if (!z)
+		return -ENODEV;
+
+	spin_lock(&fmd->lock);
+	if (z->nr_stored + z->nr_rejected)
+		comp = div64_u64(z->compress_ns, z->nr_stored + z->nr_rejected);
+	if (z->nr_loaded)
+		decomp = div64_u64(z->decompress_ns, z->nr_loaded);
+	spin_unlock(&fmd->lock);
+
+	return sprintf(buf, "%llu %llu\n", comp, decomp);
+}
+static DEVICE_ATTR_RO(latency);
+
+static struct attribute *fmd_zcache_attrs[] = {
+	&dev_attr_max_bytes.attr,
+	&dev_attr_pool.attr,
+	&dev_attr_pages.attr,
+	&dev_attr_latency.attr,
+	NULL,
+};
+
+const struct attribute_group fmd_zcache_attr_group = {
+	.name = "zcache",
+	.attrs = fmd_zcache_attrs,
+};
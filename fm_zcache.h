@@ -0,0 +1,108 @@
+/*************************************************************************
+ *
+ * Fusion Memory Confidential
+ * __________________
+ *
+ *  Fusion Memory Incorporated
+ *  All Rights Reserved.
+ *
+ * NOTICE:  All information contained herein is, and remains
+ * the property of Fusion Memory and its suppliers, if any.
+ * The intellectual and technical concepts contained herein are
+ * proprietary to Fusion Memory and its suppliers and may be covered by
+ * U.S. and Foreign Patents, patents in process, and are protected by
+ * trade secret or copyright law. Dissemination of this information or
+ * reproduction of this material is strictly forbidden unless prior
+ * written permission is obtained from Fusion Memory.
+ */
+
+
+#ifndef FM_ZCACHE_H
+#define FM_ZCACHE_H
+
+#include <linux/version.h>
+#include <linux/types.h>
+#include <linux/list.h>
+#include <linux/radix-tree.h>
+#include <linux/sysfs.h>
+#include "fm_dsk.h"
+
+/* The LZ4_compress_default API is 4.11's */
+#define FMD_ZCACHE	(LINUX_VERSION_CODE >= KERNEL_VERSION(4,11,0) && \
+			 IS_ENABLED(CONFIG_LZ4_COMPRESS) && \
+			 IS_ENABLED(CONFIG_LZ4_DECOMPRESS))
+
+#define FMD_ZCACHE_CLASS_SIZE	256	/* pool allocation granularity */
+#define FMD_ZCACHE_NR_CLASSES	12	/* larger pages aren't worth keeping */
+#define FMD_ZCACHE_MAX_PCT	100	/* of the cache size */
+#define FMD_ZCACHE_STAGE_PAGES	32	/* a reclaim batch, FMD_WB_BATCH */
+
+/* Compressed copy of a clean page */
+struct fmd_zentry_t {
+	struct list_head lru;
+	pgoff_t index;
+	u16 len;
+	u8 class;
+	u8 data[];
+};
+
+/*
+ * Pool of compressed pages behind the cache frames.  Protected by
+ * fmd->lock, like the cache.
+ */
+struct fmd_zcache_t {
+	struct radix_tree_root tree;	/* page index to entry */
+	struct list_head lru;		/* oldest first */
+	struct kmem_cache *class[FMD_ZCACHE_NR_CLASSES];
+	u64 max_bytes;			/* of the pool's allocations */
+	u64 nr_bytes;
+	u64 nr_entries;
+
+	/* Reclaim worker only: frames copied out to be compressed once
+	 * fmd->lock is dropped, and the compression buffers */
+	u8 *stage;			/* FMD_ZCACHE_STAGE_PAGES pages */
+	pgoff_t stage_index[FMD_ZCACHE_STAGE_PAGES];
+	unsigned int nr_staged;
+	void *wrkmem;
+	u8 *dst;
+
+	/* Statistics */
+	u64 nr_stored;
+	u64 nr_rejected;		/* incompressible or no memory */
+	u64 nr_loaded;
+	u64 nr_dropped;			/* to make room */
+	u64 compress_ns;
+	u64 decompress_ns;
+};
+
+#if FMD_ZCACHE
+
+int fmd_zcache_init(struct fmd_device_t *fmd, unsigned int pct);
+void fmd_zcache_cleanup(struct fmd_device_t *fmd);
+void fmd_zcache_stage(struct fmd_device_t *fmd, pgoff_t index,
+		const void __iomem *src);
+void fmd_zcache_store_staged(struct fmd_device_t *fmd);
+bool fmd_zcache_load(struct fmd_device_t *fmd, pgoff_t index, void *dst);
+void fmd_zcache_invalidate(struct fmd_device_t *fmd, pgoff_t index);
+
+#else  /* !FMD_ZCACHE */
+
+static inline int fmd_zcache_init(struct fmd_device_t *fmd, unsigned int pct)
+{
+	return 0;
+}
+static inline void fmd_zcache_cleanup(struct fmd_device_t *fmd) { }
+static inline void fmd_zcache_stage(struct fmd_device_t *fmd, pgoff_t index,
+		const void __iomem *src) { }
+static inline void fmd_zcache_store_staged(struct fmd_device_t *fmd) { }
+static inline bool fmd_zcache_load(struct fmd_device_t *fmd, pgoff_t index, void *dst)
+{
+	return false;
+}
+static inline void fmd_zcache_invalidate(struct fmd_device_t *fmd, pgoff_t index) { }
+
+#endif /* FMD_ZCACHE */
+
+extern const struct attribute_group fmd_zcache_attr_group;
+
+#endif /* FM_ZCACHE_H */
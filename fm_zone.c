@@ -0,0 +1,363 @@
+/*************************************************************************
+ *
+ * Fusion Memory Confidential
+ * __________________
+ *
+ *  Fusion Memory Incorporated
+ *  All Rights Reserved.
+ *
+ * NOTICE:  All information contained herein is, and remains
+ * the property of Fusion Memory and its suppliers, if any.
+ * The intellectual and technical concepts contained herein are
+ * proprietary to Fusion Memory and its suppliers and may be covered by
+ * U.S. and Foreign Patents, patents in process, and are protected by
+ * trade secret or copyright law. Dissemination of this information or
+ * reproduction of this material is strictly forbidden unless prior
+ * written permission is obtained from Fusion Memory.
+ */
+
+
+/*
+ * fm_zone - Host-managed zoned block device mode
+ *
+ * The region is split into equal, power of 2 sized sequential write
+ * required zones.  Write pointers and zone conditions are kept in DRAM
+ * only, so every zone starts out empty when the driver is loaded.
+ * Writes must land on their zone's write pointer; zone append writes
+ * wherever the pointer is and returns the sector written.  Resetting a
+ * zone just rewinds its pointer (and drops its cached pages), so the
+ * flash tier only ever sees sequential write streams.
+ */
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/version.h>
+#include <linux/blkdev.h>
+#include <linux/bio.h>
+#include <linux/highmem.h>
+#include <linux/vmalloc.h>
+#include <linux/log2.h>
+#include "fm_dsk.h"
+#include "fm_zone.h"
+#include "fm_cache.h"
+#include "fm_ioctl.h"
+
+#if FMD_ZONED
+
+int fmd_zone_init(struct fmd_device_t *fmd, unsigned int zone_mb)
+{
+	struct request_queue *q = fmd->queue;
+	struct fmd_zoned_t *zoned;
+	sector_t zone_sectors;
+	unsigned int nr_zones, i;
+
+	if (!zone_mb)
+		return 0;
+
+	zone_sectors = rounddown_pow_of_two((unsigned long) zone_mb << (20 - SECTOR_SHIFT));
+	nr_zones = div64_u64(get_capacity(fmd->disk), zone_sectors);
+	printk(KERN_INFO "%s: %s: %u zones of %llu sectors\n", fmd->dev_name, __func__, nr_zones, (u64) zone_sectors);
+	if (!nr_zones) {
+		printk(KERN_ERR "%s: %s: ERROR: zone size larger than the device\n", fmd->dev_name, __func__);
+		return -EINVAL;
+	}
+
+	zoned = vzalloc(sizeof(struct fmd_zoned_t) + nr_zones * sizeof(struct fmd_zone_t));
+	if (!zoned)
+		return -ENOMEM;
+
+	zoned->zone_sectors = zone_sectors;
+	zoned->zone_shift = ilog2(zone_sectors);
+	zoned->nr_zones = nr_zones;
+	for (i = 0; i < nr_zones; i++) {
+		spin_lock_init(&zoned->zones[i].lock);
+		zoned->zones[i].wp = (sector_t) i << zoned->zone_shift;
+		zoned->zones[i].cond = BLK_ZONE_COND_EMPTY;
+	}
+	fmd->zoned = zoned;
+
+	/* Zone sized chunks, fmd_make_request splits the bios crossing a
+	 * zone by them.  A partial last zone isn't exposed */
+	q->limits.zoned = BLK_ZONED_HM;
+	blk_queue_chunk_sectors(q, zone_sectors);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,20,0)
+	q->nr_zones = nr_zones;
+#endif
+#if FMD_ZONE_RESET_ALL
+	blk_queue_flag_set(QUEUE_FLAG_ZONE_RESETALL, q);
+#endif
+#if FMD_ZONE_APPEND
+	blk_queue_max_zone_append_sectors(q, zone_sectors);
+#endif
+#ifdef QUEUE_FLAG_NOWAIT
+	/* fmd_zone_bio moves the write pointer before the bio is copied,
+	 * so a write can't fail with -EAGAIN after it */
+	blk_queue_flag_clear(QUEUE_FLAG_NOWAIT, q);
+#endif
+	set_capacity(fmd->disk, (sector_t) nr_zones << zoned->zone_shift);
+
+	return 0;
+}
+
+void fmd_zone_cleanup(struct fmd_device_t *fmd)
+{
+	if (!fmd->zoned)
+		return;
+
+	printk(KERN_INFO "%s: %s\n", fmd->dev_name, __func__);
+
+	vfree(fmd->zoned);
+	fmd->zoned = NULL;
+}
+
+/* Snapshot a zone for a zone report */
+static void fmd_zone_info(struct fmd_zoned_t *zoned, unsigned int i,
+			  struct blk_zone *blkz)
+{
+	struct fmd_zone_t *zone = &zoned->zones[i];
+
+	memset(blkz, 0, sizeof(*blkz));
+	blkz->start = (sector_t) i << zoned->zone_shift;
+	blkz->len = zoned->zone_sectors;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,9,0)
+	blkz->capacity = zoned->zone_sectors;
+#endif
+	blkz->type = BLK_ZONE_TYPE_SEQWRITE_REQ;
+
+	spin_lock(&zone->lock);
+	blkz->wp = zone->wp;
+	blkz->cond = zone->cond;
+	spin_unlock(&zone->lock);
+}
+
+/*-------------------------------------------------------------*/
+/*----------------   Zone Management Functions   --------------*/
+/*-------------------------------------------------------------*/
+
+/* Rewind a zone and drop its cached pages, the data is discarded */
+static void fmd_zone_reset(struct fmd_device_t *fmd, unsigned int i)
+{
+	struct fmd_zoned_t *zoned = (struct fmd_zoned_t *) fmd->zoned;
+	struct fmd_zone_t *zone = &zoned->zones[i];
+	sector_t start = (sector_t) i << zoned->zone_shift;
+	bool empty;
+
+	spin_lock(&zone->lock);
+	empty = (zone->cond == BLK_ZONE_COND_EMPTY);
+	zone->wp = start;
+	zone->cond = BLK_ZONE_COND_EMPTY;
+	spin_unlock(&zone->lock);
+
+	if (CACHE_PAGES && !empty)
+		fmd_cache_hint(fmd, start, zoned->zone_sectors, FMD_HINT_DONTNEED);
+}
+
+#if FMD_ZONE_OPEN_CLOSE
+static void fmd_zone_open(struct fmd_zone_t *zone)
+{
+	spin_lock(&zone->lock);
+	if (zone->cond != BLK_ZONE_COND_FULL)
+		zone->cond = BLK_ZONE_COND_EXP_OPEN;
+	spin_unlock(&zone->lock);
+}
+
+static void fmd_zone_close(struct fmd_zone_t *zone, sector_t start)
+{
+	spin_lock(&zone->lock);
+	if (zone->cond == BLK_ZONE_COND_IMP_OPEN ||
+	    zone->cond == BLK_ZONE_COND_EXP_OPEN)
+		zone->cond = (zone->wp == start) ? BLK_ZONE_COND_EMPTY :
+						   BLK_ZONE_COND_CLOSED;
+	spin_unlock(&zone->lock);
+}
+
+static void fmd_zone_finish(struct fmd_zone_t *zone, sector_t end)
+{
+	spin_lock(&zone->lock);
+	zone->wp = end;
+	zone->cond = BLK_ZONE_COND_FULL;
+	spin_unlock(&zone->lock);
+}
+#endif
+
+/*
+ * Check a write against its zone's write pointer and advance the pointer.
+ * A zone append is redirected to the write pointer, which the block layer
+ * returns to the submitter as the bio's sector.
+ */
+static int fmd_zone_write(struct fmd_zoned_t *zoned, struct bio *bio, bool append)
+{
+	sector_t sector = bio->bi_iter.bi_sector;
+	unsigned int nr_sectors = bio->bi_iter.bi_size >> SECTOR_SHIFT;
+	unsigned int i = sector >> zoned->zone_shift;
+	struct fmd_zone_t *zone = &zoned->zones[i];
+	sector_t end = ((sector_t) i + 1) << zoned->zone_shift;
+	int err = 0;
+
+	/* Empty flushes carry no data */
+	if (!nr_sectors)
+		return 0;
+
+	spin_lock(&zone->lock);
+	if (append) {
+		if (sector & (zoned->zone_sectors - 1))
+			err = -EIO;
+		sector = zone->wp;
+	}
+	if (err || zone->cond == BLK_ZONE_COND_FULL || sector != zone->wp ||
+	    nr_sectors > end - zone->wp) {
+		err = -EIO;
+	} else {
+		zone->wp += nr_sectors;
+		if (zone->wp == end)
+			zone->cond = BLK_ZONE_COND_FULL;
+		else if (zone->cond != BLK_ZONE_COND_EXP_OPEN)
+			zone->cond = BLK_ZONE_COND_IMP_OPEN;
+	}
+	spin_unlock(&zone->lock);
+
+	if (!err && append)
+		bio->bi_iter.bi_sector = sector;
+	return err;
+}
+
+#if FMD_ZONE_REPORT_BIO
+/*
+ * REQ_OP_ZONE_REPORT: fill the bio's pages with a blk_zone_report_hdr
+ * followed by the zones from the bio's sector on.
+ */
+static void fmd_zone_report_bio(struct fmd_zoned_t *zoned, struct bio *bio)
+{
+	struct blk_zone_report_hdr *hdr;
+	unsigned int i = bio->bi_iter.bi_sector >> zoned->zone_shift;
+	unsigned int nr = 0, ofst;
+	struct bio_vec bvec;
+	struct bvec_iter iter;
+	bool first = true;
+	void *addr;
+
+	bio_for_each_segment(bvec, bio, iter) {
+		addr = kmap_atomic(bvec.bv_page);
+		ofst = bvec.bv_offset;
+		if (first)
+			ofst += sizeof(struct blk_zone_report_hdr);
+		first = false;
+		while (ofst + sizeof(struct blk_zone) <= bvec.bv_offset + bvec.bv_len &&
+		       i < zoned->nr_zones) {
+			fmd_zone_info(zoned, i++, addr + ofst);
+			ofst += sizeof(struct blk_zone);
+			nr++;
+		}
+		kunmap_atomic(addr);
+	}
+
+	/* The header is at the start of the first segment */
+	bvec = bio_iovec(bio);
+	addr = kmap_atomic(bvec.bv_page);
+	hdr = addr + bvec.bv_offset;
+	memset(hdr, 0, sizeof(*hdr));
+	hdr->nr_zones = nr;
+	kunmap_atomic(addr);
+}
+#else
+/* Report up to nr_zones zones from sector on, through the block layer */
+#if FMD_ZONE_REPORT_CB
+int fmd_zone_report_zones(struct gendisk *disk, sector_t sector,
+			  unsigned int nr_zones, report_zones_cb cb, void *data)
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(5,4,0)
+int fmd_zone_report_zones(struct gendisk *disk, sector_t sector,
+			  struct blk_zone *zones, unsigned int *nr_zones)
+#else
+int fmd_zone_report_zones(struct gendisk *disk, sector_t sector,
+			  struct blk_zone *zones, unsigned int *nr_zones,
+			  gfp_t gfp_mask)
+#endif
+{
+	struct fmd_device_t *fmd = disk->private_data;
+	struct fmd_zoned_t *zoned = (struct fmd_zoned_t *) fmd->zoned;
+	unsigned int i = sector >> zoned->zone_shift;
+	unsigned int n;
+#if FMD_ZONE_REPORT_CB
+	struct blk_zone blkz;
+	int err;
+
+	for (n = 0; n < nr_zones && i < zoned->nr_zones; n++, i++) {
+		fmd_zone_info(zoned, i, &blkz);
+		err = cb(&blkz, n, data);
+		if (err)
+			return err;
+	}
+	return n;
+#else
+	for (n = 0; n < *nr_zones && i < zoned->nr_zones; n++, i++)
+		fmd_zone_info(zoned, i, &zones[n]);
+	*nr_zones = n;
+	return 0;
+#endif
+}
+#endif
+
+/*
+ * Apply zone rules to a bio before it reaches the data path.
+ * Returns 0 if the bio should be processed as a read or write, 1 if it
+ * was a zone management request that is now complete, or -EIO.
+ */
+int fmd_zone_bio(struct fmd_device_t *fmd, struct bio *bio)
+{
+	struct fmd_zoned_t *zoned = (struct fmd_zoned_t *) fmd->zoned;
+	sector_t sector = bio->bi_iter.bi_sector;
+	unsigned int i = sector >> zoned->zone_shift;
+	unsigned int op = bio_op(bio);
+
+	if (i >= zoned->nr_zones)
+		return -EIO;
+
+	switch (op) {
+	case REQ_OP_READ:
+		return 0;
+	case REQ_OP_WRITE:
+		return fmd_zone_write(zoned, bio, false);
+#if FMD_ZONE_APPEND
+	case REQ_OP_ZONE_APPEND:
+		return fmd_zone_write(zoned, bio, true);
+#endif
+#if FMD_ZONE_REPORT_BIO
+	case REQ_OP_ZONE_REPORT:
+		fmd_zone_report_bio(zoned, bio);
+		return 1;
+#endif
+#if FMD_ZONE_RESET_ALL
+	case REQ_OP_ZONE_RESET_ALL:
+		for (i = 0; i < zoned->nr_zones; i++)
+			fmd_zone_reset(fmd, i);
+		return 1;
+#endif
+	default:
+		break;
+	}
+
+	/* Remaining operations address a single zone by its start */
+	if (sector & (zoned->zone_sectors - 1))
+		return -EIO;
+
+	switch (op) {
+	case REQ_OP_ZONE_RESET:
+		fmd_zone_reset(fmd, i);
+		return 1;
+#if FMD_ZONE_OPEN_CLOSE
+	case REQ_OP_ZONE_OPEN:
+		fmd_zone_open(&zoned->zones[i]);
+		return 1;
+	case REQ_OP_ZONE_CLOSE:
+		fmd_zone_close(&zoned->zones[i], sector);
+		return 1;
+	case REQ_OP_ZONE_FINISH:
+		fmd_zone_finish(&zoned->zones[i], sector + zoned->zone_sectors);
+		return 1;
+#endif
+	default:
+		return -EIO;
+	}
+}
+
+#endif /* FMD_ZONED */
@@ -0,0 +1,90 @@
+/*************************************************************************
+ *
+ * Fusion Memory Confidential
+ * __________________
+ *
+ *  Fusion Memory Incorporated
+ *  All Rights Reserved.
+ *
+ * NOTICE:  All information contained herein is, and remains
+ * the property of Fusion Memory and its suppliers, if any.
+ * The intellectual and technical concepts contained herein are
+ * proprietary to Fusion Memory and its suppliers and may be covered by
+ * U.S. and Foreign Patents, patents in process, and are protected by
+ * trade secret or copyright law. Dissemination of this information or
+ * reproduction of this material is strictly forbidden unless prior
+ * written permission is obtained from Fusion Memory.
+ */
+
+
+#ifndef FM_ZONE_H
+#define FM_ZONE_H
+
+#include <linux/version.h>
+#include <linux/spinlock.h>
+#include <linux/blkdev.h>
+#include "fm_dsk.h"
+
+/*
+ * Host-managed zoned mode.  Zone reset and report need 4.10; report
+ * moved from a bio to block_device_operations in 4.20, and took a
+ * callback in 5.5 along with zone open/close/finish.  Reset all needs
+ * 5.2 and zone append 5.8.
+ */
+#if defined(CONFIG_BLK_DEV_ZONED) && LINUX_VERSION_CODE >= KERNEL_VERSION(4,10,0)
+#define FMD_ZONED 1
+#else
+#define FMD_ZONED 0
+#endif
+
+#define FMD_ZONE_REPORT_BIO	(LINUX_VERSION_CODE < KERNEL_VERSION(4,20,0))
+#define FMD_ZONE_REPORT_CB	(LINUX_VERSION_CODE >= KERNEL_VERSION(5,5,0))
+#define FMD_ZONE_RESET_ALL	(LINUX_VERSION_CODE >= KERNEL_VERSION(5,2,0))
+#define FMD_ZONE_OPEN_CLOSE	(LINUX_VERSION_CODE >= KERNEL_VERSION(5,5,0))
+#define FMD_ZONE_APPEND		(LINUX_VERSION_CODE >= KERNEL_VERSION(5,8,0))
+
+#if FMD_ZONED
+
+/* Write pointer and condition (BLK_ZONE_COND_*) of a sequential zone */
+struct fmd_zone_t {
+	spinlock_t lock;
+	sector_t wp;
+	u8 cond;
+};
+
+struct fmd_zoned_t {
+	sector_t zone_sectors;		/* power of 2 */
+	unsigned int zone_shift;
+	unsigned int nr_zones;
+	struct fmd_zone_t zones[];
+};
+
+int fmd_zone_init(struct fmd_device_t *fmd, unsigned int zone_mb);
+void fmd_zone_cleanup(struct fmd_device_t *fmd);
+int fmd_zone_bio(struct fmd_device_t *fmd, struct bio *bio);
+
+#if !FMD_ZONE_REPORT_BIO
+#if FMD_ZONE_REPORT_CB
+int fmd_zone_report_zones(struct gendisk *disk, sector_t sector,
+			  unsigned int nr_zones, report_zones_cb cb, void *data);
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(5,4,0)
+int fmd_zone_report_zones(struct gendisk *disk, sector_t sector,
+			  struct blk_zone *zones, unsigned int *nr_zones);
+#else
+int fmd_zone_report_zones(struct gendisk *disk, sector_t sector,
+			  struct blk_zone *zones, unsigned int *nr_zones,
+			  gfp_t gfp_mask);
+#endif
+#endif
+
+#else  /* !FMD_ZONED */
+
+static inline int fmd_zone_init(struct fmd_device_t *fmd, unsigned int zone_mb)
+{
+	return zone_mb ? -EOPNOTSUPP : 0;
+}
+static inline void fmd_zone_cleanup(struct fmd_device_t *fmd) { }
+
+#endif /* FMD_ZONED */
+
+#endif /* FM_ZONE_H */
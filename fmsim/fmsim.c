@@ -0,0 +1,851 @@
+/*************************************************************************
+ *
+ * Fusion Memory Confidential
+ * __________________
+ *
+ *  Fusion Memory Incorporated
+ *  All Rights Reserved.
+ *
+ * NOTICE:  All information contained herein is, and remains
+ * the property of Fusion Memory and its suppliers, if any.
+ * The intellectual and technical concepts contained herein are
+ * proprietary to Fusion Memory and its suppliers and may be covered by
+ * U.S. and Foreign Patents, patents in process, and are protected by
+ * trade secret or copyright law. Dissemination of this information or
+ * reproduction of this material is strictly forbidden unless prior
+ * written permission is obtained from Fusion Memory.
+ */
+
+
+/*
+ * fmsim - Replay a block trace against the fmdsk DRAM cache.
+ *
+ * fm_cache.c is compiled unmodified against fmsim_kernel.h, so the
+ * eviction, writeback, admission and write policies simulated here are
+ * the driver's own.  Each trace record is issued like a bio through
+ * fmd_make_request, its segments go through the same setup and copy
+ * decisions as fmd_do_seg, and the reclaim and prefetch workers
+ * run between records.  No data is copied: the dsk is only a byte
+ * counter, and cache frames are never touched.
+ *
+ * Each (cache size, write policy) pair is replayed from a cold cache and
+ * reported as one row.
+ */
+
+#include <getopt.h>
+#include <sys/mman.h>
+
+#include "fm_dsk.h"
+#include "fm_cache.h"
+#include "fm_copy.h"
+#include "fm_stripe.h"
+
+#define FMSIM_NR_SIZES		16
+#define FMSIM_LINE		512
+
+/* Trace record operations */
+#define FMSIM_OP_READ		0
+#define FMSIM_OP_WRITE		1
+#define FMSIM_OP_FLUSH		2
+
+struct fmsim_req_t {
+	u64 time_ns;		/* 0 if the trace has no timestamps */
+	sector_t sector;
+	unsigned int bytes;
+	int op;
+};
+
+struct fmsim_trace_t {
+	struct fmsim_req_t *req;
+	unsigned long nr_req;
+	unsigned long nr_alloc;
+	unsigned long nr_skipped;	/* discards, other actions, bad lines */
+	sector_t end;			/* highest sector touched */
+	bool timed;
+};
+
+/* Cost of moving one page, in ns.  Set them from the copy/bandwidth
+ * attribute of the target device */
+struct fmsim_cost_t {
+	unsigned int dram_ns;
+	unsigned int flash_rd_ns;
+	unsigned int flash_wr_ns;
+};
+
+struct fmsim_opts_t {
+	u64 sizes[FMSIM_NR_SIZES];
+	int nr_sizes;
+	int modes[FMD_CACHE_NR_MODES];
+	int nr_modes;
+	int evict;
+	int wmark[FMD_NR_WMARKS];
+	unsigned int seq_cutoff;
+	unsigned int bypass_bio_size;
+	u64 dsk_bytes;
+	char action;
+	struct fmsim_cost_t cost;
+};
+
+struct fmsim_result_t {
+	u64 rd_pages, rd_hits;
+	u64 wr_pages, wr_hits;
+	u64 *lat_ns;		/* per data request */
+	unsigned long nr_lat;
+	u64 flush_ns;		/* all flushes */
+};
+
+static const char *fmsim_mode_names[FMD_CACHE_NR_MODES] = {
+	[FMD_CACHE_MODE_WRITEBACK]	= "writeback",
+	[FMD_CACHE_MODE_WRITETHROUGH]	= "writethrough",
+	[FMD_CACHE_MODE_WRITEAROUND]	= "writearound",
+};
+
+
+/*-------------------------------------------------------------*/
+/*--------------------   Kernel Shims   -----------------------*/
+/*-------------------------------------------------------------*/
+
+int fmsim_verbose;
+unsigned long jiffies;
+struct fmsim_io_t fmsim_io;
+
+/* Queued work of every workqueue, in queueing order */
+static struct list_head fmsim_work_list = { &fmsim_work_list, &fmsim_work_list };
+
+/* fmsim never sets fmd->copy, so the large copy routine is unreachable */
+void fmd_copy_large(struct fmd_copy_t *copy, int dir, void *dst,
+		    const void *src, size_t n)
+{
+	BUG_ON(1);
+}
+
+/* Nor fmd->wipe, so the region is never read or written through it */
+void fmd_wipe_read(struct fmd_device_t *fmd, void *dst, sector_t sector, size_t n)
+{
+	BUG_ON(1);
+}
+
+void fmd_wipe_write(struct fmd_device_t *fmd, sector_t sector, const void *src, size_t n)
+{
+	BUG_ON(1);
+}
+
+/* Nor fmd->emul, so copies are never delayed */
+void __fmd_emul_end(struct fmd_device_t *fmd, int tier, int dir, u64 start, size_t n)
+{
+	BUG_ON(1);
+}
+
+void __fmd_emul_settle(struct fmd_device_t *fmd, bool nowait)
+{
+	BUG_ON(1);
+}
+
+/* Nor fmd->backing, so no page is marked for a backing file */
+void fmd_backing_dirty(struct fmd_device_t *fmd, sector_t sector, size_t n)
+{
+	BUG_ON(1);
+}
+
+void sort(void *base, size_t num, size_t size,
+	  int (*cmp)(const void *, const void *), void *swap)
+{
+	qsort(base, num, size, cmp);
+}
+
+struct workqueue_struct *alloc_workqueue(const char *fmt, unsigned int flags,
+					 int max_active, ...)
+{
+	return calloc(1, sizeof(struct workqueue_struct));
+}
+
+bool queue_work(struct workqueue_struct *wq, struct work_struct *work)
+{
+	if (work->pending)
+		return false;
+	work->pending = true;
+	work->wq = wq;
+	list_add_tail(&work->entry, &fmsim_work_list);
+	return true;
+}
+
+bool cancel_work_sync(struct work_struct *work)
+{
+	if (!work->pending)
+		return false;
+	list_del_init(&work->entry);
+	work->pending = false;
+	return true;
+}
+
+/* Run queued work of wq, or of every queue if wq is NULL */
+static void fmsim_run_queue(struct workqueue_struct *wq)
+{
+	struct list_head *pos, *next;
+	struct work_struct *work;
+
+	for (pos = fmsim_work_list.next; pos != &fmsim_work_list; pos = next) {
+		next = pos->next;
+		work = list_entry(pos, struct work_struct, entry);
+		if (wq && work->wq != wq)
+			continue;
+		list_del_init(&work->entry);
+		work->pending = false;
+		work->func(work);	/* may free work or queue more */
+		next = fmsim_work_list.next;
+	}
+}
+
+void fmsim_run_work(void)
+{
+	fmsim_run_queue(NULL);
+}
+
+/* Like the kernel, drain the queue before destroying it */
+void destroy_workqueue(struct workqueue_struct *wq)
+{
+	fmsim_run_queue(wq);
+	free(wq);
+}
+
+bool sysfs_streq(const char *s1, const char *s2)
+{
+	size_t n1 = strcspn(s1, "\n");
+	size_t n2 = strcspn(s2, "\n");
+
+	return n1 == n2 && !strncmp(s1, s2, n1);
+}
+
+int kstrtoull(const char *s, unsigned int base, unsigned long long *res)
+{
+	char *end;
+
+	errno = 0;
+	*res = strtoull(s, &end, base);
+	if (errno || end == s || (*end && *end != '\n'))
+		return -EINVAL;
+	return 0;
+}
+
+int kstrtouint(const char *s, unsigned int base, unsigned int *res)
+{
+	unsigned long long val;
+	int err;
+
+	err = kstrtoull(s, base, &val);
+	if (err)
+		return err;
+	if (val > UINT32_MAX)
+		return -ERANGE;
+	*res = val;
+	return 0;
+}
+
+
+/*-------------------------------------------------------------*/
+/*--------------------   Trace Parsing   ----------------------*/
+/*-------------------------------------------------------------*/
+
+static void fmsim_trace_add(struct fmsim_trace_t *trace, u64 time_ns,
+			    sector_t sector, unsigned int bytes, int op)
+{
+	struct fmsim_req_t *req;
+
+	if (trace->nr_req == trace->nr_alloc) {
+		trace->nr_alloc = trace->nr_alloc ? trace->nr_alloc * 2 : 4096;
+		trace->req = realloc(trace->req,
+				     trace->nr_alloc * sizeof(*trace->req));
+		if (!trace->req) {
+			fprintf(stderr, "fmsim: out of memory\n");
+			exit(1);
+		}
+	}
+	req = &trace->req[trace->nr_req++];
+	req->time_ns = time_ns;
+	req->sector = sector;
+	req->bytes = bytes;
+	req->op = op;
+
+	if (op != FMSIM_OP_FLUSH && sector + (bytes >> SECTOR_SHIFT) > trace->end)
+		trace->end = sector + (bytes >> SECTOR_SHIFT);
+}
+
+/*
+ * blkparse default output:
+ *   8,0  3  1  0.000000000  697  Q  WS 223490 + 8 [kjournald]
+ * Only records of the chosen action are replayed.  RWBS 'F' is a flush,
+ * which may carry data; discards are skipped.
+ */
+static int fmsim_parse_blkparse(struct fmsim_trace_t *trace, const char *line,
+				char action)
+{
+	char dev[32], act[8], rwbs[16];
+	unsigned long long sector;
+	unsigned int cpu, seq, pid, nr = 0;
+	double secs;
+	u64 time_ns;
+	int n;
+
+	n = sscanf(line, "%31s %u %u %lf %u %7s %15s %llu + %u",
+		   dev, &cpu, &seq, &secs, &pid, act, rwbs, &sector, &nr);
+	if (n < 7 || !strchr(dev, ','))
+		return -EINVAL;
+	if (act[0] != action || act[1])
+		return 1;
+	if (strchr(rwbs, 'D'))
+		return 1;
+
+	time_ns = secs * 1e9;
+	if (strchr(rwbs, 'F'))
+		fmsim_trace_add(trace, time_ns, 0, 0, FMSIM_OP_FLUSH);
+	if (n < 9 || !nr)
+		return 0;
+	if (strchr(rwbs, 'W'))
+		fmsim_trace_add(trace, time_ns, sector, nr << SECTOR_SHIFT, FMSIM_OP_WRITE);
+	else if (strchr(rwbs, 'R'))
+		fmsim_trace_add(trace, time_ns, sector, nr << SECTOR_SHIFT, FMSIM_OP_READ);
+	else
+		return 1;
+	return 0;
+}
+
+/*
+ * fio iolog, version 2:  <file> <action> <offset> <length>
+ *            version 3:  <msec> <file> <action> <offset> <length>
+ * File add/open/close lines are ignored.  Offsets are in bytes.
+ */
+static int fmsim_parse_iolog(struct fmsim_trace_t *trace, const char *line,
+			     int version)
+{
+	char file[256], act[16];
+	unsigned long long msec = 0, offset, len;
+	int n;
+
+	if (version == 3)
+		n = sscanf(line, "%llu %255s %15s %llu %llu",
+			   &msec, file, act, &offset, &len) - 1;
+	else
+		n = sscanf(line, "%255s %15s %llu %llu", file, act, &offset, &len);
+	if (n < 2)
+		return -EINVAL;
+
+	if (!strcmp(act, "sync") || !strcmp(act, "datasync")) {
+		fmsim_trace_add(trace, msec * 1000000, 0, 0, FMSIM_OP_FLUSH);
+		return 0;
+	}
+	if (strcmp(act, "read") && strcmp(act, "write"))
+		return 1;
+	if (n < 4 || !len || (offset | len) & (BYTES_PER_SECTOR - 1))
+		return -EINVAL;
+
+	fmsim_trace_add(trace, msec * 1000000, offset >> SECTOR_SHIFT, len,
+			act[0] == 'w' ? FMSIM_OP_WRITE : FMSIM_OP_READ);
+	return 0;
+}
+
+static int fmsim_load_trace(struct fmsim_trace_t *trace, const char *path,
+			    char action)
+{
+	char line[FMSIM_LINE];
+	int version = 0;
+	FILE *f;
+
+	f = strcmp(path, "-") ? fopen(path, "r") : stdin;
+	if (!f) {
+		fprintf(stderr, "fmsim: %s: %s\n", path, strerror(errno));
+		return -errno;
+	}
+
+	memset(trace, 0, sizeof(*trace));
+	if (fgets(line, sizeof(line), f)) {
+		if (sscanf(line, "fio version %d iolog", &version) != 1) {
+			if (fmsim_parse_blkparse(trace, line, action))
+				trace->nr_skipped++;
+		} else if (version != 2 && version != 3) {
+			fprintf(stderr, "fmsim: %s: unsupported iolog version %d\n", path, version);
+			if (f != stdin)
+				fclose(f);
+			return -EINVAL;
+		}
+	}
+	trace->timed = (version != 2);
+
+	while (fgets(line, sizeof(line), f)) {
+		if (version ? fmsim_parse_iolog(trace, line, version) :
+			      fmsim_parse_blkparse(trace, line, action))
+			trace->nr_skipped++;
+	}
+
+	if (f != stdin)
+		fclose(f);
+	return 0;
+}
+
+
+/*-------------------------------------------------------------*/
+/*--------------------   Replay   -----------------------------*/
+/*-------------------------------------------------------------*/
+
+/*
+ * The segment handling below follows fmd_do_seg and its helpers in
+ * fm_dsk.c, minus the copies.  Keep the two in step.
+ */
+#define FMSIM_SEG_PAGES		32
+
+/* Read the parts of a segment that aren't cached from the dsk, runs of
+ * misses in one copy */
+static void fmsim_read_misses(struct fmd_device_t *fmd, sector_t sector, size_t n,
+			      u32 *frames)
+{
+	unsigned int offset = (sector & (PAGE_SECTORS-1)) << SECTOR_SHIFT;
+	sector_t miss_sector = 0;
+	size_t miss = 0;
+	size_t copy;
+
+	for (; n; frames++) {
+		copy = min_t(size_t, n, PAGE_SIZE - offset);
+		if (*frames != FMD_FRAME_NONE) {
+			if (miss)
+				fmd_region_read(fmd, NULL, miss_sector, miss);
+			miss = 0;
+		} else {
+			if (!miss)
+				miss_sector = sector;
+			miss += copy;
+		}
+		sector += copy >> SECTOR_SHIFT;
+		n -= copy;
+		offset = 0;
+	}
+	if (miss)
+		fmd_region_read(fmd, NULL, miss_sector, miss);
+}
+
+static void fmsim_do_seg(struct fmd_device_t *fmd, unsigned int len, bool write,
+			 sector_t sector, int mode)
+{
+	u32 frames[FMSIM_SEG_PAGES];
+	unsigned int nr = fmd_cache_nr_pages(sector, len);
+	bool around = (mode == FMD_CACHE_MODE_WRITEAROUND ||
+		       mode == FMD_CACHE_MODE_BYPASS);
+
+	if (write) {
+		if (!around &&
+		    fmd_radix_tree_insert_pages(fmd, sector, len, frames, false, false) < nr) {
+			fmd_radix_tree_drop_pages(fmd, frames, nr);
+			around = true;
+		}
+		if (around) {
+			fmd_cache_write_around(fmd, sector, NULL, len);
+			return;
+		}
+		if (mode != FMD_CACHE_MODE_WRITEBACK)
+			fmd_region_write(fmd, sector, NULL, len);
+	} else {
+		if (mode != FMD_CACHE_MODE_BYPASS)
+			fmd_radix_tree_insert_pages(fmd, sector, len, frames, true, false);
+		else
+			fmd_radix_tree_get_pages(fmd, sector, len, frames);
+		fmsim_read_misses(fmd, sector, len, frames);
+	}
+
+	fmd_radix_tree_put_pages(fmd, frames, nr, write && mode == FMD_CACHE_MODE_WRITEBACK);
+}
+
+/*
+ * Count the pages of a request, and those of them already cached when
+ * it arrives.  A write hit saves the fill of a partial page and a frame
+ * allocation, a read hit saves the dsk read.
+ */
+static void fmsim_count_hits(struct fmd_device_t *fmd, struct fmsim_req_t *req,
+			     u64 *pages, u64 *hits)
+{
+	pgoff_t index = req->sector >> PAGE_SECTORS_SHIFT;
+	pgoff_t last = ((req->sector << SECTOR_SHIFT) + req->bytes - 1) >> PAGE_SHIFT;
+
+	for (; index <= last; index++) {
+		(*pages)++;
+		if (fmd_radix_tree_lookup_page(fmd, (sector_t) index << PAGE_SECTORS_SHIFT) !=
+		    FMD_FRAME_NONE)
+			(*hits)++;
+	}
+}
+
+/*
+ * Issue one data request like fmd_make_request, as a single multi-page
+ * bvec split into segments like fmd_do_bvec.  Returns the modeled
+ * service time: every page is copied through DRAM, plus whatever the
+ * request moved to or from the dsk itself, including fills and direct
+ * reclaim.  Work left for the background workers is not charged.
+ */
+static u64 fmsim_do_request(struct fmd_device_t *fmd, struct fmsim_req_t *req,
+			    struct fmsim_result_t *res, struct fmsim_cost_t *cost)
+{
+	struct fmsim_io_t start = fmsim_io;
+	bool write = (req->op == FMSIM_OP_WRITE);
+	sector_t sector = req->sector;
+	unsigned int offset = (sector & (PAGE_SECTORS-1)) << SECTOR_SHIFT;
+	unsigned int left = req->bytes;
+	unsigned int len, pages;
+	int mode;
+
+	if (write)
+		fmsim_count_hits(fmd, req, &res->wr_pages, &res->wr_hits);
+	else
+		fmsim_count_hits(fmd, req, &res->rd_pages, &res->rd_hits);
+
+	pages = DIV_ROUND_UP(req->bytes, PAGE_SIZE);
+	mode = fmd_cache_io_begin(fmd, sector, req->bytes, false);
+	while (left) {
+		len = min_t(unsigned int, left, FMSIM_SEG_PAGES * PAGE_SIZE - offset);
+		fmsim_do_seg(fmd, len, write, sector, mode);
+		sector += len >> SECTOR_SHIFT;
+		left -= len;
+		offset = 0;
+	}
+	fmd_cache_io_end(fmd);
+
+	return (u64) pages * cost->dram_ns +
+	       DIV_ROUND_UP(fmsim_io.rd_bytes - start.rd_bytes, PAGE_SIZE) * cost->flash_rd_ns +
+	       DIV_ROUND_UP(fmsim_io.wr_bytes - start.wr_bytes, PAGE_SIZE) * cost->flash_wr_ns;
+}
+
+/* Issue a flush like fmd_make_request does for REQ_PREFLUSH.  Returns the
+ * modeled time to write back the dirty pages */
+static u64 fmsim_do_flush(struct fmd_device_t *fmd, struct fmsim_cost_t *cost)
+{
+	struct fmsim_io_t start = fmsim_io;
+
+	fmd_cache_flush(fmd);
+	return DIV_ROUND_UP(fmsim_io.wr_bytes - start.wr_bytes, PAGE_SIZE) * cost->flash_wr_ns;
+}
+
+/* Set up a cold cache of size bytes the way fmd_memory_alloc_manual_cache does */
+static struct fmd_device_t *fmsim_cache_create(struct fmsim_opts_t *opts,
+					       u64 size, int mode)
+{
+	struct fmd_device_t *fmd;
+	struct fmd_cache_t *cache;
+
+	fmd = calloc(1, sizeof(struct fmd_device_t) + sizeof(struct fmd_cache_t));
+	if (!fmd)
+		return NULL;
+	fmd->cache = (void *) (fmd + 1);
+	fmd->nr_pages = opts->dsk_bytes >> PAGE_SHIFT;
+	snprintf(fmd->dev_name, DEV_NAME_LEN, "fmsim");
+	spin_lock_init(&fmd->lock);
+
+	/* The frames are never written, the window only provides their
+	 * addresses */
+	cache = (struct fmd_cache_t *) fmd->cache;
+	cache->nr_pages_total = size >> PAGE_SHIFT;
+	cache->virt = mmap(NULL, size, PROT_READ | PROT_WRITE,
+			   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (cache->virt == MAP_FAILED) {
+		cache->virt = NULL;
+		goto err;
+	}
+
+	if (fmd_pagepool_init(fmd) != 0)
+		goto err;
+	fmd_radix_tree_init(fmd);
+	if (fmd_evict_list_init(fmd, opts->evict, opts->wmark[FMD_WMARK_MIN],
+				opts->wmark[FMD_WMARK_LOW],
+				opts->wmark[FMD_WMARK_HIGH]) != 0)
+		goto err;
+	if (fmd_cache_mode_init(fmd, mode) != 0)
+		goto err;
+	if (fmd_cache_hint_init(fmd) != 0)
+		goto err;
+
+	cache->seq_cutoff = opts->seq_cutoff;
+	cache->bypass_bio_size = opts->bypass_bio_size;
+	return fmd;
+
+err:
+	fmd_pagepool_cleanup(fmd);
+	if (cache->virt)
+		munmap(cache->virt, size);
+	free(fmd);
+	return NULL;
+}
+
+static void fmsim_cache_destroy(struct fmd_device_t *fmd)
+{
+	struct fmd_cache_t *cache = (struct fmd_cache_t *) fmd->cache;
+
+	fmd_cache_hint_cleanup(fmd);
+	fmd_evict_list_cleanup(fmd);
+	fmd_radix_tree_free_pages(fmd);
+	fmd_pagepool_cleanup(fmd);
+	fmd_cache_mode_cleanup(fmd);
+	radix_tree_destroy(&cache->tree);
+	munmap(cache->virt, (size_t) cache->nr_pages_total << PAGE_SHIFT);
+	free(fmd);
+}
+
+static int fmsim_lat_cmp(const void *a, const void *b)
+{
+	u64 la = *(const u64 *) a, lb = *(const u64 *) b;
+
+	return la < lb ? -1 : la > lb;
+}
+
+static double fmsim_pct(u64 part, u64 total)
+{
+	return total ? 100.0 * part / total : 0.0;
+}
+
+#define FMSIM_MB(bytes)		((double) (bytes) / (1 << 20))
+
+static void fmsim_print_header(void)
+{
+	printf("%-9s %-12s %7s %7s %10s %10s %10s %8s %9s %9s %8s %9s %9s %9s %8s %9s %9s\n",
+	       "cache", "mode", "rd_hit%", "wr_hit%", "dsk_rd_MB", "dsk_wr_MB",
+	       "wb_MB", "wb_runs", "evict_bg", "evict_io", "no_frame",
+	       "bypassed", "avg_us", "p99_us", "flushes", "flush_MB",
+	       "flush_us");
+}
+
+/*
+ * Replay the whole trace against one cache configuration and print its
+ * row.  Statistics are taken once the workers have gone idle after the
+ * last record, before teardown flushes the remaining dirty pages.
+ */
+static int fmsim_run(struct fmsim_opts_t *opts, struct fmsim_trace_t *trace,
+		     u64 size, int mode)
+{
+	struct fmsim_result_t res;
+	struct fmd_device_t *fmd;
+	struct fmd_cache_t *cache;
+	struct fmsim_req_t *req;
+	unsigned long i;
+	u64 total = 0;
+	char name[16];
+
+	memset(&fmsim_io, 0, sizeof(fmsim_io));
+	memset(&res, 0, sizeof(res));
+	jiffies = 0;
+
+	fmd = fmsim_cache_create(opts, size, mode);
+	if (!fmd) {
+		fprintf(stderr, "fmsim: unable to set up a %llu MB cache\n",
+			(unsigned long long) size >> 20);
+		return -ENOMEM;
+	}
+	cache = (struct fmd_cache_t *) fmd->cache;
+
+	res.lat_ns = malloc((trace->nr_req + 1) * sizeof(u64));
+	if (!res.lat_ns) {
+		fmsim_cache_destroy(fmd);
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < trace->nr_req; i++) {
+		req = &trace->req[i];
+
+		/* Drives the sequential stream LRU.  Untimed traces advance
+		 * one jiffy per record */
+		jiffies = trace->timed ? req->time_ns / (1000000000 / HZ) : i;
+
+		if (req->op == FMSIM_OP_FLUSH) {
+			res.flush_ns += fmsim_do_flush(fmd, &opts->cost);
+			fmsim_run_work();
+			continue;
+		}
+		res.lat_ns[res.nr_lat] = fmsim_do_request(fmd, req, &res, &opts->cost);
+		total += res.lat_ns[res.nr_lat++];
+		fmsim_run_work();
+	}
+
+	qsort(res.lat_ns, res.nr_lat, sizeof(u64), fmsim_lat_cmp);
+	if (size >= (1ULL << 30) && !(size & ((1ULL << 30) - 1)))
+		snprintf(name, sizeof(name), "%lluG", (unsigned long long) size >> 30);
+	else
+		snprintf(name, sizeof(name), "%lluM", (unsigned long long) size >> 20);
+
+	printf("%-9s %-12s %7.2f %7.2f %10.1f %10.1f %10.1f %8llu %9llu %9llu %8llu %9lld %9.2f %9.2f %8llu %9.1f %9.2f\n",
+	       name, fmsim_mode_names[mode],
+	       fmsim_pct(res.rd_hits, res.rd_pages),
+	       fmsim_pct(res.wr_hits, res.wr_pages),
+	       FMSIM_MB(fmsim_io.rd_bytes), FMSIM_MB(fmsim_io.wr_bytes),
+	       FMSIM_MB(cache->nr_wb_pages << PAGE_SHIFT), cache->nr_wb_runs,
+	       cache->nr_reclaimed, cache->nr_direct_reclaimed,
+	       cache->nr_alloc_failed, atomic64_read(&cache->bypassed_bios),
+	       res.nr_lat ? total / 1000.0 / res.nr_lat : 0.0,
+	       res.nr_lat ? res.lat_ns[(res.nr_lat * 99 + 99) / 100 - 1] / 1000.0 : 0.0,
+	       cache->nr_flushes, FMSIM_MB(cache->nr_flush_pages << PAGE_SHIFT),
+	       cache->nr_flushes ? res.flush_ns / 1000.0 / cache->nr_flushes : 0.0);
+
+	free(res.lat_ns);
+	fmsim_cache_destroy(fmd);
+	return 0;
+}
+
+
+/*-------------------------------------------------------------*/
+/*--------------------   Options   ----------------------------*/
+/*-------------------------------------------------------------*/
+
+static void fmsim_usage(void)
+{
+	fprintf(stderr,
+"usage: fmsim [options] <trace | ->\n"
+"Replay a blkparse text trace or a fio iolog (v2/v3) against the fmdsk cache.\n"
+"\n"
+"  -c SIZE[,SIZE...]  cache sizes, K/M/G suffixes (default 1G)\n"
+"  -m MODE[,MODE...]  writeback, writethrough, writearound or all (default writeback)\n"
+"  -e N               frames reclaimed per batch (default 32)\n"
+"  -w MIN,LOW,HIGH    free frame watermarks in percent (default %d,%d,%d)\n"
+"  -s BYTES           sequential cutoff, 0 disables (default %d)\n"
+"  -b BYTES           bypass bios of at least this size, 0 disables (default 0)\n"
+"  -d SIZE            dsk size (default: highest offset in the trace)\n"
+"  -a ACTION          blkparse action to replay (default Q)\n"
+"  -L DRAM,RD,WR      ns to copy a page through DRAM, read and write it on\n"
+"                     the dsk (default 400,2000,8000)\n"
+"  -v                 print the driver's log messages\n",
+		FMD_WMARK_MIN_DEFAULT, FMD_WMARK_LOW_DEFAULT,
+		FMD_WMARK_HIGH_DEFAULT, FMD_SEQ_CUTOFF_DEFAULT);
+	exit(2);
+}
+
+static u64 fmsim_parse_size(const char *s)
+{
+	char *end;
+	u64 val;
+
+	errno = 0;
+	val = strtoull(s, &end, 0);
+	if (errno || end == s)
+		fmsim_usage();
+	switch (*end) {
+	case 'g': case 'G': val <<= 10;	/* fall through */
+	case 'm': case 'M': val <<= 10;	/* fall through */
+	case 'k': case 'K': val <<= 10; end++;
+	}
+	if (*end)
+		fmsim_usage();
+	return val;
+}
+
+static int fmsim_parse_mode(const char *s)
+{
+	int i;
+
+	for (i = 0; i < FMD_CACHE_NR_MODES; i++) {
+		if (!strcmp(s, fmsim_mode_names[i]))
+			return i;
+	}
+	fmsim_usage();
+	return -1;
+}
+
+int main(int argc, char **argv)
+{
+	struct fmsim_opts_t opts = {
+		.sizes = { 1ULL << 30 },
+		.nr_sizes = 1,
+		.modes = { FMD_CACHE_MODE_WRITEBACK },
+		.nr_modes = 1,
+		.evict = 32,
+		.wmark = { FMD_WMARK_MIN_DEFAULT, FMD_WMARK_LOW_DEFAULT,
+			   FMD_WMARK_HIGH_DEFAULT },
+		.seq_cutoff = FMD_SEQ_CUTOFF_DEFAULT,
+		.action = 'Q',
+		.cost = { 400, 2000, 8000 },
+	};
+	struct fmsim_trace_t trace;
+	unsigned long nr_flush = 0, i;
+	char *tok, *save;
+	int c, s, m;
+
+	while ((c = getopt(argc, argv, "c:m:e:w:s:b:d:a:L:vh")) != -1) {
+		switch (c) {
+		case 'c':
+			opts.nr_sizes = 0;
+			for (tok = strtok_r(optarg, ",", &save); tok;
+			     tok = strtok_r(NULL, ",", &save)) {
+				if (opts.nr_sizes == FMSIM_NR_SIZES)
+					fmsim_usage();
+				opts.sizes[opts.nr_sizes++] =
+					fmsim_parse_size(tok) & ~(PAGE_SIZE - 1);
+			}
+			break;
+		case 'm':
+			opts.nr_modes = 0;
+			if (!strcmp(optarg, "all")) {
+				for (m = 0; m < FMD_CACHE_NR_MODES; m++)
+					opts.modes[opts.nr_modes++] = m;
+				break;
+			}
+			for (tok = strtok_r(optarg, ",", &save); tok;
+			     tok = strtok_r(NULL, ",", &save)) {
+				if (opts.nr_modes == FMD_CACHE_NR_MODES)
+					fmsim_usage();
+				opts.modes[opts.nr_modes++] = fmsim_parse_mode(tok);
+			}
+			break;
+		case 'e':
+			opts.evict = atoi(optarg);
+			break;
+		case 'w':
+			if (sscanf(optarg, "%d,%d,%d", &opts.wmark[FMD_WMARK_MIN],
+				   &opts.wmark[FMD_WMARK_LOW],
+				   &opts.wmark[FMD_WMARK_HIGH]) != 3)
+				fmsim_usage();
+			break;
+		case 's':
+			opts.seq_cutoff = fmsim_parse_size(optarg);
+			break;
+		case 'b':
+			opts.bypass_bio_size = fmsim_parse_size(optarg);
+			break;
+		case 'd':
+			opts.dsk_bytes = fmsim_parse_size(optarg);
+			break;
+		case 'a':
+			opts.action = optarg[0];
+			break;
+		case 'L':
+			if (sscanf(optarg, "%u,%u,%u", &opts.cost.dram_ns,
+				   &opts.cost.flash_rd_ns,
+				   &opts.cost.flash_wr_ns) != 3)
+				fmsim_usage();
+			break;
+		case 'v':
+			fmsim_verbose = 1;
+			break;
+		default:
+			fmsim_usage();
+		}
+	}
+	if (optind != argc - 1)
+		fmsim_usage();
+
+	if (fmsim_load_trace(&trace, argv[optind], opts.action))
+		return 1;
+	if (!opts.dsk_bytes)
+		opts.dsk_bytes = PAGE_ALIGN((u64) trace.end << SECTOR_SHIFT);
+	if (((u64) trace.end << SECTOR_SHIFT) > opts.dsk_bytes) {
+		fprintf(stderr, "fmsim: trace reaches past the %llu byte dsk\n",
+			(unsigned long long) opts.dsk_bytes);
+		return 1;
+	}
+
+	for (i = 0; i < trace.nr_req; i++)
+		nr_flush += (trace.req[i].op == FMSIM_OP_FLUSH);
+	fprintf(stderr, "fmsim: %lu requests, %lu flushes, %lu lines skipped, dsk %llu MB\n",
+		trace.nr_req - nr_flush, nr_flush, trace.nr_skipped,
+		(unsigned long long) opts.dsk_bytes >> 20);
+
+	fmsim_print_header();
+	for (s = 0; s < opts.nr_sizes; s++) {
+		for (m = 0; m < opts.nr_modes; m++) {
+			if (fmsim_run(&opts, &trace, opts.sizes[s], opts.modes[m]))
+				return 1;
+		}
+	}
+
+	free(trace.req);
+	return 0;
+}
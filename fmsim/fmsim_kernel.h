@@ -0,0 +1,369 @@
+/*************************************************************************
+ *
+ * Fusion Memory Confidential
+ * __________________
+ *
+ *  Fusion Memory Incorporated
+ *  All Rights Reserved.
+ *
+ * NOTICE:  All information contained herein is, and remains
+ * the property of Fusion Memory and its suppliers, if any.
+ * The intellectual and technical concepts contained herein are
+ * proprietary to Fusion Memory and its suppliers and may be covered by
+ * U.S. and Foreign Patents, patents in process, and are protected by
+ * trade secret or copyright law. Dissemination of this information or
+ * reproduction of this material is strictly forbidden unless prior
+ * written permission is obtained from Fusion Memory.
+ */
+
+
+/*
+ * fmsim_kernel.h - Just enough of the kernel API to build fm_cache.c in
+ * userspace.  Force-included ahead of every source file; the headers
+ * under include/ are empty stand-ins for the kernel headers fm_cache.c
+ * names.
+ *
+ * The simulator is single threaded, so locks and the write policy
+ * semaphore do nothing.  Work items run when fmsim_run_work() is called
+ * between trace records.  Copies to and from the dsk are counted and
+ * never performed, so cache frames are never touched.
+ */
+
+#ifndef FMSIM_KERNEL_H
+#define FMSIM_KERNEL_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+
+#define LINUX_VERSION_CODE	KERNEL_VERSION(4,14,0)
+#define KERNEL_VERSION(a,b,c)	(((a) << 16) + ((b) << 8) + (c))
+
+/*-------------------------------------------------------------*/
+/*--------------------   Types and Macros   -------------------*/
+/*-------------------------------------------------------------*/
+
+typedef uint8_t u8;
+typedef uint16_t u16;
+typedef uint32_t u32;
+typedef int32_t s32;
+typedef unsigned long long u64;
+typedef long long s64;
+typedef u64 sector_t;
+typedef unsigned long pgoff_t;
+typedef u64 phys_addr_t;
+typedef unsigned int gfp_t;
+
+#define __iomem
+#define __force
+#define __percpu
+#define alloc_percpu(type)	((type *) calloc(1, sizeof(type)))
+#define free_percpu(p)		free(p)
+#define this_cpu_ptr(p)		(p)
+#define per_cpu_ptr(p, cpu)	((void) (cpu), (p))
+#define get_cpu_ptr(p)		(p)
+#define put_cpu_ptr(p)		((void) (p))
+#define cpu_to_node(cpu)	((void) (cpu), 0)
+#define for_each_possible_cpu(cpu)	for ((cpu) = 0; (cpu) < 1; (cpu)++)
+#define __user
+#define __init
+#define __exit
+
+/* No kernel config: optional features that need one are left out */
+#define IS_ENABLED(option)	0
+
+#define PAGE_SHIFT	12
+#define PAGE_SIZE	(1UL << PAGE_SHIFT)
+#define PAGE_ALIGN(x)	(((x) + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1))
+
+#define GFP_KERNEL	0
+#define GFP_NOIO	0
+#define GFP_ATOMIC	0
+
+#define KERN_INFO	""
+#define KERN_ERR	""
+#define NUMA_NO_NODE	(-1)
+#define HZ		1000
+
+extern int fmsim_verbose;
+#define printk(fmt, ...) \
+	do { if (fmsim_verbose) fprintf(stderr, fmt, ##__VA_ARGS__); } while (0)
+
+#define BUG_ON(cond) \
+	do { if (cond) { fprintf(stderr, "BUG at %s:%d\n", __FILE__, __LINE__); abort(); } } while (0)
+#define WARN_ON(cond)	({ bool __c = (cond); if (__c) fprintf(stderr, "WARNING at %s:%d\n", __FILE__, __LINE__); __c; })
+
+#define container_of(ptr, type, member) \
+	((type *) ((char *) (ptr) - offsetof(type, member)))
+
+#define min(a, b)		((a) < (b) ? (a) : (b))
+#define max(a, b)		((a) > (b) ? (a) : (b))
+#define min_t(t, a, b)		((t) (a) < (t) (b) ? (t) (a) : (t) (b))
+#define max_t(t, a, b)		((t) (a) > (t) (b) ? (t) (a) : (t) (b))
+#define clamp(v, lo, hi)	min(max(v, lo), hi)
+#define DIV_ROUND_UP(n, d)	(((n) + (d) - 1) / (d))
+
+#define unlikely(x)		__builtin_expect(!!(x), 0)
+
+#define READ_ONCE(x)		(*(volatile __typeof__(x) *) &(x))
+#define WRITE_ONCE(x, v)	(*(volatile __typeof__(x) *) &(x) = (v))
+
+static inline unsigned int ilog2(unsigned long n) { return 63 - __builtin_clzl(n | 1); }
+static inline unsigned long roundup_pow_of_two(unsigned long n)
+{
+	return n <= 1 ? 1 : 1UL << (ilog2(n - 1) + 1);
+}
+
+static inline u64 div_u64(u64 n, u32 d) { return n / d; }
+static inline u64 div64_u64(u64 n, u64 d) { return n / d; }
+static inline u64 div_u64_rem(u64 n, u32 d, u32 *rem) { *rem = n % d; return n / d; }
+
+#define kmalloc(size, gfp)	malloc(size)
+#define kmalloc_node(size, gfp, node)	malloc(size)
+#define kzalloc(size, gfp)	calloc(1, size)
+#define kfree(p)		free(p)
+#define vmalloc(size)		malloc(size)
+#define vzalloc(size)		calloc(1, size)
+#define vmalloc_node(size, node)	malloc(size)
+#define vzalloc_node(size, node)	calloc(1, size)
+#define vfree(p)		free(p)
+
+#define cond_resched()		do { } while (0)
+
+/* Bitwise, fmsim frames hold no data and never dedup */
+static inline u32 crc32c(u32 crc, const void *p, size_t len)
+{
+	const unsigned char *b = p;
+	int i;
+
+	while (len--) {
+		crc ^= *b++;
+		for (i = 0; i < 8; i++)
+			crc = (crc >> 1) ^ (0x82f63b78 & -(crc & 1));
+	}
+	return crc;
+}
+
+/* Simulated time, advanced from the trace timestamps */
+extern unsigned long jiffies;
+#define time_before(a, b)	((long) ((a) - (b)) < 0)
+#define ktime_get_ns()		0ULL
+
+typedef struct { int counter; } atomic_t;
+typedef struct { long long counter; } atomic64_t;
+#define atomic64_read(v)	((v)->counter)
+#define atomic64_set(v, i)	((v)->counter = (i))
+#define atomic64_inc(v)		((v)->counter++)
+#define atomic64_add(i, v)	((v)->counter += (i))
+
+void sort(void *base, size_t num, size_t size,
+	  int (*cmp)(const void *, const void *), void *swap);
+
+/*-------------------------------------------------------------*/
+/*--------------------   Locking   ----------------------------*/
+/*-------------------------------------------------------------*/
+
+typedef struct { int unused; } spinlock_t;
+#define spin_lock_init(l)	do { } while (0)
+#define spin_lock(l)		do { } while (0)
+#define spin_unlock(l)		do { } while (0)
+
+struct mutex { int unused; };
+
+struct percpu_rw_semaphore { int unused; };
+#define percpu_init_rwsem(s)	0
+#define percpu_free_rwsem(s)	((void) (s))
+#define percpu_down_read(s)	((void) (s))
+#define percpu_down_read_trylock(s)	((void) (s), 1)
+#define percpu_up_read(s)	((void) (s))
+#define percpu_down_write(s)	do { } while (0)
+#define percpu_up_write(s)	do { } while (0)
+
+/*-------------------------------------------------------------*/
+/*--------------------   Lists   ------------------------------*/
+/*-------------------------------------------------------------*/
+
+struct list_head {
+	struct list_head *next, *prev;
+};
+
+static inline void INIT_LIST_HEAD(struct list_head *list)
+{
+	list->next = list;
+	list->prev = list;
+}
+
+static inline void __list_add(struct list_head *new, struct list_head *prev,
+			      struct list_head *next)
+{
+	next->prev = new;
+	new->next = next;
+	new->prev = prev;
+	prev->next = new;
+}
+
+static inline void list_add(struct list_head *new, struct list_head *head)
+{
+	__list_add(new, head, head->next);
+}
+
+static inline void list_add_tail(struct list_head *new, struct list_head *head)
+{
+	__list_add(new, head->prev, head);
+}
+
+static inline void list_del_init(struct list_head *entry)
+{
+	entry->next->prev = entry->prev;
+	entry->prev->next = entry->next;
+	INIT_LIST_HEAD(entry);
+}
+
+static inline void list_del(struct list_head *entry)
+{
+	entry->next->prev = entry->prev;
+	entry->prev->next = entry->next;
+}
+
+static inline void list_move_tail(struct list_head *entry, struct list_head *head)
+{
+	list_del_init(entry);
+	list_add_tail(entry, head);
+}
+
+static inline int list_empty(const struct list_head *head)
+{
+	return head->next == head;
+}
+
+#define list_entry(ptr, type, member)		container_of(ptr, type, member)
+#define list_first_entry(ptr, type, member)	list_entry((ptr)->next, type, member)
+#define list_for_each_entry(pos, head, member) \
+	for (pos = list_entry((head)->next, typeof(*pos), member); \
+	     &pos->member != (head); \
+	     pos = list_entry(pos->member.next, typeof(*pos), member))
+
+/*-------------------------------------------------------------*/
+/*--------------------   Radix Tree   -------------------------*/
+/*-------------------------------------------------------------*/
+
+#define PAGECACHE_TAG_DIRTY	0
+#define RADIX_TREE_MAX_TAGS	2
+
+/* Two level table of slots, chunks allocated on first insert */
+struct radix_tree_root {
+	void ***chunks;
+	unsigned long **tags[RADIX_TREE_MAX_TAGS];
+	unsigned long nr_chunks;
+	unsigned long nr_tagged[RADIX_TREE_MAX_TAGS];
+};
+
+#define INIT_RADIX_TREE(root, gfp)	memset(root, 0, sizeof(*(root)))
+#define radix_tree_preload(gfp)		0
+#define radix_tree_preload_end()	do { } while (0)
+
+int radix_tree_insert(struct radix_tree_root *root, unsigned long index, void *item);
+void *radix_tree_lookup(struct radix_tree_root *root, unsigned long index);
+void *radix_tree_delete(struct radix_tree_root *root, unsigned long index);
+void **radix_tree_lookup_slot(struct radix_tree_root *root, unsigned long index);
+void radix_tree_replace_slot(struct radix_tree_root *root, void **slot, void *item);
+void *radix_tree_tag_set(struct radix_tree_root *root, unsigned long index, unsigned int tag);
+void *radix_tree_tag_clear(struct radix_tree_root *root, unsigned long index, unsigned int tag);
+int radix_tree_tag_get(struct radix_tree_root *root, unsigned long index, unsigned int tag);
+int radix_tree_tagged(struct radix_tree_root *root, unsigned int tag);
+unsigned int radix_tree_gang_lookup(struct radix_tree_root *root, void **results,
+				    unsigned long first_index, unsigned int max_items);
+unsigned int radix_tree_gang_lookup_tag(struct radix_tree_root *root, void **results,
+					unsigned long first_index, unsigned int max_items,
+					unsigned int tag);
+void radix_tree_destroy(struct radix_tree_root *root);
+
+/*-------------------------------------------------------------*/
+/*--------------------   Work Queues   ------------------------*/
+/*-------------------------------------------------------------*/
+
+struct work_struct;
+typedef void (*work_func_t)(struct work_struct *work);
+
+struct workqueue_struct;
+
+struct work_struct {
+	work_func_t func;
+	struct list_head entry;		/* on fmsim's pending list */
+	struct workqueue_struct *wq;
+	bool pending;
+};
+
+struct workqueue_struct { int unused; };
+
+#define WQ_MEM_RECLAIM	0
+#define WQ_UNBOUND	0
+
+#define INIT_WORK(w, f) \
+	do { (w)->func = (f); (w)->wq = NULL; (w)->pending = false; \
+	     INIT_LIST_HEAD(&(w)->entry); } while (0)
+
+struct workqueue_struct *alloc_workqueue(const char *fmt, unsigned int flags,
+					 int max_active, ...);
+void destroy_workqueue(struct workqueue_struct *wq);
+bool queue_work(struct workqueue_struct *wq, struct work_struct *work);
+bool cancel_work_sync(struct work_struct *work);
+void fmsim_run_work(void);
+
+/*-------------------------------------------------------------*/
+/*--------------------   Sysfs   ------------------------------*/
+/*-------------------------------------------------------------*/
+
+struct attribute {
+	const char *name;
+};
+
+struct device;
+struct device_attribute {
+	struct attribute attr;
+	ssize_t (*show)(struct device *dev, struct device_attribute *attr, char *buf);
+	ssize_t (*store)(struct device *dev, struct device_attribute *attr,
+			 const char *buf, size_t count);
+};
+
+struct attribute_group {
+	const char *name;
+	struct attribute **attrs;
+};
+
+#define DEVICE_ATTR_RW(_name) \
+	struct device_attribute dev_attr_##_name = \
+		{ { #_name }, _name##_show, _name##_store }
+#define DEVICE_ATTR_RO(_name) \
+	struct device_attribute dev_attr_##_name = { { #_name }, _name##_show, NULL }
+
+struct gendisk {
+	void *private_data;
+};
+#define dev_to_disk(dev)	((struct gendisk *) (dev))
+
+bool sysfs_streq(const char *s1, const char *s2);
+int kstrtouint(const char *s, unsigned int base, unsigned int *res);
+int kstrtoull(const char *s, unsigned int base, unsigned long long *res);
+#define scnprintf(buf, size, fmt, ...)	snprintf(buf, size, fmt, ##__VA_ARGS__)
+
+/*-------------------------------------------------------------*/
+/*--------------------   I/O Memory   -------------------------*/
+/*-------------------------------------------------------------*/
+
+/* Bytes the cache moved to and from the dsk */
+struct fmsim_io_t {
+	u64 rd_bytes;
+	u64 wr_bytes;
+};
+extern struct fmsim_io_t fmsim_io;
+
+#define memcpy_fromio(dst, src, n)	(fmsim_io.rd_bytes += (n))
+#define memcpy_toio(dst, src, n)	(fmsim_io.wr_bytes += (n))
+
+#endif /* FMSIM_KERNEL_H */
@@ -0,0 +1 @@
+/* fmsim: provided by fmsim_kernel.h */
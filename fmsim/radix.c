@@ -0,0 +1,229 @@
+/*************************************************************************
+ *
+ * Fusion Memory Confidential
+ * __________________
+ *
+ *  Fusion Memory Incorporated
+ *  All Rights Reserved.
+ *
+ * NOTICE:  All information contained herein is, and remains
+ * the property of Fusion Memory and its suppliers, if any.
+ * The intellectual and technical concepts contained herein are
+ * proprietary to Fusion Memory and its suppliers and may be covered by
+ * U.S. and Foreign Patents, patents in process, and are protected by
+ * trade secret or copyright law. Dissemination of this information or
+ * reproduction of this material is strictly forbidden unless prior
+ * written permission is obtained from Fusion Memory.
+ */
+
+
+/*
+ * radix.c - Radix tree stand-in for fmsim.
+ *
+ * The cache only needs lookup by page index, two tags and gang lookups
+ * in index order, so a two level table is enough: chunks of
+ * RADIX_CHUNK slots, each with a bitmap per tag, allocated on first
+ * insert and kept until radix_tree_destroy.
+ */
+
+#define RADIX_CHUNK_SHIFT	12
+#define RADIX_CHUNK		(1UL << RADIX_CHUNK_SHIFT)
+#define RADIX_LONGS		(RADIX_CHUNK / (8 * sizeof(long)))
+#define RADIX_BITS		(8 * sizeof(long))
+
+static void **
+radix_slot(struct radix_tree_root *root, unsigned long index, bool create)
+{
+	unsigned long c = index >> RADIX_CHUNK_SHIFT;
+	unsigned long n;
+	int t;
+
+	if (c >= root->nr_chunks) {
+		if (!create)
+			return NULL;
+		n = max(c + 1, root->nr_chunks * 2);
+		root->chunks = realloc(root->chunks, n * sizeof(void **));
+		BUG_ON(!root->chunks);
+		memset(root->chunks + root->nr_chunks, 0,
+		       (n - root->nr_chunks) * sizeof(void **));
+		for (t = 0; t < RADIX_TREE_MAX_TAGS; t++) {
+			root->tags[t] = realloc(root->tags[t], n * sizeof(unsigned long *));
+			BUG_ON(!root->tags[t]);
+			memset(root->tags[t] + root->nr_chunks, 0,
+			       (n - root->nr_chunks) * sizeof(unsigned long *));
+		}
+		root->nr_chunks = n;
+	}
+	if (!root->chunks[c]) {
+		if (!create)
+			return NULL;
+		root->chunks[c] = calloc(RADIX_CHUNK, sizeof(void *));
+		BUG_ON(!root->chunks[c]);
+		for (t = 0; t < RADIX_TREE_MAX_TAGS; t++) {
+			root->tags[t][c] = calloc(RADIX_LONGS, sizeof(long));
+			BUG_ON(!root->tags[t][c]);
+		}
+	}
+	return &root->chunks[c][index & (RADIX_CHUNK - 1)];
+}
+
+static inline unsigned long *
+radix_tag_word(struct radix_tree_root *root, unsigned long index, unsigned int tag)
+{
+	unsigned long i = index & (RADIX_CHUNK - 1);
+
+	return &root->tags[tag][index >> RADIX_CHUNK_SHIFT][i / RADIX_BITS];
+}
+
+#define RADIX_TAG_BIT(index)	(1UL << ((index) % RADIX_BITS))
+
+int radix_tree_insert(struct radix_tree_root *root, unsigned long index, void *item)
+{
+	void **slot = radix_slot(root, index, true);
+
+	if (*slot)
+		return -EEXIST;
+	*slot = item;
+	return 0;
+}
+
+void *radix_tree_lookup(struct radix_tree_root *root, unsigned long index)
+{
+	void **slot = radix_slot(root, index, false);
+
+	return slot ? *slot : NULL;
+}
+
+void **radix_tree_lookup_slot(struct radix_tree_root *root, unsigned long index)
+{
+	void **slot = radix_slot(root, index, false);
+
+	return (slot && *slot) ? slot : NULL;
+}
+
+void radix_tree_replace_slot(struct radix_tree_root *root, void **slot, void *item)
+{
+	BUG_ON(!item);
+	*slot = item;
+}
+
+void *radix_tree_tag_set(struct radix_tree_root *root, unsigned long index, unsigned int tag)
+{
+	void **slot = radix_slot(root, index, false);
+	unsigned long *word;
+
+	BUG_ON(!slot || !*slot);
+	word = radix_tag_word(root, index, tag);
+	if (!(*word & RADIX_TAG_BIT(index))) {
+		*word |= RADIX_TAG_BIT(index);
+		root->nr_tagged[tag]++;
+	}
+	return *slot;
+}
+
+void *radix_tree_tag_clear(struct radix_tree_root *root, unsigned long index, unsigned int tag)
+{
+	void **slot = radix_slot(root, index, false);
+	unsigned long *word;
+
+	if (!slot || !*slot)
+		return NULL;
+	word = radix_tag_word(root, index, tag);
+	if (*word & RADIX_TAG_BIT(index)) {
+		*word &= ~RADIX_TAG_BIT(index);
+		root->nr_tagged[tag]--;
+	}
+	return *slot;
+}
+
+int radix_tree_tag_get(struct radix_tree_root *root, unsigned long index, unsigned int tag)
+{
+	void **slot = radix_slot(root, index, false);
+
+	if (!slot || !*slot)
+		return 0;
+	return !!(*radix_tag_word(root, index, tag) & RADIX_TAG_BIT(index));
+}
+
+int radix_tree_tagged(struct radix_tree_root *root, unsigned int tag)
+{
+	return root->nr_tagged[tag] != 0;
+}
+
+void *radix_tree_delete(struct radix_tree_root *root, unsigned long index)
+{
+	void **slot = radix_slot(root, index, false);
+	void *item;
+	int t;
+
+	if (!slot || !*slot)
+		return NULL;
+	for (t = 0; t < RADIX_TREE_MAX_TAGS; t++)
+		radix_tree_tag_clear(root, index, t);
+	item = *slot;
+	*slot = NULL;
+	return item;
+}
+
+unsigned int radix_tree_gang_lookup(struct radix_tree_root *root, void **results,
+				    unsigned long first_index, unsigned int max_items)
+{
+	unsigned long index = first_index;
+	unsigned int n = 0;
+	void **chunk;
+
+	while (n < max_items && (index >> RADIX_CHUNK_SHIFT) < root->nr_chunks) {
+		chunk = root->chunks[index >> RADIX_CHUNK_SHIFT];
+		if (!chunk) {
+			index = (index | (RADIX_CHUNK - 1)) + 1;
+			continue;
+		}
+		if (chunk[index & (RADIX_CHUNK - 1)])
+			results[n++] = chunk[index & (RADIX_CHUNK - 1)];
+		index++;
+	}
+	return n;
+}
+
+unsigned int radix_tree_gang_lookup_tag(struct radix_tree_root *root, void **results,
+					unsigned long first_index, unsigned int max_items,
+					unsigned int tag)
+{
+	unsigned long index = first_index;
+	unsigned long word;
+	unsigned int n = 0;
+	unsigned long c;
+
+	while (n < max_items && (c = index >> RADIX_CHUNK_SHIFT) < root->nr_chunks) {
+		if (!root->chunks[c]) {
+			index = (index | (RADIX_CHUNK - 1)) + 1;
+			continue;
+		}
+		/* Skip to the next set bit of this word, or the next word */
+		word = *radix_tag_word(root, index, tag) >> (index % RADIX_BITS);
+		if (!word) {
+			index = (index | (RADIX_BITS - 1)) + 1;
+			continue;
+		}
+		index += __builtin_ctzl(word);
+		results[n++] = root->chunks[c][index & (RADIX_CHUNK - 1)];
+		index++;
+	}
+	return n;
+}
+
+void radix_tree_destroy(struct radix_tree_root *root)
+{
+	unsigned long c;
+	int t;
+
+	for (c = 0; c < root->nr_chunks; c++) {
+		free(root->chunks[c]);
+		for (t = 0; t < RADIX_TREE_MAX_TAGS; t++)
+			free(root->tags[t][c]);
+	}
+	free(root->chunks);
+	for (t = 0; t < RADIX_TREE_MAX_TAGS; t++)
+		free(root->tags[t]);
+	memset(root, 0, sizeof(*root));
+}
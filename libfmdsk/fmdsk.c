@@ -0,0 +1,174 @@
+/*************************************************************************
+ *
+ * Fusion Memory Confidential
+ * __________________
+ *
+ *  Fusion Memory Incorporated
+ *  All Rights Reserved.
+ *
+ * NOTICE:  All information contained herein is, and remains
+ * the property of Fusion Memory and its suppliers, if any.
+ * The intellectual and technical concepts contained herein are
+ * proprietary to Fusion Memory and its suppliers and may be covered by
+ * U.S. and Foreign Patents, patents in process, and are protected by
+ * trade secret or copyright law. Dissemination of this information or
+ * reproduction of this material is strictly forbidden unless prior
+ * written permission is obtained from Fusion Memory.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <cpuid.h>
+#include <emmintrin.h>
+
+#include "fmdsk.h"
+
+#define CACHELINE_SIZE	64
+#define HUGE_PAGE_SIZE	(2UL << 20)
+
+/* Cache line write back instructions, emitted as bytes so no special
+ * compiler flags are needed */
+static void flush_clflush(const void *p)
+{
+	asm volatile("clflush %0" : "+m" (*(volatile char *) p));
+}
+
+static void flush_clflushopt(const void *p)
+{
+	asm volatile(".byte 0x66; clflush %0" : "+m" (*(volatile char *) p));
+}
+
+static void flush_clwb(const void *p)
+{
+	asm volatile(".byte 0x66; xsaveopt %0" : "+m" (*(volatile char *) p));
+}
+
+static void (*flush_line)(const void *p);
+
+/* Pick the best flush instruction the CPU supports */
+__attribute__((constructor))
+static void fmdsk_init(void)
+{
+	unsigned int eax, ebx, ecx, edx;
+
+	flush_line = flush_clflush;
+	if (__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)) {
+		if (ebx & (1 << 24))
+			flush_line = flush_clwb;
+		else if (ebx & (1 << 23))
+			flush_line = flush_clflushopt;
+	}
+}
+
+int fmdsk_map(const char *path, struct fmdsk_map *map)
+{
+	off_t size;
+	void *addr;
+	int fd;
+	int err;
+
+	fd = open(path, O_RDWR);
+	if (fd < 0)
+		return -errno;
+
+	/* The device reports its size at SEEK_END */
+	size = lseek(fd, 0, SEEK_END);
+	if (size <= 0) {
+		err = size ? -errno : -ENXIO;
+		close(fd);
+		return err;
+	}
+
+	addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (addr == MAP_FAILED) {
+		err = -errno;
+		close(fd);
+		return err;
+	}
+
+	/* Ask for huge pages where the kernel needs the hint */
+	madvise(addr, size, MADV_HUGEPAGE);
+
+	map->addr = addr;
+	map->len = size;
+	map->fd = fd;
+	return 0;
+}
+
+void fmdsk_unmap(struct fmdsk_map *map)
+{
+	if (map->addr)
+		munmap(map->addr, map->len);
+	if (map->fd >= 0)
+		close(map->fd);
+	map->addr = NULL;
+	map->len = 0;
+	map->fd = -1;
+}
+
+void fmdsk_flush(const void *addr, size_t len)
+{
+	uintptr_t p = (uintptr_t) addr & ~(uintptr_t) (CACHELINE_SIZE - 1);
+	uintptr_t end = (uintptr_t) addr + len;
+
+	for (; p < end; p += CACHELINE_SIZE)
+		flush_line((const void *) p);
+}
+
+void fmdsk_drain(void)
+{
+	_mm_sfence();
+}
+
+void fmdsk_persist(const void *addr, size_t len)
+{
+	fmdsk_flush(addr, len);
+	fmdsk_drain();
+}
+
+void *fmdsk_memcpy_persist(void *dst, const void *src, size_t len)
+{
+	char *d = dst;
+	const char *s = src;
+	size_t head;
+
+	/* Head: regular stores up to a cache line boundary, then flushed */
+	head = (CACHELINE_SIZE - ((uintptr_t) d & (CACHELINE_SIZE - 1))) & (CACHELINE_SIZE - 1);
+	if (head > len)
+		head = len;
+	if (head) {
+		memcpy(d, s, head);
+		fmdsk_flush(d, head);
+		d += head;
+		s += head;
+		len -= head;
+	}
+
+	/* Body: whole cache lines with non-temporal stores */
+	for (; len >= CACHELINE_SIZE; len -= CACHELINE_SIZE) {
+		__m128i x0 = _mm_loadu_si128((const __m128i *) s + 0);
+		__m128i x1 = _mm_loadu_si128((const __m128i *) s + 1);
+		__m128i x2 = _mm_loadu_si128((const __m128i *) s + 2);
+		__m128i x3 = _mm_loadu_si128((const __m128i *) s + 3);
+
+		_mm_stream_si128((__m128i *) d + 0, x0);
+		_mm_stream_si128((__m128i *) d + 1, x1);
+		_mm_stream_si128((__m128i *) d + 2, x2);
+		_mm_stream_si128((__m128i *) d + 3, x3);
+		d += CACHELINE_SIZE;
+		s += CACHELINE_SIZE;
+	}
+
+	/* Tail: regular stores, then flushed */
+	if (len) {
+		memcpy(d, s, len);
+		fmdsk_flush(d, len);
+	}
+
+	fmdsk_drain();
+	return dst;
+}
@@ -0,0 +1,62 @@
+/*************************************************************************
+ *
+ * Fusion Memory Confidential
+ * __________________
+ *
+ *  Fusion Memory Incorporated
+ *  All Rights Reserved.
+ *
+ * NOTICE:  All information contained herein is, and remains
+ * the property of Fusion Memory and its suppliers, if any.
+ * The intellectual and technical concepts contained herein are
+ * proprietary to Fusion Memory and its suppliers and may be covered by
+ * U.S. and Foreign Patents, patents in process, and are protected by
+ * trade secret or copyright law. Dissemination of this information or
+ * reproduction of this material is strictly forbidden unless prior
+ * written permission is obtained from Fusion Memory.
+ */
+
+/*
+ * libfmdsk - Userspace load/store access to fmdsk devices
+ *
+ * Maps the character device of an fmdsk device (e.g. /dev/fmdsk0c, created
+ * with the chr_dev=1 module parameter) and provides helpers to make stores
+ * to the mapping durable.
+ */
+
+#ifndef LIBFMDSK_H
+#define LIBFMDSK_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct fmdsk_map {
+	void *addr;	/* start of the mapping */
+	size_t len;	/* size of the device region in bytes */
+	int fd;
+};
+
+/* Map the whole region of a character device.  Returns 0 or -errno. */
+int fmdsk_map(const char *path, struct fmdsk_map *map);
+void fmdsk_unmap(struct fmdsk_map *map);
+
+/* Write back the CPU cache lines covering [addr, addr + len) */
+void fmdsk_flush(const void *addr, size_t len);
+
+/* Wait for flushes and non-temporal stores to complete */
+void fmdsk_drain(void);
+
+/* Flush then drain: the range is durable on return */
+void fmdsk_persist(const void *addr, size_t len);
+
+/* Copy with non-temporal stores and drain: dst is durable on return */
+void *fmdsk_memcpy_persist(void *dst, const void *src, size_t len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* LIBFMDSK_H */